@@ -0,0 +1,728 @@
+/* This file is the analyzing evaluator scm_eval() uses once the analyze engine
+ * is selected with scm_set_engine(). The resolved code of a PROTO (see the
+ * resolution pass in Eval.c) is turned once into a tree of nodes. Each node
+ * holds the C function that executes it along with its operands, already
+ * taken apart: an if node has its three branches, a call its procedure and
+ * arguments. Executing code then comes down to calling those functions,
+ * without looking at the shape of any list again. The nodes are kept on the
+ * PROTO, so all the closures made from it share them.
+ *
+ * Arguments are evaluated onto a stack of values, which is a gc root and
+ * grows on the heap as needed. Calls to closures recurse in C, except for tail
+ * calls: the node making one leaves the procedure and its arguments on the
+ * stack, and the call it replaces carries it out in its stead. Like the tree
+ * walker, it gives up once the C stack is close to running out.
+ *
+ * Errors are returned like any other value, but those primitives fail with,
+ * raise among them, unwind straight back to the __try that catches them with
+ * a longjmp, skipping the nodes in between (see scm_signal()).
+ *
+ * Forms the VM compiler hands to the tree walker are handed to it here too,
+ * so that they behave and fail in the same way on every engine.
+ */
+
+#include "SchemeSecret.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STACK_SIZE 8192
+
+typedef Expr* (*Exec)(Node* n);
+
+struct Node {
+	Exec exec;
+	Expr* e;       // constant, reference, name or form, depending on exec
+	unsigned a, b; // depth and index of an LREF
+	unsigned n;
+	Node* kids[];
+};
+
+static Expr** stack = NULL;
+static size_t sp = 0;
+static size_t stackCap = 0;
+
+// What a node returns for a call in tail position, leaving the procedure
+// and tailArgs arguments on top of the stack
+static Expr tailCall;
+#define TAIL (&tailCall)
+static unsigned tailArgs;
+
+void scm_mark_analyzer() {
+	for(size_t i = 0; i < sp; i++) {
+		scm_mark(stack[i]);
+	}
+}
+
+// Makes room for n more values on the stack, which moves when it grows
+static bool reserve(size_t n) {
+	if(sp + n <= stackCap) return true;
+
+	size_t cap = stackCap ? stackCap : STACK_SIZE;
+	while(cap < sp + n) cap *= 2;
+
+	Expr** grown = realloc(stack, cap * sizeof(Expr*));
+	if(!grown) return false;
+
+	stack = grown;
+	stackCap = cap;
+	return true;
+}
+
+static Node* analyze_body(Expr* code, bool tail);
+
+// Calls the procedure under the argc values on top of the stack, popping them
+static Expr* call(unsigned argc) {
+	const size_t at = sp - argc - 1;
+	const size_t frames = scm_frame_stack_size();
+	Expr* const env = CURRENT_ENV;
+	Expr* res;
+
+	if(scm_too_deep()) {
+		sp = at;
+		return scm_mk_error("recursion too deep");
+	}
+
+	for(;;) {
+		// the env to return to goes over the first argument, if there is any
+		if(!reserve(1)) {
+			res = scm_mk_error("stack overflow");
+			break;
+		}
+
+		Expr* func = stack[at];
+		Expr** args = &stack[at + 1];
+
+		if(scm_is_ffunc(func)) {
+			res = scm_call_ffunc(func, argc, args);
+			if(scm_is_error(res)) res = scm_signal(res);
+			break;
+		}
+
+		if(scm_is_cont(func)) {
+			res = scm_throw(func, argc, args);
+			break;
+		}
+
+		if(!scm_is_closure(func) && !scm_is_proto(func)) {
+			res = scm_mk_error("can't evaluate (not a ffunc or closure)");
+			break;
+		}
+
+		// a lambda applied on the spot, as in a let, needs no closure
+		Expr* proto = scm_is_proto(func) ? func : scm_closure_proto(func);
+		Expr* penv = scm_is_proto(func) ? CURRENT_ENV : scm_closure_env(func);
+
+		Proto* p = scm_proto(proto);
+		if(!p->node) {
+			res = p->code ? proto : scm_resolve_body(proto);
+			if(scm_is_error(res)) break;
+
+			p->node = analyze_body(p->code, true);
+			if(!p->node) {
+				res = OOM;
+				break;
+			}
+		}
+
+		if(p->badArgs) {
+			res = scm_mk_error("last entry in dotted tail args isn't a symbol");
+			break;
+		} else if(!p->rest && argc != p->nreq) {
+			res = scm_mk_error("incorrect number of args to procedure");
+			break;
+		} else if(argc < p->nreq) {
+			res = scm_mk_error("too few args to procedure");
+			break;
+		}
+
+		res = scm_tick();
+		if(res) break;
+
+		Expr* newEnv = scm_mk_env(penv, p->args, p->size);
+		if(scm_is_error(newEnv)) {
+			res = newEnv;
+			break;
+		}
+		scm_env_frame(newEnv)->extra = p->locals;
+
+		for(unsigned i = 0; i < p->nreq; i++) {
+			scm_env_frame(newEnv)->slots[i] = args[i];
+		}
+		if(p->rest) {
+			scm_stack_push(&newEnv);
+			res = scm_mk_list(args + p->nreq, argc - p->nreq);
+			scm_stack_pop(&newEnv);
+
+			if(scm_is_error(res)) break;
+			scm_env_frame(newEnv)->slots[p->nreq] = res;
+		}
+
+		// the procedure stays on the stack while its nodes run, and so does
+		// the env to return to
+		stack[at + 1] = env;
+		sp = at + 2;
+
+		// the frames of the call this one replaces are done with
+		scm_frame_stack_unwind(frames, penv);
+		if(p->noCapture) scm_frame_stack_push(newEnv);
+
+		CURRENT_ENV = newEnv;
+		res = p->node->exec(p->node);
+		if(res != TAIL) break;
+
+		argc = tailArgs;
+		memmove(&stack[at], &stack[sp - argc - 1], (argc + 1) * sizeof(Expr*));
+		sp = at + argc + 1;
+	}
+
+	scm_frame_stack_unwind(frames, NULL);
+	CURRENT_ENV = env;
+	sp = at;
+
+	return res;
+}
+
+// Evaluates e in env, which the tree walker handles when it is false
+static Expr* eval_in(Expr* e, Expr* env) {
+	Expr* curEnv = CURRENT_ENV;
+	scm_stack_push(&curEnv);
+
+	CURRENT_ENV = env;
+	Expr* res = env == FALSE ? scm_eval_tree(e) : scm_analyze_eval(e);
+
+	CURRENT_ENV = curEnv;
+	scm_stack_pop(&curEnv);
+
+	return res;
+}
+
+#define run(n) ((n)->exec(n))
+
+static Expr* exec_const(Node* n) {
+	return n->e;
+}
+
+static Expr* exec_local(Node* n) {
+	Expr* env = CURRENT_ENV;
+	for(unsigned d = n->a; d > 0; d--) {
+		env = scm_env_parent(env);
+	}
+
+	Expr* v = scm_env_frame(env)->slots[n->b];
+	return v && !scm_extended_frames ? v : scm_env_get_ref(CURRENT_ENV, n->e);
+}
+
+static Expr* exec_global(Node* n) {
+	Expr* v = *scm_symbol_cell(n->e->atom.gref);
+	return v && !scm_extended_frames ? v : scm_env_get_ref(CURRENT_ENV, n->e);
+}
+
+static Expr* exec_ref(Node* n) {
+	return scm_env_get_ref(CURRENT_ENV, n->e);
+}
+
+static Expr* exec_closure(Node* n) {
+	return scm_mk_closure(CURRENT_ENV, n->e);
+}
+
+static Expr* exec_raw(Node* n) {
+	return scm_eval_tree(n->e);
+}
+
+static Expr* exec_if(Node* n) {
+	Expr* test = run(n->kids[0]);
+	if(scm_is_error(test)) return test;
+
+	return run(n->kids[test != FALSE ? 1 : 2]);
+}
+
+static Expr* exec_seq(Node* n) {
+	for(unsigned i = 0; i < n->n - 1; i++) {
+		Expr* v = run(n->kids[i]);
+		if(scm_is_error(v)) return v;
+	}
+
+	return run(n->kids[n->n - 1]);
+}
+
+// Runs the exprs of a body that isn't a proper list, up to where it breaks
+static Expr* exec_bad_seq(Node* n) {
+	for(unsigned i = 0; i < n->n; i++) {
+		Expr* v = run(n->kids[i]);
+		if(scm_is_error(v)) return v;
+	}
+
+	return scm_mk_error("sequence of expressions to evaluate isn't a proper list");
+}
+
+static Expr* exec_and(Node* n) {
+	for(unsigned i = 0; i < n->n - 1; i++) {
+		Expr* v = run(n->kids[i]);
+		if(v == FALSE || scm_is_error(v)) return v;
+	}
+
+	return run(n->kids[n->n - 1]);
+}
+
+static Expr* exec_or(Node* n) {
+	for(unsigned i = 0; i < n->n - 1; i++) {
+		Expr* v = run(n->kids[i]);
+		if(v != FALSE) return v;
+	}
+
+	return run(n->kids[n->n - 1]);
+}
+
+static Expr* exec_define(Node* n) {
+	Expr* v = run(n->kids[0]);
+	if(scm_is_error(v)) return v;
+
+	// the value stays on the stack while it is bound
+	if(!reserve(1)) return scm_mk_error("stack overflow");
+	stack[sp++] = v;
+	v = scm_env_define(CURRENT_ENV, n->e, v);
+	sp--;
+
+	return v;
+}
+
+static Expr* exec_set(Node* n) {
+	Expr* v = run(n->kids[0]);
+	if(scm_is_error(v)) return v;
+
+	if(!reserve(1)) return scm_mk_error("stack overflow");
+	stack[sp++] = v;
+	v = scm_is_symbol(n->e) ? scm_env_set(CURRENT_ENV, n->e, v) : scm_env_set_ref(CURRENT_ENV, n->e, v);
+	sp--;
+
+	return v;
+}
+
+static Expr* exec_eval(Node* n) {
+	const size_t base = sp;
+
+	Expr* v = run(n->kids[0]);
+	if(scm_is_error(v)) return v;
+	if(!reserve(1)) return scm_mk_error("stack overflow");
+	stack[sp++] = v;
+
+	Expr* env = run(n->kids[1]);
+	if(scm_is_error(env)) {
+		sp = base;
+		return env;
+	}
+	if(!scm_is_env(env) && env != FALSE) {
+		sp = base;
+		return scm_mk_error("invalid environment passed to __eval");
+	}
+
+	v = eval_in(v, env);
+	sp = base;
+
+	return v;
+}
+
+// Evaluates the procedure and the arguments of a call onto the stack,
+// returns an scm error on failure and NULL otherwise
+static Expr* push_call(Node* n) {
+	const size_t base = sp;
+
+	for(unsigned i = 0; i < n->n; i++) {
+		Expr* v = run(n->kids[i]);
+		if(!scm_is_error(v) && !reserve(1)) v = scm_mk_error("stack overflow");
+		if(scm_is_error(v)) {
+			sp = base;
+			return v;
+		}
+
+		stack[sp++] = v;
+	}
+
+	return NULL;
+}
+
+static Expr* exec_call(Node* n) {
+	Expr* err = push_call(n);
+	return err ? err : call(n->n - 1);
+}
+
+static Expr* exec_tail_call(Node* n) {
+	Expr* err = push_call(n);
+	if(err) return err;
+
+	tailArgs = n->n - 1;
+	return TAIL;
+}
+
+// Calls the primitive n->e on the arguments on the stack, or returns NULL
+// when the procedure under them isn't that primitive anymore
+static Expr* call_prim(Node* n) {
+	const size_t at = sp - n->n;
+	if(stack[at] != n->e) return NULL;
+
+	Expr* v = scm_call_ffunc(n->e, n->n - 1, &stack[at + 1]);
+	sp = at;
+
+	return scm_is_error(v) ? scm_signal(v) : v;
+}
+
+static Expr* exec_prim(Node* n) {
+	Expr* v = push_call(n);
+	if(v) return v;
+
+	v = call_prim(n);
+	return v ? v : call(n->n - 1);
+}
+
+static Expr* exec_tail_prim(Node* n) {
+	Expr* v = push_call(n);
+	if(v) return v;
+
+	v = call_prim(n);
+	if(v) return v;
+
+	tailArgs = n->n - 1;
+	return TAIL;
+}
+
+static Expr* exec_fold(Node* n) {
+	return n->a == scm_fold_version ? n->e : run(n->kids[0]);
+}
+
+// Same as push_call for __apply, spreading the list of arguments out
+static Expr* push_apply(Node* n, unsigned* argc) {
+	const size_t base = sp;
+
+	// the arguments are evaluated before the procedure, as the tree walker does
+	Expr* args = run(n->kids[0]);
+	if(scm_is_error(args)) return args;
+
+	int len = scm_list_len(args);
+	if(len < 0) return scm_mk_error("args to apply aren't a list");
+	if(!reserve(len + 1)) return scm_mk_error("stack overflow");
+	stack[sp++] = args;
+
+	Expr* func = run(n->kids[1]);
+	if(scm_is_error(func)) {
+		sp = base;
+		return func;
+	}
+
+	stack[sp - 1] = func;
+	for(; scm_is_pair(args); args = scm_cdr(args)) {
+		stack[sp++] = scm_car(args);
+	}
+	*argc = len;
+
+	return NULL;
+}
+
+static Expr* exec_apply(Node* n) {
+	unsigned argc;
+	Expr* err = push_apply(n, &argc);
+	return err ? err : call(argc);
+}
+
+static Expr* exec_tail_apply(Node* n) {
+	Expr* err = push_apply(n, &tailArgs);
+	return err ? err : TAIL;
+}
+
+// Calls a procedure on a continuation that escapes back to here, for as
+// long as the call lasts
+static Expr* exec_callcc(Node* n) {
+	Expr* f = run(n->kids[0]);
+	if(scm_is_error(f)) return f;
+	if(!reserve(2)) return scm_mk_error("stack overflow");
+	stack[sp++] = f;
+
+	Expr* k = scm_mk_cont(NULL);
+	if(scm_is_error(k)) {
+		sp--;
+		return k;
+	}
+	stack[sp++] = k;
+
+	// the call doesn't keep its arguments on the stack
+	scm_stack_push(&k);
+	Expr* v = call(1);
+	scm_cont(k)->live = false;
+	if(v == ESCAPE) {
+		Expr* caught = scm_catch(k);
+		if(caught) v = caught;
+	}
+	scm_stack_pop(&k);
+
+	return v;
+}
+
+// Calls a thunk with a list of handlers installed, and a handler on the
+// condition of the error it raises unless that one is false, which the
+// error unwinds straight back to
+static Expr* exec_try(Node* n) {
+	const size_t base = sp;
+
+	// handlers, thunk, handler, then the handlers to put back and the thunk
+	// again to call it
+	for(unsigned i = 0; i < 3; i++) {
+		Expr* v = run(n->kids[i]);
+		if(!scm_is_error(v) && !reserve(5 - i)) v = scm_mk_error("stack overflow");
+		if(scm_is_error(v)) {
+			sp = base;
+			return v;
+		}
+
+		stack[sp++] = v;
+	}
+	stack[sp++] = scm_handlers;
+	stack[sp] = stack[sp - 3];
+	sp++;
+
+	Catch here;
+	Expr* v;
+	scm_handlers = stack[base];
+	if(stack[base + 2] == FALSE) {
+		v = call(0);
+	} else if(!setjmp(here.to)) {
+		scm_enter_catch(&here, stack[base]);
+		v = call(0);
+		scm_leave_catch(&here);
+	} else {
+		v = here.caught;
+		sp = base + 4;
+	}
+	scm_handlers = stack[base + 3];
+
+	Expr* c = scm_is_error(v) && stack[base + 2] != FALSE ? scm_condition(v, stack[base]) : NULL;
+	if(c && !scm_is_error(c)) {
+		sp = base + 3;
+		stack[sp++] = c;
+		v = call(1);
+	} else if(c) {
+		v = c;
+	}
+	sp = base;
+
+	return v;
+}
+
+#undef run
+
+static Node* mk_node(Exec exec, Expr* e, unsigned n) {
+	Node* node = malloc(sizeof(Node) + n * sizeof(Node*));
+	if(!node) return NULL;
+
+	node->exec = exec;
+	node->e = e;
+	node->a = node->b = 0;
+	node->n = n;
+	for(unsigned i = 0; i < n; i++) {
+		node->kids[i] = NULL;
+	}
+
+	return node;
+}
+
+void scm_free_node(Node* n) {
+	for(unsigned i = 0; i < n->n; i++) {
+		if(n->kids[i]) scm_free_node(n->kids[i]);
+	}
+
+	free(n);
+}
+
+static Node* analyze(Expr* e, bool tail);
+
+// Analyzes the first n exprs of l as the children of node, the last one in
+// tail position when tail is set. Frees node on failure.
+static Node* analyze_kids(Node* node, Expr* l, bool tail) {
+	if(!node) return NULL;
+
+	for(unsigned i = 0; i < node->n; i++, l = scm_cdr(l)) {
+		node->kids[i] = analyze(scm_car(l), tail && i == node->n - 1);
+		if(!node->kids[i]) {
+			scm_free_node(node);
+			return NULL;
+		}
+	}
+
+	return node;
+}
+
+static Node* analyze_body(Expr* code, bool tail) {
+	int len = scm_list_len(code);
+	if(len == 1) return analyze(scm_car(code), tail);
+	if(len > 1)  return analyze_kids(mk_node(exec_seq, NULL, len), code, tail);
+
+	unsigned n = 0;
+	for(Expr* l = code; scm_is_pair(l); l = scm_cdr(l)) {
+		n++;
+	}
+
+	return analyze_kids(mk_node(exec_bad_seq, NULL, n), code, false);
+}
+
+static Node* analyze_pair(Expr* e, bool tail) {
+	Expr* head = scm_car(e);
+	Expr* rest = scm_cdr(e);
+
+	switch(scm_is_symbol(head) ? scm_symbol_form(head) : FORM_NONE) {
+	case FORM_QUOTE:
+		if(!scm_is_pair(rest)) break;
+
+		return mk_node(exec_const, scm_car(rest), 0);
+	case FORM_IF: {
+		if(scm_list_len(rest) != 3) break;
+
+		Node* node = mk_node(exec_if, NULL, 3);
+		if(!node) return NULL;
+
+		// both branches are in tail position, the test isn't
+		for(unsigned i = 0; i < 3; i++, rest = scm_cdr(rest)) {
+			node->kids[i] = analyze(scm_car(rest), tail && i > 0);
+			if(!node->kids[i]) {
+				scm_free_node(node);
+				return NULL;
+			}
+		}
+
+		return node;
+	}
+	case FORM_BEGIN: {
+		if(scm_list_len(rest) < 1) break;
+
+		return analyze_body(rest, tail);
+	}
+	case FORM_AND:
+	case FORM_OR: {
+		int len = scm_list_len(rest);
+		if(len < 0) break;
+
+		if(len == 0) return mk_node(exec_const, head == AND ? TRUE : FALSE, 0);
+		return analyze_kids(mk_node(head == AND ? exec_and : exec_or, NULL, len), rest, tail);
+	}
+	case FORM_DEFINE:
+		if(scm_list_len(rest) != 2 || !scm_is_symbol(scm_car(rest))) break;
+
+		return analyze_kids(mk_node(exec_define, scm_car(rest), 1), scm_cdr(rest), false);
+	case FORM_SET: {
+		if(scm_list_len(rest) != 2) break;
+
+		Expr* name = scm_car(rest);
+		if(!scm_is_symbol(name) && !scm_is_lref(name) && !scm_is_gref(name) && !scm_is_dref(name)) break;
+
+		return analyze_kids(mk_node(exec_set, name, 1), scm_cdr(rest), false);
+	}
+	case FORM_R_APPLY: {
+		if(!scm_is_pair(rest) || !scm_is_pair(scm_cdr(rest))) break;
+
+		Node* node = mk_node(tail ? exec_tail_apply : exec_apply, NULL, 2);
+		if(!node) return NULL;
+
+		node->kids[0] = analyze(scm_cadr(rest), false);
+		node->kids[1] = node->kids[0] ? analyze(scm_car(rest), false) : NULL;
+		if(!node->kids[1]) {
+			scm_free_node(node);
+			return NULL;
+		}
+
+		return node;
+	}
+	case FORM_R_EVAL:
+		if(!scm_is_pair(rest) || !scm_is_pair(scm_cdr(rest))) break;
+
+		return analyze_kids(mk_node(exec_eval, NULL, 2), rest, false);
+	case FORM_R_CALLCC:
+	case FORM_R_CALLEC:
+		if(!scm_is_pair(rest) || scm_cdr(rest) != EMPTY_LIST) break;
+
+		return analyze_kids(mk_node(exec_callcc, NULL, 1), rest, false);
+	case FORM_R_TRY:
+		if(scm_list_len(rest) != 3) break;
+
+		return analyze_kids(mk_node(exec_try, NULL, 3), rest, false);
+	case FORM_R_FOLD: {
+		if(scm_list_len(rest) != 3 || !scm_is_int(scm_car(rest))) break;
+
+		Node* node = mk_node(exec_fold, scm_cadr(rest), 1);
+		if(!node) return NULL;
+
+		node->a = scm_ival(scm_car(rest));
+		node->kids[0] = analyze(scm_caddr(rest), tail);
+		if(!node->kids[0]) {
+			scm_free_node(node);
+			return NULL;
+		}
+
+		return node;
+	}
+	case FORM_QUASIQUOTE:
+	case FORM_LAMBDA:
+	case FORM_LET:
+	case FORM_COND:
+		break;
+	default: {
+		int len = scm_list_len(rest);
+		if(len < 0) break;
+
+		// a primitive bound to a global gets the arguments as they lie on the stack
+		Expr* ff = scm_is_gref(head) ? *scm_symbol_cell(head->atom.gref) : NULL;
+		if(ff && scm_is_ffunc(ff)) {
+			return analyze_kids(mk_node(tail ? exec_tail_prim : exec_prim, ff, len + 1), e, false);
+		}
+
+		Node* node = analyze_kids(mk_node(tail ? exec_tail_call : exec_call, NULL, len + 1), e, false);
+
+		// a lambda applied on the spot is called without making a closure
+		if(node && scm_is_proto(head)) node->kids[0]->exec = exec_const;
+		return node;
+	}
+	}
+
+	return mk_node(exec_raw, e, 0);
+}
+
+static Node* analyze(Expr* e, bool tail) {
+	assert(e);
+
+	if(scm_is_pair(e)) return analyze_pair(e, tail);
+
+	if(scm_is_lref(e)) {
+		Node* node = mk_node(exec_local, e, 0);
+		if(!node) return NULL;
+
+		node->a = e->atom.lref.depth;
+		node->b = e->atom.lref.index;
+		return node;
+	}
+
+	Exec exec = exec_const;
+	if(scm_is_gref(e))       exec = exec_global;
+	else if(scm_is_dref(e))  exec = exec_ref;
+	else if(scm_is_proto(e)) exec = exec_closure;
+	else if(scm_is_symbol(e) || scm_is_ffunc(e) || scm_is_closure(e)) exec = exec_raw;
+
+	return mk_node(exec, e, 0);
+}
+
+Expr* scm_analyze_eval(Expr* e) {
+	assert(e);
+
+	scm_stack_push(&e);
+	Expr* proto = scm_resolve_toplevel(e);
+	scm_stack_pop(&e);
+	if(scm_is_error(proto)) return proto;
+
+	// kept on the proto so that it is freed along with it
+	Proto* p = scm_proto(proto);
+	p->node = analyze_body(p->code, false);
+	if(!p->node) return OOM;
+
+	scm_stack_push(&proto);
+	Expr* res = p->node->exec(p->node);
+	scm_stack_pop(&proto);
+
+	return res;
+}
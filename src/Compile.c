@@ -0,0 +1,346 @@
+/* This file compiles the resolved code of a PROTO (see the resolution pass in
+ * Eval.c) into bytecode for the VM in VM.c. The instructions are listed in
+ * Opcodes.def. Variables are already LREFs, GREFs and DREFs by then, and let
+ * and cond are already desugared, so what is left maps onto a handful of
+ * instructions for a stack machine.
+ *
+ * Forms the compiler doesn't handle, which are the malformed ones the
+ * resolver left untouched along with quasiquote, are handed as they are to
+ * the tree walking evaluator at runtime. That way they behave, and fail, in
+ * the same way on both engines.
+ */
+
+#include "SchemeSecret.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+typedef struct Builder {
+	int* ops;
+	size_t nops, capOps;
+	Expr** consts;
+	size_t nconsts, capConsts;
+	unsigned depth, maxDepth; // of the stack at the current instruction
+	bool oom;
+} Builder;
+
+static void emit(Builder* b, int op) {
+	if(b->nops == b->capOps) {
+		size_t cap = b->capOps ? b->capOps * 2 : 32;
+		int* ops = realloc(b->ops, cap * sizeof(int));
+		if(!ops) {
+			b->oom = true;
+			return;
+		}
+		b->ops = ops;
+		b->capOps = cap;
+	}
+
+	b->ops[b->nops++] = op;
+}
+
+static int constant(Builder* b, Expr* e) {
+	if(b->nconsts == b->capConsts) {
+		size_t cap = b->capConsts ? b->capConsts * 2 : 8;
+		Expr** consts = realloc(b->consts, cap * sizeof(Expr*));
+		if(!consts) {
+			b->oom = true;
+			return 0;
+		}
+		b->consts = consts;
+		b->capConsts = cap;
+	}
+
+	b->consts[b->nconsts] = e;
+	return b->nconsts++;
+}
+
+// Keeps track of how many values the code emitted so far leaves on the stack
+static void grow(Builder* b, int n) {
+	b->depth += n;
+	if(b->depth > b->maxDepth) b->maxDepth = b->depth;
+}
+
+// Emits a jump, whose target is set by land()
+static size_t jump(Builder* b, int op) {
+	emit(b, op);
+	emit(b, 0);
+	return b->nops - 1;
+}
+
+static void land(Builder* b, size_t from) {
+	if(!b->oom) b->ops[from] = b->nops;
+}
+
+static void ret(Builder* b, bool tail) {
+	if(!tail) return;
+
+	emit(b, OP_RETURN);
+	grow(b, -1);
+}
+
+static void push_const(Builder* b, int op, Expr* e, bool tail) {
+	emit(b, op);
+	emit(b, constant(b, e));
+	grow(b, 1);
+	ret(b, tail);
+}
+
+static void compile(Builder* b, Expr* e, bool tail);
+
+// body must be a proper list, with at least one element
+static void compile_seq(Builder* b, Expr* body, bool tail) {
+	for(; scm_cdr(body) != EMPTY_LIST; body = scm_cdr(body)) {
+		compile(b, scm_car(body), false);
+		emit(b, OP_POP);
+		grow(b, -1);
+	}
+
+	compile(b, scm_car(body), tail);
+}
+
+// and and or, with op short circuiting them
+static void compile_junction(Builder* b, Expr* args, int op, bool tail) {
+	// the jumps to the end are chained through their targets until it is known
+	int chain = -1;
+	for(; scm_cdr(args) != EMPTY_LIST; args = scm_cdr(args)) {
+		compile(b, scm_car(args), false);
+		emit(b, op);
+		emit(b, chain);
+		chain = b->nops - 1;
+		grow(b, -1);
+	}
+
+	compile(b, scm_car(args), tail);
+
+	while(chain != -1 && !b->oom) {
+		int next = b->ops[chain];
+		b->ops[chain] = b->nops;
+		chain = next;
+	}
+
+	// the values jumped here with are still on the stack
+	if(tail) {
+		grow(b, 1);
+		ret(b, true);
+	}
+}
+
+static void compile_pair(Builder* b, Expr* e, bool tail) {
+	Expr* head = scm_car(e);
+	Expr* rest = scm_cdr(e);
+
+	switch(scm_is_symbol(head) ? scm_symbol_form(head) : FORM_NONE) {
+	case FORM_QUOTE:
+		if(!scm_is_pair(rest)) break;
+
+		push_const(b, OP_CONST, scm_car(rest), tail);
+		return;
+	case FORM_IF: {
+		if(scm_list_len(rest) != 3) break;
+
+		compile(b, scm_car(rest), false);
+		size_t alternative = jump(b, OP_JUMP_FALSE);
+		grow(b, -1);
+
+		unsigned depth = b->depth;
+		compile(b, scm_cadr(rest), tail);
+		size_t end = tail ? 0 : jump(b, OP_JUMP);
+
+		b->depth = depth;
+		land(b, alternative);
+		compile(b, scm_caddr(rest), tail);
+		if(!tail) land(b, end);
+		return;
+	}
+	case FORM_BEGIN:
+		if(scm_list_len(rest) < 1) break;
+
+		compile_seq(b, rest, tail);
+		return;
+	case FORM_AND:
+	case FORM_OR: {
+		int len = scm_list_len(rest);
+		if(len < 0) break;
+
+		if(len == 0) push_const(b, OP_CONST, head == AND ? TRUE : FALSE, tail);
+		else         compile_junction(b, rest, head == AND ? OP_AND : OP_OR, tail);
+		return;
+	}
+	case FORM_DEFINE:
+		if(scm_list_len(rest) != 2 || !scm_is_symbol(scm_car(rest))) break;
+
+		compile(b, scm_cadr(rest), false);
+		emit(b, OP_DEFINE);
+		emit(b, constant(b, scm_car(rest)));
+		ret(b, tail);
+		return;
+	case FORM_SET: {
+		if(scm_list_len(rest) != 2) break;
+
+		Expr* name = scm_car(rest);
+		if(!scm_is_symbol(name) && !scm_is_lref(name) && !scm_is_gref(name) && !scm_is_dref(name)) break;
+
+		compile(b, scm_cadr(rest), false);
+		emit(b, OP_SET);
+		emit(b, constant(b, name));
+		ret(b, tail);
+		return;
+	}
+	case FORM_R_APPLY:
+		if(!scm_is_pair(rest) || !scm_is_pair(scm_cdr(rest))) break;
+
+		// the arguments are evaluated before the procedure, as the tree walker does
+		compile(b, scm_cadr(rest), false);
+		compile(b, scm_car(rest), false);
+		emit(b, tail ? OP_TAIL_APPLY : OP_APPLY);
+		grow(b, tail ? -2 : -1);
+		return;
+	case FORM_R_EVAL:
+		if(!scm_is_pair(rest) || !scm_is_pair(scm_cdr(rest))) break;
+
+		compile(b, scm_car(rest), false);
+		compile(b, scm_cadr(rest), false);
+		emit(b, OP_EVAL);
+		grow(b, -1);
+		ret(b, tail);
+		return;
+	case FORM_R_TRY:
+		if(scm_list_len(rest) != 3) break;
+
+		compile(b, scm_car(rest), false);
+		compile(b, scm_cadr(rest), false);
+		compile(b, scm_caddr(rest), false);
+		emit(b, OP_TRY);
+		grow(b, 1);
+		grow(b, -3);
+		ret(b, tail);
+		return;
+	case FORM_R_CALLCC:
+	case FORM_R_CALLEC:
+		if(!scm_is_pair(rest) || scm_cdr(rest) != EMPTY_LIST) break;
+
+		// the continuation goes on the stack above the procedure
+		compile(b, scm_car(rest), false);
+		emit(b, OP_CALLCC);
+		emit(b, head == R_CALLEC);
+		grow(b, 1);
+		grow(b, -1);
+		ret(b, tail);
+		return;
+	case FORM_R_FOLD: {
+		if(scm_list_len(rest) != 3 || !scm_is_int(scm_car(rest))) break;
+
+		emit(b, OP_FOLD);
+		emit(b, constant(b, scm_cadr(rest)));
+		emit(b, scm_ival(scm_car(rest)));
+		emit(b, 0);
+		size_t end = b->nops - 1;
+
+		// the call itself, for when the folded value doesn't hold anymore
+		compile(b, scm_caddr(rest), false);
+		land(b, end);
+		ret(b, tail);
+		return;
+	}
+	case FORM_QUASIQUOTE:
+	case FORM_LAMBDA:
+	case FORM_LET:
+	case FORM_COND:
+		break;
+	default: {
+		int len = scm_list_len(rest);
+		if(len < 0) break;
+
+		// a lambda applied on the spot is called without making a closure
+		if(scm_is_proto(head)) push_const(b, OP_CONST, head, false);
+		else                   compile(b, head, false);
+
+		for(; scm_is_pair(rest); rest = scm_cdr(rest)) {
+			compile(b, scm_car(rest), false);
+		}
+
+		// a primitive bound to a global gets the arguments as they lie on the stack
+		Expr* ff = scm_is_gref(head) ? *scm_symbol_cell(head->atom.gref) : NULL;
+		if(ff && scm_is_ffunc(ff)) {
+			emit(b, tail ? OP_TAIL_PRIM : OP_PRIM);
+			emit(b, len);
+			emit(b, constant(b, ff));
+		} else {
+			emit(b, tail ? OP_TAIL_CALL : OP_CALL);
+			emit(b, len);
+		}
+		grow(b, tail ? -len - 1 : -len);
+		return;
+	}
+	}
+
+	push_const(b, OP_RAW, e, tail);
+}
+
+static void compile(Builder* b, Expr* e, bool tail) {
+	assert(e);
+
+	if(scm_is_pair(e)) {
+		compile_pair(b, e, tail);
+	} else if(scm_is_lref(e)) {
+		emit(b, OP_LOCAL);
+		emit(b, e->atom.lref.depth);
+		emit(b, e->atom.lref.index);
+		emit(b, constant(b, e));
+		grow(b, 1);
+		ret(b, tail);
+	} else if(scm_is_gref(e)) {
+		push_const(b, OP_GLOBAL, e, tail);
+	} else if(scm_is_dref(e)) {
+		push_const(b, OP_REF, e, tail);
+	} else if(scm_is_proto(e)) {
+		push_const(b, OP_CLOSURE, e, tail);
+	} else if(scm_is_symbol(e) || scm_is_ffunc(e) || scm_is_closure(e)) {
+		push_const(b, OP_RAW, e, tail);
+	} else {
+		push_const(b, OP_CONST, e, tail);
+	}
+}
+
+void scm_free_bytecode(Bytecode* bc) {
+	free(bc->ops);
+	free(bc->consts);
+	free(bc);
+}
+
+Expr* scm_compile(Expr* proto) {
+	assert(proto); assert(scm_is_proto(proto));
+
+	Proto* p = scm_proto(proto);
+	assert(p->code); assert(!p->bc);
+
+	Builder b = { 0 };
+	Expr* code = p->code;
+	if(scm_list_len(code) > 0) {
+		compile_seq(&b, code, true);
+	} else {
+		for(; scm_is_pair(code); code = scm_cdr(code)) {
+			compile(&b, scm_car(code), false);
+			emit(&b, OP_POP);
+			grow(&b, -1);
+		}
+		emit(&b, OP_BAD_SEQ);
+	}
+
+	Bytecode* bc = b.oom ? NULL : malloc(sizeof(Bytecode));
+	if(!bc) {
+		free(b.ops);
+		free(b.consts);
+		return OOM;
+	}
+
+	bc->ops = b.ops;
+	bc->consts = b.consts;
+	bc->nops = b.nops;
+	bc->nconsts = b.nconsts;
+	bc->maxStack = b.maxDepth;
+	p->bc = bc;
+
+	return proto;
+}
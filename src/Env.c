@@ -1,78 +1,158 @@
-/* This file represents environments. Each "frame" is simply a list of:
- *   (parent-env names values)
- * where
- *   parent-env is the parent environment if it exists, false otherwise,
- *   names is the list of names of the bound variables in this environment,
- *   values contains the values bound to the names of this environemnt
+/* This file represents environments. Each "frame" is an ENV Expr holding its
+ * parent environment (false for the outermost one) and a Frame, which lives
+ * outside of the pool and is freed by the gc along with its Expr. A Frame is:
+ *   - a contiguous array of slots holding the values bound in the frame,
+ *   - the names of the first slots, given in the same shape as the argument
+ *     list of a lambda: a list, a dotted list or a single symbol,
+ *   - the names of any further slots added by define, most recent first.
+ *
+ * A slot is NULL while the variable it holds is unbound, in which case
+ * lookups carry on into the parent environment.
+ *
+ * BASE_ENV is special: its values live in the global cells of the symbols
+ * themselves (see scm_symbol_cell()), so accessing a global variable takes
+ * constant time. It has no slots, and its list of extra names holds all the
+ * global names, most recent definition first.
+ *
+ * Code resolved by the evaluator refers to variables through LREFs, which
+ * name a slot by how many frames up it is and its index there, and GREFs,
+ * which name the global cell of a symbol. Either one falls back to a search
+ * by name when its slot is unbound or some frame may hide it.
+ *
+ * Names the evaluator couldn't resolve ahead of time, because the outermost
+ * lambda around them wasn't made in BASE_ENV, become DREFs. A DREF caches the
+ * cell it was last found in, which stays valid until a define creates a new
+ * binding somewhere and bumps scm_env_version. set! never moves a binding,
+ * so it doesn't need to invalidate anything.
+ *
+ * The frames of calls whose code can't capture them are also pushed on a
+ * stack by the evaluator, and handed straight back to the pool once the call
+ * is over instead of waiting for the gc. cur-env is the one way left to get
+ * hold of such a frame, so it flags the frames it hands out as captured.
  */
 
 #include "SchemeSecret.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 Expr* BASE_ENV = NULL;
 Expr* CURRENT_ENV = NULL;
 
-static int idxOf(Expr* sym, Expr* list) {
-	assert(sym); assert(list);
-	
+unsigned scm_extended_frames = 0;
+unsigned long long scm_env_version = 1; // 0 marks an empty cache
+unsigned scm_fold_version = 0;
+
+// The LREFs for the first few slots of the nearest frames are preallocated
+#define LREF_DEPTHS 8
+#define LREF_INDICES 16
+static Expr lrefs[LREF_DEPTHS][LREF_INDICES];
+
+// Freed frames of a few slots are kept around for reuse, chained through
+// their names
+#define CACHED_SIZES 8
+static Frame* frameCache[CACHED_SIZES];
+
+// Tasks switch this for frame stacks of their own while they run
+#define FRAME_STACK_SIZE 1024
+static Expr* rootFrames[FRAME_STACK_SIZE];
+static Expr** frameStack = rootFrames;
+static size_t frameTop = 0;
+static size_t frameCap = FRAME_STACK_SIZE;
+
+static int shapeIdxOf(Expr* sym, Expr* shape) {
+	assert(sym); assert(shape);
+
 	int cur = 0;
-	while(scm_is_pair(list)) {
-		if(scm_car(list) == sym) {
+	while(scm_is_pair(shape)) {
+		if(scm_car(shape) == sym) {
 			return cur;
 		}
 
-		list = scm_cdr(list);
+		shape = scm_cdr(shape);
 		cur++;
 	}
 
-	return -1;
+	return shape == sym ? cur : -1;
 }
 
-static Expr* get(Expr* list, int idx) {
-	assert(list); assert(idx >= 0);
+int scm_slot_index(Expr* sym, Expr* names, Expr* extra, unsigned size) {
+	assert(sym); assert(names); assert(extra);
 
-	while(scm_is_pair(list) && idx > 0) {
-		list = scm_cdr(list);
+	int idx = shapeIdxOf(sym, names);
+	if(idx != -1) return idx;
+
+	idx = size;
+	for(; scm_is_pair(extra); extra = scm_cdr(extra)) {
 		idx--;
+		if(scm_car(extra) == sym) return idx;
 	}
 
-	assert(idx == 0);
+	return -1;
+}
 
-	return scm_is_pair(list) ? scm_car(list) : NULL;
+static inline int idxOf(Expr* sym, Frame* f) {
+	return scm_slot_index(sym, f->names, f->extra, f->size);
 }
 
-static Expr* replace(int idx, Expr* list, Expr* val) {
-	assert(idx >= 0); assert(list); assert(val);
+static Expr* slotName(Frame* f, unsigned idx) {
+	Expr* shape = f->names;
+	unsigned cur = 0;
+	while(scm_is_pair(shape)) {
+		if(cur == idx) return scm_car(shape);
 
-	while(scm_is_pair(list) && idx > 0) {
-		list = scm_cdr(list);
-		idx--;
+		shape = scm_cdr(shape);
+		cur++;
+	}
+	if(scm_is_symbol(shape)) {
+		if(cur == idx) return shape;
+		cur++;
 	}
 
-	assert(idx == 0);
+	Expr* extra = f->extra;
+	for(unsigned i = f->size - 1; i > idx; i--) {
+		extra = scm_cdr(extra);
+	}
 
-	Expr* toRet = scm_car(list);
-	list->pair.car = val;
-	return toRet;
+	return scm_car(extra);
 }
 
-Expr* scm_env_lookup(Expr* env, Expr* sym) {
-	assert(env); assert(sym); assert(scm_is_symbol(sym)); assert(env->tag == ENV || env == FALSE);
-
+// The cell holding the value of sym as seen from env, NULL if it's unbound
+static Expr** find(Expr* env, Expr* sym) {
 	while(env != FALSE) {
-		Expr* names = scm_cadr(env);
-		int idx = idxOf(sym, names);
+		if(env == BASE_ENV) {
+			Expr** cell = scm_symbol_cell(sym);
+			return *cell ? cell : NULL;
+		}
+
+		Frame* f = scm_env_frame(env);
+		int idx = idxOf(sym, f);
 
-		if(idx != -1) {
-			Expr* res = get(scm_caddr(env), idx);
-			if(res) return res;
+		if(idx != -1 && f->slots[idx]) {
+			return &f->slots[idx];
 		}
 
-		env = scm_car(env);
+		env = scm_env_parent(env);
 	}
 
+	return NULL;
+}
+
+Expr* scm_env_find(Expr* env, Expr* sym) {
+	assert(env); assert(sym); assert(scm_is_symbol(sym)); assert(env->tag == ENV || env == FALSE);
+
+	Expr** cell = find(env, sym);
+	return cell ? *cell : NULL;
+}
+
+Expr* scm_env_lookup(Expr* env, Expr* sym) {
+	assert(env); assert(sym); assert(scm_is_symbol(sym)); assert(env->tag == ENV || env == FALSE);
+
+	Expr** cell = find(env, sym);
+	if(cell) return *cell;
+
 	char buf[256];
 	buf[0] = '\0';
 	strcat(buf, "can't get unbound symbol: ");
@@ -81,55 +161,105 @@ Expr* scm_env_lookup(Expr* env, Expr* sym) {
 	return scm_mk_error(buf);
 }
 
+// Stores val in a bound cell, returning what it held
+static Expr* rebind(Expr** cell, Expr* val) {
+	Expr* old = *cell;
+	if(scm_is_ffunc(old) && old != val) scm_fold_version++;
+
+	*cell = val;
+	return old;
+}
+
+static Expr* global_define(Expr* sym, Expr* val) {
+	Expr** cell = scm_symbol_cell(sym);
+
+	if(*cell) return rebind(cell, val);
+
+	scm_stack_push(&sym);
+	scm_stack_push(&val);
+
+	Frame* f = scm_env_frame(BASE_ENV);
+	Expr* t = scm_mk_pair(sym, f->extra);
+	if(t) {
+		f->extra = t;
+		*cell = val;
+		scm_env_version++;
+	}
+
+	scm_stack_pop(&val);
+	scm_stack_pop(&sym);
+
+	return t ? val : OOM;
+}
+
 Expr* scm_env_define_unsafe(Expr* env, Expr* sym, Expr* val) {
-	assert(env); assert(sym); assert(val); assert(env->tag == ENV || env == FALSE);
+	assert(env); assert(sym); assert(val); assert(env->tag == ENV);
+
+	if(env == BASE_ENV) return global_define(sym, val);
 
 	scm_stack_push(&env);
+	scm_stack_push(&sym);
 	scm_stack_push(&val);
 
-	Expr* t = scm_mk_pair(sym, scm_cadr(env));
+	Expr* t = scm_mk_pair(sym, scm_env_frame(env)->extra);
 	if(!t) goto end;
-	scm_cdr(env)->pair.car = t;
 
-	t = scm_mk_pair(val, scm_caddr(env));
-	if(!t) {
-		// restore change to name list
-		scm_cdr(env)->pair.car = scm_cdadr(env);
-		goto end;
+	Frame* f = scm_env_frame(env);
+	if(f->size == f->cap) {
+		unsigned ncap = f->cap < 2 ? 4 : f->cap * 2;
+		Frame* nf = realloc(f, sizeof(Frame) + ncap * sizeof(Expr*));
+		if(!nf) {
+			t = NULL;
+			goto end;
+		}
+
+		nf->cap = ncap;
+		env->env.frame = f = nf;
 	}
-	scm_cddr(env)->pair.car = t;
+
+	f->slots[f->size++] = val;
+	f->extra = t;
+	if(!f->extended) {
+		f->extended = true;
+		scm_extended_frames++;
+	}
+	scm_env_version++;
+	scm_fold_version++;
 
 end:
 	scm_stack_pop(&val);
+	scm_stack_pop(&sym);
 	scm_stack_pop(&env);
 
 	return t ? val : OOM;
 }
 
 Expr* scm_env_define(Expr* env, Expr* sym, Expr* val) {
-	assert(env); assert(sym); assert(val); assert(env->tag == ENV || env == FALSE);
+	assert(env); assert(sym); assert(val); assert(env->tag == ENV);
+
+	if(env == BASE_ENV) return global_define(sym, val);
 
-	int idx = idxOf(sym, scm_cadr(env));
+	Frame* f = scm_env_frame(env);
+	int idx = idxOf(sym, f);
 
 	if(idx == -1) {
 		return scm_env_define_unsafe(env, sym, val);
 	} else {
 		//TODO not sure overriding anyway is the best option...
-		return replace(idx, scm_caddr(env), val);
+		Expr* toRet = f->slots[idx];
+		f->slots[idx] = val;
+		if(toRet) return toRet;
+
+		scm_env_version++;
+		return val;
 	}
 }
 
 Expr* scm_env_set(Expr* env, Expr* sym, Expr* val) {
 	assert(env); assert(sym); assert(val); assert(env->tag == ENV || env == FALSE);
 
-	while(env != FALSE) {
-		int idx = idxOf(sym, scm_cadr(env));
-		if(idx != -1) {
-			return replace(idx, scm_caddr(env), val);
-		}
-
-		env = scm_car(env);
-	}
+	Expr** cell = find(env, sym);
+	if(cell) return rebind(cell, val);
 
 	char buf[256];
 	buf[0] = '\0';
@@ -139,36 +269,334 @@ Expr* scm_env_set(Expr* env, Expr* sym, Expr* val) {
 	return scm_mk_error(buf);
 }
 
-Expr* scm_mk_env(Expr* parent, Expr* names, Expr* vals) {
-	assert(parent); assert(names); assert(vals);
+Expr* scm_mk_lref(unsigned depth, unsigned index) {
+	if(depth < LREF_DEPTHS && index < LREF_INDICES) {
+		return &lrefs[depth][index];
+	}
+
+	Expr* toRet = scm_alloc();
+	if(!toRet) return OOM;
+
+	toRet->tag = ATOM;
+	toRet->atom.type = LREF;
+	toRet->atom.lref.depth = depth;
+	toRet->atom.lref.index = index;
+
+	return toRet;
+}
+
+Expr* scm_mk_dref(Expr* sym, unsigned depth) {
+	assert(sym); assert(scm_is_symbol(sym));
+
+	DRef* r = malloc(sizeof(DRef));
+	if(!r) return OOM;
+
+	r->sym = sym;
+	r->cell = NULL;
+	r->version = 0;
+	r->depth = depth;
+
+	scm_stack_push(&sym);
+	Expr* toRet = scm_alloc();
+	scm_stack_pop(&sym);
+
+	if(!toRet) {
+		free(r);
+		return OOM;
+	}
+
+	toRet->tag = ATOM;
+	toRet->atom.type = DREF;
+	toRet->atom.dref = r;
+
+	return toRet;
+}
+
+void scm_free_dref(DRef* r) {
+	free(r);
+}
+
+// Whether one of the n innermost frames of env was extended at runtime, and
+// may hide a name the resolver looked up past it
+static bool extended_within(Expr* env, unsigned n) {
+	if(!scm_extended_frames) return false;
+
+	for(; n > 0 && scm_is_env(env) && env != BASE_ENV; n--, env = scm_env_parent(env)) {
+		if(scm_env_frame(env)->extended) return true;
+	}
+	return false;
+}
+
+// The cell ref refers to from env, or NULL if it has to be looked up by sym
+// as some frame it goes past was extended at runtime
+static Expr** refCell(Expr* env, Expr* ref, Expr** sym) {
+	if(scm_is_gref(ref)) {
+		*sym = ref->atom.gref;
+		return extended_within(env, UINT_MAX) ? NULL : scm_symbol_cell(*sym);
+	}
+
+	if(scm_is_dref(ref)) {
+		DRef* r = ref->atom.dref;
+		*sym = r->sym;
+		if(r->version == scm_env_version) return r->cell;
+
+		//with no frame extended at runtime, the frames up to the one the
+		//outermost lambda was made in can't hold sym
+		if(extended_within(env, r->depth)) return NULL;
+
+		for(unsigned d = r->depth; d > 0; d--) {
+			env = scm_env_parent(env);
+		}
+
+		r->cell = find(env, r->sym);
+		r->version = r->cell ? scm_env_version : 0;
+		return r->cell;
+	}
+
+	Expr* from = env;
+	for(unsigned d = ref->atom.lref.depth; d > 0; d--) {
+		env = scm_env_parent(env);
+	}
+
+	Frame* f = scm_env_frame(env);
+	*sym = slotName(f, ref->atom.lref.index);
+
+	return extended_within(from, ref->atom.lref.depth) ? NULL : &f->slots[ref->atom.lref.index];
+}
+
+Expr* scm_env_get_ref(Expr* env, Expr* ref) {
+	assert(env); assert(ref); assert(scm_is_lref(ref) || scm_is_gref(ref) || scm_is_dref(ref));
+
+	Expr* sym;
+	Expr** cell = refCell(env, ref, &sym);
+	if(cell && *cell) return *cell;
+
+	//unbound, or maybe shadowed: fall back to looking it up by name
+	return scm_env_lookup(env, sym);
+}
+
+Expr* scm_env_set_ref(Expr* env, Expr* ref, Expr* val) {
+	assert(env); assert(ref); assert(val); assert(scm_is_lref(ref) || scm_is_gref(ref) || scm_is_dref(ref));
+
+	Expr* sym;
+	Expr** cell = refCell(env, ref, &sym);
+	if(cell && *cell) return rebind(cell, val);
+
+	return scm_env_set(env, sym, val);
+}
+
+Expr* scm_mk_env(Expr* parent, Expr* names, unsigned size) {
+	assert(parent); assert(names);
+
+	Frame* f;
+	if(size < CACHED_SIZES && frameCache[size]) {
+		f = frameCache[size];
+		frameCache[size] = (Frame*) f->names;
+	} else {
+		f = malloc(sizeof(Frame) + size * sizeof(Expr*));
+		if(!f) return OOM;
+	}
+
+	f->names = names;
+	f->extra = EMPTY_LIST;
+	f->size = f->cap = size;
+	f->captured = false;
+	f->extended = false;
+	for(unsigned i = 0; i < size; i++) {
+		f->slots[i] = NULL;
+	}
+
+	scm_stack_push(&parent);
+	scm_stack_push(&names);
+
+	Expr* toRet = scm_alloc();
+
+	scm_stack_pop(&names);
+	scm_stack_pop(&parent);
+
+	if(!toRet) {
+		scm_free_frame(f);
+		return OOM;
+	}
 
-	Expr* ll[3] = { parent, names, vals };
-	Expr* toRet = scm_mk_list(ll, 3);
-	if(scm_is_error(toRet)) return toRet;
 	toRet->tag = ENV;
+	toRet->env.parent = parent;
+	toRet->env.frame = f;
+
 	return toRet;
 }
 
+void scm_free_frame(Frame* f) {
+	if(f->extended) scm_extended_frames--;
 
-void scm_env_push(Expr* names, Expr* vals) {
-	assert(CURRENT_ENV);
+	if(f->cap < CACHED_SIZES) {
+		f->names = (Expr*) frameCache[f->cap];
+		frameCache[f->cap] = f;
+	} else {
+		free(f);
+	}
+}
+
+Expr* scm_env_names(Expr* env) {
+	assert(env); assert(scm_is_env(env));
 
-	Expr* new = scm_mk_env(CURRENT_ENV, names, vals);
-	CURRENT_ENV = new;
+	Frame* f = scm_env_frame(env);
+	if(env == BASE_ENV) return f->extra;
+
+	unsigned bound = 0;
+	for(unsigned i = 0; i < f->size; i++) {
+		bound += f->slots[i] != NULL;
+	}
+
+	//the common case of a frame made by calling a closure
+	if(f->extra == EMPTY_LIST && bound == f->size && scm_list_len(f->names) == (int) bound) {
+		return f->names;
+	}
+
+	Expr* toRet = EMPTY_LIST;
+	scm_stack_push(&env);
+	scm_stack_push(&toRet);
+
+	Expr* shape = f->names;
+	Expr* stack[f->size > 0 ? f->size : 1];
+	unsigned n = 0;
+	while(scm_is_pair(shape)) {
+		stack[n++] = scm_car(shape);
+		shape = scm_cdr(shape);
+	}
+	if(scm_is_symbol(shape)) stack[n++] = shape;
+
+	for(unsigned i = n; toRet && i > 0; i--) {
+		if(f->slots[i-1]) toRet = scm_mk_pair(stack[i-1], toRet);
+	}
+
+	unsigned idx = f->size;
+	for(Expr* l = f->extra; toRet && scm_is_pair(l); l = scm_cdr(l)) {
+		idx--;
+		stack[idx] = scm_car(l);
+	}
+	for(unsigned i = f->size; toRet && i > n; i--) {
+		if(f->slots[i-1]) toRet = scm_mk_pair(stack[i-1], toRet);
+	}
+
+	scm_stack_pop(&toRet);
+	scm_stack_pop(&env);
+
+	return toRet ? toRet : OOM;
+}
+
+Expr* scm_env_values(Expr* env) {
+	assert(env); assert(scm_is_env(env));
+
+	Expr* names = scm_env_names(env);
+	if(scm_is_error(names)) return names;
+
+	Expr* head = EMPTY_LIST;
+	Expr* tail = EMPTY_LIST;
+	scm_stack_push(&env);
+	scm_stack_push(&names);
+	scm_stack_push(&head);
+
+	while(scm_is_pair(names)) {
+		Expr* cur = scm_mk_pair(scm_env_lookup(env, scm_car(names)), EMPTY_LIST);
+		if(!cur) {
+			head = OOM;
+			break;
+		}
+
+		if(head == EMPTY_LIST) head = cur;
+		else                   tail->pair.cdr = cur;
+		tail = cur;
+
+		names = scm_cdr(names);
+	}
+
+	scm_stack_pop(&head);
+	scm_stack_pop(&names);
+	scm_stack_pop(&env);
+
+	return head;
 }
 
 void scm_env_pop() {
 	assert(CURRENT_ENV != BASE_ENV);
 
-	CURRENT_ENV = scm_car(CURRENT_ENV);
+	CURRENT_ENV = scm_env_parent(CURRENT_ENV);
+}
+
+void scm_env_capture(Expr* env) {
+	for(; env != FALSE && !scm_env_frame(env)->captured; env = scm_env_parent(env)) {
+		scm_env_frame(env)->captured = true;
+	}
+}
+
+bool scm_frame_stack_push(Expr* env) {
+	assert(env); assert(scm_is_env(env));
+
+	if(frameTop == frameCap) return false;
+
+	frameStack[frameTop++] = env;
+	return true;
+}
+
+size_t scm_frame_stack_size() {
+	return frameTop;
+}
+
+void scm_frame_stack_unwind(size_t base, Expr* keep) {
+	assert(base <= frameTop);
+
+	for(size_t i = frameTop; i > base; i--) {
+		if(frameStack[i-1] == keep) {
+			base = i;
+			break;
+		}
+	}
+
+	while(frameTop > base) {
+		Expr* env = frameStack[--frameTop];
+		if(!scm_env_frame(env)->captured) scm_release(env);
+	}
+}
+
+void scm_frame_stack_switch(Expr*** frames, size_t* top, size_t* cap) {
+	Expr** f = frameStack;
+	size_t t = frameTop, c = frameCap;
+
+	frameStack = *frames;
+	frameTop = *top;
+	frameCap = *cap;
+
+	*frames = f;
+	*top = t;
+	*cap = c;
+}
+
+void scm_mark_frame_stack() {
+	for(size_t i = 0; i < frameTop; i++) {
+		scm_mark(frameStack[i]);
+	}
 }
 
 void scm_init_env() {
-	BASE_ENV = scm_mk_env(FALSE, EMPTY_LIST, EMPTY_LIST);
+	for(unsigned d = 0; d < LREF_DEPTHS; d++) {
+		for(unsigned i = 0; i < LREF_INDICES; i++) {
+			lrefs[d][i] = (Expr) { .tag = ATOM, .atom = { .type = LREF, .lref = { d, i } }, .protect = true, .mark = true };
+		}
+	}
+
+	scm_extended_frames = 0;
+	BASE_ENV = scm_mk_env(FALSE, EMPTY_LIST, 0);
+	scm_env_frame(BASE_ENV)->extra = scm_builtin_globals();
 	CURRENT_ENV = BASE_ENV;
 }
 
 void scm_reset_env() {
 	BASE_ENV = NULL;
 	CURRENT_ENV = NULL;
+	scm_env_version = 1;
+	scm_fold_version = 0;
+	frameStack = rootFrames;
+	frameTop = 0;
+	frameCap = FRAME_STACK_SIZE;
 }
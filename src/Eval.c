@@ -1,7 +1,15 @@
+// for pthread_getattr_np()
+#define _GNU_SOURCE
+
 #include "Scheme.h"
 #include "SchemeSecret.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 
 static Expr* stc_eval(Expr* e);
 
@@ -17,23 +25,6 @@ static inline bool is_last(Expr* l) {
 	return !scm_is_pair(scm_cdr(l));
 }
 
-static Expr* quote_all_inplace(Expr* l) {
-	scm_stack_push(&l);
-	Expr* cur = l;
-	while(scm_is_pair(cur)) {
-		Expr* ll[2] = { QUOTE, scm_car(cur) };
-		cur->pair.car = scm_mk_list(ll, 2);
-		if(scm_is_error(scm_car(cur))) {
-			scm_stack_pop(&l);
-			return scm_car(cur);
-		}
-		cur = scm_cdr(cur);
-	}
-
-	scm_stack_pop(&l);
-	return l;
-}
-
 static Expr* save_eval(Expr* es) {
 	Expr* curEnv = CURRENT_ENV;
 	scm_stack_push(&curEnv);
@@ -227,56 +218,1061 @@ static Expr* let2lambda(Expr* let) {
 	return toRet;
 }
 
-// short circuits errors up the call stack
-#define error_circuit(expr) \
-	{ Expr* TmP = expr; \
-	  if(scm_is_error(TmP)) return TmP; }
+// (guard (var clause...) body...) is
+//   (__try (handlers) (lambda () body...) (lambda (var) (cond clause... (else (raise var)))))
+// with the primitives exception-handlers and raise themselves in place of
+// handlers and raise, so that rebinding their names changes nothing
+static Expr* guard2try(Expr* guard) {
+	assert(guard);
+	assert(scm_is_pair(guard));
+	assert(scm_car(guard) == GUARD);
+
+	Expr* rest = scm_cdr(guard);
+	if(!scm_is_pair(rest) || !scm_is_pair(scm_car(rest)) || !scm_is_symbol(scm_caar(rest)) || !scm_is_pair(scm_cdr(rest))) {
+		return scm_mk_error("malformed guard");
+	}
 
-static Expr* save_eval_all(Expr* es) {
-	assert(es);
+	Expr* var = scm_caar(rest);
+	Expr* clauses = scm_cdar(rest);
+	Expr* body = scm_cdr(rest);
+	if(scm_list_len(clauses) < 0) {
+		return scm_mk_error("malformed guard clauses");
+	}
 
-	if(es == EMPTY_LIST) {
-		return EMPTY_LIST;
+	Expr* last = clauses;
+	while(scm_is_pair(last) && scm_cdr(last) != EMPTY_LIST) last = scm_cdr(last);
+	bool hasElse = scm_is_pair(last) && scm_is_pair(scm_car(last)) && scm_caar(last) == ELSE;
+
+	scm_stack_push(&guard);
+	Expr* ll[4];
+
+	Expr* handler = EMPTY_LIST;
+	scm_stack_push(&handler);
+	ll[0] = QUOTE;
+	ll[1] = (Expr*) &FF_RAISE;
+	handler = scm_mk_list(ll, 2);
+	ll[0] = handler;
+	ll[1] = var;
+	handler = scm_mk_list(ll, 2);
+	ll[0] = ELSE;
+	ll[1] = handler;
+	handler = scm_mk_list(ll, 2);
+	handler = scm_mk_list(&handler, 1);
+	handler = hasElse ? clauses : scm_append(clauses, handler);
+	if(!scm_is_error(handler)) {
+		handler = scm_mk_pair(COND, handler);
+		handler = handler ? handler : OOM;
 	}
 
-	Expr* curEnv = CURRENT_ENV;
-	scm_stack_push(&curEnv);
+	Expr* args = scm_mk_list(&var, 1);
+	scm_stack_push(&args);
+	ll[0] = LAMBDA;
+	ll[1] = args;
+	ll[2] = handler;
+	handler = scm_mk_list(ll, 3);
+	scm_stack_pop(&args);
+
+	Expr* thunk = EMPTY_LIST;
+	scm_stack_push(&thunk);
+	ll[0] = LAMBDA;
+	ll[1] = EMPTY_LIST;
+	ll[2] = body;
+	thunk = scm_concat(ll, 3);
+
+	Expr* handlers = EMPTY_LIST;
+	scm_stack_push(&handlers);
+	ll[0] = QUOTE;
+	ll[1] = (Expr*) &FF_HANDLERS;
+	handlers = scm_mk_list(ll, 2);
+	handlers = scm_mk_list(&handlers, 1);
+
+	ll[0] = R_TRY;
+	ll[1] = handlers;
+	ll[2] = thunk;
+	ll[3] = handler;
+	Expr* toRet = scm_mk_list(ll, 4);
+
+	scm_stack_pop(&handlers);
+	scm_stack_pop(&thunk);
+	scm_stack_pop(&handler);
+	scm_stack_pop(&guard);
+
+	return toRet;
+}
+
+/* The resolution pass. Before a lambda is first called its body is copied
+ * into code where every variable reference found in the frames of the
+ * enclosing lambdas is replaced by an LREF to its slot. The names a body
+ * defines get slots too, so the scan below looks for defines ahead of time.
+ * What is left refers to BASE_ENV when the outermost lambda was evaluated
+ * there, in which case it becomes a GREF, and has to be looked up by name
+ * otherwise (e.g. in code passed to eval), through a DREF caching the result.
+ *
+ * Nested lambdas become PROTOs, resolved in turn on their first call. let,
+ * named let, cond, guard and the define shorthand for procedures are
+ * desugared once and for all here, and malformed forms are left untouched so
+ * that evaluating them reports the same errors as before.
+ *
+ * Macro uses are expanded here too, and the expansion is stored in place of
+ * the use in the code itself, so that code evaluated over and over, as eval
+ * does, is expanded only once. A define-syntax at toplevel makes its macro as
+ * soon as it is resolved, and one in a body when the body is scanned, where
+ * the uses that could expand into defines are expanded as well.
+ */
+
+static bool memq(Expr* x, Expr* l) {
+	for(; scm_is_pair(l); l = scm_cdr(l)) {
+		if(scm_car(l) == x) return true;
+	}
+
+	return false;
+}
+
+static Expr* assq(Expr* x, Expr* alist) {
+	for(; scm_is_pair(alist); alist = scm_cdr(alist)) {
+		if(scm_caar(alist) == x) return scm_car(alist);
+	}
+
+	return NULL;
+}
+
+Expr* scm_macro_ref(Expr* sym, Expr* scope) {
+	for(Expr* s = scope; s != FALSE; s = scm_proto(s)->outer) {
+		Proto* p = scm_proto(s);
+		Expr* m = assq(sym, p->macros);
+		if(m) return scm_cdr(m);
+		if(scm_slot_index(sym, p->args, p->locals, p->size) != -1) return NULL;
+	}
+
+	Expr* v = scope == FALSE ? scm_env_find(CURRENT_ENV, sym) : *scm_symbol_cell(sym);
+	return v && scm_is_macro(v) ? v : NULL;
+}
+
+// Expands e, a use of the macro m, into e itself, ready to be resolved or not
+static Expr* expand_in_place(Expr* m, Expr* e, bool resolved) {
+	scm_stack_push(&e);
+
+	Expr* x = scm_expand(m, e, resolved);
+	if(!scm_is_error(x) && !scm_is_pair(x)) {
+		scm_stack_push(&x);
+		Expr* ll[2] = { BEGIN, x };
+		x = scm_mk_list(ll, 2);
+		scm_stack_pop(&x);
+	}
+
+	if(!scm_is_error(x)) {
+		e->pair.car = scm_car(x);
+		e->pair.cdr = scm_cdr(x);
+		x = e;
+	}
+
+	scm_stack_pop(&e);
+	return x;
+}
+
+// The macro (define-syntax name (syntax-rules ...)) makes in scope, name is
+// set to its name
+static Expr* syntax_def(Expr* e, Expr* scope, Expr** name) {
+	Expr* rest = scm_cdr(e);
+	if(scm_list_len(rest) != 2 || !scm_is_symbol(scm_car(rest)) || !is_tpair(scm_cadr(rest), SYNRULES)) {
+		return scm_mk_error("Malformed define-syntax");
+	}
+
+	*name = scm_car(rest);
+	return scm_mk_macro(scm_cadr(rest), scope);
+}
 
-	Expr* head = scm_mk_pair(EMPTY_LIST, EMPTY_LIST);
+// Returns TRUE, or the error that stopped the scan
+static Expr* scan_defines(Expr* e, Expr* proto, Expr** locals) {
+	if(!scm_is_pair(e)) return TRUE;
+
+	Expr* head = scm_car(e);
+	if(head == QUOTE || head == QUASIQUOTE || head == LAMBDA) return TRUE;
+
+	if(head == DEFSYNTAX) {
+		Expr* name;
+		Expr* m = syntax_def(e, proto, &name);
+		if(scm_is_error(m)) return m;
+
+		scm_stack_push(&m);
+		m = scm_mk_pair(name, m);
+		if(m) m = scm_mk_pair(m, scm_proto(proto)->macros);
+		scm_stack_pop(&m);
+		if(!m) return OOM;
+
+		scm_proto(proto)->macros = m;
+		return TRUE;
+	}
+
+	Expr* m = scm_is_symbol(head) && !memq(head, *locals) ? scm_macro_ref(head, proto) : NULL;
+	if(m) {
+		Expr* x = expand_in_place(m, e, true);
+		return scm_is_error(x) ? x : scan_defines(x, proto, locals);
+	}
+
+	Expr* args = scm_proto(proto)->args;
+
+	if(head == LET) {
+		// only the initial values of a plain let are evaluated in this frame
+		Expr* rest = scm_cdr(e);
+		if(!scm_is_pair(rest) || !scm_is_pair(scm_car(rest))) return TRUE;
+
+		for(Expr* b = scm_car(rest); scm_is_pair(b); b = scm_cdr(b)) {
+			Expr* binding = scm_car(b);
+			if(scm_is_pair(binding) && scm_is_pair(scm_cdr(binding))) {
+				Expr* res = scan_defines(scm_cadr(binding), proto, locals);
+				if(res != TRUE) return res;
+			}
+		}
+		return TRUE;
+	}
+
+	if(head == DEFINE && scm_is_pair(scm_cdr(e))) {
+		Expr* name = scm_cadr(e);
+		bool isFunc = scm_is_pair(name);
+		if(isFunc) name = scm_car(name);
+
+		if(scm_is_symbol(name) && scm_slot_index(name, args, EMPTY_LIST, 0) == -1 && !memq(name, *locals)) {
+			Expr* t = scm_mk_pair(name, *locals);
+			if(!t) return OOM;
+			*locals = t;
+		}
+
+		if(isFunc) return TRUE;
+		e = scm_cdr(e);
+	}
+
+	for(; scm_is_pair(e); e = scm_cdr(e)) {
+		Expr* res = scan_defines(scm_car(e), proto, locals);
+		if(res != TRUE) return res;
+	}
+
+	return TRUE;
+}
+
+static Expr* resolve(Expr* e, Expr* scope);
+
+// Whether names that aren't bound in the frames of scope are globals. Code
+// resolved outside of any lambda, for the VM, has FALSE for a scope.
+static inline bool is_global(Expr* scope) {
+	return scope == FALSE ? CURRENT_ENV == BASE_ENV : scm_proto(scope)->global;
+}
+
+static Expr* resolve_ref(Expr* sym, Expr* scope) {
+	unsigned depth = 0;
+	Expr* s = scope;
+	for(;;) {
+		for(; s != FALSE; s = scm_proto(s)->outer) {
+			Proto* p = scm_proto(s);
+			int idx = scm_slot_index(sym, p->args, p->locals, p->size);
+			if(idx != -1) return scm_mk_lref(depth, idx);
+
+			depth++;
+		}
+
+		// a name a macro renamed that its expansion doesn't bind stands for
+		// the one it renamed, looked up where the macro was made
+		Expr* alias = scm_symbol_alias(sym);
+		if(!alias) break;
+
+		sym = scm_car(alias);
+		depth = 0;
+		for(s = scope; s != FALSE && s != scm_cdr(alias); s = scm_proto(s)->outer) depth++;
+	}
+
+	return is_global(scope) ? scm_mk_gref(sym) : scm_mk_dref(sym, depth);
+}
+
+// Applies f to all the elements of l, unless it isn't a proper list
+static Expr* map_seq(Expr* l, Expr* scope, Expr* (*f)(Expr*, Expr*)) {
+	if(scm_list_len(l) == -1) return l;
+
+	Expr* head = EMPTY_LIST;
+	Expr* tail = EMPTY_LIST;
+	Expr* cur = EMPTY_LIST;
+	scm_stack_push(&l);
 	scm_stack_push(&head);
-	Expr* cur = head;
+	scm_stack_push(&cur);
+
+	for(; scm_is_pair(l); l = scm_cdr(l)) {
+		cur = f(scm_car(l), scope);
+		if(scm_is_error(cur)) {
+			head = cur;
+			break;
+		}
+
+		cur = scm_mk_pair(cur, EMPTY_LIST);
+		if(!cur) {
+			head = OOM;
+			break;
+		}
+
+		if(head == EMPTY_LIST) head = cur;
+		else                   tail->pair.cdr = cur;
+		tail = cur;
+	}
+
+	scm_stack_pop(&cur);
+	scm_stack_pop(&head);
+	scm_stack_pop(&l);
+
+	return head;
+}
+
+static inline Expr* resolve_seq(Expr* l, Expr* scope) {
+	return map_seq(l, scope, resolve);
+}
+
+// Prepends head to the resolved elements of rest
+static Expr* resolve_form(Expr* head, Expr* rest, Expr* scope) {
+	scm_stack_push(&head);
+
+	Expr* toRet = resolve_seq(rest, scope);
+	scm_stack_push(&toRet);
+	if(!scm_is_error(toRet)) {
+		toRet = scm_mk_pair(head, toRet);
+		toRet = toRet ? toRet : OOM;
+	}
+
+	scm_stack_pop(&toRet);
+	scm_stack_pop(&head);
+
+	return toRet;
+}
+
+// Only what is unquoted at the outermost level is evaluated
+static Expr* resolve_quasi(Expr* e, Expr* scope, unsigned level) {
+	if(!scm_is_pair(e)) return e;
+
+	Expr* head = scm_car(e);
+	Expr* rest = scm_cdr(e);
+	if((head == QUASIQUOTE || head == UNQUOTE || head == UNQUOTE_SPLICING) && scm_is_pair(rest)) {
+		Expr* inner = scm_car(rest);
+		if(head == QUASIQUOTE)  inner = resolve_quasi(inner, scope, level + 1);
+		else if(level == 0)     inner = resolve(inner, scope);
+		else                    inner = resolve_quasi(inner, scope, level - 1);
+
+		if(scm_is_error(inner)) return inner;
+		if(inner == scm_car(rest)) return e;
+
+		scm_stack_push(&inner);
+		inner = scm_mk_pair(inner, scm_cdr(rest));
+		inner = inner ? scm_mk_pair(head, inner) : NULL;
+		scm_stack_pop(&inner);
+
+		return inner ? inner : OOM;
+	}
+
+	scm_stack_push(&e);
 
-	while(scm_is_pair(es)) {
-		cur->pair.car = stc_eval(scm_car(es));
-		if(scm_is_error(scm_car(cur))) {
-			scm_stack_pop(&head); scm_stack_pop(&curEnv); CURRENT_ENV = curEnv;
-			return scm_car(cur);
+	Expr* car = resolve_quasi(head, scope, level);
+	Expr* cdr = car;
+	if(!scm_is_error(car)) {
+		scm_stack_push(&car);
+		cdr = resolve_quasi(rest, scope, level);
+		scm_stack_pop(&car);
+	}
+
+	Expr* toRet;
+	if(scm_is_error(car))         toRet = car;
+	else if(scm_is_error(cdr))    toRet = cdr;
+	else if(car == scm_car(e) && cdr == scm_cdr(e)) toRet = e;
+	else {
+		scm_stack_push(&car);
+		scm_stack_push(&cdr);
+		toRet = scm_mk_pair(car, cdr);
+		scm_stack_pop(&cdr);
+		scm_stack_pop(&car);
+		toRet = toRet ? toRet : OOM;
+	}
+
+	scm_stack_pop(&e);
+
+	return toRet;
+}
+
+static Expr* resolve_clause(Expr* clause, Expr* scope) {
+	if(!scm_is_pair(clause)) return clause;
+
+	Expr* test = scm_car(clause);
+	if(test != ELSE) {
+		test = resolve(test, scope);
+		if(scm_is_error(test)) return test;
+	}
+
+	return resolve_form(test, scm_cdr(clause), scope);
+}
+
+// Whether evaluating a cond with these clauses can't report a malformed one
+static bool well_formed_cond(Expr* clauses) {
+	for(; scm_is_pair(clauses); clauses = scm_cdr(clauses)) {
+		Expr* clause = scm_car(clauses);
+		if(!scm_is_pair(clause) || scm_list_len(scm_cdr(clause)) < 1) return false;
+	}
+
+	return clauses == EMPTY_LIST;
+}
+
+// A well formed cond becomes nested ifs, so picking a clause allocates nothing
+static Expr* cond2if(Expr* clauses, Expr* scope) {
+	if(clauses == EMPTY_LIST) {
+		//no matching clause in cond is unspecified
+		Expr* ll[2] = { QUOTE, EMPTY_LIST };
+		return scm_mk_list(ll, 2);
+	}
+
+	Expr* clause = scm_car(clauses);
+	Expr* test = EMPTY_LIST;
+	Expr* body = EMPTY_LIST;
+	Expr* rest = EMPTY_LIST;
+	scm_stack_push(&test);
+	scm_stack_push(&body);
+	scm_stack_push(&rest);
+
+	body = resolve_seq(scm_cdr(clause), scope);
+	if(!scm_is_error(body)) {
+		if(is_last(body)) body = scm_car(body);
+		else              body = scm_mk_pair(BEGIN, body);
+		body = body ? body : OOM;
+	}
+
+	Expr* toRet = body;
+	if(!scm_is_error(body) && scm_car(clause) != ELSE) {
+		toRet = test = resolve(scm_car(clause), scope);
+		if(!scm_is_error(test)) toRet = rest = cond2if(scm_cdr(clauses), scope);
+		if(!scm_is_error(toRet)) {
+			Expr* ll[4] = { IF, test, body, rest };
+			toRet = scm_mk_list(ll, 4);
+		}
+	}
+
+	scm_stack_pop(&rest);
+	scm_stack_pop(&body);
+	scm_stack_pop(&test);
+
+	return toRet;
+}
+
+// Whether e, as written in code, evaluates to itself or is quoted. Its value
+// is set in v if so.
+static bool literal(Expr* e, Expr** v) {
+	if(scm_is_pair(e)) {
+		if(scm_car(e) != QUOTE || !scm_is_pair(scm_cdr(e)) || scm_cddr(e) != EMPTY_LIST) return false;
+
+		*v = scm_cadr(e);
+		return true;
+	}
+
+	if(scm_is_closure(e) || scm_is_symbol(e) || scm_is_ffunc(e)) return false;
+	if(scm_is_lref(e) || scm_is_gref(e) || scm_is_dref(e) || scm_is_proto(e)) return false;
+
+	*v = e;
+	return true;
+}
+
+// Whether e is (__fold version value original), as made by fold()
+static bool is_fold(Expr* e) {
+	return scm_is_pair(e) && scm_car(e) == R_FOLD && scm_list_len(e) == 4 && scm_is_int(scm_cadr(e));
+}
+
+// A literal, or a folded call that still holds
+static bool constant(Expr* e, Expr** v) {
+	if(is_fold(e)) {
+		if((unsigned) scm_ival(scm_cadr(e)) != scm_fold_version) return false;
+
+		*v = scm_caddr(e);
+		return true;
+	}
+
+	return literal(e, v);
+}
+
+// Calls a primitive that is bound to a global on constant arguments once and
+// for all. The call becomes (__fold version value call), which stands for
+// value as long as scm_fold_version stays the same and for call otherwise.
+static Expr* fold(Expr* call) {
+	if(!scm_is_pair(call) || !scm_is_gref(scm_car(call))) return call;
+
+	Expr* ff = *scm_symbol_cell(scm_car(call)->atom.gref);
+	if(!ff || !scm_is_vfunc(ff) || !ff->atom.vfptr->pure) return call;
+
+	const size_t base = scm_arg_stack_size();
+	int n = 0;
+	for(Expr* l = scm_cdr(call); l != EMPTY_LIST; l = scm_cdr(l), n++) {
+		Expr* c;
+		if(!scm_is_pair(l) || !constant(scm_car(l), &c) || !scm_arg_stack_push(c)) {
+			scm_arg_stack_unwind(base);
+			return call;
 		}
+	}
+
+	scm_stack_push(&call);
+	Expr* v = scm_call_ffunc(ff, n, scm_arg_stack_at(base));
+	scm_arg_stack_unwind(base);
+	if(!scm_is_error(v)) {
+		scm_stack_push(&v);
+		Expr* version = scm_mk_int(scm_fold_version);
+		if(version) {
+			Expr* ll[4] = { R_FOLD, version, v, call };
+			v = scm_mk_list(ll, 4);
+		} else {
+			v = OOM;
+		}
+		scm_stack_pop(&v);
+	}
+	scm_stack_pop(&call);
+
+	// a call that fails is left for the engine to report at runtime
+	return v == OOM || !scm_is_error(v) ? v : call;
+}
 
-		if(scm_is_pair(scm_cdr(es))) {
-			cur->pair.cdr = scm_mk_pair(EMPTY_LIST, EMPTY_LIST);
-			if(!cur->pair.cdr) {
-				scm_stack_pop(&head); scm_stack_pop(&curEnv); CURRENT_ENV = curEnv;
-				return OOM;
+static Expr* resolve(Expr* e, Expr* scope) {
+	assert(e); assert(scope);
+
+	if(scm_is_symbol(e)) return resolve_ref(e, scope);
+	if(!scm_is_pair(e)) return e;
+
+	Expr* head = scm_car(e);
+	Expr* rest = scm_cdr(e);
+
+	if(head == QUOTE) {
+		return e;
+	} else if(head == QUASIQUOTE) {
+		if(!scm_is_pair(rest)) return e;
+
+		Expr* inner = resolve_quasi(scm_car(rest), scope, 0);
+		if(scm_is_error(inner) || inner == scm_car(rest)) return inner == scm_car(rest) ? e : inner;
+
+		scm_stack_push(&inner);
+		inner = scm_mk_pair(inner, scm_cdr(rest));
+		inner = inner ? scm_mk_pair(QUASIQUOTE, inner) : NULL;
+		scm_stack_pop(&inner);
+
+		return inner ? inner : OOM;
+	} else if(head == LAMBDA) {
+		if(!scm_is_pair(rest)) return e;
+
+		Expr* args = scm_car(rest);
+		Expr* body = scm_cdr(rest);
+		if(!scm_is_pair(args) && !scm_is_symbol(args) && args != EMPTY_LIST) return e;
+		if(!scm_is_pair(body)) return e;
+
+		return scm_mk_proto(args, body, scope, is_global(scope));
+	} else if(head == GUARD) {
+		Expr* try = guard2try(e);
+		if(scm_is_error(try)) return try == OOM ? OOM : e;
+
+		scm_stack_push(&try);
+		Expr* toRet = resolve(try, scope);
+		scm_stack_pop(&try);
+
+		return toRet;
+	} else if(head == LET) {
+		Expr* lambda = let2lambda(e);
+		if(scm_is_error(lambda)) return lambda == OOM ? OOM : e;
+
+		scm_stack_push(&lambda);
+		Expr* toRet = resolve(lambda, scope);
+		scm_stack_pop(&lambda);
+
+		return toRet;
+	} else if(head == DEFINE) {
+		if(!scm_is_pair(rest)) return e;
+
+		Expr* name = scm_car(rest);
+		Expr* val;
+		if(scm_is_pair(name)) {
+			name = scm_car(name);
+			if(!scm_is_symbol(name)) return e;
+
+			val = def2lambda(rest);
+		} else {
+			if(!scm_is_symbol(name) || !scm_is_pair(scm_cdr(rest)) || scm_cddr(rest) != EMPTY_LIST) return e;
+
+			val = scm_cadr(rest);
+		}
+		if(scm_is_error(val)) return val;
+
+		// a name a macro renamed is defined at toplevel as it was written
+		if(scope == FALSE) name = scm_unrenamed(name);
+
+		scm_stack_push(&val);
+		val = resolve(val, scope);
+		if(scm_is_proto(val) && scm_proto(val)->name == FALSE) scm_proto(val)->name = name;
+		if(!scm_is_error(val)) {
+			Expr* ll[3] = { DEFINE, name, val };
+			val = scm_mk_list(ll, 3);
+		}
+		scm_stack_pop(&val);
+
+		return val;
+	} else if(head == SET) {
+		if(!scm_is_pair(rest) || !scm_is_symbol(scm_car(rest)) || !scm_is_pair(scm_cdr(rest)) || scm_cddr(rest) != EMPTY_LIST) return e;
+
+		Expr* ref = resolve_ref(scm_car(rest), scope);
+		if(scm_is_error(ref)) return ref;
+		scm_stack_push(&ref);
+
+		Expr* val = resolve(scm_cadr(rest), scope);
+		scm_stack_push(&val);
+		if(!scm_is_error(val)) {
+			Expr* ll[3] = { SET, ref, val };
+			val = scm_mk_list(ll, 3);
+		}
+		scm_stack_pop(&val);
+
+		scm_stack_pop(&ref);
+		return val;
+	} else if(head == COND) {
+		if(well_formed_cond(rest)) return cond2if(rest, scope);
+
+		Expr* clauses = map_seq(rest, scope, resolve_clause);
+		if(scm_is_error(clauses)) return clauses;
+
+		scm_stack_push(&clauses);
+		Expr* toRet = scm_mk_pair(COND, clauses);
+		scm_stack_pop(&clauses);
+
+		return toRet ? toRet : OOM;
+	} else if(head == IF) {
+		// only the branch a literal test picks is kept
+		Expr* test;
+		if(scm_list_len(rest) == 3 && literal(scm_car(rest), &test)) {
+			return resolve(test != FALSE ? scm_cadr(rest) : scm_caddr(rest), scope);
+		}
+
+		return resolve_form(head, rest, scope);
+	} else if(head == DEFSYNTAX) {
+		// one in a body was made by the scan already
+		Expr* name;
+		Expr* m = syntax_def(e, scope, &name);
+		if(scm_is_error(m)) return m;
+
+		if(scope == FALSE) {
+			name = scm_unrenamed(name);
+			m = scm_env_define(CURRENT_ENV, name, m);
+			if(scm_is_error(m)) return m;
+		}
+
+		Expr* ll[2] = { QUOTE, name };
+		return scm_mk_list(ll, 2);
+	} else if(head == SYNRULES) {
+		Expr* m = scm_mk_macro(e, scope);
+		if(scm_is_error(m)) return m;
+
+		scm_stack_push(&m);
+		Expr* ll[2] = { QUOTE, m };
+		Expr* toRet = scm_mk_list(ll, 2);
+		scm_stack_pop(&m);
+
+		return toRet;
+	} else if(head == BEGIN || head == AND || head == OR || head == R_APPLY || head == R_EVAL || head == R_CALLCC || head == R_CALLEC || head == R_TRY) {
+		return resolve_form(head, rest, scope);
+	} else {
+		Expr* m = scm_is_symbol(head) ? scm_macro_ref(head, scope) : NULL;
+		if(m) {
+			Expr* x = expand_in_place(m, e, true);
+			return scm_is_error(x) ? x : resolve(x, scope);
+		}
+
+		Expr* call = resolve_seq(e, scope);
+		return scm_is_error(call) ? call : fold(call);
+	}
+}
+
+// Whether evaluating resolved code can make a closure over the current frame
+// that outlives the call, or leave a lambda to be made at runtime. A PROTO
+// that is applied on the spot, as let does, only counts if its own body can.
+static bool may_capture(Expr* e) {
+	if(scm_is_proto(e)) return true;
+	if(!scm_is_pair(e)) return false;
+
+	Expr* head = scm_car(e);
+	if(head == QUOTE || is_fold(e)) return false;
+	if(head == LAMBDA || head == LET) return true;
+	if(head == DEFINE && scm_is_pair(scm_cdr(e)) && scm_is_pair(scm_cadr(e))) return true;
+
+	if(scm_is_proto(head)) {
+		if(!scm_proto(head)->code && scm_is_error(scm_resolve_body(head))) return true;
+		if(!scm_proto(head)->noCapture) return true;
+		e = scm_cdr(e);
+	}
+
+	for(; scm_is_pair(e); e = scm_cdr(e)) {
+		if(may_capture(scm_car(e))) return true;
+	}
+	return false;
+}
+
+// Resolves the body of a closure's PROTO before its first call
+Expr* scm_resolve_body(Expr* proto) {
+	assert(proto); assert(scm_is_proto(proto));
+
+	Proto* p = scm_proto(proto);
+	Expr* locals = EMPTY_LIST;
+	scm_stack_push(&proto);
+	scm_stack_push(&locals);
+
+	Expr* toRet = NULL;
+	for(Expr* l = p->body; scm_is_pair(l); l = scm_cdr(l)) {
+		Expr* res = scan_defines(scm_car(l), proto, &locals);
+		if(res != TRUE) {
+			toRet = res;
+			break;
+		}
+	}
+
+	if(!toRet) {
+		p->locals = locals;
+		p->size = p->nreq + p->rest + scm_list_len(locals);
+
+		toRet = resolve_seq(p->body, proto);
+		if(!scm_is_error(toRet)) {
+			// the code is kept by proto before may_capture() resolves the
+			// lambdas let applies, which allocates. It is a sequence, which
+			// may_capture() would take for a call when it starts with a lambda.
+			p->code = toRet;
+			bool capture = false;
+			for(Expr* l = toRet; !capture && scm_is_pair(l); l = scm_cdr(l)) {
+				capture = may_capture(scm_car(l));
 			}
-			cur = scm_cdr(cur);
+			p->noCapture = !capture;
 		}
+	}
+
+	scm_stack_pop(&locals);
+	scm_stack_pop(&proto);
 
-		es = scm_cdr(es);
+	return toRet;
+}
+
+Expr* scm_resolve_toplevel(Expr* e) {
+	assert(e);
 
-		CURRENT_ENV = curEnv;
+	Expr* body = scm_mk_pair(e, EMPTY_LIST);
+	if(!body) return OOM;
+	scm_stack_push(&body);
+
+	Expr* proto = scm_mk_proto(EMPTY_LIST, body, FALSE, CURRENT_ENV == BASE_ENV);
+	scm_stack_push(&proto);
+
+	Expr* toRet = proto;
+	if(!scm_is_error(proto)) {
+		toRet = resolve_seq(body, FALSE);
+		if(!scm_is_error(toRet)) {
+			scm_proto(proto)->code = toRet;
+			toRet = proto;
+		}
 	}
 
-	if(es != EMPTY_LIST) {
-		return scm_mk_error("arguments aren't a proper list");
+	scm_stack_pop(&proto);
+	scm_stack_pop(&body);
+
+	return toRet;
+}
+
+// short circuits errors up the call stack
+#define error_circuit(expr) \
+	{ Expr* TmP = expr; \
+	  if(scm_is_error(TmP)) return TmP; }
+
+// A fresh copy of the proper list l
+static Expr* copy_list(Expr* l) {
+	Expr* head = EMPTY_LIST;
+	Expr* tail = EMPTY_LIST;
+	scm_stack_push(&l);
+	scm_stack_push(&head);
+
+	for(; scm_is_pair(l); l = scm_cdr(l)) {
+		Expr* cur = scm_mk_pair(scm_car(l), EMPTY_LIST);
+		if(!cur) {
+			head = OOM;
+			break;
+		}
+
+		if(head == EMPTY_LIST) head = cur;
+		else                   tail->pair.cdr = cur;
+		tail = cur;
 	}
 
 	scm_stack_pop(&head);
-	scm_stack_pop(&curEnv);
+	scm_stack_pop(&l);
 
 	return head;
 }
 
+// Evaluates the arguments es onto the argument stack, which the caller
+// unwinds. Returns the error that stopped it if any, NULL otherwise.
+static Expr* eval_args(Expr* es) {
+	assert(es);
+
+	for(; scm_is_pair(es); es = scm_cdr(es)) {
+		Expr* v = save_eval(scm_car(es));
+		if(scm_is_error(v)) return v;
+		if(!scm_arg_stack_push(v)) return scm_mk_error("too many arguments");
+	}
+
+	return es == EMPTY_LIST ? NULL : scm_mk_error("arguments aren't a proper list");
+}
+
+// Evaluates the arguments es of a call to func and calls func on them, unless
+// it isn't a primitive or a continuation after all
+static Expr* call_ffunc(Expr* func, Expr* es) {
+	assert(func); assert(es);
+
+	const size_t base = scm_arg_stack_size();
+	Expr* toRet = eval_args(es);
+
+	if(!toRet) {
+		const int argc = scm_arg_stack_size() - base;
+		if(scm_is_cont(func))        toRet = scm_throw(func, argc, scm_arg_stack_at(base));
+		else if(!scm_is_ffunc(func)) toRet = scm_mk_error("can't evaluate (not a ffunc or closure)");
+		else                         toRet = scm_call_ffunc(func, argc, scm_arg_stack_at(base));
+	}
+
+	scm_arg_stack_unwind(base);
+
+	return toRet;
+}
+
+// Evaluates the arguments es into the list a rest parameter is bound to, made
+// once they all are
+static Expr* eval_rest(Expr* es) {
+	assert(es);
+
+	const size_t base = scm_arg_stack_size();
+	Expr* toRet = eval_args(es);
+	if(!toRet) toRet = scm_mk_list(scm_arg_stack_at(base), scm_arg_stack_size() - base);
+
+	scm_arg_stack_unwind(base);
+
+	return toRet;
+}
+
+// Where ESCAPE is headed, and the value it carries there
+static Expr* escapeTo = NULL;
+static Expr* escapeWith = NULL;
+
+Expr* scm_throw(Expr* k, int argc, Expr** argv) {
+	assert(k); assert(scm_is_cont(k));
+
+	if(argc != 1) return scm_mk_error("continuation expects 1 arg");
+
+	// once its call is over, the continuation of the tree walker or the
+	// analyzer has nowhere to go back to
+	escapeTo = scm_cont(k)->vm || scm_cont(k)->live ? k : NULL;
+	escapeWith = argv[0];
+
+	return ESCAPE;
+}
+
+Expr* scm_escape_target() {
+	return escapeTo;
+}
+
+Expr* scm_catch(Expr* k) {
+	if(escapeTo != k) return NULL;
+
+	Expr* v = escapeWith;
+	escapeTo = escapeWith = NULL;
+
+	return v;
+}
+
+Expr* scm_handlers;
+
+// The latest error made and the handlers installed at the time
+static Expr* lastError = NULL;
+static Expr* lastHandlers = NULL;
+
+void scm_note_error(Expr* err) {
+	lastError = err;
+	lastHandlers = scm_handlers;
+}
+
+// Whether a __try that installed handlers catches err
+static bool caught_by(Expr* err, Expr* handlers) {
+	if(err == ESCAPE || err == SWITCH || scm_is_preempted(err)) return false;
+
+	// errors raised by a handler called from raise-continuable are raised
+	// outside of the handlers it was installed with
+	if(err == lastError) {
+		Expr* h = lastHandlers;
+		while(h != handlers && scm_is_pair(h)) h = scm_cdr(h);
+		if(h != handlers) return false;
+	}
+
+	return true;
+}
+
+// The innermost place to unwind to, NULL outside of any
+static Catch* catches = NULL;
+
+void scm_enter_catch(Catch* c, Expr* handlers) {
+	c->outer = catches;
+	c->handlers = handlers;
+	c->env = CURRENT_ENV;
+	c->roots = scm_stack_size();
+	c->args = scm_arg_stack_size();
+	c->frames = scm_frame_stack_size();
+	c->caught = NULL;
+	catches = c;
+}
+
+void scm_leave_catch(Catch* c) {
+	assert(catches == c);
+	catches = c->outer;
+}
+
+Expr* scm_signal(Expr* err) {
+	assert(err); assert(scm_is_error(err));
+
+	// the __try that don't catch it are unwound along with everything
+	// else, as a run of the VM can't be
+	for(Catch* c = catches; c && c->handlers; c = c->outer) {
+		if(!caught_by(err, c->handlers)) continue;
+
+		scm_stack_unwind(c->roots);
+		scm_arg_stack_unwind(c->args);
+		scm_frame_stack_unwind(c->frames, NULL);
+		CURRENT_ENV = c->env;
+		catches = c->outer;
+
+		c->caught = err;
+		longjmp(c->to, 1);
+	}
+
+	return err;
+}
+
+Expr* scm_raise(Expr* obj) {
+	assert(obj);
+
+	// an error caught earlier is raised again as it was
+	Expr* err = scm_is_condition(obj) ? scm_mk_error(scm_sval(obj)) : scm_mk_raised(obj);
+
+	return scm_signal(err);
+}
+
+Expr* scm_condition(Expr* err, Expr* handlers) {
+	assert(err); assert(scm_is_error(err)); assert(handlers);
+
+	if(!caught_by(err, handlers)) return NULL;
+
+	if(scm_is_raised(err)) return err->atom.raised;
+	return scm_mk_condition(scm_sval(err));
+}
+
+void scm_mark_escape() {
+	if(escapeTo)     scm_mark(escapeTo);
+	if(escapeWith)   scm_mark(escapeWith);
+	if(scm_handlers) scm_mark(scm_handlers);
+	if(lastError)    scm_mark(lastError);
+	if(lastHandlers) scm_mark(lastHandlers);
+}
+
+void scm_init_eval() {
+	scm_handlers = EMPTY_LIST;
+}
+
+void scm_reset_eval() {
+	catches = NULL;
+	escapeTo = escapeWith = NULL;
+	lastError = lastHandlers = NULL;
+	scm_handlers = EMPTY_LIST;
+}
+
+// Calls the continuation k on the list of values args
+static Expr* throw_list(Expr* k, Expr* args) {
+	Expr* v = scm_is_pair(args) ? scm_car(args) : NULL;
+	return scm_throw(k, scm_list_len(args), &v);
+}
+
+// Calls f on arg, or on nothing when it is NULL
+static Expr* call_on(Expr* f, Expr* arg) {
+	scm_stack_push(&f);
+	if(arg) scm_stack_push(&arg);
+
+	// evaluates ((quote f) (quote arg)), as neither evaluates to itself
+	Expr* qf = EMPTY_LIST;
+	Expr* qarg = EMPTY_LIST;
+	scm_stack_push(&qf);
+	scm_stack_push(&qarg);
+
+	Expr* ll[2] = { QUOTE, f };
+	qf = scm_mk_list(ll, 2);
+	if(arg) {
+		ll[1] = arg;
+		qarg = scm_is_error(qf) ? qf : scm_mk_list(ll, 2);
+	}
+	ll[0] = qf;
+	ll[1] = qarg;
+	Expr* call = scm_is_error(qf) ? qf : scm_is_error(qarg) ? qarg : scm_mk_list(ll, arg ? 2 : 1);
+
+	scm_stack_pop(&qarg);
+	scm_stack_pop(&qf);
+
+	Expr* res = scm_is_error(call) ? call : save_eval(call);
+
+	if(arg) scm_stack_pop(&arg);
+	scm_stack_pop(&f);
+
+	return res;
+}
+
+// Calls f on a continuation that escapes back to here, for as long as the
+// call lasts
+static Expr* call_cc(Expr* f) {
+	Expr* k = scm_mk_cont(NULL);
+	if(scm_is_error(k)) return k;
+
+	scm_stack_push(&k);
+
+	Expr* res = call_on(f, k);
+	scm_cont(k)->live = false;
+	if(res == ESCAPE) {
+		Expr* v = scm_catch(k);
+		if(v) res = v;
+	}
+
+	scm_stack_pop(&k);
+
+	return res;
+}
+
+// Calls thunk with handlers installed, and handler on the condition of the
+// error it raises unless handler is false. What is raised within the call
+// unwinds straight back to here rather than returning through it.
+static Expr* try_thunk(Expr* handlers, Expr* thunk, Expr* handler) {
+	Expr* saved = scm_handlers;
+	scm_stack_push(&saved);
+	scm_stack_push(&handlers);
+	scm_stack_push(&handler);
+
+	Catch here;
+	Expr* res;
+	scm_handlers = handlers;
+	if(handler == FALSE) {
+		res = call_on(thunk, NULL);
+	} else if(!setjmp(here.to)) {
+		scm_enter_catch(&here, handlers);
+		res = call_on(thunk, NULL);
+		scm_leave_catch(&here);
+	} else {
+		res = here.caught;
+	}
+	scm_handlers = saved;
+
+	Expr* c = scm_is_error(res) && handler != FALSE ? scm_condition(res, handlers) : NULL;
+	if(c) res = scm_is_error(c) ? c : call_on(handler, c);
+
+	scm_stack_pop(&handler);
+	scm_stack_pop(&handlers);
+	scm_stack_pop(&saved);
+
+	return res;
+}
+
 static Expr* quasi_eval(Expr* e, unsigned level) {
 	if(is_tpair(e, QUASIQUOTE)) {
 		Expr* rest = scm_cdr(e);
@@ -353,17 +1349,25 @@ static Expr* quasi_eval(Expr* e, unsigned level) {
 	{ Expr* TmP = expr; \
 	  if(scm_is_error(TmP)) { scm_stack_pop(&e); return TmP; } }
 
-static Expr* stc_eval(Expr* e) {
+// base is how many frames were stacked before e, the ones above it belong to
+// the calls made in this invocation
+static Expr* stc_eval_at(Expr* e, size_t base) {
 	scm_stack_push(&e);
 //just a tail call
 begin:
 	assert(e);
 
 	if(scm_is_pair(e)) {
-		if(is_tpair(e, QUOTE)) {
+		Expr* head = scm_car(e);
+		Expr* func;
+		bool evaluated;
+
+		switch(scm_is_symbol(head) ? scm_symbol_form(head) : FORM_NONE) {
+		case FORM_QUOTE: {
 			scm_stack_pop(&e);
 			return scm_cadr(e);
-		} else if(is_tpair(e, QUASIQUOTE)) {
+		}
+		case FORM_QUASIQUOTE: {
 			Expr* rest = scm_cdr(e);
 			if(!scm_is_pair(rest)) {
 				scm_stack_pop(&e);
@@ -374,7 +1378,8 @@ begin:
 			scm_stack_pop(&e);
 
 			return toRet;
-		} else if(is_tpair(e, IF)) {
+		}
+		case FORM_IF: {
 			//(if predicate consequent alternative)
 			//ensure list length is correct, error out otherwise
 			e = scm_cdr(e);
@@ -404,12 +1409,16 @@ begin:
 			error:
 				scm_stack_pop(&e);
 				return scm_mk_error("Incorrect number of args to if (expected 3)");
-		} else if(is_tpair(e, LET)) {
+		}
+		case FORM_LET: {
 			e = let2lambda(e);
 			goto begin;
-		} else if(is_tpair(e, BEGIN)) {
+		}
+		case FORM_BEGIN: {
 			e = scm_cdr(e);
 
+		//closure bodies are run from here, without a begin around them
+		sequence:
 			while(scm_is_pair(e) && scm_cdr(e) != EMPTY_LIST) {
 				Expr* res = save_eval(scm_car(e));
 				error_circuit(res);
@@ -424,7 +1433,8 @@ begin:
 
 			e = scm_car(e);
 			goto begin;
-		} else if(is_tpair(e, COND)) {
+		}
+		case FORM_COND: {
 			e = scm_cdr(e);
 
 			while(scm_is_pair(e)) {
@@ -446,12 +1456,8 @@ begin:
 				}
 
 				if(go) {
-					e = scm_mk_pair(BEGIN, scm_cdr(clause));
-					if(!e) {
-						scm_stack_pop(&e);
-						return OOM;
-					}
-					goto begin;
+					e = scm_cdr(clause);
+					goto sequence;
 				}
 
 				e = scm_cdr(e);
@@ -465,7 +1471,8 @@ begin:
 			//no matching clause in cond is unspecified
 			scm_stack_pop(&e);
 			return EMPTY_LIST;
-		} else if(is_tpair(e, DEFINE)) {
+		}
+		case FORM_DEFINE: {
 			e = scm_cdr(e);
 
 			bool isPair = scm_is_pair(e);
@@ -502,25 +1509,30 @@ begin:
 
 			scm_stack_pop(&e);
 			return res;
-		} else if(is_tpair(e, SET)) {
+		}
+		case FORM_SET: {
 			e = scm_cdr(e);
 
-			if(!scm_is_pair(e) || !scm_is_symbol(scm_car(e)) || !scm_is_pair(scm_cdr(e)) || scm_cddr(e) != EMPTY_LIST) {
-				scm_stack_pop(&e);
-				return scm_mk_error("Malformed set!");
-			}
+			if(!scm_is_pair(e) || !scm_is_pair(scm_cdr(e)) || scm_cddr(e) != EMPTY_LIST) goto malformed_set;
 
 			Expr* name = scm_car(e);
+			if(!scm_is_symbol(name) && !scm_is_lref(name) && !scm_is_gref(name) && !scm_is_dref(name)) goto malformed_set;
+
 			Expr* val = save_eval(scm_cadr(e));
 			error_circuit(val);
 
 			scm_stack_push(&val);
-			Expr* res = scm_env_set(CURRENT_ENV, name, val);
+			Expr* res = scm_is_symbol(name) ? scm_env_set(CURRENT_ENV, name, val) : scm_env_set_ref(CURRENT_ENV, name, val);
 			scm_stack_pop(&val);
 
 			scm_stack_pop(&e);
 			return res;
-		} else if(is_tpair(e, AND)) {
+
+			malformed_set:
+				scm_stack_pop(&e);
+				return scm_mk_error("Malformed set!");
+		}
+		case FORM_AND: {
 			e = scm_cdr(e);
 			if(e == EMPTY_LIST) {
 				scm_stack_pop(&e);
@@ -546,7 +1558,8 @@ begin:
 
 			e = scm_car(e);
 			goto begin;
-		} else if(is_tpair(e, OR)) {
+		}
+		case FORM_OR: {
 			e = scm_cdr(e);
 			if(e == EMPTY_LIST) {
 				scm_stack_pop(&e);
@@ -572,7 +1585,8 @@ begin:
 
 			e = scm_car(e);
 			goto begin;
-		} else if(is_tpair(e, LAMBDA)) {
+		}
+		case FORM_LAMBDA: {
 			// (lambda (the arg list) body)
 			e = scm_cdr(e);
 
@@ -593,46 +1607,46 @@ begin:
 				return scm_mk_error("lambda body is not a list");
 			}
 
+			Expr* proto = scm_mk_proto(args, body, FALSE, CURRENT_ENV == BASE_ENV);
+			error_circuit(proto);
+
+			scm_stack_push(&proto);
+			Expr* closure = scm_mk_closure(CURRENT_ENV, proto);
+			scm_stack_pop(&proto);
+
 			scm_stack_pop(&e);
-			return scm_mk_closure(CURRENT_ENV, args, body);
-		} else  if(is_tpair(e, R_APPLY)) {
+			return closure;
+		}
+		case FORM_R_APPLY: {
 			e = scm_cdr(e);
 
 			if(!scm_is_pair(e)) {
 				scm_stack_pop(&e);
 				return scm_mk_error("insufficient arguments to __apply");
 			}
-			Expr* func = scm_car(e);
-
-			e = scm_cdr(e);
-			if(!scm_is_pair(e)) {
+			if(!scm_is_pair(scm_cdr(e))) {
 				scm_stack_pop(&e);
 				return scm_mk_error("insufficient arguments to __apply");
 			}
-			Expr* args = scm_car(e);
 
-			scm_stack_push(&args);
-			args = save_eval(args);
-			if(scm_is_error(args)) {
-				scm_stack_pop(&args); scm_stack_pop(&e);
-				return args;
-			}
-			if(!scm_is_pair(args)) {
-				scm_stack_pop(&args); scm_stack_pop(&e);
+			Expr* args = save_eval(scm_cadr(e));
+			error_circuit(args);
+			if(scm_list_len(args) < 0) {
+				scm_stack_pop(&e);
 				return scm_mk_error("args to apply aren't a list");
 			}
-			args = quote_all_inplace(args);
-			if(scm_is_error(args)) {
-				scm_stack_pop(&args); scm_stack_pop(&e);
-				return args;
-			}
 
-			// tail call
-			e = scm_mk_pair(func, args);
+			scm_stack_push(&args);
+			func = save_eval(scm_car(e));
 			scm_stack_pop(&args);
-			e = e ? e : OOM;
-			goto begin;
-		} else  if(is_tpair(e, R_EVAL)) {
+			error_circuit(func);
+
+			// tail call, with e standing for the arguments already evaluated
+			e = args;
+			evaluated = true;
+			goto apply;
+		}
+		case FORM_R_EVAL: {
 			e = scm_cdr(e);
 			if(!scm_is_pair(e)) {
 				scm_stack_pop(&e);
@@ -665,99 +1679,171 @@ begin:
 			e = toEval;
 			scm_stack_pop(&toEval);
 			goto begin;
-		} else {
+		}
+		case FORM_R_CALLCC:
+		case FORM_R_CALLEC: {
+			// only ever escapes here, so both are the same
+			e = scm_cdr(e);
+			if(!scm_is_pair(e) || scm_cdr(e) != EMPTY_LIST) {
+				scm_stack_pop(&e);
+				return scm_mk_error("Malformed call/cc");
+			}
+
+			Expr* f = save_eval(scm_car(e));
+			error_circuit(f);
+
+			scm_stack_pop(&e);
+			return call_cc(f);
+		}
+		case FORM_R_TRY: {
+			e = scm_cdr(e);
+			if(scm_list_len(e) != 3) {
+				scm_stack_pop(&e);
+				return scm_mk_error("Malformed __try");
+			}
+
+			Expr* handlers = save_eval(scm_car(e));
+			error_circuit(handlers);
+			scm_stack_push(&handlers);
+
+			Expr* thunk = save_eval(scm_cadr(e));
+			if(scm_is_error(thunk)) {
+				scm_stack_pop(&handlers); scm_stack_pop(&e);
+				return thunk;
+			}
+			scm_stack_push(&thunk);
+
+			Expr* handler = save_eval(scm_caddr(e));
+			Expr* res = scm_is_error(handler) ? handler : try_thunk(handlers, thunk, handler);
+
+			scm_stack_pop(&thunk); scm_stack_pop(&handlers); scm_stack_pop(&e);
+			return res;
+		}
+		case FORM_GUARD: {
+			e = guard2try(e);
+			goto begin;
+		}
+		case FORM_DEFSYNTAX: {
+			Expr* name;
+			Expr* m = syntax_def(e, FALSE, &name);
+			error_circuit(m);
+
+			scm_stack_push(&m);
+			Expr* res = scm_env_define(CURRENT_ENV, name, m);
+			scm_stack_pop(&m);
+
+			scm_stack_pop(&e);
+			return scm_is_error(res) ? res : name;
+		}
+		case FORM_SYNRULES: {
+			scm_stack_pop(&e);
+			return scm_mk_macro(e, FALSE);
+		}
+		case FORM_R_FOLD: {
+			if(!is_fold(e)) {
+				scm_stack_pop(&e);
+				return scm_mk_error("Malformed __fold");
+			}
+
+			if((unsigned) scm_ival(scm_cadr(e)) == scm_fold_version) {
+				scm_stack_pop(&e);
+				return scm_caddr(e);
+			}
+
+			e = scm_car(scm_cdddr(e));
+			goto begin;
+		}
+		default: {
 			//TODO GC safety
-			Expr* func = save_eval(scm_car(e));
+			// a lambda applied on the spot, as in a let, needs no closure
+			func = scm_car(e);
+			if(!scm_is_proto(func)) func = save_eval(func);
 			error_circuit(func);
-			scm_stack_push(&func);
+			evaluated = false;
 
-			Expr* args = save_eval_all(scm_cdr(e));
-			if(scm_is_error(args)) {
-				scm_stack_pop(&func); scm_stack_pop(&e);
-				return args;
+			if(scm_is_macro(func)) {
+				error_circuit(expand_in_place(func, e, false));
+				goto begin;
 			}
-			scm_stack_push(&args);
 
-			if(scm_is_ffunc(func)) {
-				Expr* toRet = scm_ffval(func)(args);
-				scm_stack_pop(&args);
-				scm_stack_pop(&func);
+		apply:
+			scm_stack_push(&func);
+			Expr* argl = evaluated ? e : scm_cdr(e);
+
+			if(!scm_is_closure(func) && !scm_is_proto(func)) {
+				Expr* toRet;
+				if(!evaluated)               toRet = call_ffunc(func, argl);
+				else if(scm_is_cont(func))   toRet = throw_list(func, argl);
+				else if(!scm_is_ffunc(func)) toRet = scm_mk_error("can't evaluate (not a ffunc or closure)");
+				else                         toRet = scm_apply_ffunc(func, argl);
+				if(scm_is_error(toRet)) toRet = scm_signal(toRet);
+				scm_stack_pop(&func); scm_stack_pop(&e);
 
-				scm_stack_pop(&e);
 				return toRet;
 			}
 
-			if(!scm_is_closure(func)) {
-				scm_stack_pop(&args); scm_stack_pop(&func); scm_stack_pop(&e);
-				return scm_mk_error("can't evaluate (not a ffunc or closure)");
-			}
-
-			Expr* cenv = scm_closure_env(func);
-			Expr* anames = scm_closure_args(func);
-			Expr* body = scm_closure_body(func);
-
-			Expr* newEnv = NULL;
-			if(scm_is_pair(anames)) {
-				int nlen = scm_list_len(anames);
-				// args may be of the form (x y . zs)
-				if(nlen == -1) {
-					newEnv = scm_mk_env(cenv, EMPTY_LIST, EMPTY_LIST);
-					Expr* rns;
-					Expr* ras;
-					for(rns = anames, ras = args; scm_is_pair(rns); rns = scm_cdr(rns), ras = scm_cdr(ras)) {
-						if(ras == EMPTY_LIST) {
-							newEnv = scm_mk_error("too few args to procedure");
-							break;
-						}
-						scm_env_define_unsafe(newEnv, scm_car(rns), scm_car(ras));
-					}
-
-					if(scm_is_symbol(rns)) {
-						scm_env_define_unsafe(newEnv, rns, ras);
-					} else if(rns == EMPTY_LIST) {
-						if(ras != EMPTY_LIST) {
-							newEnv = scm_mk_error("too many args to procedure");
-						}
-					} else if(!scm_is_error(newEnv)) {
-						newEnv = scm_mk_error("last entry in dotted tail args isn't a symbol");
-					}
-				} else {
-					int alen = scm_list_len(args);
-					newEnv = nlen == alen ? scm_mk_env(cenv, anames, args) : scm_mk_error("incorrect number of args to procedure");
-				}
-			} else {
-				Expr* argname = EMPTY_LIST;
-				Expr* flatargs = EMPTY_LIST;
-				scm_stack_push(&argname);
-				scm_stack_push(&flatargs);
-
-				argname = scm_mk_pair(anames, EMPTY_LIST);
-				flatargs = scm_mk_pair(args, EMPTY_LIST);
+			Expr* proto = scm_is_proto(func) ? func : scm_closure_proto(func);
+			Expr* penv = scm_is_proto(func) ? CURRENT_ENV : scm_closure_env(func);
 
-				newEnv = !(argname && flatargs) ? OOM : scm_mk_env(cenv, argname, flatargs);
+			Proto* p = scm_proto(proto);
+			if(!p->code) {
+				Expr* code = scm_resolve_body(proto);
+				if(scm_is_error(code)) {
+					scm_stack_pop(&func); scm_stack_pop(&e);
+					return code;
+				}
+			}
 
-				scm_stack_pop(&flatargs);
-				scm_stack_pop(&argname);
+			int alen = scm_list_len(argl);
+			Expr* err = NULL;
+			if(alen == -1) {
+				err = scm_mk_error("arguments aren't a proper list");
+			} else if(p->badArgs) {
+				err = scm_mk_error("last entry in dotted tail args isn't a symbol");
+			} else if(!p->rest) {
+				if((unsigned) alen != p->nreq) err = scm_mk_error("incorrect number of args to procedure");
+			} else if((unsigned) alen < p->nreq) {
+				err = scm_mk_error("too few args to procedure");
 			}
+			if(!err) err = scm_tick();
 
+			Expr* newEnv = err ? err : scm_mk_env(penv, p->args, p->size);
 			if(scm_is_error(newEnv)) {
-				scm_stack_pop(&args); scm_stack_pop(&func); scm_stack_pop(&e);
+				scm_stack_pop(&func); scm_stack_pop(&e);
 				return newEnv;
 			}
+			scm_env_frame(newEnv)->extra = p->locals;
 			scm_stack_push(&newEnv);
 
-			e = scm_mk_pair(BEGIN, body);
+			// arguments are evaluated straight into the slots of the new frame
+			Expr* ae = argl;
+			for(unsigned i = 0; i <= p->nreq; i++) {
+				if(i == p->nreq && !p->rest) break;
+
+				Expr* val;
+				if(i < p->nreq) val = evaluated ? scm_car(ae) : save_eval(scm_car(ae));
+				else            val = evaluated ? copy_list(ae) : eval_rest(ae);
+				if(scm_is_error(val)) {
+					scm_stack_pop(&newEnv); scm_stack_pop(&func); scm_stack_pop(&e);
+					return val;
+				}
+				scm_env_frame(newEnv)->slots[i] = val;
+
+				if(i < p->nreq) ae = scm_cdr(ae);
+			}
+
+			e = p->code;
 
 			scm_stack_pop(&newEnv);
-			scm_stack_pop(&args);
 			scm_stack_pop(&func);
 
-			if(!e) {
-				scm_stack_pop(&e);
-				return OOM;
-			}
+			// the frames of the calls this one replaces are done with
+			scm_frame_stack_unwind(base, scm_env_parent(newEnv));
+			if(p->noCapture) scm_frame_stack_push(newEnv);
+
 			CURRENT_ENV = newEnv;
-			goto begin;
+			goto sequence;
+		}
 		}
 
 		scm_stack_pop(&e);
@@ -765,6 +1851,13 @@ begin:
 	} else if(scm_is_ffunc(e)) {
 		scm_stack_pop(&e);
 		return scm_mk_symbol("#(Foreign function)#");
+	} else if(scm_is_lref(e) || scm_is_gref(e) || scm_is_dref(e)) {
+		scm_stack_pop(&e);
+		return scm_env_get_ref(CURRENT_ENV, e);
+	} else if(scm_is_proto(e)) {
+		Expr* closure = scm_mk_closure(CURRENT_ENV, e);
+		scm_stack_pop(&e);
+		return closure;
 	} else if(scm_is_symbol(e)) {
 		scm_stack_pop(&e);
 		return scm_env_lookup(CURRENT_ENV, e);
@@ -777,7 +1870,80 @@ begin:
 	}
 }
 
-Expr* scm_eval(Expr* e) {
+// The tree walker and the analyzer recurse in C for every expression they
+// evaluate that isn't in tail position, so they give up once the C stack of
+// the thread they run on or the gc roots get close to running out, instead
+// of running out of them. The VM has no such limit.
+//
+// The bounds of the stack are looked up once per thread. What is left below
+// the margin is for the primitives called at the deepest level.
+#define STACK_MARGIN ((size_t) 64 * 1024)
+// Taken as the size of the stack when its bounds can't be found
+#define FALLBACK_STACK ((size_t) 8 * 1024 * 1024)
+// Roots left for the primitives called at the deepest level
+#define SPARE_ROOTS 1024
+
+// Lowest address the stack may grow down to, 0 until found
+static _Thread_local uintptr_t stackLimit = 0;
+
+static uintptr_t stack_limit(uintptr_t here) {
+#if defined(__linux__)
+	pthread_attr_t attr;
+	if(pthread_getattr_np(pthread_self(), &attr) == 0) {
+		void* low;
+		size_t size;
+		const int failed = pthread_attr_getstack(&attr, &low, &size);
+		pthread_attr_destroy(&attr);
+		if(!failed && here - (uintptr_t) low > STACK_MARGIN) return (uintptr_t) low + STACK_MARGIN;
+	}
+#endif
+
+	// counted from here, which has used some of it already
+	size_t size = FALLBACK_STACK;
+	struct rlimit l;
+	if(getrlimit(RLIMIT_STACK, &l) == 0 && l.rlim_cur != RLIM_INFINITY && l.rlim_cur < size) size = l.rlim_cur;
+
+	return here - size / 2;
+}
+
+bool scm_too_deep() {
+	char here;
+	const uintptr_t at = (uintptr_t) &here;
+	if(!stackLimit) stackLimit = stack_limit(at);
+
+	return at < stackLimit || scm_stack_room() < SPARE_ROOTS;
+}
+
+static Expr* stc_eval(Expr* e) {
+	if(scm_too_deep()) return scm_mk_error("recursion too deep");
+
+	size_t base = scm_frame_stack_size();
+	Expr* toRet = stc_eval_at(e, base);
+	scm_frame_stack_unwind(base, NULL);
+
+	return toRet;
+}
+
+static scm_engine engine = SCM_ENGINE_VM;
+
+void scm_set_engine(scm_engine e) {
+	engine = e;
+}
+
+scm_engine scm_get_engine() {
+	return engine;
+}
+
+Expr* scm_eval_tree(Expr* e) {
 	assert(e);
 	return save_eval(e);
 }
+
+Expr* scm_eval(Expr* e) {
+	assert(e);
+	switch(engine) {
+	case SCM_ENGINE_VM:      return scm_vm_eval(e);
+	case SCM_ENGINE_ANALYZE: return scm_analyze_eval(e);
+	default:                 return save_eval(e);
+	}
+}
@@ -6,6 +6,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 
 static const Expr _EMPTY_LIST = { .tag = ELIST, .pair = { NULL, NULL }, .protect = true, .mark = true };
@@ -20,22 +21,26 @@ Expr* FALSE;
 static const Expr _OOM = { .tag = ATOM, .atom = { .type = ERROR, .sval = "Out of memory" }, .protect = true, .mark = true };
 Expr* OOM;
 
-Expr* DEFINE = NULL;
-Expr* SET = NULL;
-Expr* IF = NULL;
-Expr* LET = NULL;
-Expr* LAMBDA = NULL;
-Expr* QUOTE = NULL;
-Expr* QUASIQUOTE = NULL;
-Expr* UNQUOTE = NULL;
-Expr* UNQUOTE_SPLICING = NULL;
-Expr* BEGIN = NULL;
-Expr* COND = NULL;
-Expr* ELSE = NULL;
-Expr* AND = NULL;
-Expr* OR = NULL;
-Expr* R_APPLY;
-Expr* R_EVAL;
+static const Expr _ESCAPE = { .tag = ATOM, .atom = { .type = ERROR, .sval = "continuation called outside of its extent" }, .protect = true, .mark = true };
+Expr* ESCAPE;
+
+static const Expr _OUT_OF_FUEL = { .tag = ATOM, .atom = { .type = ERROR, .sval = "out of fuel" }, .protect = true, .mark = true };
+Expr* OUT_OF_FUEL;
+
+static const Expr _TIMED_OUT = { .tag = ATOM, .atom = { .type = ERROR, .sval = "timed out" }, .protect = true, .mark = true };
+Expr* TIMED_OUT;
+
+static const Expr _INTERRUPTED = { .tag = ATOM, .atom = { .type = ERROR, .sval = "interrupted" }, .protect = true, .mark = true };
+Expr* INTERRUPTED;
+
+static const Expr _SWITCH = { .tag = ATOM, .atom = { .type = ERROR, .sval = "task switched out" }, .protect = true, .mark = true };
+Expr* SWITCH;
+
+#define SYNTAX(id, name) Expr* id = &scm_builtin_symbols[SYM_##id].e;
+#define PRIMITIVE(id, name)
+#include "Builtins.def"
+#undef PRIMITIVE
+#undef SYNTAX
 
 // Keep a cache for characters since there are only 256 possible ones
 #define mk_chr(x) { .tag = ATOM, .atom = { .type = CHAR, .cval = (char)(x) }, .protect = true, .mark = true }
@@ -136,11 +141,11 @@ bool scm_is_symbol(const Expr* e) {
 }
 bool scm_is_error(const Expr* e) {
 	assert(e);
-	return e->tag == ATOM && e->atom.type == ERROR;
+	return e->tag == ATOM && (e->atom.type == ERROR || e->atom.type == RAISED);
 }
 bool scm_is_ffunc(const Expr* e) {
 	assert(e);
-	return e->tag == ATOM && e->atom.type == FFUNC;
+	return e->tag == ATOM && (e->atom.type == FFUNC || e->atom.type == VFUNC);
 }
 bool scm_is_true(const Expr* e) {
 	assert(e);
@@ -175,7 +180,7 @@ char scm_cval(const Expr* e) {
 }
 char* scm_sval(const Expr* e) {
 	assert(e);
-	assert(e->tag == ATOM && (e->atom.type == STRING || e->atom.type == SYMBOL || e->atom.type == ERROR));
+	assert(e->tag == ATOM && (e->atom.type == STRING || e->atom.type == SYMBOL || e->atom.type == ERROR || e->atom.type == CONDITION));
 	return e->atom.sval;
 }
 bool scm_bval(const Expr* e) {
@@ -191,12 +196,12 @@ ffunc scm_ffval(const Expr* e) {
 
 Expr* scm_car(const Expr* e) {
 	assert(e);
-	assert(e->tag == PAIR || e->tag == CLOSURE || e->tag == ENV);
+	assert(e->tag == PAIR || e->tag == CLOSURE);
 	return e->pair.car;
 }
 Expr* scm_cdr(const Expr* e) {
 	assert(e);
-	assert(e->tag == PAIR || e->tag == CLOSURE || e->tag == ENV);
+	assert(e->tag == PAIR || e->tag == CLOSURE);
 	return e->pair.cdr;
 }
 
@@ -260,6 +265,33 @@ Expr* scm_mk_error(const char* v) {
 	if(toRet) toRet->atom.type = ERROR;
 	else      toRet = OOM;
 
+	scm_note_error(toRet);
+	return toRet;
+}
+
+Expr* scm_mk_raised(Expr* obj) {
+	assert(obj);
+
+	Expr* toRet = scm_alloc();
+
+	if(toRet) {
+		toRet->tag = ATOM;
+		toRet->atom.type = RAISED;
+		toRet->atom.raised = obj;
+	} else {
+		toRet = OOM;
+	}
+
+	scm_note_error(toRet);
+	return toRet;
+}
+
+Expr* scm_mk_condition(const char* msg) {
+	Expr* toRet = scm_mk_string(msg);
+
+	if(toRet) toRet->atom.type = CONDITION;
+	else      toRet = OOM;
+
 	return toRet;
 }
 
@@ -342,19 +374,98 @@ Expr* scm_append(Expr* l1, Expr* l2) {
 	return l2;
 }
 
-Expr* scm_mk_closure(Expr* penv, Expr* args, Expr* body) {
+Expr* scm_mk_proto(Expr* args, Expr* body, Expr* outer, bool global) {
+	assert(args); assert(body); assert(outer);
+
+	Proto* p = malloc(sizeof(Proto));
+	if(!p) return OOM;
+
+	p->args = args;
+	p->body = body;
+	p->outer = outer;
+	p->name = FALSE;
+	p->locals = EMPTY_LIST;
+	p->macros = EMPTY_LIST;
+	p->code = NULL;
+	p->global = global;
+	p->noCapture = false;
+	p->bc = NULL;
+	p->native = NULL;
+	p->calls = 0;
+	p->node = NULL;
+
+	p->nreq = 0;
+	for(; scm_is_pair(args); args = scm_cdr(args)) {
+		p->nreq++;
+	}
+	p->rest = args != EMPTY_LIST;
+	p->badArgs = p->rest && !scm_is_symbol(args);
+	p->size = p->nreq + p->rest;
+
+	scm_stack_push(&outer);
+	scm_stack_push(&body);
+	scm_stack_push(&p->args);
+
+	Expr* toRet = scm_alloc();
+
+	scm_stack_pop(&p->args);
+	scm_stack_pop(&body);
+	scm_stack_pop(&outer);
+
+	if(!toRet) {
+		free(p);
+		return OOM;
+	}
+
+	toRet->tag = ATOM;
+	toRet->atom.type = PROTO;
+	toRet->atom.proto = p;
+
+	return toRet;
+}
+
+void scm_free_proto(Proto* p) {
+	if(p->bc) scm_free_bytecode(p->bc);
+	if(p->native) scm_free_native(p->native);
+	if(p->node) scm_free_node(p->node);
+	free(p);
+}
+
+Expr* scm_mk_cont(Snapshot* vm) {
+	Cont* c = malloc(sizeof(Cont));
+	Expr* toRet = c ? scm_alloc() : NULL;
+	if(!toRet) {
+		free(c);
+		if(vm) scm_free_snapshot(vm);
+		return OOM;
+	}
+
+	c->live = true;
+	c->vm = vm;
+
+	toRet->tag = ATOM;
+	toRet->atom.type = CONT;
+	toRet->atom.cont = c;
+
+	return toRet;
+}
+
+void scm_free_cont(Cont* c) {
+	if(c->vm) scm_free_snapshot(c->vm);
+	free(c);
+}
+
+Expr* scm_mk_closure(Expr* penv, Expr* proto) {
 	assert(penv);
-	assert(args);
-	assert(body);
+	assert(proto); assert(scm_is_proto(proto));
 
-	Expr* contents[3] = { penv, args, body };
-	Expr* res = scm_mk_list(contents, 3);
+	Expr* res = scm_mk_pair(penv, proto);
 	
-	if(!scm_is_error(res)) {
+	if(res) {
 		res->tag = CLOSURE;
 	}
 
-	return res;
+	return res ? res : OOM;
 }
 
 int scm_list_len(Expr* l) {
@@ -368,6 +479,11 @@ int scm_list_len(Expr* l) {
 	return l == EMPTY_LIST ? soFar : -1;
 }
 
+Expr* scm_closure_proto(Expr* c) {
+	assert(c); assert(scm_is_closure(c));
+	return scm_cdr(c);
+}
+
 Expr* scm_closure_env(Expr* c) {
 	assert(c); assert(scm_is_closure(c));
 	return scm_car(c);
@@ -375,54 +491,27 @@ Expr* scm_closure_env(Expr* c) {
 
 Expr* scm_closure_args(Expr* c) {
 	assert(c); assert(scm_is_closure(c));
-	return scm_cadr(c);
+	return scm_proto(scm_cdr(c))->args;
 }
 
 Expr* scm_closure_body(Expr* c) {
 	assert(c); assert(scm_is_closure(c));
-	return scm_caddr(c);
+	return scm_proto(scm_cdr(c))->body;
 }
 
 void scm_init_expr() {
-	DEFINE = scm_get_symbol("define");
-	SET = scm_get_symbol("set!");
-	IF = scm_get_symbol("if");
-	LET = scm_get_symbol("let");
-	LAMBDA = scm_get_symbol("lambda");
-	QUOTE = scm_get_symbol("quote");
-	QUASIQUOTE = scm_get_symbol("quasiquote");
-	UNQUOTE = scm_get_symbol("unquote");
-	UNQUOTE_SPLICING = scm_get_symbol("unquote-splicing");
-	BEGIN = scm_get_symbol("begin");
-	COND = scm_get_symbol("cond");
-	ELSE = scm_get_symbol("else");
-	AND = scm_get_symbol("and");
-	OR = scm_get_symbol("or");
-	R_APPLY = scm_get_symbol("__apply");
-	R_EVAL = scm_get_symbol("__eval");
 	EMPTY_LIST = (Expr*) &_EMPTY_LIST;
 	TRUE = (Expr*) &_TRUE;
 	FALSE = (Expr*) &_FALSE;
 	OOM = (Expr*) &_OOM;
+	ESCAPE = (Expr*) &_ESCAPE;
+	OUT_OF_FUEL = (Expr*) &_OUT_OF_FUEL;
+	TIMED_OUT = (Expr*) &_TIMED_OUT;
+	INTERRUPTED = (Expr*) &_INTERRUPTED;
+	SWITCH = (Expr*) &_SWITCH;
 }
 
 void scm_reset_expr() {
-	DEFINE = NULL;
-	SET = NULL;
-	IF = NULL;
-	LET = NULL;
-	LAMBDA = NULL;
-	QUOTE = NULL;
-	QUASIQUOTE = NULL;
-	UNQUOTE = NULL;
-	UNQUOTE_SPLICING = NULL;
-	BEGIN = NULL;
-	COND = NULL;
-	ELSE = NULL;
-	AND = NULL;
-	OR = NULL;
-	R_APPLY = NULL;
-	R_EVAL = NULL;
 	EMPTY_LIST = NULL;
 	TRUE = NULL;
 	FALSE = NULL;
@@ -1,89 +1,154 @@
+/* This file defines the primitive procedures bound in Builtins.def. They take
+ * their arguments as a vector, whose length is checked against the arity
+ * listed along with each one before it is called (see scm_call_ffunc()).
+ * Primitives made elsewhere may also take a list of arguments instead, which
+ * is made for them out of the vector.
+ *
+ * The tree walker evaluates the arguments of a call to a primitive onto the
+ * argument stack below, the VM and the analyzer hand over the ones already on
+ * their own stacks, so no list is allocated for them.
+ */
+
 #include "SchemeSecret.h"
 
 #include <string.h>
+#include <stdio.h>
 #include <assert.h>
 
 // Remove later
 void* malloc(size_t);
+void* realloc(void*, size_t);
 void free(void*);
 
-// Numerical predicates
+#define ARG_STACK_SIZE 65536
 
-static Expr* number(Expr* args) {
-	assert(args);
+static Expr* argStack[ARG_STACK_SIZE];
+static size_t argTop = 0;
 
-	if(args == EMPTY_LIST) return scm_mk_error("No args passed to number? (expected 1)");
+bool scm_arg_stack_push(Expr* v) {
+	if(argTop == ARG_STACK_SIZE) return false;
 
-	Expr* fst = scm_car(args);
-	Expr* rst = scm_cdr(args);
+	argStack[argTop++] = v;
+	return true;
+}
 
-	if(rst != EMPTY_LIST) return scm_mk_error("Too many args passed to number? (expected 1)");
+size_t scm_arg_stack_size() {
+	return argTop;
+}
 
-	return (scm_is_int(fst) || scm_is_real(fst)) ? TRUE : FALSE;
+Expr** scm_arg_stack_at(size_t base) {
+	assert(base <= argTop);
+	return &argStack[base];
 }
 
-static Expr* integer(Expr* args) {
-	assert(args);
+void scm_arg_stack_unwind(size_t base) {
+	assert(base <= argTop);
+	argTop = base;
+}
 
-	if(args == EMPTY_LIST) return scm_mk_error("No args passed to integer? (expected 1)");
+void scm_mark_arg_stack() {
+	for(size_t i = 0; i < argTop; i++) {
+		scm_mark(argStack[i]);
+	}
+}
 
-	Expr* fst = scm_car(args);
-	Expr* rst = scm_cdr(args);
+static Expr* arity_error(const VFunc* f) {
+	char buf[128];
+	const char* s = f->minArgs == 1 ? "" : "s";
 
-	if(rst != EMPTY_LIST) return scm_mk_error("Too many args passed to integer? (expected 1)");
+	if(f->minArgs == f->maxArgs) snprintf(buf, sizeof(buf), "%s expects %d arg%s", f->name, f->minArgs, s);
+	else if(f->maxArgs < 0)      snprintf(buf, sizeof(buf), "%s expects at least %d arg%s", f->name, f->minArgs, s);
+	else                         snprintf(buf, sizeof(buf), "%s expects %d to %d args", f->name, f->minArgs, f->maxArgs);
 
-	return scm_is_int(fst) ? TRUE : FALSE;
+	return scm_mk_error(buf);
 }
 
-static Expr* real(Expr* args) {
-	assert(args);
+Expr* scm_call_ffunc(Expr* f, int argc, Expr** argv) {
+	assert(f); assert(scm_is_ffunc(f)); assert(argc >= 0);
 
-	if(args == EMPTY_LIST) return scm_mk_error("No args passed to real? (expected 1)");
+	if(scm_is_vfunc(f)) {
+		const VFunc* vf = f->atom.vfptr;
+		if(argc < vf->minArgs || (vf->maxArgs >= 0 && argc > vf->maxArgs)) return arity_error(vf);
 
-	Expr* fst = scm_car(args);
-	Expr* rst = scm_cdr(args);
+		Expr* toRet = vf->fn(argc, argv);
+		return toRet ? toRet : OOM;
+	}
 
-	if(rst != EMPTY_LIST) return scm_mk_error("Too many args passed to real? (expected 1)");
+	Expr* l = scm_mk_list(argv, argc);
+	if(scm_is_error(l)) return l;
 
-	return scm_is_real(fst) ? TRUE : FALSE;
+	scm_stack_push(&l);
+	Expr* toRet = scm_ffval(f)(l);
+	scm_stack_pop(&l);
+
+	return toRet ? toRet : OOM;
 }
 
-static Expr* exact(Expr* args) {
-	assert(args);
+Expr* scm_apply_ffunc(Expr* f, Expr* args) {
+	assert(f); assert(scm_is_ffunc(f)); assert(args);
 
-	if(args == EMPTY_LIST) return scm_mk_error("No args passed to exact? (expected 1)");
+	if(!scm_is_vfunc(f)) {
+		Expr* toRet = scm_ffval(f)(args);
+		return toRet ? toRet : OOM;
+	}
 
-	Expr* fst = scm_car(args);
-	Expr* rst = scm_cdr(args);
+	const size_t base = argTop;
+	int argc = 0;
+	for(; scm_is_pair(args); args = scm_cdr(args), argc++) {
+		if(!scm_arg_stack_push(scm_car(args))) {
+			argTop = base;
+			return scm_mk_error("too many args to primitive");
+		}
+	}
 
-	if(rst != EMPTY_LIST) return scm_mk_error("Too many args passed to exact? (expected 1)");
-	if(number(args) != TRUE) return scm_mk_error("Argument to exact? is not a number");
+	Expr* toRet = args == EMPTY_LIST ? scm_call_ffunc(f, argc, &argStack[base]) : scm_mk_error("arguments aren't a proper list");
+	argTop = base;
 
-	return scm_is_int(fst) ? TRUE : FALSE;
+	return toRet;
 }
 
-static Expr* inexact(Expr* args) {
-	assert(args);
+// Numerical predicates
 
-	if(args == EMPTY_LIST) return scm_mk_error("No args passed to inexact? (expected 1)");
+static Expr* number(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
-	Expr* rst = scm_cdr(args);
+	return scm_is_num(argv[0]) ? TRUE : FALSE;
+}
 
-	if(rst != EMPTY_LIST) return scm_mk_error("Too many args passed to inexact? (expected 1)");
-	if(number(args) != TRUE) return scm_mk_error("Argument to inexact? is not a number");
+static Expr* integer(int argc, Expr** argv) {
+	(void)argc;
 
-	return scm_is_real(fst) ? TRUE : FALSE;
+	return scm_is_int(argv[0]) ? TRUE : FALSE;
 }
 
-// Numerical conversions
+static Expr* real(int argc, Expr** argv) {
+	(void)argc;
+
+	return scm_is_real(argv[0]) ? TRUE : FALSE;
+}
+
+static Expr* exact(int argc, Expr** argv) {
+	(void)argc;
 
-static Expr* ex2in(Expr* args) {
-	assert(args);
+	if(!scm_is_num(argv[0])) return scm_mk_error("Argument to exact? is not a number");
 
-	if(scm_list_len(args) != 1) return scm_mk_error("exact->inexact expects 1 arg");
+	return scm_is_int(argv[0]) ? TRUE : FALSE;
+}
+
+static Expr* inexact(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!scm_is_num(argv[0])) return scm_mk_error("Argument to inexact? is not a number");
 
-	Expr* fst = scm_car(args);
+	return scm_is_real(argv[0]) ? TRUE : FALSE;
+}
+
+// Numerical conversions
+
+static Expr* ex2in(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* fst = argv[0];
 
 	if(scm_is_int(fst)) {
 		Expr* toRet = scm_mk_real(scm_ival(fst));
@@ -95,12 +160,10 @@ static Expr* ex2in(Expr* args) {
 	}
 }
 
-static Expr* in2ex(Expr* args) {
-	assert(args);
-
-	if(scm_list_len(args) != 1) return scm_mk_error("inexact->exact expects 1 arg");
+static Expr* in2ex(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(scm_is_int(fst)) {
 		return fst;
@@ -115,29 +178,25 @@ static Expr* in2ex(Expr* args) {
 
 // Character conversions
 
-static Expr* chr2int(Expr* args) {
-	assert(args);
-	
-	if(scm_list_len(args) != 1) return scm_mk_error("char->integer expects 1 arg");
+static Expr* chr2int(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(!scm_is_char(fst)) return scm_mk_error("char->integer expects a character");
 
 	return scm_mk_int(scm_cval(fst));
 }
 
-static Expr* int2chr(Expr* args) {
-	assert(args);
-	
-	if(scm_list_len(args) != 1) return scm_mk_error("integer->char expects 1 arg");
+static Expr* int2chr(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(!scm_is_int(fst)) return scm_mk_error("integer->char expects an integer");
-	
+
 	long long v = scm_ival(fst);
-	
+
 	if(!(0 <= v && v < 256)) return scm_mk_error("argument to integer->char is out of range");
 
 	return scm_mk_char((char)v);
@@ -146,49 +205,44 @@ static Expr* int2chr(Expr* args) {
 
 // Boolean operations
 
-static Expr* boolean(Expr* args) {
-	assert(args);
-	
-	if(scm_list_len(args) != 1) return scm_mk_error("boolean? expects 1 arg");
+static Expr* boolean(int argc, Expr** argv) {
+	(void)argc;
 
-	return scm_is_bool(scm_car(args)) ? TRUE : FALSE;
+	return scm_is_bool(argv[0]) ? TRUE : FALSE;
 }
 
-static Expr* not(Expr* args) {
-	assert(args);
-	
-	if(scm_list_len(args) != 1) return scm_mk_error("not expects 1 arg");
+static Expr* not(int argc, Expr** argv) {
+	(void)argc;
 
-	return scm_is_true(scm_car(args)) ? FALSE : TRUE;
+	return scm_is_true(argv[0]) ? FALSE : TRUE;
 }
 
 // Equality
 
-static Expr* eq(Expr* args) {
-	assert(args);
+static Expr* eq(int argc, Expr** argv) {
+	(void)argc;
 
-	if(scm_list_len(args) != 2) return scm_mk_error("eq? expects 2 args");
-
-	return scm_car(args) == scm_cadr(args) ? TRUE : FALSE;
+	return argv[0] == argv[1] ? TRUE : FALSE;
 }
 
-static Expr* num_eq(Expr*);
-
-static Expr* eqv(Expr* args) {
-	assert(args);
+static Expr* num_eq(int argc, Expr** argv);
 
-	if(scm_list_len(args) != 2) return scm_mk_error("eqv? expects 2 args");
-	
-	Expr* fst = scm_car(args);
-	Expr* snd = scm_cadr(args);
+bool scm_eqv(Expr* fst, Expr* snd) {
+	if(fst == snd) return true;
+	if(scm_is_pair(fst) || scm_is_pair(snd)) return false;
+	if(scm_is_closure(fst) || scm_is_closure(snd)) return false;
+	if(scm_is_num(fst) && scm_is_num(snd)) {
+		Expr* args[2] = { fst, snd };
+		return num_eq(2, args) == TRUE;
+	}
+	if(scm_is_string(fst) && scm_is_string(snd) && strcmp(scm_sval(fst), scm_sval(snd)) == 0) return true;
 
-	if(fst == snd) return TRUE;
-	if(scm_is_pair(fst) || scm_is_pair(snd)) return FALSE;
-	if(scm_is_closure(fst) || scm_is_closure(snd)) return FALSE;
-	if(scm_is_num(fst) && scm_is_num(snd)) return num_eq(args);
-	if(scm_is_string(fst) && scm_is_string(snd) && strcmp(scm_sval(fst), scm_sval(snd)) == 0) return TRUE;
+	return false;
+}
 
-	return FALSE;
+static Expr* eqv(int argc, Expr** argv) {
+	(void)argc;
+	return scm_eqv(argv[0], argv[1]) ? TRUE : FALSE;
 }
 
 
@@ -196,12 +250,10 @@ static Expr* eqv(Expr* args) {
 
 #define checknum(x) if(!scm_is_num(x)) return scm_mk_error("= expects only numbers")
 
-static Expr* num_eq(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return TRUE;
+static Expr* num_eq(int argc, Expr** argv) {
+	if(argc == 0) return TRUE;
 
-	Expr* cur = scm_car(args);
+	Expr* cur = argv[0];
 	checknum(cur);
 
 	bool eq = true;
@@ -219,10 +271,8 @@ static Expr* num_eq(Expr* args) {
 		exact = ((double)ex) == in;
 	}
 
-	args = scm_cdr(args);
-
-	while(scm_is_pair(args)) {
-		cur = scm_car(args);
+	for(int i = 1; i < argc; i++) {
+		cur = argv[i];
 		checknum(cur);
 
 		if(exact && scm_is_int(cur)) {
@@ -244,12 +294,8 @@ static Expr* num_eq(Expr* args) {
 			eq = false;
 			break;
 		}
-
-		args = scm_cdr(args);
 	}
 
-	if(eq && args != EMPTY_LIST) return scm_mk_error("arguments to = aren't a proper list");
-
 	return eq ? TRUE : FALSE;
 }
 
@@ -259,20 +305,17 @@ static Expr* num_eq(Expr* args) {
 
 #define checknum(x) if(!scm_is_num(x)) return scm_mk_error("< expects only numbers")
 
-static Expr* num_lt(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return TRUE;
+static Expr* num_lt(int argc, Expr** argv) {
+	if(argc == 0) return TRUE;
 
-	Expr* cur = scm_car(args);
+	Expr* cur = argv[0];
 	checknum(cur);
 
 	bool ok = true;
 	double curVal = scm_is_int(cur) ? scm_ival(cur) : scm_rval(cur);
-	args = scm_cdr(args);
 
-	while(scm_is_pair(args)) {
-		cur = scm_car(args);
+	for(int i = 1; i < argc; i++) {
+		cur = argv[i];
 		checknum(cur);
 
 		double newVal = scm_is_int(cur) ? scm_ival(cur) : scm_rval(cur);
@@ -282,12 +325,8 @@ static Expr* num_lt(Expr* args) {
 			break;
 		}
 		curVal = newVal;
-
-		args = scm_cdr(args);
 	}
 
-	if(ok && args != EMPTY_LIST) return scm_mk_error("arguments to < aren't a proper list");
-
 	return ok ? TRUE : FALSE;
 }
 
@@ -295,20 +334,17 @@ static Expr* num_lt(Expr* args) {
 
 #define checknum(x) if(!scm_is_num(x)) return scm_mk_error("> expects only numbers")
 
-static Expr* num_gt(Expr* args) {
-	assert(args);
+static Expr* num_gt(int argc, Expr** argv) {
+	if(argc == 0) return TRUE;
 
-	if(args == EMPTY_LIST) return TRUE;
-
-	Expr* cur = scm_car(args);
+	Expr* cur = argv[0];
 	checknum(cur);
 
 	bool ok = true;
 	double curVal = scm_is_int(cur) ? scm_ival(cur) : scm_rval(cur);
-	args = scm_cdr(args);
 
-	while(scm_is_pair(args)) {
-		cur = scm_car(args);
+	for(int i = 1; i < argc; i++) {
+		cur = argv[i];
 		checknum(cur);
 
 		double newVal = scm_is_int(cur) ? scm_ival(cur) : scm_rval(cur);
@@ -318,12 +354,8 @@ static Expr* num_gt(Expr* args) {
 			break;
 		}
 		curVal = newVal;
-
-		args = scm_cdr(args);
 	}
 
-	if(ok && args != EMPTY_LIST) return scm_mk_error("arguments to > aren't a proper list");
-
 	return ok ? TRUE : FALSE;
 }
 
@@ -331,20 +363,17 @@ static Expr* num_gt(Expr* args) {
 
 #define checknum(x) if(!scm_is_num(x)) return scm_mk_error(">= expects only numbers")
 
-static Expr* num_gte(Expr* args) {
-	assert(args);
+static Expr* num_gte(int argc, Expr** argv) {
+	if(argc == 0) return TRUE;
 
-	if(args == EMPTY_LIST) return TRUE;
-
-	Expr* cur = scm_car(args);
+	Expr* cur = argv[0];
 	checknum(cur);
 
 	bool ok = true;
 	double curVal = scm_is_int(cur) ? scm_ival(cur) : scm_rval(cur);
-	args = scm_cdr(args);
 
-	while(scm_is_pair(args)) {
-		cur = scm_car(args);
+	for(int i = 1; i < argc; i++) {
+		cur = argv[i];
 		checknum(cur);
 
 		double newVal = scm_is_int(cur) ? scm_ival(cur) : scm_rval(cur);
@@ -354,12 +383,8 @@ static Expr* num_gte(Expr* args) {
 			break;
 		}
 		curVal = newVal;
-
-		args = scm_cdr(args);
 	}
 
-	if(ok && args != EMPTY_LIST) return scm_mk_error("arguments to >= aren't a proper list");
-
 	return ok ? TRUE : FALSE;
 }
 
@@ -367,20 +392,17 @@ static Expr* num_gte(Expr* args) {
 
 #define checknum(x) if(!scm_is_num(x)) return scm_mk_error("<= expects only numbers")
 
-static Expr* num_lte(Expr* args) {
-	assert(args);
+static Expr* num_lte(int argc, Expr** argv) {
+	if(argc == 0) return TRUE;
 
-	if(args == EMPTY_LIST) return TRUE;
-
-	Expr* cur = scm_car(args);
+	Expr* cur = argv[0];
 	checknum(cur);
 
 	bool ok = true;
 	double curVal = scm_is_int(cur) ? scm_ival(cur) : scm_rval(cur);
-	args = scm_cdr(args);
 
-	while(scm_is_pair(args)) {
-		cur = scm_car(args);
+	for(int i = 1; i < argc; i++) {
+		cur = argv[i];
 		checknum(cur);
 
 		double newVal = scm_is_int(cur) ? scm_ival(cur) : scm_rval(cur);
@@ -390,27 +412,21 @@ static Expr* num_lte(Expr* args) {
 			break;
 		}
 		curVal = newVal;
-
-		args = scm_cdr(args);
 	}
 
-	if(ok && args != EMPTY_LIST) return scm_mk_error("arguments to <= aren't a proper list");
-
 	return ok ? TRUE : FALSE;
 }
 
 #undef checknum
 // Numerical operations
 
-static Expr* add(Expr* args) {
-	assert(args);
-
+static Expr* add(int argc, Expr** argv) {
 	double dbuf = 0.0;
 	long long lbuf = 0;
 	bool exact = true;
 
-	while(scm_is_pair(args)) {
-		Expr* cur = scm_car(args);
+	for(int i = 0; i < argc; i++) {
+		Expr* cur = argv[i];
 		if(scm_is_int(cur)) {
 			lbuf += scm_ival(cur);
 			dbuf += scm_ival(cur);
@@ -420,25 +436,15 @@ static Expr* add(Expr* args) {
 		} else {
 			return scm_mk_error("Wrong type of argument to +");
 		}
-		args = scm_cdr(args);
-	}
-
-	if(args != EMPTY_LIST) {
-		return scm_mk_error("args to + aren't a proper list");
 	}
 
-
 	return exact ? scm_mk_int(lbuf) : scm_mk_real(dbuf);
 }
 
-static Expr* sub(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return scm_mk_error("no arguments passed to - (expected at least 1)");
-
+static Expr* sub(int argc, Expr** argv) {
 	// unary case
-	if(scm_cdr(args) == EMPTY_LIST) {
-		Expr* v = scm_car(args);
+	if(argc == 1) {
+		Expr* v = argv[0];
 
 		if(scm_is_int(v)) return scm_mk_int(-scm_ival(v));
 		if(scm_is_real(v)) return scm_mk_int(-scm_rval(v));
@@ -446,17 +452,15 @@ static Expr* sub(Expr* args) {
 		return scm_mk_error("wrong type of argument to -");
 	}
 
-	Expr* first = scm_car(args);
+	Expr* first = argv[0];
 	if(!scm_is_num(first)) return scm_mk_error("wrong type of argument to -");
 
 	bool exact = scm_is_int(first);
 	double dbuf = exact ? scm_ival(first) : scm_rval(first);
 	long long lbuf = exact ? scm_ival(first) : 0;
 
-	args = scm_cdr(args);
-
-	while(scm_is_pair(args)) {
-		Expr* cur = scm_car(args);
+	for(int i = 1; i < argc; i++) {
+		Expr* cur = argv[i];
 		if(scm_is_int(cur)) {
 			lbuf -= scm_ival(cur);
 			dbuf -= scm_ival(cur);
@@ -466,26 +470,18 @@ static Expr* sub(Expr* args) {
 		} else {
 			return scm_mk_error("Wrong type of argument to +");
 		}
-		args = scm_cdr(args);
 	}
 
-	if(args != EMPTY_LIST) {
-		return scm_mk_error("args to + aren't a proper list");
-	}
-
-
 	return exact ? scm_mk_int(lbuf) : scm_mk_real(dbuf);
 }
 
-static Expr* mul(Expr* args) {
-	assert(args);
-
+static Expr* mul(int argc, Expr** argv) {
 	double dbuf = 1.0;
 	long long lbuf = 1;
 	bool exact = true;
 
-	while(scm_is_pair(args)) {
-		Expr* cur = scm_car(args);
+	for(int i = 0; i < argc; i++) {
+		Expr* cur = argv[i];
 		if(scm_is_int(cur)) {
 			lbuf *= scm_ival(cur);
 			dbuf *= scm_ival(cur);
@@ -495,25 +491,15 @@ static Expr* mul(Expr* args) {
 		} else {
 			return scm_mk_error("Wrong type of argument to *");
 		}
-		args = scm_cdr(args);
-	}
-
-	if(args != EMPTY_LIST) {
-		return scm_mk_error("args to * aren't a proper list");
 	}
 
-
 	return exact ? scm_mk_int(lbuf) : scm_mk_real(dbuf);
 }
 
-static Expr* div(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return scm_mk_error("no arguments passed to / (expected at least 1)");
-
+static Expr* div(int argc, Expr** argv) {
 	// unary case
-	if(scm_cdr(args) == EMPTY_LIST) {
-		Expr* v = scm_car(args);
+	if(argc == 1) {
+		Expr* v = argv[0];
 
 		if(scm_is_int(v)) return scm_mk_real(1.0 / scm_ival(v));
 		if(scm_is_real(v)) return scm_mk_real(1.0 / scm_rval(v));
@@ -521,16 +507,14 @@ static Expr* div(Expr* args) {
 		return scm_mk_error("wrong type of argument to /");
 	}
 
-	Expr* first = scm_car(args);
+	Expr* first = argv[0];
 	if(!scm_is_num(first)) return scm_mk_error("wrong type of argument to /");
 
 	bool exact = scm_is_int(first);
 	double dbuf = exact ? scm_ival(first) : scm_rval(first);
 
-	args = scm_cdr(args);
-
-	while(scm_is_pair(args)) {
-		Expr* cur = scm_car(args);
+	for(int i = 1; i < argc; i++) {
+		Expr* cur = argv[i];
 		if(scm_is_int(cur)) {
 			dbuf /= scm_ival(cur);
 		} else if(scm_is_real(cur)) {
@@ -538,162 +522,428 @@ static Expr* div(Expr* args) {
 		} else {
 			return scm_mk_error("Wrong type of argument to /");
 		}
-		args = scm_cdr(args);
-	}
-
-	if(args != EMPTY_LIST) {
-		return scm_mk_error("args to / aren't a proper list");
 	}
 
-
 	return scm_mk_real(dbuf);
 }
 
 // Pair operations
 
-static Expr* pair(Expr* args) {
-	assert(args);
+static Expr* pair(int argc, Expr** argv) {
+	(void)argc;
 
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("passed more than 1 arg to pair?");
-	
-	return scm_is_pair(scm_car(args)) ? TRUE : FALSE;
+	return scm_is_pair(argv[0]) ? TRUE : FALSE;
 }
 
-static Expr* car(Expr* args) {
-	assert(args);
-
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("passed more than 1 arg to car");
+static Expr* car(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* arg = scm_car(args);
+	Expr* arg = argv[0];
 	if(!scm_is_pair(arg)) return scm_mk_error("arg to car must be a pair");
 
 	return scm_car(arg);
 }
 
-static Expr* cdr(Expr* args) {
-	assert(args);
-
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("passed more than 1 arg to cdr");
+static Expr* cdr(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* arg = scm_car(args);
+	Expr* arg = argv[0];
 	if(!scm_is_pair(arg)) return scm_mk_error("arg to cdr must be a pair");
 
 	return scm_cdr(arg);
 }
 
-static Expr* set_car(Expr* args) {
-	assert(args);
+static Expr* set_car(int argc, Expr** argv) {
+	(void)argc;
 
-	if(scm_list_len(args) != 2) return scm_mk_error("set-car! expects 2 arguments");
-
-	Expr* arg = scm_car(args);
+	Expr* arg = argv[0];
 	if(!scm_is_pair(arg)) return scm_mk_error("first arg to set-car! must be a pair");
 
-	Expr* val = scm_cadr(args);
+	arg->pair.car = argv[1];
+
+	return EMPTY_LIST;
+}
+
+static Expr* set_cdr(int argc, Expr** argv) {
+	(void)argc;
 
-	arg->pair.car = val;
+	Expr* arg = argv[0];
+	if(!scm_is_pair(arg)) return scm_mk_error("first arg to set-cdr! must be a pair");
+
+	arg->pair.cdr = argv[1];
 
 	return EMPTY_LIST;
 }
 
-static Expr* set_cdr(Expr* args) {
-	assert(args);
+// the arguments lie on a stack that is a gc root, so they need no protection
+static Expr* cons(int argc, Expr** argv) {
+	(void)argc;
 
-	if(scm_list_len(args) != 2) return scm_mk_error("set-cdr! expects 2 arguments");
+	Expr* toRet = scm_mk_pair(argv[0], argv[1]);
 
-	Expr* arg = scm_car(args);
-	if(!scm_is_pair(arg)) return scm_mk_error("first arg to set-cdr! must be a pair");
+	return toRet ? toRet : OOM;
+}
 
-	Expr* val = scm_cadr(args);
+static Expr* list(int argc, Expr** argv) {
+	return scm_mk_list(argv, argc);
+}
 
-	arg->pair.cdr = val;
+// List operations, which go over lists in loops however long they are
 
-	return EMPTY_LIST;
+// Goes down x along path, read right to left as in the name of a c[ad]+r
+static Expr* cxr(Expr* x, const char* path, const char* err) {
+	for(size_t i = strlen(path); i > 0; i--) {
+		if(!scm_is_pair(x)) return scm_mk_error(err);
+		x = path[i - 1] == 'a' ? scm_car(x) : scm_cdr(x);
+	}
+
+	return x;
 }
 
-static Expr* cons(Expr* args) {
-	assert(args);
-	
-	if(scm_list_len(args) != 2) return scm_mk_error("cons expects 2 args");
-	
-	Expr* es[2] = { scm_car(args), scm_cadr(args) };
-	
-	scm_stack_push(&es[0]);
-	scm_stack_push(&es[1]);
+#define mk_cxr(name, path) \
+	static Expr* name(int argc, Expr** argv) { \
+		(void)argc; \
+		return cxr(argv[0], path, "arg to " #name " isn't made of enough pairs"); \
+	}
+
+mk_cxr(caar, "aa")
+mk_cxr(cadr, "ad")
+mk_cxr(cdar, "da")
+mk_cxr(cddr, "dd")
+mk_cxr(caaar, "aaa")
+mk_cxr(caadr, "aad")
+mk_cxr(cadar, "ada")
+mk_cxr(caddr, "add")
+mk_cxr(cdaar, "daa")
+mk_cxr(cdadr, "dad")
+mk_cxr(cddar, "dda")
+mk_cxr(cdddr, "ddd")
+mk_cxr(caaaar, "aaaa")
+mk_cxr(caaadr, "aaad")
+mk_cxr(caadar, "aada")
+mk_cxr(caaddr, "aadd")
+mk_cxr(cadaar, "adaa")
+mk_cxr(cadadr, "adad")
+mk_cxr(caddar, "adda")
+mk_cxr(cadddr, "addd")
+mk_cxr(cdaaar, "daaa")
+mk_cxr(cdaadr, "daad")
+mk_cxr(cdadar, "dada")
+mk_cxr(cdaddr, "dadd")
+mk_cxr(cddaar, "ddaa")
+mk_cxr(cddadr, "ddad")
+mk_cxr(cdddar, "ddda")
+mk_cxr(cddddr, "dddd")
+
+#undef mk_cxr
+
+// The length of the list l, -1 if it isn't a proper one, circular ones
+// included
+static long long list_length(Expr* l) {
+	long long n = 0;
+	for(Expr* slow = l; scm_is_pair(l); n++) {
+		l = scm_cdr(l);
+		if(n % 2) slow = scm_cdr(slow);
+		if(l == slow) return -1;
+	}
+
+	return l == EMPTY_LIST ? n : -1;
+}
 
-	Expr* toRet = scm_mk_pair(es[0], es[1]);
+static Expr* length(int argc, Expr** argv) {
+	(void)argc;
 
-	scm_stack_pop(&es[1]);
-	scm_stack_pop(&es[0]);
+	long long n = list_length(argv[0]);
+	if(n < 0) return scm_mk_error("length expects a list");
+
+	Expr* toRet = scm_mk_int(n);
 
 	return toRet ? toRet : OOM;
 }
 
-static Expr* list(Expr* args) {
-	assert(args);
+// all the lists but the last are copied, which the result ends with
+static Expr* append(int argc, Expr** argv) {
+	if(argc == 0) return EMPTY_LIST;
 
-	if(args == EMPTY_LIST) return EMPTY_LIST;
+	for(int i = 0; i < argc - 1; i++) {
+		if(list_length(argv[i]) < 0) return scm_mk_error("append expects lists");
+	}
 
-	Expr* head = scm_mk_pair(EMPTY_LIST, EMPTY_LIST);
-	Expr* cur = head;
-	if(!head) return OOM;
-	scm_stack_push(&head);
+	Expr* toRet = EMPTY_LIST;
+	Expr* last = NULL;
+	scm_stack_push(&toRet);
 
-	while(scm_is_pair(args) && scm_is_pair(scm_cdr(args))) {
-		cur->pair.car = scm_car(args);
-		Expr* next = scm_mk_pair(EMPTY_LIST, EMPTY_LIST);
-		if(!next) {
-			cur = NULL;
-			break;
+	for(int i = 0; i < argc - 1; i++) {
+		for(Expr* l = argv[i]; l != EMPTY_LIST; l = scm_cdr(l)) {
+			Expr* p = scm_mk_pair(scm_car(l), EMPTY_LIST);
+			if(!p) {
+				scm_stack_pop(&toRet);
+				return OOM;
+			}
+
+			if(last) last->pair.cdr = p;
+			else     toRet = p;
+			last = p;
 		}
-		cur->pair.cdr = next;
-		cur = next;
+	}
+
+	if(last) last->pair.cdr = argv[argc - 1];
+	else     toRet = argv[argc - 1];
+	scm_stack_pop(&toRet);
+
+	return toRet;
+}
+
+static Expr* reverse(int argc, Expr** argv) {
+	(void)argc;
+
+	if(list_length(argv[0]) < 0) return scm_mk_error("reverse expects a list");
+
+	Expr* toRet = EMPTY_LIST;
+	scm_stack_push(&toRet);
+
+	for(Expr* l = argv[0]; toRet && l != EMPTY_LIST; l = scm_cdr(l)) {
+		toRet = scm_mk_pair(scm_car(l), toRet);
+	}
+
+	scm_stack_pop(&toRet);
 
-		args = scm_cdr(args);
+	return toRet ? toRet : OOM;
+}
+
+// the cdrs are read from the pairs directly, as scm_cdr() would be assumed
+// not to see them change
+static Expr* reverse_in_place(int argc, Expr** argv) {
+	(void)argc;
+
+	if(list_length(argv[0]) < 0) return scm_mk_error("reverse-in-place! expects a list");
+
+	Expr* toRet = EMPTY_LIST;
+	for(Expr* l = argv[0]; l != EMPTY_LIST;) {
+		Expr* next = l->pair.cdr;
+		l->pair.cdr = toRet;
+		toRet = l;
+		l = next;
 	}
 
-	scm_stack_pop(&head);
+	return toRet;
+}
+
+static Expr* list_tail(int argc, Expr** argv) {
+	(void)argc;
 
-	if(!cur) return OOM;
+	if(!scm_is_int(argv[1])) return scm_mk_error("list-tail expects an int as its 2nd arg");
+	if(scm_ival(argv[1]) < 0) return scm_mk_error("list-tail expects a non-negative 2nd arg");
 
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("Args to list aren't in a proper list");
-	
-	cur->pair.car = scm_car(args);
+	Expr* l = argv[0];
+	for(long long k = scm_ival(argv[1]); k > 0; k--) {
+		if(!scm_is_pair(l)) return scm_mk_error("list-tail expects a list longer than its 2nd arg");
+		l = scm_cdr(l);
+	}
 
-	return head;
+	return l;
 }
 
-// String functions
-static Expr* is_str(Expr* args) {
-	assert(args);
+static Expr* list_ref(int argc, Expr** argv) {
+	Expr* l = list_tail(argc, argv);
+	if(scm_is_error(l)) return l;
+	if(!scm_is_pair(l)) return scm_mk_error("list-ref expects a list longer than its 2nd arg");
+
+	return scm_car(l);
+}
+
+// The pairs left to compare by equal?, as the cdrs of the ones whose cars
+// are being compared. Nothing is allocated while it is in use.
+static Expr** pending = NULL;
+static size_t pendingCap = 0;
+
+// TRUE if a and b are eqv? or pairs of equal? values, OOM if out of room to
+// keep track of them
+Expr* scm_equal(Expr* a, Expr* b) {
+	size_t n = 0;
+
+	for(;;) {
+		while(a != b && scm_is_pair(a) && scm_is_pair(b)) {
+			if(n + 2 > pendingCap) {
+				size_t cap = pendingCap ? 2 * pendingCap : 64;
+				Expr** grown = realloc(pending, cap * sizeof(Expr*));
+				if(!grown) return OOM;
+
+				pending = grown;
+				pendingCap = cap;
+			}
+
+			pending[n++] = scm_cdr(a);
+			pending[n++] = scm_cdr(b);
+			a = scm_car(a);
+			b = scm_car(b);
+		}
+
+		if(a != b && (scm_is_pair(a) || scm_is_pair(b) || !scm_eqv(a, b))) return FALSE;
+		if(n == 0) return TRUE;
+
+		b = pending[--n];
+		a = pending[--n];
+	}
+}
+
+static Expr* equal(int argc, Expr** argv) {
+	(void)argc;
+	return scm_equal(argv[0], argv[1]);
+}
 
-	if(scm_list_len(args) != 1) return scm_mk_error("string? expects 1 arg");
+typedef enum { BY_EQ, BY_EQV, BY_EQUAL } Sameness;
 
-	return scm_is_string(scm_car(args)) ? TRUE: FALSE;
+static Expr* same(Sameness by, Expr* a, Expr* b) {
+	switch(by) {
+	case BY_EQ:  return a == b ? TRUE : FALSE;
+	case BY_EQV: return scm_eqv(a, b) ? TRUE : FALSE;
+	default:     return scm_equal(a, b);
+	}
+}
+
+// The first tail of l whose car is the same as x, #f if none
+static Expr* member_by(Sameness by, Expr* x, Expr* l, const char* err) {
+	for(; scm_is_pair(l); l = scm_cdr(l)) {
+		Expr* found = same(by, x, scm_car(l));
+		if(found != FALSE) return found == TRUE ? l : found;
+	}
+
+	return l == EMPTY_LIST ? FALSE : scm_mk_error(err);
+}
+
+// The first pair in l whose car is the same as x, #f if none
+static Expr* assoc_by(Sameness by, Expr* x, Expr* l, const char* err) {
+	for(; scm_is_pair(l); l = scm_cdr(l)) {
+		if(!scm_is_pair(scm_car(l))) return scm_mk_error(err);
+
+		Expr* found = same(by, x, scm_caar(l));
+		if(found != FALSE) return found == TRUE ? scm_car(l) : found;
+	}
+
+	return l == EMPTY_LIST ? FALSE : scm_mk_error(err);
+}
+
+static Expr* memq(int argc, Expr** argv) {
+	(void)argc;
+	return member_by(BY_EQ, argv[0], argv[1], "memq expects a list");
+}
+
+static Expr* memv(int argc, Expr** argv) {
+	(void)argc;
+	return member_by(BY_EQV, argv[0], argv[1], "memv expects a list");
+}
+
+static Expr* member(int argc, Expr** argv) {
+	(void)argc;
+	return member_by(BY_EQUAL, argv[0], argv[1], "member expects a list");
+}
+
+static Expr* assq(int argc, Expr** argv) {
+	(void)argc;
+	return assoc_by(BY_EQ, argv[0], argv[1], "assq expects a list of pairs");
+}
+
+static Expr* assv(int argc, Expr** argv) {
+	(void)argc;
+	return assoc_by(BY_EQV, argv[0], argv[1], "assv expects a list of pairs");
+}
+
+static Expr* assoc(int argc, Expr** argv) {
+	(void)argc;
+	return assoc_by(BY_EQUAL, argv[0], argv[1], "assoc expects a list of pairs");
 }
 
-static Expr* str_null(Expr* args) {
-	assert(args);
+static bool is_procedure(const Expr* e) {
+	return scm_is_closure(e) || scm_is_ffunc(e) || scm_is_cont(e);
+}
+
+// Calls argv[0] on the cars of the lists in argv[1 .. argc), which are moved
+// along in their argument slots, until the shortest one is over. What it
+// returns goes at the end of the list in *into, unless into is NULL.
+//
+// The VM goes over the lists itself instead (see MAP in VM.c). Here, each
+// call is an evaluation of its own, so a continuation made in one can't be
+// called once it is over, nor can a task switch out of it or an evaluation
+// preempted in it be resumed.
+static Expr* map_over(int argc, Expr** argv, Expr** into, const char* err) {
+	const size_t base = scm_arg_stack_size();
+	Expr* last = NULL;
+
+	for(;;) {
+		for(int i = 1; i < argc; i++) {
+			if(!scm_is_pair(argv[i])) return argv[i] == EMPTY_LIST ? NULL : scm_mk_error(err);
+		}
+
+		for(int i = 1; i < argc; i++) {
+			if(!scm_arg_stack_push(scm_car(argv[i]))) {
+				scm_arg_stack_unwind(base);
+				return scm_mk_error("too many lists to map over");
+			}
+			argv[i] = scm_cdr(argv[i]);
+		}
+
+		Expr* v = scm_apply(argv[0], argc - 1, scm_arg_stack_at(base));
+		scm_arg_stack_unwind(base);
+		if(scm_is_error(v)) return v;
+
+		if(!into) continue;
+
+		scm_stack_push(&v);
+		Expr* p = scm_mk_pair(v, EMPTY_LIST);
+		scm_stack_pop(&v);
+		if(!p) return OOM;
+
+		if(last) last->pair.cdr = p;
+		else     *into = p;
+		last = p;
+	}
+}
+
+static Expr* map(int argc, Expr** argv) {
+	if(!is_procedure(argv[0])) return scm_mk_error("first arg to map must be a procedure");
+
+	Expr* toRet = EMPTY_LIST;
+	scm_stack_push(&toRet);
+	Expr* failed = map_over(argc, argv, &toRet, "map expects lists");
+	scm_stack_pop(&toRet);
+
+	return failed ? failed : toRet;
+}
+
+static Expr* for_each(int argc, Expr** argv) {
+	if(!is_procedure(argv[0])) return scm_mk_error("first arg to for-each must be a procedure");
 
-	if(scm_list_len(args) != 1) return scm_mk_error("string-null? expects 1 arg");
+	Expr* failed = map_over(argc, argv, NULL, "for-each expects lists");
 
-	Expr* a = scm_car(args);
+	return failed ? failed : EMPTY_LIST;
+}
+
+// String functions
+static Expr* is_str(int argc, Expr** argv) {
+	(void)argc;
+
+	return scm_is_string(argv[0]) ? TRUE: FALSE;
+}
+
+static Expr* str_null(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* a = argv[0];
 
 	if(!scm_is_string(a)) return scm_mk_error("string-null? expects a string");
 
 	return scm_sval(a)[0] == '\0' ? TRUE : FALSE;
 }
 
-static Expr* str_ref(Expr* args) {
-	assert(args);
-
-	if(scm_list_len(args) != 2) return scm_mk_error("string-ref expects 2 args");
+static Expr* str_ref(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* a = scm_car(args);
+	Expr* a = argv[0];
 
 	if(!scm_is_string(a)) return scm_mk_error("string-ref expects a string as its 1st arg");
 
-	Expr* i = scm_cadr(args);
+	Expr* i = argv[1];
 
 	if(!scm_is_int(i)) return scm_mk_error("string-ref expects an int as its 2nd arg");
 
@@ -702,20 +952,18 @@ static Expr* str_ref(Expr* args) {
 	return toRet ? toRet : OOM;
 }
 
-static Expr* str_set(Expr* args) {
-	assert(args);
+static Expr* str_set(int argc, Expr** argv) {
+	(void)argc;
 
-	if(scm_list_len(args) != 3) return scm_mk_error("string-set! expects 2 args");
-
-	Expr* a = scm_car(args);
+	Expr* a = argv[0];
 
 	if(!scm_is_string(a)) return scm_mk_error("string-set! expects a string as its 1st arg");
 
-	Expr* i = scm_cadr(args);
+	Expr* i = argv[1];
 
 	if(!scm_is_int(i)) return scm_mk_error("string-set! expects an int as its 2nd arg");
 
-	Expr* c = scm_caddr(args);
+	Expr* c = argv[2];
 
 	if(!scm_is_char(c)) return scm_mk_error("string-set! expects a char as its 3rd arg");
 
@@ -724,12 +972,10 @@ static Expr* str_set(Expr* args) {
 	return EMPTY_LIST;
 }
 
-static Expr* str_len(Expr* args) {
-	assert(args);
-
-	if(scm_list_len(args) != 1) return scm_mk_error("string-length expects 1 arg");
+static Expr* str_len(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* a = scm_car(args);
+	Expr* a = argv[0];
 
 	if(!scm_is_string(a)) return scm_mk_error("string-length expects a string");
 
@@ -738,35 +984,19 @@ static Expr* str_len(Expr* args) {
 	return toRet ? toRet : OOM;
 }
 
-static Expr* str(Expr* args) {
-	assert(args);
-
-	int len = scm_list_len(args);
-
-	if(len < 0) return scm_mk_error("string expects a proper list as its arguments");
-
-	char* buf = malloc(len + 1);
+static Expr* str(int argc, Expr** argv) {
+	char* buf = malloc(argc + 1);
 	if(!buf) return OOM;
-	
-	int i = 0;
-	while(args != EMPTY_LIST) {
-		Expr* c = scm_car(args);
 
-		if(!scm_is_char(c)) {
-			i = -1;
-			break;
+	for(int i = 0; i < argc; i++) {
+		if(!scm_is_char(argv[i])) {
+			free(buf);
+			return scm_mk_error("string expects all its args to be chars");
 		}
-		buf[i++] = scm_cval(c);
-
-		args = scm_cdr(args);
+		buf[i] = scm_cval(argv[i]);
 	}
 
-	buf[len] = '\0';
-
-	if(i == -1) {
-		free(buf);
-		return scm_mk_error("string expects all its args to be chars");
-	}
+	buf[argc] = '\0';
 
 	Expr* toRet = scm_alloc();
 	if(toRet) {
@@ -776,17 +1006,12 @@ static Expr* str(Expr* args) {
 		return toRet;
 	}
 
+	free(buf);
 	return OOM;
 }
 
-static Expr* mk_str(Expr* args) {
-	assert(args);
-
-	int len = scm_list_len(args);
-
-	if(len < 0 || len > 2) return scm_mk_error("make-string expects 1 or 2 args");
-
-	Expr* l = scm_car(args);
+static Expr* mk_str(int argc, Expr** argv) {
+	Expr* l = argv[0];
 	if(!scm_is_int(l)) return scm_mk_error("make-string expects an int as its 1st arg");
 
 	long long size = scm_ival(l);
@@ -801,8 +1026,8 @@ static Expr* mk_str(Expr* args) {
 	}
 
 	char c = 'a';
-	if(len == 2) {
-		Expr* ca = scm_cadr(args);
+	if(argc == 2) {
+		Expr* ca = argv[1];
 		if(!scm_is_char(ca)) {
 			free(buf);
 			return scm_mk_error("make-string expects a char as its 2nd arg");
@@ -821,12 +1046,10 @@ static Expr* mk_str(Expr* args) {
 	return toRet;
 }
 
-static Expr* str_cpy(Expr* args) {
-	assert(args);
-
-	if(scm_list_len(args) != 1) return scm_mk_error("string-copy expects 1 arg");
+static Expr* str_cpy(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* s = scm_car(args);
+	Expr* s = argv[0];
 
 	if(!scm_is_string(s)) return scm_mk_error("string-copy expects a string as its 1st arg");
 
@@ -835,308 +1058,638 @@ static Expr* str_cpy(Expr* args) {
 	return toRet ? toRet : OOM;
 }
 
-// Procedure operations
+static Expr* str2list(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* s = argv[0];
+
+	if(!scm_is_string(s)) return scm_mk_error("string->list expects a string");
 
-static Expr* procedure(Expr* args) {
-	assert(args);
+	// chars need no protection, they aren't allocated
+	Expr* toRet = EMPTY_LIST;
+	scm_stack_push(&toRet);
 
-	if(args == EMPTY_LIST) return scm_mk_error("procedure? expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("procedure? expects only 1 argument");
+	for(size_t i = strlen(scm_sval(s)); toRet && i > 0; i--) {
+		toRet = scm_mk_pair(scm_mk_char(scm_sval(s)[i - 1]), toRet);
+	}
 
-	Expr* fst = scm_car(args);
+	scm_stack_pop(&toRet);
 
-	return fst->tag == CLOSURE || (fst->tag == ATOM && fst->atom.type == FFUNC) ? TRUE : FALSE;
+	return toRet ? toRet : OOM;
 }
 
-static Expr* p_procedure(Expr* args) {
-	assert(args);
+static Expr* list2str(int argc, Expr** argv) {
+	(void)argc;
+
+	long long len = list_length(argv[0]);
+	if(len < 0) return scm_mk_error("list->string expects a list");
 
-	if(args == EMPTY_LIST) return scm_mk_error("primitive-procedure? expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("primitive-procedure? expects only 1 argument");
+	char* buf = malloc(len + 1);
+	if(!buf) return OOM;
 
-	Expr* fst = scm_car(args);
+	char* c = buf;
+	for(Expr* l = argv[0]; l != EMPTY_LIST; l = scm_cdr(l)) {
+		if(!scm_is_char(scm_car(l))) {
+			free(buf);
+			return scm_mk_error("list->string expects a list of chars");
+		}
+		*c++ = scm_cval(scm_car(l));
+	}
+	*c = '\0';
+
+	Expr* toRet = scm_alloc();
+	if(toRet) {
+		toRet->tag = ATOM;
+		toRet->atom.type = STRING;
+		toRet->atom.sval = buf;
+		return toRet;
+	}
 
-	return (fst->tag == ATOM && fst->atom.type == FFUNC) ? TRUE : FALSE;
+	free(buf);
+	return OOM;
 }
 
-static Expr* c_procedure(Expr* args) {
-	assert(args);
+// Procedure operations
 
-	if(args == EMPTY_LIST) return scm_mk_error("compound-procedure? expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("compound-procedure? expects only 1 argument");
+static Expr* procedure(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
-	return fst->tag == CLOSURE ? TRUE : FALSE;
+	return fst->tag == CLOSURE || scm_is_ffunc(fst) || scm_is_cont(fst) ? TRUE : FALSE;
 }
 
-static Expr* c_args(Expr* args) {
-	assert(args);
+static Expr* p_procedure(int argc, Expr** argv) {
+	(void)argc;
+
+	return scm_is_ffunc(argv[0]) ? TRUE : FALSE;
+}
+
+static Expr* c_procedure(int argc, Expr** argv) {
+	(void)argc;
+
+	return argv[0]->tag == CLOSURE ? TRUE : FALSE;
+}
 
-	if(args == EMPTY_LIST) return scm_mk_error("closure-args expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("closure-args expects only 1 argument");
+static Expr* c_args(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(fst->tag != CLOSURE) return scm_mk_error("argument to closure-args is not a closure");
 
 	return scm_closure_args(fst);
 }
 
-static Expr* c_code(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return scm_mk_error("closure-code expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("closure-code expects only 1 argument");
+static Expr* c_code(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(fst->tag != CLOSURE) return scm_mk_error("argument to closure-code is not a closure");
 
 	return scm_closure_body(fst);
 }
 
-static Expr* c_env(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return scm_mk_error("closure-env expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("closure-env expects only 1 argument");
+static Expr* c_env(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(fst->tag != CLOSURE) return scm_mk_error("argument to closure-env is not a closure");
 
 	return scm_closure_env(fst);
 }
 
-static Expr* env_parent(Expr* args) {
-	assert(args);
+static Expr* env_parent(int argc, Expr** argv) {
+	(void)argc;
 
-	if(args == EMPTY_LIST) return scm_mk_error("env-parent expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("env-parent expects only 1 argument");
-
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(fst == FALSE) return EMPTY_LIST;
 	if(!scm_is_env(fst)) return scm_mk_error("env-parent expects an environment");
 
-	return scm_car(fst);
+	return scm_env_parent(fst);
 }
 
-static Expr* env_names(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return scm_mk_error("env-names expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("env-names expects only 1 argument");
+static Expr* env_names(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(fst == FALSE) return EMPTY_LIST;
 	if(!scm_is_env(fst)) return scm_mk_error("env-names expects an environment");
 
-	return scm_cadr(fst);
+	return scm_env_names(fst);
 }
 
-static Expr* env_values(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return scm_mk_error("env-values expects an argument");
-	if(scm_cdr(args) != EMPTY_LIST) return scm_mk_error("env-values expects only 1 argument");
+static Expr* env_values(int argc, Expr** argv) {
+	(void)argc;
 
-	Expr* fst = scm_car(args);
+	Expr* fst = argv[0];
 
 	if(fst == FALSE) return EMPTY_LIST;
 	if(!scm_is_env(fst)) return scm_mk_error("env-values expects an environment");
 
-	return scm_caddr(fst);
+	return scm_env_values(fst);
 }
 
-static Expr* gc(Expr* args) {
-	assert(args);
-
-	if(args != EMPTY_LIST) return scm_mk_error("gc expects no arguments");
+static Expr* gc(int argc, Expr** argv) {
+	(void)argc; (void)argv;
 
 	scm_gc();
 
 	return EMPTY_LIST;
 }
 
-static Expr* free_mem(Expr* args) {
-	assert(args);
+static Expr* free_mem(int argc, Expr** argv) {
+	(void)argc; (void)argv;
 
-	if(args != EMPTY_LIST) return scm_mk_error("gc expects no arguments");
-	
 	Expr* toRet = scm_mk_int(scm_gc_free_objects());
 
 	return toRet ? toRet : OOM;
 }
 
-static Expr* gc_runs(Expr* args) {
-	(void)args;
+static Expr* gc_runs(int argc, Expr** argv) {
+	(void)argc; (void)argv;
 	return scm_mk_int(scm_gc_runs());
 }
 
-static Expr* error(Expr* args) {
-	assert(args);
-
-	if(args == EMPTY_LIST) return scm_mk_error("generic error");
-
-	if(scm_list_len(args) != 1) return scm_mk_error("error expects zero or one arguments)");
+static Expr* error(int argc, Expr** argv) {
+	if(argc == 0) return scm_mk_error("generic error");
 
-	Expr* msg = scm_car(args);
+	Expr* msg = argv[0];
 
 	if(!scm_is_string(msg)) return scm_mk_error("error expects a string as its argument");
 
 	return scm_mk_error(scm_sval(msg));
 }
 
-Expr* all_syms(Expr* args) {
-	(void)args;
+static Expr* raise_obj(int argc, Expr** argv) {
+	(void)argc;
+	return scm_raise(argv[0]);
+}
+
+static Expr* exception_handlers(int argc, Expr** argv) {
+	(void)argc; (void)argv;
+	return scm_handlers;
+}
+
+static Expr* error_object(int argc, Expr** argv) {
+	(void)argc;
+	return scm_is_condition(argv[0]) ? TRUE : FALSE;
+}
+
+static Expr* error_object_message(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* obj = argv[0];
+	if(!scm_is_condition(obj)) return scm_mk_error("error-object-message expects an error object");
+
+	Expr* toRet = scm_mk_string(scm_sval(obj));
+	return toRet ? toRet : OOM;
+}
+
+// Tasks
+
+static Expr* spawn(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!scm_is_closure(argv[0]) && !scm_is_ffunc(argv[0]) && !scm_is_cont(argv[0])) return scm_mk_error("spawn expects a procedure");
+
+	return scm_spawn(argv[0]);
+}
+
+static Expr* yield(int argc, Expr** argv) {
+	(void)argc; (void)argv;
+	return scm_yield();
+}
+
+static Expr* sleep_for(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* s = argv[0];
+	if(!scm_is_num(s)) return scm_mk_error("sleep expects a number of seconds");
+
+	return scm_sleep(scm_is_int(s) ? scm_ival(s) : scm_rval(s));
+}
+
+static Expr* task(int argc, Expr** argv) {
+	(void)argc;
+	return scm_is_task(argv[0]) ? TRUE : FALSE;
+}
+
+static Expr* task_wait(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!scm_is_task(argv[0])) return scm_mk_error("task-wait expects a task");
+
+	return scm_task_wait(argv[0]);
+}
+
+static Expr* make_channel(int argc, Expr** argv) {
+	if(argc == 1 && !scm_is_int(argv[0])) return scm_mk_error("make-channel expects an integer");
+
+	return scm_mk_channel(argc == 1 ? scm_ival(argv[0]) : 0);
+}
+
+static Expr* channel(int argc, Expr** argv) {
+	(void)argc;
+	return scm_is_channel(argv[0]) ? TRUE : FALSE;
+}
+
+static Expr* channel_send(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!scm_is_channel(argv[0])) return scm_mk_error("channel-send expects a channel");
+
+	return scm_channel_send(argv[0], argv[1]);
+}
+
+static Expr* channel_receive(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!scm_is_channel(argv[0])) return scm_mk_error("channel-receive expects a channel");
+
+	return scm_channel_receive(argv[0]);
+}
+
+static Expr* select_op(int argc, Expr** argv) {
+	return scm_select(argc, argv);
+}
+
+// Promises and streams
+
+static Expr* lazy(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!is_procedure(argv[0])) return scm_mk_error("delay-force expects a thunk");
+
+	return scm_mk_lazy(argv[0]);
+}
+
+static Expr* eager(int argc, Expr** argv) {
+	(void)argc;
+	return scm_mk_forced(argv[0]);
+}
+
+static Expr* make_promise(int argc, Expr** argv) {
+	(void)argc;
+	return scm_is_promise(argv[0]) ? argv[0] : scm_mk_forced(argv[0]);
+}
+
+static Expr* promise(int argc, Expr** argv) {
+	(void)argc;
+	return scm_is_promise(argv[0]) ? TRUE : FALSE;
+}
+
+static Expr* force(int argc, Expr** argv) {
+	(void)argc;
+	return scm_force(argv[0]);
+}
+
+static Expr* stream_null(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* c = scm_force(argv[0]);
+	if(scm_is_error(c)) return c;
+
+	return c == EMPTY_LIST ? TRUE : FALSE;
+}
+
+static Expr* stream_pair(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* c = scm_force(argv[0]);
+	if(scm_is_error(c)) return c;
+
+	return scm_is_pair(c) ? TRUE : FALSE;
+}
+
+static Expr* stream_car(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* c = scm_force(argv[0]);
+	if(scm_is_error(c)) return c;
+	if(!scm_is_pair(c)) return scm_mk_error("stream-car expects a stream that isn't over");
+
+	return scm_car(c);
+}
+
+static Expr* stream_cdr(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* c = scm_force(argv[0]);
+	if(scm_is_error(c)) return c;
+	if(!scm_is_pair(c)) return scm_mk_error("stream-cdr expects a stream that isn't over");
+
+	return scm_cdr(c);
+}
+
+static Expr* stream_map(int argc, Expr** argv) {
+	if(!is_procedure(argv[0])) return scm_mk_error("first arg to stream-map must be a procedure");
+
+	Expr* streams = scm_mk_list(argv + 1, argc - 1);
+	if(scm_is_error(streams)) return streams;
+
+	return scm_stream_map(argv[0], streams);
+}
+
+static Expr* stream_filter(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!is_procedure(argv[0])) return scm_mk_error("first arg to stream-filter must be a procedure");
+
+	return scm_stream_filter(argv[0], argv[1]);
+}
+
+static Expr* stream_take(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!scm_is_int(argv[0])) return scm_mk_error("first arg to stream-take must be an integer");
+
+	return scm_stream_take(scm_ival(argv[0]), argv[1]);
+}
+
+static Expr* stream_fold(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!is_procedure(argv[0])) return scm_mk_error("first arg to stream-fold must be a procedure");
+
+	// the stream is moved along in its argument slot, which keeps it alive
+	return scm_stream_fold(argv[0], argv[1], &argv[2]);
+}
+
+static Expr* stream_to_list(int argc, Expr** argv) {
+	if(argc == 2 && !scm_is_int(argv[1])) return scm_mk_error("second arg to stream->list must be an integer");
+
+	return scm_stream_to_list(argv[0], argc == 2 ? scm_ival(argv[1]) : -1);
+}
+
+// Memoization
+
+static Expr* make_memo(int argc, Expr** argv) {
+	(void)argc;
+
+	if(!is_procedure(argv[0])) return scm_mk_error("memoize expects a procedure");
+
+	// the options are (), (bound) or (bound same?), bound being #f if there
+	// is none
+	Expr* opts = argv[1];
+	long long bound = 0;
+	bool byEqual = true;
+	if(scm_is_pair(opts)) {
+		Expr* b = scm_car(opts);
+		if(b != FALSE && (!scm_is_int(b) || scm_ival(b) < 1)) return scm_mk_error("memoize expects a positive int or #f as its bound");
+		if(b != FALSE) bound = scm_ival(b);
+		opts = scm_cdr(opts);
+	}
+	if(scm_is_pair(opts)) {
+		Expr* by = scm_car(opts);
+		if(by != &FF_EQV && by != &FF_EQUAL) return scm_mk_error("memoize compares arguments by either eqv? or equal?");
+		byEqual = by == &FF_EQUAL;
+		opts = scm_cdr(opts);
+	}
+	if(opts != EMPTY_LIST) return scm_mk_error("memoize takes a procedure, a bound and eqv? or equal?");
+
+	return scm_mk_memo(bound, byEqual);
+}
+
+// The value memo keeps for args, memo itself if none
+static Expr* memo_ref(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* v = scm_memo_ref(argv[0], argv[1]);
+	return v ? v : argv[0];
+}
+
+static Expr* memo_set(int argc, Expr** argv) {
+	(void)argc;
+	return scm_memo_set(argv[0], argv[1], argv[2]);
+}
+
+// The table of a procedure made by memoize, which holds it in the frame it
+// closes over. NULL if f isn't one.
+static Expr* memo_of(Expr* f) {
+	if(!scm_is_closure(f)) return NULL;
+
+	Expr* env = scm_closure_env(f);
+	Frame* frame = scm_is_env(env) ? scm_env_frame(env) : NULL;
+	for(unsigned i = 0; frame && i < frame->size; i++) {
+		Expr* slot = frame->slots[i];
+		if(slot && scm_is_memo(slot)) return slot;
+	}
+
+	return NULL;
+}
+
+static Expr* memo_forget(int argc, Expr** argv) {
+	Expr* memo = memo_of(argv[0]);
+	if(!memo) return scm_mk_error("memo-forget! expects a procedure made by memoize");
+
+	Expr* args = scm_mk_list(argv + 1, argc - 1);
+	if(scm_is_error(args)) return args;
+
+	return scm_memo_forget(memo, args);
+}
+
+static Expr* memo_clear(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* memo = memo_of(argv[0]);
+	if(!memo) return scm_mk_error("memo-clear! expects a procedure made by memoize");
+
+	scm_memo_clear(memo);
+	return EMPTY_LIST;
+}
+
+static Expr* memo_size(int argc, Expr** argv) {
+	(void)argc;
+
+	Expr* memo = memo_of(argv[0]);
+	if(!memo) return scm_mk_error("memo-size expects a procedure made by memoize");
+
+	return scm_mk_int(scm_memo_size(memo));
+}
+
+Expr* all_syms(int argc, Expr** argv) {
+	(void)argc; (void)argv;
 	return scm_all_symbols();
 }
 
-Expr* base_env(Expr* args) {
-	(void)args;
+Expr* base_env(int argc, Expr** argv) {
+	(void)argc; (void)argv;
 	return BASE_ENV;
 }
 
-Expr* cur_env(Expr* args) {
-	(void)args;
+Expr* cur_env(int argc, Expr** argv) {
+	(void)argc; (void)argv;
+	scm_env_capture(CURRENT_ENV);
 	return CURRENT_ENV;
 }
 
-#define mk_ff(name, ptr) static const Expr name = { .tag = ATOM, .atom = { .type = FFUNC, .ffptr = ptr }, .protect = true, .mark = true }
-
-mk_ff(NUMBER, number);
-mk_ff(INTEGER, integer);
-mk_ff(REALL, real);
-mk_ff(EXACT, exact);
-mk_ff(INEXACT, inexact);
-
-mk_ff(EX2IN, ex2in);
-mk_ff(IN2EX, in2ex);
-mk_ff(CHR2INT, chr2int);
-mk_ff(INT2CHR, int2chr);
-
-mk_ff(BOOLEAN, boolean);
-mk_ff(NOT, not);
-
-mk_ff(EQ, eq);
-mk_ff(EQV, eqv);
-mk_ff(LT, num_lt);
-mk_ff(LTE, num_lte);
-mk_ff(GT, num_gt);
-mk_ff(GTE, num_gte);
-
-mk_ff(NUM_EQ, num_eq);
-mk_ff(ADD, add);
-mk_ff(SUB, sub);
-mk_ff(MUL, mul);
-mk_ff(DIV, div);
-
-mk_ff(PAIRR, pair);
-mk_ff(CAR, car);
-mk_ff(CDR, cdr);
-mk_ff(CONS, cons);
-mk_ff(LIST, list);
-mk_ff(SETCAR, set_car);
-mk_ff(SETCDR, set_cdr);
-
-mk_ff(ISSTR, is_str);
-mk_ff(STRNUL, str_null);
-mk_ff(STRREF, str_ref);
-mk_ff(STRSET, str_set);
-mk_ff(STRLEN, str_len);
-
-mk_ff(SSTRING, str);
-mk_ff(MKSTR, mk_str);
-mk_ff(STRCPY, str_cpy);
-
-mk_ff(PROC, procedure);
-mk_ff(P_PROC, p_procedure);
-mk_ff(C_PROC, c_procedure);
-mk_ff(C_ARGS, c_args);
-mk_ff(C_CODE, c_code);
-mk_ff(C_ENV, c_env);
-
-mk_ff(E_PAR, env_parent);
-mk_ff(E_NAM, env_names);
-mk_ff(E_VAL, env_values);
-
-mk_ff(GC, gc);
-mk_ff(FREE_M, free_mem);
-mk_ff(GC_RUNS, gc_runs);
-mk_ff(ERRORF, error);
-
-mk_ff(ALLSYMS, all_syms);
-mk_ff(CURENV, cur_env);
-mk_ff(BASEENV, base_env);
-
-#define bind_ff(name, oname) scm_env_define(BASE_ENV, scm_mk_symbol(name), (Expr*) &oname)
-
-void scm_init_func() {
-	bind_ff("number?", NUMBER);
-	bind_ff("integer?", INTEGER);
-	bind_ff("real?", REALL);
-	bind_ff("exact?", EXACT);
-	bind_ff("inexact?", INEXACT);
-
-	bind_ff("exact->inexact", EX2IN);
-	bind_ff("inexact->exact", IN2EX);
-	bind_ff("char->integer", CHR2INT);
-	bind_ff("integer->char", INT2CHR);
-
-	bind_ff("boolean?", BOOLEAN);
-	bind_ff("not", NOT);
-
-	bind_ff("eq?", EQ);
-	bind_ff("eqv?", EQV);
-
-	bind_ff("=", NUM_EQ);
-	bind_ff("<", LT);
-	bind_ff("<=", LTE);
-	bind_ff(">", GT);
-	bind_ff(">=", GTE);
-	bind_ff("+", ADD);
-	bind_ff("-", SUB);
-	bind_ff("*", MUL);
-	bind_ff("/", DIV);
-
-	bind_ff("pair?", PAIRR);
-	bind_ff("car", CAR);
-	bind_ff("cdr", CDR);
-	bind_ff("cons", CONS);
-	bind_ff("list", LIST);
-	bind_ff("set-car!", SETCAR);
-	bind_ff("set-cdr!", SETCDR);
-
-	bind_ff("string?", ISSTR);
-	bind_ff("string-null?", STRNUL);
-	bind_ff("string-ref", STRREF);
-	bind_ff("string-set!", STRSET);
-	bind_ff("string-length", STRLEN);
-
-	bind_ff("string", SSTRING);
-	bind_ff("make-string", MKSTR);
-	bind_ff("string-copy", STRCPY);
-
-	bind_ff("gc", GC);
-	bind_ff("free-mem", FREE_M);
-	bind_ff("gc-runs", GC_RUNS);
-	bind_ff("error", ERRORF);
-
-	bind_ff("procedure?", PROC);
-	bind_ff("primitive-procedure?", P_PROC);
-	bind_ff("compound-procedure?", C_PROC);
-	bind_ff("closure-args", C_ARGS);
-	bind_ff("closure-code", C_CODE);
-	bind_ff("closure-env", C_ENV);
-
-	bind_ff("env-parent", E_PAR);
-	bind_ff("env-names", E_NAM);
-	bind_ff("env-values", E_VAL);
-
-	bind_ff("all-syms", ALLSYMS);
-	bind_ff("cur-env", CURENV);
-	bind_ff("base-env", BASEENV);
+// These are bound to their names in Builtins.def at compile time. The ones
+// marked pure depend on nothing but their arguments and change nothing.
+#define mk_ff(id, fn, name, minArgs, maxArgs, pure) \
+	static const VFunc VF_##id = { fn, name, minArgs, maxArgs, pure }; \
+	const Expr FF_##id = { .tag = ATOM, .atom = { .type = VFUNC, .vfptr = &VF_##id }, .protect = true, .mark = true }
+
+#define ANY -1
+
+mk_ff(NUMBER, number, "number?", 1, 1, true);
+mk_ff(INTEGER, integer, "integer?", 1, 1, true);
+mk_ff(REALL, real, "real?", 1, 1, true);
+mk_ff(EXACT, exact, "exact?", 1, 1, true);
+mk_ff(INEXACT, inexact, "inexact?", 1, 1, true);
+
+mk_ff(EX2IN, ex2in, "exact->inexact", 1, 1, true);
+mk_ff(IN2EX, in2ex, "inexact->exact", 1, 1, true);
+mk_ff(CHR2INT, chr2int, "char->integer", 1, 1, true);
+mk_ff(INT2CHR, int2chr, "integer->char", 1, 1, true);
+
+mk_ff(BOOLEAN, boolean, "boolean?", 1, 1, true);
+mk_ff(NOT, not, "not", 1, 1, true);
+
+mk_ff(EQ, eq, "eq?", 2, 2, true);
+mk_ff(EQV, eqv, "eqv?", 2, 2, true);
+mk_ff(LT, num_lt, "<", 0, ANY, true);
+mk_ff(LTE, num_lte, "<=", 0, ANY, true);
+mk_ff(GT, num_gt, ">", 0, ANY, true);
+mk_ff(GTE, num_gte, ">=", 0, ANY, true);
+
+mk_ff(NUM_EQ, num_eq, "=", 0, ANY, true);
+mk_ff(ADD, add, "+", 0, ANY, true);
+mk_ff(SUB, sub, "-", 1, ANY, true);
+mk_ff(MUL, mul, "*", 0, ANY, true);
+mk_ff(DIV, div, "/", 1, ANY, true);
+
+mk_ff(PAIRR, pair, "pair?", 1, 1, true);
+mk_ff(CAR, car, "car", 1, 1, true);
+mk_ff(CDR, cdr, "cdr", 1, 1, true);
+mk_ff(CONS, cons, "cons", 2, 2, false);
+mk_ff(LIST, list, "list", 0, ANY, false);
+mk_ff(SETCAR, set_car, "set-car!", 2, 2, false);
+mk_ff(SETCDR, set_cdr, "set-cdr!", 2, 2, false);
+
+mk_ff(CAAR, caar, "caar", 1, 1, true);
+mk_ff(CADR, cadr, "cadr", 1, 1, true);
+mk_ff(CDAR, cdar, "cdar", 1, 1, true);
+mk_ff(CDDR, cddr, "cddr", 1, 1, true);
+mk_ff(CAAAR, caaar, "caaar", 1, 1, true);
+mk_ff(CAADR, caadr, "caadr", 1, 1, true);
+mk_ff(CADAR, cadar, "cadar", 1, 1, true);
+mk_ff(CADDR, caddr, "caddr", 1, 1, true);
+mk_ff(CDAAR, cdaar, "cdaar", 1, 1, true);
+mk_ff(CDADR, cdadr, "cdadr", 1, 1, true);
+mk_ff(CDDAR, cddar, "cddar", 1, 1, true);
+mk_ff(CDDDR, cdddr, "cdddr", 1, 1, true);
+mk_ff(CAAAAR, caaaar, "caaaar", 1, 1, true);
+mk_ff(CAAADR, caaadr, "caaadr", 1, 1, true);
+mk_ff(CAADAR, caadar, "caadar", 1, 1, true);
+mk_ff(CAADDR, caaddr, "caaddr", 1, 1, true);
+mk_ff(CADAAR, cadaar, "cadaar", 1, 1, true);
+mk_ff(CADADR, cadadr, "cadadr", 1, 1, true);
+mk_ff(CADDAR, caddar, "caddar", 1, 1, true);
+mk_ff(CADDDR, cadddr, "cadddr", 1, 1, true);
+mk_ff(CDAAAR, cdaaar, "cdaaar", 1, 1, true);
+mk_ff(CDAADR, cdaadr, "cdaadr", 1, 1, true);
+mk_ff(CDADAR, cdadar, "cdadar", 1, 1, true);
+mk_ff(CDADDR, cdaddr, "cdaddr", 1, 1, true);
+mk_ff(CDDAAR, cddaar, "cddaar", 1, 1, true);
+mk_ff(CDDADR, cddadr, "cddadr", 1, 1, true);
+mk_ff(CDDDAR, cdddar, "cdddar", 1, 1, true);
+mk_ff(CDDDDR, cddddr, "cddddr", 1, 1, true);
+mk_ff(LENGTH, length, "length", 1, 1, true);
+mk_ff(APPEND, append, "append", 0, ANY, false);
+mk_ff(REVERSE, reverse, "reverse", 1, 1, false);
+mk_ff(REVIP, reverse_in_place, "reverse-in-place!", 1, 1, false);
+mk_ff(LISTTAIL, list_tail, "list-tail", 2, 2, true);
+mk_ff(LISTREF, list_ref, "list-ref", 2, 2, true);
+mk_ff(EQUAL, equal, "equal?", 2, 2, true);
+mk_ff(MEMQ, memq, "memq", 2, 2, true);
+mk_ff(MEMV, memv, "memv", 2, 2, true);
+mk_ff(MEMBER, member, "member", 2, 2, true);
+mk_ff(ASSQ, assq, "assq", 2, 2, true);
+mk_ff(ASSV, assv, "assv", 2, 2, true);
+mk_ff(ASSOC, assoc, "assoc", 2, 2, true);
+mk_ff(MAP, map, "map", 2, ANY, false);
+mk_ff(FOREACH, for_each, "for-each", 2, ANY, false);
+
+// strings can be changed in place, so calls on them aren't pure
+mk_ff(ISSTR, is_str, "string?", 1, 1, true);
+mk_ff(STRNUL, str_null, "string-null?", 1, 1, false);
+mk_ff(STRREF, str_ref, "string-ref", 2, 2, false);
+mk_ff(STRSET, str_set, "string-set!", 3, 3, false);
+mk_ff(STRLEN, str_len, "string-length", 1, 1, false);
+
+mk_ff(SSTRING, str, "string", 0, ANY, false);
+mk_ff(MKSTR, mk_str, "make-string", 1, 2, false);
+mk_ff(STRCPY, str_cpy, "string-copy", 1, 1, false);
+mk_ff(STR2LIST, str2list, "string->list", 1, 1, false);
+mk_ff(LIST2STR, list2str, "list->string", 1, 1, false);
+
+mk_ff(PROC, procedure, "procedure?", 1, 1, true);
+mk_ff(P_PROC, p_procedure, "primitive-procedure?", 1, 1, true);
+mk_ff(C_PROC, c_procedure, "compound-procedure?", 1, 1, true);
+mk_ff(C_ARGS, c_args, "closure-args", 1, 1, false);
+mk_ff(C_CODE, c_code, "closure-code", 1, 1, false);
+mk_ff(C_ENV, c_env, "closure-env", 1, 1, false);
+
+mk_ff(E_PAR, env_parent, "env-parent", 1, 1, false);
+mk_ff(E_NAM, env_names, "env-names", 1, 1, false);
+mk_ff(E_VAL, env_values, "env-values", 1, 1, false);
+
+mk_ff(GC, gc, "gc", 0, 0, false);
+mk_ff(FREE_M, free_mem, "free-mem", 0, 0, false);
+mk_ff(GC_RUNS, gc_runs, "gc-runs", 0, ANY, false);
+mk_ff(ERRORF, error, "error", 0, 1, false);
+mk_ff(RAISE, raise_obj, "raise", 1, 1, false);
+mk_ff(HANDLERS, exception_handlers, "exception-handlers", 0, 0, false);
+mk_ff(ERROBJ, error_object, "error-object?", 1, 1, true);
+mk_ff(ERRMSG, error_object_message, "error-object-message", 1, 1, false);
+
+mk_ff(SPAWN, spawn, "spawn", 1, 1, false);
+mk_ff(YIELD, yield, "yield", 0, 0, false);
+mk_ff(SLEEP, sleep_for, "sleep", 1, 1, false);
+mk_ff(ISTASK, task, "task?", 1, 1, true);
+mk_ff(TASKWAIT, task_wait, "task-wait", 1, 1, false);
+mk_ff(MKCHAN, make_channel, "make-channel", 0, 1, false);
+mk_ff(ISCHAN, channel, "channel?", 1, 1, true);
+mk_ff(CHSEND, channel_send, "channel-send", 2, 2, false);
+mk_ff(CHRECV, channel_receive, "channel-receive", 1, 1, false);
+mk_ff(SELECT, select_op, "select", 1, ANY, false);
+
+mk_ff(LAZY, lazy, "__lazy", 1, 1, false);
+mk_ff(EAGER, eager, "__eager", 1, 1, false);
+mk_ff(MKPROM, make_promise, "make-promise", 1, 1, false);
+mk_ff(ISPROM, promise, "promise?", 1, 1, true);
+mk_ff(FORCE, force, "force", 1, 1, false);
+mk_ff(SNULL, stream_null, "stream-null?", 1, 1, false);
+mk_ff(SPAIR, stream_pair, "stream-pair?", 1, 1, false);
+mk_ff(SCAR, stream_car, "stream-car", 1, 1, false);
+mk_ff(SCDR, stream_cdr, "stream-cdr", 1, 1, false);
+mk_ff(SMAP, stream_map, "stream-map", 2, ANY, false);
+mk_ff(SFILTER, stream_filter, "stream-filter", 2, 2, false);
+mk_ff(STAKE, stream_take, "stream-take", 2, 2, false);
+mk_ff(SFOLD, stream_fold, "stream-fold", 3, 3, false);
+mk_ff(S2LIST, stream_to_list, "stream->list", 1, 2, false);
+
+mk_ff(MKMEMO, make_memo, "__make-memo", 2, 2, false);
+mk_ff(MEMOREF, memo_ref, "__memo-ref", 2, 2, false);
+mk_ff(MEMOSET, memo_set, "__memo-set!", 3, 3, false);
+mk_ff(MEMOFORGET, memo_forget, "memo-forget!", 1, ANY, false);
+mk_ff(MEMOCLEAR, memo_clear, "memo-clear!", 1, 1, false);
+mk_ff(MEMOSIZE, memo_size, "memo-size", 1, 1, false);
+
+mk_ff(ALLSYMS, all_syms, "all-syms", 0, ANY, false);
+mk_ff(CURENV, cur_env, "cur-env", 0, ANY, false);
+mk_ff(BASEENV, base_env, "base-env", 0, ANY, false);
+
+#undef ANY
+#undef mk_ff
+
+bool scm_needs_vm(const Expr* f) {
+	return f == &FF_YIELD || f == &FF_SLEEP || f == &FF_TASKWAIT || f == &FF_CHSEND || f == &FF_CHRECV || f == &FF_SELECT
+	    || f == &FF_MAP || f == &FF_FOREACH
+	    || f == &FF_FORCE || f == &FF_SNULL || f == &FF_SPAIR || f == &FF_SCAR || f == &FF_SCDR || f == &FF_SFOLD || f == &FF_S2LIST;
 }
@@ -9,16 +9,22 @@
 void scm_init() {
 	scm_init_mem();
 	scm_init_expr();
+	scm_init_eval();
 	scm_init_env();
-	scm_init_func();
 	scm_init_stdlib();
 }
 
 void scm_reset() {
 	scm_reset_expr();
 	scm_reset_env();
+	scm_reset_builtins();
+	scm_reset_eval();
+	scm_reset_vm();
+	scm_reset_tasks();
+	scm_reset_limits();
 	scm_gc();
 	scm_reset_symbol_set();
+	scm_reset_mem();
 }
 
 void scm_init_stdlib() {
@@ -0,0 +1,689 @@
+/* This file is a template JIT for the VM in VM.c. Once a closure has been
+ * called SCM_JIT_THRESHOLD times on the VM, the bytecode of its PROTO is
+ * translated instruction by instruction into x86-64 machine code, written to
+ * memory mapped executable.
+ *
+ * The machine code works on the stack of the VM, keeping a pointer to its top
+ * in rbx, and handles everything but the instructions that enter or leave a
+ * call. When it reaches one of those it hands back to the VM, which performs
+ * the call or return and then resumes the machine code where it left off, so
+ * that both agree on the state of every call at all times. Calls to the
+ * arithmetic and comparison primitives are the exception: when both arguments
+ * are integers they are computed inline, guarded by checks that fall back to
+ * the VM when the procedure turns out to be something else.
+ *
+ * When HLISP_PERF_MAP is set in the environment, or scm_set_jit_perf_map()
+ * turned it on, each compiled PROTO is listed in /tmp/perf-<pid>.map under
+ * the name it was defined as, so that perf can symbolize the frames of
+ * machine code.
+ *
+ * The JIT is only built on x86-64 Linux with SCM_JIT defined. Elsewhere every
+ * closure simply stays on the VM.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "SchemeSecret.h"
+
+#include <assert.h>
+
+#if defined(SCM_JIT) && defined(__x86_64__) && defined(__linux__)
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef int (*Entry)(Expr** stack, size_t* sp, int at);
+
+struct Native {
+	Entry entry;
+	void* code;
+	size_t size;
+	void** table;   // where to enter the code for each offset in the bytecode
+};
+
+// The error a helper failed with, for scm_jit_run() to hand to the VM
+static Expr* failure = NULL;
+
+int scm_jit_run(Native* n, Expr** stack, size_t* sp, int at, Expr** err) {
+	assert(n->table[at]);
+
+	int next = n->entry(stack, sp, at);
+	if(next < 0) *err = failure;
+
+	return next;
+}
+
+void scm_free_native(Native* n) {
+	munmap(n->code, n->size);
+	free(n->table);
+	free(n);
+}
+
+// Helpers called from the machine code for what isn't worth doing inline.
+// They take the top of the stack and return its new top, or NULL on failure.
+
+static Expr** push(Expr** top, Expr* v) {
+	if(scm_is_error(v)) {
+		failure = v;
+		return NULL;
+	}
+
+	*top = v;
+	return top + 1;
+}
+
+static Expr** push_ref(Expr** top, Expr* ref) {
+	return push(top, scm_env_get_ref(CURRENT_ENV, ref));
+}
+
+static Expr** push_closure(Expr** top, Expr* proto) {
+	return push(top, scm_mk_closure(CURRENT_ENV, proto));
+}
+
+static Expr** push_raw(Expr** top, Expr* form) {
+	return push(top, scm_eval_tree(form));
+}
+
+static Expr** define(Expr** top, Expr* sym) {
+	return push(top - 1, scm_env_define(CURRENT_ENV, sym, top[-1]));
+}
+
+static Expr** prim(Expr** top, int argc) {
+	return push(top - argc - 1, scm_call_ffunc(top[-argc - 1], argc, top - argc));
+}
+
+static Expr** set(Expr** top, Expr* name) {
+	Expr* v = scm_is_symbol(name) ? scm_env_set(CURRENT_ENV, name, top[-1]) : scm_env_set_ref(CURRENT_ENV, name, top[-1]);
+	return push(top - 1, v);
+}
+
+// Machine code being put together
+
+typedef struct Code {
+	unsigned char* buf;
+	size_t len, cap;
+	bool oom;
+} Code;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+enum { CC_O = 0x0, CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7 };
+
+static void byte(Code* c, unsigned char b) {
+	if(c->len == c->cap) {
+		size_t cap = c->cap ? c->cap * 2 : 1024;
+		unsigned char* buf = realloc(c->buf, cap);
+		if(!buf) {
+			c->oom = true;
+			return;
+		}
+		c->buf = buf;
+		c->cap = cap;
+	}
+
+	c->buf[c->len++] = b;
+}
+
+static void emit(Code* c, int n, ...) {
+	va_list bytes;
+	va_start(bytes, n);
+	for(int i = 0; i < n; i++) {
+		byte(c, va_arg(bytes, int));
+	}
+	va_end(bytes);
+}
+
+static void imm32(Code* c, int32_t v) {
+	for(int i = 0; i < 4; i++) {
+		byte(c, (uint32_t) v >> (8 * i));
+	}
+}
+
+static void imm64(Code* c, uint64_t v) {
+	for(int i = 0; i < 8; i++) {
+		byte(c, v >> (8 * i));
+	}
+}
+
+// mov reg, v
+static void mov_imm(Code* c, int reg, const void* v) {
+	emit(c, 2, 0x48, 0xB8 + reg);
+	imm64(c, (uintptr_t) v);
+}
+
+// Stores rbx back into the sp of the VM, using rcx
+static void store_sp(Code* c) {
+	emit(c, 3, 0x48, 0x89, 0xD9);        // mov rcx, rbx
+	emit(c, 3, 0x4C, 0x29, 0xE1);        // sub rcx, r12
+	emit(c, 4, 0x48, 0xC1, 0xF9, 0x03);  // sar rcx, 3
+	emit(c, 4, 0x49, 0x89, 0x4D, 0x00);  // mov [r13], rcx
+}
+
+// Pushes rax on the stack of the VM
+static void push_rax(Code* c) {
+	emit(c, 3, 0x48, 0x89, 0x03);        // mov [rbx], rax
+	emit(c, 4, 0x48, 0x83, 0xC3, 0x08);  // add rbx, 8
+}
+
+// A jump whose target is set later by land() or resolved by offset, returns
+// where its displacement lies
+static size_t jcc(Code* c, int cc) {
+	if(cc < 0) emit(c, 1, 0xE9);
+	else       emit(c, 2, 0x0F, 0x80 + cc);
+	imm32(c, 0);
+
+	return c->len - 4;
+}
+
+static size_t jmp(Code* c) {
+	return jcc(c, -1);
+}
+
+static void land_at(Code* c, size_t from, size_t to) {
+	if(c->oom) return;
+
+	int32_t rel = (int32_t) (to - (from + 4));
+	memcpy(c->buf + from, &rel, 4);
+}
+
+static void land(Code* c, size_t from) {
+	land_at(c, from, c->len);
+}
+
+// Calls helper(rbx, arg), taking its result as the new top of the stack
+static void call_helper(Code* c, Expr** (*helper)(Expr**, Expr*), const void* arg, size_t fail) {
+	store_sp(c);
+	emit(c, 3, 0x48, 0x89, 0xDF);        // mov rdi, rbx
+	mov_imm(c, RSI, arg);
+	emit(c, 2, 0x48, 0xB8);              // mov rax, helper
+	imm64(c, (uintptr_t) helper);
+	emit(c, 2, 0xFF, 0xD0);              // call rax
+	emit(c, 3, 0x48, 0x85, 0xC0);        // test rax, rax
+	land_at(c, jcc(c, CC_E), fail);
+	emit(c, 3, 0x48, 0x89, 0xC3);        // mov rbx, rax
+}
+
+// Calls the primitive under the argc values on top of the stack by value
+static void call_prim(Code* c, int argc, size_t fail) {
+	store_sp(c);
+	emit(c, 3, 0x48, 0x89, 0xDF);        // mov rdi, rbx
+	emit(c, 1, 0xBE);                    // mov esi, argc
+	imm32(c, argc);
+	mov_imm(c, RAX, (const void*) (uintptr_t) prim);
+	emit(c, 2, 0xFF, 0xD0);              // call rax
+	emit(c, 3, 0x48, 0x85, 0xC0);        // test rax, rax
+	land_at(c, jcc(c, CC_E), fail);
+	emit(c, 3, 0x48, 0x89, 0xC3);        // mov rbx, rax
+}
+
+// Hands the instruction at offset back to the VM
+static void leave(Code* c, int offset, size_t exit) {
+	emit(c, 1, 0xB8);                    // mov eax, offset
+	imm32(c, offset);
+	land_at(c, jmp(c), exit);
+}
+
+// The tag of an Expr is a bitfield, so where it lies is found out at runtime
+static size_t tagOffset;
+static unsigned char tagMask;
+
+static void find_tag() {
+	Expr e;
+	memset(&e, 0xFF, sizeof(Expr));
+	e.tag = ATOM;
+
+	unsigned char* bytes = (unsigned char*) &e;
+	for(tagOffset = 0; bytes[tagOffset] == 0xFF; tagOffset++);
+	tagMask = ~bytes[tagOffset];
+}
+
+// Adds the jumps taken unless the Expr in reg, rax or rcx, is an integer
+static void check_int(Code* c, int reg, size_t* jumps, size_t* n) {
+	emit(c, 2, 0xF6, 0x80 + reg);        // test byte [reg + tag], mask
+	imm32(c, tagOffset);
+	byte(c, tagMask);
+	jumps[(*n)++] = jcc(c, CC_NE);
+
+	emit(c, 2, 0x83, 0xB8 + reg);        // cmp dword [reg + type], INT
+	imm32(c, offsetof(Expr, atom.type));
+	byte(c, INT);
+	jumps[(*n)++] = jcc(c, CC_NE);
+}
+
+// The primitives computed inline, NULL for any other value
+static const Expr* inlined(Expr* v) {
+	if(v == &FF_ADD || v == &FF_SUB || v == &FF_NUM_EQ || v == &FF_LT || v == &FF_GT || v == &FF_LTE || v == &FF_GTE) return v;
+
+	return NULL;
+}
+
+// A call of the primitive ff on the two integers on top of the stack
+static void inline_call(Code* c, const Expr* ff, int offset, size_t exit) {
+	// where the procedure or its arguments turn out not to fit
+	size_t generic[8], n = 0;
+
+	emit(c, 4, 0x48, 0x8B, 0x43, 0xE8);  // mov rax, [rbx - 24]
+	mov_imm(c, RCX, ff);
+	emit(c, 3, 0x48, 0x39, 0xC8);        // cmp rax, rcx
+	generic[n++] = jcc(c, CC_NE);
+
+	emit(c, 4, 0x48, 0x8B, 0x43, 0xF0);  // mov rax, [rbx - 16]
+	emit(c, 4, 0x48, 0x8B, 0x4B, 0xF8);  // mov rcx, [rbx - 8]
+	check_int(c, RAX, generic, &n);
+	check_int(c, RCX, generic, &n);
+
+	emit(c, 3, 0x48, 0x8B, 0x80);        // mov rax, [rax + ival]
+	imm32(c, offsetof(Expr, atom.ival));
+	emit(c, 3, 0x48, 0x8B, 0x89);        // mov rcx, [rcx + ival]
+	imm32(c, offsetof(Expr, atom.ival));
+
+	if(ff == &FF_ADD || ff == &FF_SUB) {
+		if(ff == &FF_ADD) emit(c, 3, 0x48, 0x01, 0xC8);  // add rax, rcx
+		else              emit(c, 3, 0x48, 0x29, 0xC8);  // sub rax, rcx
+		generic[n++] = jcc(c, CC_O);
+
+		store_sp(c);
+		emit(c, 3, 0x48, 0x89, 0xC7);    // mov rdi, rax
+		mov_imm(c, RAX, (const void*) (uintptr_t) scm_mk_int);
+		emit(c, 2, 0xFF, 0xD0);          // call rax
+		emit(c, 3, 0x48, 0x85, 0xC0);    // test rax, rax
+		generic[n++] = jcc(c, CC_E);
+	} else {
+		int cc;
+		if(ff == &FF_NUM_EQ) {
+			emit(c, 3, 0x48, 0x39, 0xC8);                 // cmp rax, rcx
+			cc = CC_E;
+		} else {
+			// compared as doubles, as the primitives do
+			emit(c, 5, 0xF2, 0x48, 0x0F, 0x2A, 0xC0);     // cvtsi2sd xmm0, rax
+			emit(c, 5, 0xF2, 0x48, 0x0F, 0x2A, 0xC9);     // cvtsi2sd xmm1, rcx
+			emit(c, 4, 0x66, 0x0F, 0x2E, 0xC1);           // ucomisd xmm0, xmm1
+			cc = ff == &FF_LT ? CC_B : ff == &FF_GT ? CC_A : ff == &FF_LTE ? CC_BE : CC_AE;
+		}
+		mov_imm(c, RAX, FALSE);
+		mov_imm(c, RCX, TRUE);
+		emit(c, 4, 0x48, 0x0F, 0x40 + cc, 0xC1);          // cmovcc rax, rcx
+	}
+
+	emit(c, 4, 0x48, 0x83, 0xEB, 0x10);  // sub rbx, 16
+	emit(c, 4, 0x48, 0x89, 0x43, 0xF8);  // mov [rbx - 8], rax
+	size_t done = jmp(c);
+
+	for(size_t i = 0; i < n; i++) {
+		land(c, generic[i]);
+	}
+	leave(c, offset, exit);
+
+	land(c, done);
+}
+
+typedef struct Fixup {
+	size_t from;
+	int to;         // offset in the bytecode
+} Fixup;
+
+typedef struct Builder {
+	Code c;
+	Fixup* fixups;
+	size_t nfixups, capFixups;
+	int* depths;    // depth of the stack at jump targets, -1 when unknown
+} Builder;
+
+// A jump to the instruction at offset to
+static void jump_to(Builder* b, int cc, int to, int depth) {
+	if(b->nfixups == b->capFixups) {
+		size_t cap = b->capFixups ? b->capFixups * 2 : 16;
+		Fixup* fixups = realloc(b->fixups, cap * sizeof(Fixup));
+		if(!fixups) {
+			b->c.oom = true;
+			return;
+		}
+		b->fixups = fixups;
+		b->capFixups = cap;
+	}
+
+	b->fixups[b->nfixups++] = (Fixup) { jcc(&b->c, cc), to };
+	b->depths[to] = depth;
+}
+
+static const int operands[] = {
+#define OPCODE(name, operands) operands,
+#include "Opcodes.def"
+#undef OPCODE
+};
+
+// Translates bc, filling in where each of its instructions starts in addrs.
+// Returns false when the code can't be compiled.
+static bool translate(Builder* b, Bytecode* bc, void** table, size_t* addrs) {
+	Code* c = &b->c;
+
+	// prologue, rbx is the top of the stack, r12 its base and r13 the sp
+	emit(c, 1, 0x53);                    // push rbx
+	emit(c, 2, 0x41, 0x54);              // push r12
+	emit(c, 2, 0x41, 0x55);              // push r13
+	emit(c, 3, 0x49, 0x89, 0xFC);        // mov r12, rdi
+	emit(c, 3, 0x49, 0x89, 0xF5);        // mov r13, rsi
+	emit(c, 4, 0x49, 0x8B, 0x45, 0x00);  // mov rax, [r13]
+	emit(c, 4, 0x49, 0x8D, 0x1C, 0xC4);  // lea rbx, [r12 + rax * 8]
+	emit(c, 2, 0x89, 0xD2);              // mov edx, edx
+	mov_imm(c, RAX, table);
+	emit(c, 3, 0xFF, 0x24, 0xD0);        // jmp [rax + rdx * 8]
+
+	// exit, with the offset of the next instruction for the VM in eax
+	size_t exit = c->len;
+	store_sp(c);
+	emit(c, 2, 0x41, 0x5D);              // pop r13
+	emit(c, 2, 0x41, 0x5C);              // pop r12
+	emit(c, 1, 0x5B);                    // pop rbx
+	emit(c, 1, 0xC3);                    // ret
+
+	size_t fail = c->len;
+	emit(c, 1, 0xB8);                    // mov eax, -1
+	imm32(c, -1);
+	land_at(c, jmp(c), exit);
+
+	// the primitives known to be on the stack, by depth
+	const Expr** known = calloc(bc->maxStack + 1, sizeof(Expr*));
+	if(!known) return false;
+	int depth = 0;
+
+	for(unsigned at = 0; at < bc->nops; at += 1 + operands[bc->ops[at]]) {
+		const int* op = &bc->ops[at];
+		addrs[at] = c->len;
+
+		// paths join at jump targets, on which the value on top may differ
+		if(b->depths[at] >= 0) {
+			depth = b->depths[at];
+			for(int d = depth > 0 ? depth - 1 : 0; d <= (int) bc->maxStack; d++) {
+				known[d] = NULL;
+			}
+		}
+		const Expr* global = NULL;
+
+		switch(op[0]) {
+		case OP_CONST:
+			mov_imm(c, RAX, bc->consts[op[1]]);
+			push_rax(c);
+			depth++;
+			break;
+		case OP_LOCAL: {
+			mov_imm(c, RAX, &CURRENT_ENV);
+			emit(c, 3, 0x48, 0x8B, 0x00);                    // mov rax, [rax]
+			for(int d = op[1]; d > 0; d--) {
+				emit(c, 3, 0x48, 0x8B, 0x80);                // mov rax, [rax + parent]
+				imm32(c, offsetof(Expr, env.parent));
+			}
+			emit(c, 3, 0x48, 0x8B, 0x80);                    // mov rax, [rax + frame]
+			imm32(c, offsetof(Expr, env.frame));
+			emit(c, 3, 0x48, 0x8B, 0x80);                    // mov rax, [rax + slot]
+			imm32(c, offsetof(Frame, slots) + op[2] * sizeof(Expr*));
+			goto loaded;
+		case OP_GLOBAL:
+			mov_imm(c, RAX, scm_symbol_cell(bc->consts[op[1]]->atom.gref));
+			emit(c, 3, 0x48, 0x8B, 0x00);                    // mov rax, [rax]
+			global = inlined(*scm_symbol_cell(bc->consts[op[1]]->atom.gref));
+
+		loaded:
+			// unbound, or maybe shadowed, values are looked up by the helper
+			emit(c, 3, 0x48, 0x85, 0xC0);                    // test rax, rax
+			size_t unbound = jcc(c, CC_E);
+			mov_imm(c, RCX, &scm_extended_frames);
+			emit(c, 3, 0x83, 0x39, 0x00);                    // cmp dword [rcx], 0
+			size_t extended = jcc(c, CC_NE);
+			push_rax(c);
+			size_t done = jmp(c);
+
+			land(c, unbound);
+			land(c, extended);
+			call_helper(c, push_ref, bc->consts[op[op[0] == OP_LOCAL ? 3 : 1]], fail);
+			land(c, done);
+			depth++;
+			break;
+		}
+		case OP_REF:
+			call_helper(c, push_ref, bc->consts[op[1]], fail);
+			depth++;
+			break;
+		case OP_CLOSURE:
+			call_helper(c, push_closure, bc->consts[op[1]], fail);
+			depth++;
+			break;
+		case OP_RAW:
+			call_helper(c, push_raw, bc->consts[op[1]], fail);
+			depth++;
+			break;
+		case OP_POP:
+			emit(c, 4, 0x48, 0x83, 0xEB, 0x08);              // sub rbx, 8
+			depth--;
+			break;
+		case OP_DEFINE:
+			call_helper(c, define, bc->consts[op[1]], fail);
+			break;
+		case OP_SET:
+			call_helper(c, set, bc->consts[op[1]], fail);
+			break;
+		case OP_JUMP:
+			jump_to(b, -1, op[1], depth);
+			depth = 0;
+			break;
+		case OP_JUMP_FALSE:
+			emit(c, 4, 0x48, 0x83, 0xEB, 0x08);              // sub rbx, 8
+			emit(c, 3, 0x48, 0x8B, 0x03);                    // mov rax, [rbx]
+			mov_imm(c, RCX, FALSE);
+			emit(c, 3, 0x48, 0x39, 0xC8);                    // cmp rax, rcx
+			depth--;
+			jump_to(b, CC_E, op[1], depth);
+			break;
+		case OP_AND:
+		case OP_OR:
+			emit(c, 4, 0x48, 0x8B, 0x43, 0xF8);              // mov rax, [rbx - 8]
+			mov_imm(c, RCX, FALSE);
+			emit(c, 3, 0x48, 0x39, 0xC8);                    // cmp rax, rcx
+			jump_to(b, op[0] == OP_AND ? CC_E : CC_NE, op[1], depth);
+			emit(c, 4, 0x48, 0x83, 0xEB, 0x08);              // sub rbx, 8
+			depth--;
+			break;
+		case OP_CALL:
+			if(op[1] == 2 && depth >= 3 && known[depth - 3]) inline_call(c, known[depth - 3], at, exit);
+			else                                              leave(c, at, exit);
+			depth -= op[1];
+			break;
+		case OP_PRIM: {
+			if(op[1] == 2 && depth >= 3 && known[depth - 3]) {
+				inline_call(c, known[depth - 3], at, exit);
+			} else if(scm_needs_vm(bc->consts[op[2]])) {
+				// the task calling it can only switch out of the VM, and
+				// the procedures it calls need the stack to grow
+				leave(c, at, exit);
+			} else {
+				emit(c, 3, 0x48, 0x8B, 0x83);                // mov rax, [rbx - 8 * (argc + 1)]
+				imm32(c, -8 * (op[1] + 1));
+				mov_imm(c, RCX, bc->consts[op[2]]);
+				emit(c, 3, 0x48, 0x39, 0xC8);                // cmp rax, rcx
+				size_t generic = jcc(c, CC_NE);
+				call_prim(c, op[1], fail);
+				size_t done = jmp(c);
+
+				land(c, generic);
+				leave(c, at, exit);
+				land(c, done);
+			}
+			depth -= op[1];
+			break;
+		}
+		case OP_FOLD: {
+			mov_imm(c, RCX, &scm_fold_version);
+			emit(c, 2, 0x81, 0x39);                          // cmp dword [rcx], version
+			imm32(c, op[2]);
+			size_t stale = jcc(c, CC_NE);
+			mov_imm(c, RAX, bc->consts[op[1]]);
+			push_rax(c);
+			jump_to(b, -1, op[3], depth + 1);
+			land(c, stale);
+			break;
+		}
+		case OP_APPLY:
+		case OP_EVAL:
+			leave(c, at, exit);
+			depth--;
+			break;
+		case OP_TRY:
+			leave(c, at, exit);
+			depth -= 2;
+			break;
+		case OP_CALLCC:
+			leave(c, at, exit);
+			break;
+		default:
+			// whatever ends a call, the next instruction is only reached by jumps
+			leave(c, at, exit);
+			depth = 0;
+			break;
+		}
+
+		// the value the instruction left on top, if it pushed or replaced one
+		// on the way to the next instruction
+		bool pops = op[0] == OP_POP || op[0] == OP_JUMP_FALSE || op[0] == OP_AND || op[0] == OP_OR || op[0] == OP_FOLD;
+		if(!pops && depth > 0) known[depth - 1] = global;
+	}
+	free(known);
+
+	if(c->oom) return false;
+
+	for(size_t i = 0; i < b->nfixups; i++) {
+		land_at(c, b->fixups[i].from, addrs[b->fixups[i].to]);
+	}
+	return true;
+}
+
+// -1 until HLISP_PERF_MAP was looked up or scm_set_jit_perf_map() called
+static int perfMap = -1;
+
+void scm_set_jit_perf_map(bool on) {
+	perfMap = on;
+}
+
+static void perf_map(Native* n, size_t len, Expr* proto) {
+	if(perfMap < 0) perfMap = getenv("HLISP_PERF_MAP") != NULL;
+	if(!perfMap) return;
+
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+
+	FILE* f = fopen(path, "a");
+	if(!f) return;
+
+	// a lambda that wasn't defined as a name goes by the one it is nested in
+	Proto* p = scm_proto(proto);
+	Expr* outer = proto;
+	while(scm_is_proto(outer) && scm_proto(outer)->name == FALSE) {
+		outer = scm_proto(outer)->outer;
+	}
+
+	fprintf(f, "%lx %zx hlisp:", (unsigned long) (uintptr_t) n->code, len);
+	if(p->name != FALSE) {
+		fprintf(f, "%s\n", scm_sval(p->name));
+	} else if(scm_is_proto(outer)) {
+		fprintf(f, "lambda in %s\n", scm_sval(scm_proto(outer)->name));
+	} else {
+		char* args = scm_print(p->args);
+		fprintf(f, "lambda %s\n", args ? args : "");
+		free(args);
+	}
+	fclose(f);
+}
+
+void scm_jit_compile(Expr* proto) {
+	assert(proto); assert(scm_is_proto(proto));
+
+	Proto* p = scm_proto(proto);
+	Bytecode* bc = p->bc;
+	assert(bc); assert(!p->native);
+
+	if(!tagMask) find_tag();
+
+	Builder b = { { NULL, 0, 0, false }, NULL, 0, 0, NULL };
+	size_t* addrs = calloc(bc->nops, sizeof(size_t));
+	b.depths = malloc(bc->nops * sizeof(int));
+	Native* n = malloc(sizeof(Native));
+	void** table = calloc(bc->nops, sizeof(void*));
+
+	bool ok = addrs && b.depths && n && table;
+	if(ok) {
+		for(unsigned i = 0; i < bc->nops; i++) {
+			b.depths[i] = -1;
+		}
+		ok = translate(&b, bc, table, addrs);
+	}
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = ok ? (b.c.len + page - 1) / page * page : 0;
+	void* code = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+
+	if(code != MAP_FAILED) {
+		memcpy(code, b.c.buf, b.c.len);
+
+		if(mprotect(code, size, PROT_READ | PROT_EXEC) == 0) {
+			// the VM only enters the code at the start and after the calls it
+			// makes, which are the instructions the code may leave to it
+			table[0] = (char*) code + addrs[0];
+			for(unsigned at = 0; at < bc->nops; at += 1 + operands[bc->ops[at]]) {
+				int op = bc->ops[at];
+				unsigned next = at + 1 + operands[op];
+				if((op == OP_CALL || op == OP_PRIM || op == OP_APPLY || op == OP_EVAL || op == OP_TRY || op == OP_CALLCC) && next < bc->nops) {
+					table[next] = (char*) code + addrs[next];
+				}
+			}
+
+			n->code = code;
+			n->size = size;
+			n->table = table;
+			memcpy(&n->entry, &code, sizeof(void*));
+			p->native = n;
+
+			perf_map(n, b.c.len, proto);
+		} else {
+			munmap(code, size);
+		}
+	}
+
+	if(!p->native) {
+		free(n);
+		free(table);
+	}
+	free(addrs);
+	free(b.depths);
+	free(b.fixups);
+	free(b.c.buf);
+}
+
+#else
+
+struct Native {
+	int unused;
+};
+
+void scm_set_jit_perf_map(bool on) {
+	(void) on;
+}
+
+void scm_jit_compile(Expr* proto) {
+	(void) proto;
+}
+
+int scm_jit_run(Native* n, Expr** stack, size_t* sp, int at, Expr** err) {
+	(void) n; (void) stack; (void) sp; (void) at; (void) err;
+
+	assert(false);
+	return -1;
+}
+
+void scm_free_native(Native* n) {
+	(void) n;
+}
+
+#endif
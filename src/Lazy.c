@@ -0,0 +1,296 @@
+/* This file implements promises, and the streams made of them.
+ *
+ * A promise is a single atom. Until it is forced it is a PROMISE holding
+ * either a thunk, which returns another promise to force in its place as
+ * made by delay-force, a step of a stream made in C along with what it reads
+ * from, or else another promise it was merged into. Once forced it turns into
+ * a FORCED one holding its value, and drops whatever computed it. delay wraps
+ * the value of its expression in a promise already forced (see stdlib.scm).
+ *
+ * Forcing is iterative, as in R7RS: when the thunk returns a promise not
+ * forced yet, the one being forced takes over what it holds and the other is
+ * merged into it, so that a chain of delay-force runs in constant space
+ * however long it is.
+ *
+ * A stream is a promise of either () or a pair of a value and another
+ * stream, a list being taken as one already forced. stream-map, stream-filter
+ * and stream-take are steps in C, which hold nothing but the streams they
+ * read from, so a pipeline of them over an unbounded stream only keeps alive
+ * what hasn't been consumed yet.
+ */
+
+#include "SchemeSecret.h"
+
+static Expr* mk_promise(bool forced, Expr* v) {
+	scm_stack_push(&v);
+	Expr* toRet = scm_alloc();
+	scm_stack_pop(&v);
+	if(!toRet) return OOM;
+
+	toRet->tag = ATOM;
+	toRet->atom.type = forced ? FORCED : PROMISE;
+	toRet->atom.promise = v;
+
+	return toRet;
+}
+
+Expr* scm_mk_lazy(Expr* thunk) {
+	return mk_promise(false, thunk);
+}
+
+Expr* scm_mk_forced(Expr* v) {
+	return mk_promise(true, v);
+}
+
+// The promise p was merged into, p itself if none
+static Expr* merged(Expr* p) {
+	while(p->atom.type == PROMISE && scm_is_promise(p->atom.promise)) {
+		p = p->atom.promise;
+	}
+	return p;
+}
+
+Expr* scm_force(Expr* p) {
+	if(!scm_is_promise(p)) return p;
+
+	scm_stack_push(&p);
+	Expr* v = EMPTY_LIST;
+	for(;;) {
+		p = merged(p);
+		if(p->atom.type == FORCED) break;
+
+		// a step is a pair of an FFUNC and the arguments to apply it to
+		Expr* how = p->atom.promise;
+		v = scm_is_pair(how) ? scm_apply_ffunc(scm_car(how), scm_cdr(how)) : scm_apply(how, 0, NULL);
+		if(scm_is_error(v)) break;
+
+		// if forcing it again got there first, that value stands
+		p = merged(p);
+		if(p->atom.type == FORCED) break;
+
+		if(!scm_is_promise(v)) {
+			p->atom.type = FORCED;
+			p->atom.promise = v;
+			break;
+		}
+
+		Expr* q = merged(v);
+		if(q == p) continue;
+
+		p->atom.type = q->atom.type;
+		p->atom.promise = q->atom.promise;
+		if(q->atom.type == PROMISE) q->atom.promise = p;
+	}
+	scm_stack_pop(&p);
+
+	return scm_is_error(v) ? v : p->atom.promise;
+}
+
+// Streams
+
+static Expr* map_step(Expr* args);
+static Expr* filter_step(Expr* args);
+static Expr* take_step(Expr* args);
+
+static const Expr MAP = { .tag = ATOM, .atom = { .type = FFUNC, .ffptr = map_step }, .protect = true, .mark = true };
+static const Expr FILTER = { .tag = ATOM, .atom = { .type = FFUNC, .ffptr = filter_step }, .protect = true, .mark = true };
+static const Expr TAKE = { .tag = ATOM, .atom = { .type = FFUNC, .ffptr = take_step }, .protect = true, .mark = true };
+
+// Forces the stream s into () or a pair
+static Expr* next(Expr* s) {
+	Expr* c = scm_force(s);
+	if(scm_is_error(c) || c == EMPTY_LIST || scm_is_pair(c)) return c;
+
+	return scm_mk_error("stream isn't a promise of () or a pair");
+}
+
+// The stream step makes out of args when forced
+static Expr* mk_step(const Expr* step, Expr* args) {
+	scm_stack_push(&args);
+	Expr* how = scm_mk_pair((Expr*) step, args);
+	scm_stack_pop(&args);
+
+	return how ? scm_mk_lazy(how) : OOM;
+}
+
+// The stream of v followed by the one step makes out of args when forced
+static Expr* cons_step(Expr* v, const Expr* step, Expr* args) {
+	scm_stack_push(&v);
+	Expr* rest = mk_step(step, args);
+	scm_stack_push(&rest);
+	Expr* toRet = scm_is_error(rest) ? rest : scm_mk_pair(v, rest);
+	scm_stack_pop(&rest);
+	scm_stack_pop(&v);
+
+	return toRet ? toRet : OOM;
+}
+
+// The list (a b)
+static Expr* list2(Expr* a, Expr* b) {
+	scm_stack_push(&a);
+	scm_stack_push(&b);
+	b = scm_mk_pair(b, EMPTY_LIST);
+	if(b) b = scm_mk_pair(a, b);
+	scm_stack_pop(&b);
+	scm_stack_pop(&a);
+
+	return b ? b : OOM;
+}
+
+// Pushes the values of args on the argument stack, an error if it is full
+static Expr* push_all(Expr* args) {
+	for(; scm_is_pair(args); args = scm_cdr(args)) {
+		if(!scm_arg_stack_push(scm_car(args))) return scm_mk_error("too many streams to map over");
+	}
+	return NULL;
+}
+
+// args is (f stream...), all of them forced already once any is
+static Expr* map_step(Expr* args) {
+	Expr* f = scm_car(args);
+	const size_t base = scm_arg_stack_size();
+
+	Expr* err = push_all(scm_cdr(args));
+	for(size_t i = base; !err && i < scm_arg_stack_size(); i++) {
+		Expr* c = next(*scm_arg_stack_at(i));
+		if(c == EMPTY_LIST || scm_is_error(c)) err = c;
+		else                                   *scm_arg_stack_at(i) = scm_car(c);
+	}
+	if(err) {
+		scm_arg_stack_unwind(base);
+		return err;
+	}
+
+	// f replaces the values it is called on, followed by the rest of the
+	// streams
+	const size_t n = scm_arg_stack_size() - base;
+	Expr* v = scm_apply(f, n, scm_arg_stack_at(base));
+	scm_arg_stack_unwind(base);
+	if(scm_is_error(v)) return v;
+
+	if(!scm_arg_stack_push(v) || (err = push_all(args))) {
+		scm_arg_stack_unwind(base);
+		return err ? err : scm_mk_error("too many streams to map over");
+	}
+	for(size_t i = base + 2; i < scm_arg_stack_size(); i++) {
+		*scm_arg_stack_at(i) = scm_cdr(scm_force(*scm_arg_stack_at(i)));
+	}
+
+	Expr* rest = scm_mk_list(scm_arg_stack_at(base + 1), n + 1);
+	v = *scm_arg_stack_at(base);
+	scm_arg_stack_unwind(base);
+
+	return scm_is_error(rest) ? rest : cons_step(v, &MAP, rest);
+}
+
+// args is (pred stream)
+static Expr* filter_step(Expr* args) {
+	Expr* pred = scm_car(args);
+	Expr* s = scm_cdr(args);
+
+	// the stream is read from s itself, which scm_car() would be assumed
+	// not to see change
+	for(;;) {
+		Expr* c = next(s->pair.car);
+		if(c == EMPTY_LIST || scm_is_error(c)) return c;
+
+		Expr* v = scm_car(c);
+		Expr* keep = scm_apply(pred, 1, &v);
+		if(scm_is_error(keep)) return keep;
+
+		// the values left out are dropped right away, so that a long run of
+		// them can be collected while going over it
+		c = scm_force(s->pair.car);
+		if(keep == FALSE) {
+			s->pair.car = scm_cdr(c);
+			continue;
+		}
+
+		Expr* l = list2(pred, scm_cdr(c));
+		return scm_is_error(l) ? l : cons_step(scm_car(c), &FILTER, l);
+	}
+}
+
+// args is (n stream)
+static Expr* take_step(Expr* args) {
+	long long n = scm_ival(scm_car(args));
+	if(n <= 0) return EMPTY_LIST;
+
+	Expr* c = next(scm_cadr(args));
+	if(c == EMPTY_LIST || scm_is_error(c)) return c;
+
+	// c is held by the stream it was forced from, which args holds
+	Expr* left = scm_mk_int(n - 1);
+	Expr* l = left ? list2(left, scm_cdr(c)) : OOM;
+
+	return scm_is_error(l) ? l : cons_step(scm_car(c), &TAKE, l);
+}
+
+Expr* scm_stream_map(Expr* f, Expr* streams) {
+	scm_stack_push(&streams);
+	Expr* args = scm_mk_pair(f, streams);
+	scm_stack_pop(&streams);
+
+	return args ? mk_step(&MAP, args) : OOM;
+}
+
+Expr* scm_stream_filter(Expr* pred, Expr* s) {
+	Expr* args = list2(pred, s);
+	return scm_is_error(args) ? args : mk_step(&FILTER, args);
+}
+
+Expr* scm_stream_take(long long n, Expr* s) {
+	Expr* left = scm_mk_int(n);
+	Expr* args = left ? list2(left, s) : OOM;
+
+	return scm_is_error(args) ? args : mk_step(&TAKE, args);
+}
+
+Expr* scm_stream_fold(Expr* f, Expr* init, Expr** s) {
+	Expr* acc = init;
+	scm_stack_push(&acc);
+
+	for(;;) {
+		Expr* c = next(*s);
+		if(scm_is_error(c)) acc = c;
+		if(c == EMPTY_LIST || scm_is_error(c)) break;
+
+		Expr* args[2] = { acc, scm_car(c) };
+		*s = scm_cdr(c);
+		acc = scm_apply(f, 2, args);
+		if(scm_is_error(acc)) break;
+	}
+
+	scm_stack_pop(&acc);
+	return acc;
+}
+
+Expr* scm_stream_to_list(Expr* s, long long n) {
+	Expr* toRet = EMPTY_LIST;
+	Expr* last = NULL;
+	scm_stack_push(&s);
+	scm_stack_push(&toRet);
+
+	for(; n != 0; n--) {
+		// c is held by s, which it was forced from
+		Expr* c = next(s);
+		if(scm_is_error(c)) toRet = c;
+		if(c == EMPTY_LIST || scm_is_error(c)) break;
+
+		Expr* l = scm_mk_pair(scm_car(c), EMPTY_LIST);
+		if(!l) {
+			toRet = OOM;
+			break;
+		}
+
+		if(last) last->pair.cdr = l;
+		else     toRet = l;
+		last = l;
+		s = scm_cdr(c);
+	}
+
+	scm_stack_pop(&toRet);
+	scm_stack_pop(&s);
+
+	return toRet;
+}
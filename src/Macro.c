@@ -0,0 +1,551 @@
+/* This file implements syntax-rules macros. A macro is a MACRO atom holding
+ * (scope ellipsis literals rule...), made once from its syntax-rules form in
+ * scope, and a use of it is expanded by matching it against the pattern of
+ * each rule in turn, then filling in the template of the first one that
+ * matches.
+ *
+ * Matching binds each pattern variable to the part of the use it matched, in
+ * an alist. A variable under an ellipsis is bound to a sequence instead: a
+ * list headed by SEQUENCE of what it matched on each repetition, which the
+ * template takes apart again under as many ellipses.
+ *
+ * Expansion is hygienic: the names a template binds itself, lambda
+ * arguments, let and named let names, defines in a body and guard variables,
+ * are renamed to fresh symbols on every expansion, so they can't capture the
+ * variables of the code that pattern variables carry in. The other names it
+ * refers to are renamed too when the expansion is to be resolved, to fresh
+ * symbols that remember the name and scope they stand for. The resolver
+ * looks those up where the macro was made, unless something in the
+ * expansion binds them after all, so that the code around a use can't
+ * capture them either. Syntax, macros, quoted names and what a template
+ * defines outside of a body keep their names. The fresh symbols start with a
+ * #, which the reader never makes one of.
+ */
+
+#include "Scheme.h"
+#include "SchemeSecret.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+// Heads the lists pattern variables under an ellipsis are bound to
+static Expr SEQUENCE = { .tag = ATOM, .atom = { .type = BOOL, .bval = false }, .protect = true, .mark = true };
+
+typedef struct Rules {
+	Expr* ellipsis;   // NULL within (... template), where it is just a name
+	Expr* literals;
+} Rules;
+
+static inline bool is_ellipsis(const Rules* r, Expr* e) {
+	return r->ellipsis && e == r->ellipsis;
+}
+
+// Whether the first element of l is followed by an ellipsis
+static inline bool repeats(const Rules* r, Expr* l) {
+	return scm_is_pair(scm_cdr(l)) && is_ellipsis(r, scm_cadr(l));
+}
+
+static inline bool is_sequence(Expr* v) {
+	return scm_is_pair(v) && scm_car(v) == &SEQUENCE;
+}
+
+static bool memq(Expr* x, Expr* l) {
+	for(; scm_is_pair(l); l = scm_cdr(l)) {
+		if(scm_car(l) == x) return true;
+	}
+
+	return false;
+}
+
+static Expr* assq(Expr* x, Expr* alist) {
+	for(; scm_is_pair(alist); alist = scm_cdr(alist)) {
+		if(scm_caar(alist) == x) return scm_car(alist);
+	}
+
+	return NULL;
+}
+
+// A pair of car and cdr, which are kept from the gc while it is made
+static Expr* cons(Expr* car, Expr* cdr) {
+	scm_stack_push(&car);
+	scm_stack_push(&cdr);
+	Expr* toRet = scm_mk_pair(car, cdr);
+	scm_stack_pop(&cdr);
+	scm_stack_pop(&car);
+
+	return toRet ? toRet : OOM;
+}
+
+// Conses (key . val) onto the alist *l, which must be protected
+static Expr* push(Expr** l, Expr* key, Expr* val) {
+	Expr* entry = cons(key, val);
+	if(entry != OOM) entry = cons(entry, *l);
+	if(entry == OOM) return OOM;
+
+	*l = entry;
+	return TRUE;
+}
+
+static Expr* reverse(Expr* l) {
+	Expr* toRet = EMPTY_LIST;
+	while(scm_is_pair(l)) {
+		Expr* next = scm_cdr(l);
+		l->pair.cdr = toRet;
+		toRet = l;
+		l = next;
+	}
+
+	return toRet;
+}
+
+static unsigned renamed = 0;
+
+// A symbol named after sym that no other code can refer to
+static Expr* fresh_name(Expr* sym) {
+	char name[256];
+	snprintf(name, sizeof(name), "#%.200s.%u", scm_sval(sym), ++renamed);
+
+	Expr* toRet = scm_mk_symbol(name);
+	return toRet ? toRet : OOM;
+}
+
+Expr* scm_unrenamed(Expr* sym) {
+	while(scm_is_symbol(sym) && scm_symbol_alias(sym)) sym = scm_car(scm_symbol_alias(sym));
+	return sym;
+}
+
+Expr* scm_mk_macro(Expr* spec, Expr* scope) {
+	assert(spec); assert(scm_is_pair(spec)); assert(scope);
+
+	// (syntax-rules [ellipsis] (literal...) (pattern template)...)
+	Expr* rest = scm_cdr(spec);
+	Expr* ellipsis = ELLIPSIS;
+	if(scm_is_pair(rest) && scm_is_symbol(scm_car(rest))) {
+		ellipsis = scm_car(rest);
+		rest = scm_cdr(rest);
+	}
+	if(!scm_is_pair(rest) || scm_list_len(scm_car(rest)) == -1 || scm_list_len(scm_cdr(rest)) == -1) {
+		return scm_mk_error("Malformed syntax-rules");
+	}
+
+	for(Expr* l = scm_car(rest); scm_is_pair(l); l = scm_cdr(l)) {
+		if(!scm_is_symbol(scm_car(l))) return scm_mk_error("syntax-rules literal isn't a symbol");
+	}
+	for(Expr* l = scm_cdr(rest); scm_is_pair(l); l = scm_cdr(l)) {
+		Expr* rule = scm_car(l);
+		if(scm_list_len(rule) != 2 || !scm_is_pair(scm_car(rule))) return scm_mk_error("Malformed syntax-rules rule");
+	}
+
+	Expr* rules = cons(ellipsis, rest);
+	if(rules != OOM) rules = cons(scope, rules);
+	if(rules == OOM) return OOM;
+
+	scm_stack_push(&rules);
+	Expr* toRet = scm_alloc();
+	scm_stack_pop(&rules);
+	if(!toRet) return OOM;
+
+	toRet->tag = ATOM;
+	toRet->atom.type = MACRO;
+	toRet->atom.rules = rules;
+
+	return toRet;
+}
+
+
+// Matching
+
+// Adds the pattern variables in p to *vars, which must be protected
+static Expr* pattern_vars(const Rules* r, Expr* p, Expr** vars) {
+	if(scm_is_symbol(p)) {
+		if(memq(p, r->literals) || is_ellipsis(r, p) || p == UNDERSCORE) return TRUE;
+
+		Expr* t = cons(p, *vars);
+		if(t == OOM) return OOM;
+		*vars = t;
+		return TRUE;
+	}
+
+	for(; scm_is_pair(p); p = scm_cdr(p)) {
+		Expr* res = pattern_vars(r, scm_car(p), vars);
+		if(res != TRUE) return res;
+	}
+
+	return scm_is_symbol(p) ? pattern_vars(r, p, vars) : TRUE;
+}
+
+static Expr* match(const Rules* r, Expr* p, Expr* form, Expr** b);
+
+// Matches the first n elements of form against p each, and binds the
+// variables in p to the sequences of what they matched
+static Expr* match_repeated(const Rules* r, Expr* p, Expr* form, int n, Expr** b) {
+	Expr* seqs = EMPTY_LIST;
+	Expr* ib = EMPTY_LIST;
+	scm_stack_push(&seqs);
+	scm_stack_push(&ib);
+
+	// (var . what it matched, last first) for each variable in p
+	Expr* res = pattern_vars(r, p, &seqs);
+	for(Expr* l = seqs; res == TRUE && scm_is_pair(l); l = scm_cdr(l)) {
+		Expr* entry = cons(scm_car(l), EMPTY_LIST);
+		if(entry == OOM) res = OOM;
+		else             l->pair.car = entry;
+	}
+
+	for(int i = 0; res == TRUE && i < n; i++, form = scm_cdr(form)) {
+		ib = EMPTY_LIST;
+		res = match(r, p, scm_car(form), &ib);
+
+		for(Expr* l = seqs; res == TRUE && scm_is_pair(l); l = scm_cdr(l)) {
+			Expr* entry = scm_car(l);
+			Expr* t = cons(scm_cdr(assq(scm_car(entry), ib)), scm_cdr(entry));
+			if(t == OOM) res = OOM;
+			else         entry->pair.cdr = t;
+		}
+	}
+
+	for(Expr* l = seqs; res == TRUE && scm_is_pair(l); l = scm_cdr(l)) {
+		Expr* entry = scm_car(l);
+		Expr* seq = cons(&SEQUENCE, reverse(scm_cdr(entry)));
+		res = seq == OOM ? OOM : push(b, scm_car(entry), seq);
+	}
+
+	scm_stack_pop(&ib);
+	scm_stack_pop(&seqs);
+
+	return res;
+}
+
+// Matches form against the pattern p, adding the bindings it makes to *b,
+// which must be protected. Returns TRUE or FALSE, or an error.
+static Expr* match(const Rules* r, Expr* p, Expr* form, Expr** b) {
+	if(scm_is_symbol(p)) {
+		if(memq(p, r->literals)) return scm_unrenamed(form) == p ? TRUE : FALSE;
+		if(p == UNDERSCORE) return TRUE;
+
+		return push(b, p, form);
+	}
+
+	if(scm_is_pair(p) && repeats(r, p)) {
+		// the ellipsis takes whatever the patterns after it leave
+		Expr* after = scm_cddr(p);
+		int n = 0;
+		for(Expr* l = form; scm_is_pair(l); l = scm_cdr(l)) n++;
+		for(Expr* l = after; scm_is_pair(l); l = scm_cdr(l)) n--;
+		if(n < 0) return FALSE;
+
+		Expr* res = match_repeated(r, scm_car(p), form, n, b);
+		if(res != TRUE) return res;
+
+		while(n--) form = scm_cdr(form);
+		return match(r, after, form, b);
+	}
+
+	if(scm_is_pair(p)) {
+		if(!scm_is_pair(form)) return FALSE;
+
+		Expr* res = match(r, scm_car(p), scm_car(form), b);
+		if(res != TRUE) return res;
+
+		return match(r, scm_cdr(p), scm_cdr(form), b);
+	}
+
+	if(p == EMPTY_LIST || scm_is_pair(form)) return p == form ? TRUE : FALSE;
+
+	Expr* argv[2] = { p, form };
+	return scm_call_ffunc((Expr*) &FF_EQV, 2, argv);
+}
+
+
+// Renaming
+
+// Renames sym in every expansion, unless it is a pattern variable
+static Expr* introduce(const Rules* r, Expr* sym, Expr* b, Expr** renames) {
+	if(!scm_is_symbol(sym) || is_ellipsis(r, sym) || sym == UNDERSCORE) return TRUE;
+	if(assq(sym, b) || assq(sym, *renames)) return TRUE;
+
+	Expr* to = fresh_name(sym);
+	return to == OOM ? OOM : push(renames, sym, to);
+}
+
+// Keeps the name sym, unless it is a pattern variable
+static Expr* keep(Expr* sym, Expr* b, Expr** renames) {
+	if(!scm_is_symbol(sym) || assq(sym, b) || assq(sym, *renames)) return TRUE;
+
+	return push(renames, sym, sym);
+}
+
+static Expr* binders(const Rules* r, Expr* t, Expr* b, Expr** renames, bool body);
+
+static Expr* binders_seq(const Rules* r, Expr* l, Expr* b, Expr** renames, bool body) {
+	for(; scm_is_pair(l); l = scm_cdr(l)) {
+		Expr* res = binders(r, scm_car(l), b, renames, body);
+		if(res != TRUE) return res;
+	}
+
+	return TRUE;
+}
+
+// Adds the names the template t binds to *renames, which must be protected.
+// A body can also bind names with define.
+static Expr* binders(const Rules* r, Expr* t, Expr* b, Expr** renames, bool body) {
+	if(!scm_is_pair(t)) return TRUE;
+
+	Expr* head = scm_car(t);
+	Expr* rest = scm_cdr(t);
+	if(head == QUOTE || !scm_is_pair(rest)) return TRUE;
+
+	Expr* res = TRUE;
+	if(head == LAMBDA) {
+		Expr* args = scm_car(rest);
+		for(; res == TRUE && scm_is_pair(args); args = scm_cdr(args)) {
+			res = introduce(r, scm_car(args), b, renames);
+		}
+		if(res == TRUE) res = introduce(r, args, b, renames);
+
+		return res == TRUE ? binders_seq(r, scm_cdr(rest), b, renames, true) : res;
+	}
+
+	if(head == LET) {
+		if(scm_is_symbol(scm_car(rest))) {
+			res = introduce(r, scm_car(rest), b, renames);
+			rest = scm_cdr(rest);
+		}
+		if(!scm_is_pair(rest)) return res;
+
+		for(Expr* l = scm_car(rest); res == TRUE && scm_is_pair(l); l = scm_cdr(l)) {
+			Expr* binding = scm_car(l);
+			if(!scm_is_pair(binding)) continue;
+
+			res = introduce(r, scm_car(binding), b, renames);
+			if(res == TRUE) res = binders_seq(r, scm_cdr(binding), b, renames, false);
+		}
+
+		return res == TRUE ? binders_seq(r, scm_cdr(rest), b, renames, true) : res;
+	}
+
+	if(head == DEFINE) {
+		Expr* target = scm_car(rest);
+		if(scm_is_pair(target)) target = scm_car(target);
+		res = body ? introduce(r, target, b, renames) : keep(target, b, renames);
+	} else if(head == GUARD && scm_is_pair(scm_car(rest))) {
+		res = introduce(r, scm_caar(rest), b, renames);
+	}
+
+	return res == TRUE ? binders_seq(r, t, b, renames, body && head == BEGIN) : res;
+}
+
+// Renames sym, which the template doesn't bind, to a name that stands for it
+// in scope
+static Expr* alias(const Rules* r, Expr* sym, Expr* b, Expr** renames, Expr* scope) {
+	if(is_ellipsis(r, sym) || scm_symbol_form(sym) != FORM_NONE) return TRUE;
+	if(assq(sym, b) || assq(sym, *renames) || scm_macro_ref(sym, scope)) return TRUE;
+
+	Expr* to = fresh_name(sym);
+	if(to == OOM) return OOM;
+
+	scm_stack_push(&to);
+	Expr* from = cons(sym, scope);
+	if(from != OOM) scm_symbol_alias(to) = from;
+	Expr* res = from == OOM ? OOM : push(renames, sym, to);
+	scm_stack_pop(&to);
+
+	return res;
+}
+
+static Expr* frees(const Rules* r, Expr* t, Expr* b, Expr** renames, Expr* scope);
+
+// Adds the names unquoted in the quasiquoted template t to *renames
+static Expr* frees_quasi(const Rules* r, Expr* t, Expr* b, Expr** renames, Expr* scope) {
+	for(; scm_is_pair(t); t = scm_cdr(t)) {
+		Expr* x = scm_car(t);
+		if(x == UNQUOTE || x == UNQUOTE_SPLICING) return scm_is_pair(scm_cdr(t)) ? frees(r, scm_cadr(t), b, renames, scope) : TRUE;
+
+		Expr* res = frees_quasi(r, x, b, renames, scope);
+		if(res != TRUE) return res;
+	}
+
+	return TRUE;
+}
+
+// Adds the names the template t refers to without binding them to *renames,
+// which must be protected, once binders() added the ones it binds
+static Expr* frees(const Rules* r, Expr* t, Expr* b, Expr** renames, Expr* scope) {
+	if(scm_is_symbol(t)) return alias(r, t, b, renames, scope);
+	if(!scm_is_pair(t)) return TRUE;
+
+	Expr* head = scm_car(t);
+	if(head == QUOTE) return TRUE;
+	if(head == QUASIQUOTE) return frees_quasi(r, scm_cdr(t), b, renames, scope);
+	if(is_ellipsis(r, head) && scm_is_pair(scm_cdr(t))) {
+		const Rules literally = { NULL, r->literals };
+		return frees(&literally, scm_cadr(t), b, renames, scope);
+	}
+
+	for(; scm_is_pair(t); t = scm_cdr(t)) {
+		Expr* res = frees(r, scm_car(t), b, renames, scope);
+		if(res != TRUE) return res;
+	}
+
+	return scm_is_symbol(t) ? frees(r, t, b, renames, scope) : TRUE;
+}
+
+
+// Filling in templates
+
+static Expr* fill(const Rules* r, Expr* t, Expr* b, Expr* renames);
+
+// Adds the bindings to sequences of the variables in t to *seqs, which must
+// be protected
+static Expr* sequences(const Rules* r, Expr* t, Expr* b, Expr** seqs) {
+	if(scm_is_symbol(t)) {
+		Expr* v = assq(t, b);
+		if(!v || !is_sequence(scm_cdr(v)) || assq(t, *seqs)) return TRUE;
+
+		return push(seqs, t, scm_cddr(v));
+	}
+
+	for(; scm_is_pair(t); t = scm_cdr(t)) {
+		Expr* res = sequences(r, scm_car(t), b, seqs);
+		if(res != TRUE) return res;
+	}
+
+	return scm_is_symbol(t) ? sequences(r, t, b, seqs) : TRUE;
+}
+
+// A fresh list of what t fills in to for each repetition of the sequences in
+// it, flattened depth - 1 times
+static Expr* fill_repeated(const Rules* r, Expr* t, unsigned depth, Expr* b, Expr* renames) {
+	// (var . what is left of its sequence) for each one in t
+	Expr* cursors = EMPTY_LIST;
+	Expr* nb = EMPTY_LIST;
+	Expr* head = EMPTY_LIST;
+	Expr* last = EMPTY_LIST;
+	scm_stack_push(&cursors);
+	scm_stack_push(&nb);
+	scm_stack_push(&head);
+
+	Expr* res = sequences(r, t, b, &cursors);
+	if(res == TRUE && cursors == EMPTY_LIST) {
+		res = scm_mk_error("no pattern variable to repeat in syntax-rules template");
+	}
+
+	int n = res == TRUE ? scm_list_len(scm_cdar(cursors)) : 0;
+	for(Expr* l = cursors; res == TRUE && scm_is_pair(l); l = scm_cdr(l)) {
+		if(scm_list_len(scm_cdar(l)) != n) res = scm_mk_error("pattern variables repeated unevenly in syntax-rules template");
+	}
+
+	for(int i = 0; res == TRUE && i < n; i++) {
+		nb = b;
+		for(Expr* l = cursors; res == TRUE && scm_is_pair(l); l = scm_cdr(l)) {
+			Expr* cursor = scm_car(l);
+			res = push(&nb, scm_car(cursor), scm_cadr(cursor));
+			cursor->pair.cdr = scm_cddr(cursor);
+		}
+		if(res != TRUE) break;
+
+		Expr* x = depth > 1 ? fill_repeated(r, t, depth - 1, nb, renames) : fill(r, t, nb, renames);
+		if(depth == 1 && !scm_is_error(x)) x = cons(x, EMPTY_LIST);
+		if(scm_is_error(x)) {
+			res = x;
+			break;
+		}
+
+		if(x == EMPTY_LIST) continue;
+		if(head == EMPTY_LIST) head = x;
+		else                   last->pair.cdr = x;
+		for(last = x; scm_is_pair(scm_cdr(last)); last = scm_cdr(last));
+	}
+
+	scm_stack_pop(&head);
+	scm_stack_pop(&nb);
+	scm_stack_pop(&cursors);
+
+	return res == TRUE ? head : res;
+}
+
+// What the template t stands for with the pattern variables bound in b and
+// the names it binds renamed as in renames
+static Expr* fill(const Rules* r, Expr* t, Expr* b, Expr* renames) {
+	if(scm_is_symbol(t)) {
+		Expr* v = assq(t, b);
+		if(v && is_sequence(scm_cdr(v))) return scm_mk_error("pattern variable used without an ellipsis in syntax-rules template");
+		if(v) return scm_cdr(v);
+
+		v = assq(t, renames);
+		return v ? scm_cdr(v) : t;
+	}
+	if(!scm_is_pair(t)) return t;
+
+	if(is_ellipsis(r, scm_car(t)) && scm_is_pair(scm_cdr(t))) {
+		// (... template) is template with the ellipsis taken as a name
+		const Rules literally = { NULL, r->literals };
+		return fill(&literally, scm_cadr(t), b, renames);
+	}
+
+	if(repeats(r, t)) {
+		unsigned depth = 0;
+		Expr* after = scm_cdr(t);
+		for(; scm_is_pair(after) && is_ellipsis(r, scm_car(after)); after = scm_cdr(after)) depth++;
+
+		Expr* tail = fill(r, after, b, renames);
+		if(scm_is_error(tail)) return tail;
+
+		scm_stack_push(&tail);
+		Expr* toRet = fill_repeated(r, scm_car(t), depth, b, renames);
+		scm_stack_pop(&tail);
+		if(scm_is_error(toRet) || toRet == EMPTY_LIST) return scm_is_error(toRet) ? toRet : tail;
+
+		Expr* l = toRet;
+		while(scm_is_pair(scm_cdr(l))) l = scm_cdr(l);
+		l->pair.cdr = tail;
+
+		return toRet;
+	}
+
+	Expr* car = fill(r, scm_car(t), b, renames);
+	if(scm_is_error(car)) return car;
+
+	scm_stack_push(&car);
+	Expr* cdr = fill(r, scm_cdr(t), b, renames);
+	scm_stack_pop(&car);
+	if(scm_is_error(cdr)) return cdr;
+
+	return cons(car, cdr);
+}
+
+Expr* scm_expand(Expr* macro, Expr* form, bool resolved) {
+	assert(macro); assert(scm_is_macro(macro));
+	assert(form); assert(scm_is_pair(form));
+
+	Expr* scope = scm_car(macro->atom.rules);
+	Expr* spec = scm_cdr(macro->atom.rules);
+	const Rules r = { scm_car(spec), scm_cadr(spec) };
+
+	Expr* b = EMPTY_LIST;
+	Expr* renames = EMPTY_LIST;
+	scm_stack_push(&macro);
+	scm_stack_push(&form);
+	scm_stack_push(&b);
+	scm_stack_push(&renames);
+
+	Expr* toRet = NULL;
+	for(Expr* l = scm_cddr(spec); !toRet && scm_is_pair(l); l = scm_cdr(l)) {
+		// the keyword the pattern starts with is left out
+		Expr* rule = scm_car(l);
+		b = EMPTY_LIST;
+		Expr* res = match(&r, scm_cdar(rule), scm_cdr(form), &b);
+		if(res == FALSE) continue;
+
+		if(res == TRUE) res = binders(&r, scm_cadr(rule), b, &renames, false);
+		if(res == TRUE && resolved) res = frees(&r, scm_cadr(rule), b, &renames, scope);
+		toRet = res == TRUE ? fill(&r, scm_cadr(rule), b, renames) : res;
+	}
+
+	scm_stack_pop(&renames);
+	scm_stack_pop(&b);
+	scm_stack_pop(&form);
+	scm_stack_pop(&macro);
+
+	return toRet ? toRet : scm_mk_error("no syntax-rules pattern matches the use of the macro");
+}
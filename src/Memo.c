@@ -0,0 +1,282 @@
+/* This file implements the tables memoize keeps what a procedure returned in.
+ *
+ * A MEMO atom holds a hash table from the lists of arguments a procedure was
+ * called with to what it returned for them, the arguments being compared by
+ * eqv? or equal?. The entries are kept outside of the pools and marked along
+ * with the atom, so what a table holds stays alive exactly as long as it
+ * does. A table may be bounded, in which case adding to it once full drops
+ * the entry used least recently, all of them being linked from the one used
+ * most recently to that one.
+ *
+ * The hash of a value only depends on what eqv? or equal? look at: numbers
+ * that are = hash the same whether exact or not, and strings by their chars.
+ * equal? only hashes the first few pairs of a value, deep or long ones
+ * differing further down sharing buckets rather than taking long to hash.
+ */
+
+#include "SchemeSecret.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_BUCKETS 16
+#define HASH_PAIRS 32
+
+typedef struct Entry {
+	Expr* args;
+	Expr* value;
+	size_t hash;
+	struct Entry* next;   // in the same bucket
+	struct Entry* newer;  // used more recently
+	struct Entry* older;  // used less recently
+} Entry;
+
+struct Memo {
+	Entry** buckets;
+	size_t nbuckets, count;
+	size_t bound;         // 0 if unbounded
+	bool byEqual;
+	Entry* newest;
+	Entry* oldest;
+};
+
+Expr* scm_mk_memo(long long bound, bool byEqual) {
+	if(bound < 0) return scm_mk_error("a memo table can't be bounded by fewer than 0 entries");
+
+	Memo* m = calloc(1, sizeof(Memo));
+	Entry** buckets = m ? calloc(MIN_BUCKETS, sizeof(Entry*)) : NULL;
+	Expr* toRet = buckets ? scm_alloc() : NULL;
+	if(!toRet) {
+		free(buckets);
+		free(m);
+		return OOM;
+	}
+
+	m->buckets = buckets;
+	m->nbuckets = MIN_BUCKETS;
+	m->bound = bound;
+	m->byEqual = byEqual;
+
+	toRet->tag = ATOM;
+	toRet->atom.type = MEMO;
+	toRet->atom.memo = m;
+
+	return toRet;
+}
+
+static size_t mix(size_t h, size_t v) {
+	return h ^ (v + 0x9e3779b9 + (h << 6) + (h >> 2));
+}
+
+static size_t hash_atom(Expr* e) {
+	if(scm_is_int(e)) return mix(0, (size_t) scm_ival(e));
+
+	if(scm_is_real(e)) {
+		// = holds between a real and the int it is equal to
+		double r = scm_rval(e);
+		if(r >= -9.2e18 && r <= 9.2e18 && r == (double) (long long) r) return mix(0, (size_t) (long long) r);
+
+		size_t bits = 0;
+		memcpy(&bits, &r, sizeof(bits) < sizeof(r) ? sizeof(bits) : sizeof(r));
+		return mix(0, bits);
+	}
+
+	if(scm_is_string(e)) {
+		size_t h = 0;
+		for(const char* c = scm_sval(e); *c; c++) h = mix(h, (unsigned char) *c);
+		return h;
+	}
+
+	return mix(0, (size_t) e);
+}
+
+static size_t hash_value(Expr* e, bool byEqual) {
+	if(!byEqual || !scm_is_pair(e)) return hash_atom(e);
+
+	// the pairs are gone over car first up to HASH_PAIRS of them, which only
+	// depends on the shape of e, as equal? does
+	Expr* todo[2 * HASH_PAIRS];
+	size_t n = 0, pairs = 0, h = 0;
+	todo[n++] = e;
+	while(n) {
+		e = todo[--n];
+		if(!scm_is_pair(e)) {
+			h = mix(h, hash_atom(e));
+		} else if(pairs++ < HASH_PAIRS) {
+			h = mix(h, 1);
+			todo[n++] = scm_cdr(e);
+			todo[n++] = scm_car(e);
+		}
+	}
+
+	return h;
+}
+
+static size_t hash_args(Expr* args, bool byEqual) {
+	size_t h = 0;
+	for(; scm_is_pair(args); args = scm_cdr(args)) {
+		h = mix(h, hash_value(scm_car(args), byEqual));
+	}
+	return h;
+}
+
+// TRUE if the arguments a and b are the same, OOM if equal? ran out of room
+static Expr* same_args(Expr* a, Expr* b, bool byEqual) {
+	for(; scm_is_pair(a) && scm_is_pair(b); a = scm_cdr(a), b = scm_cdr(b)) {
+		Expr* same = byEqual ? scm_equal(scm_car(a), scm_car(b)) : scm_eqv(scm_car(a), scm_car(b)) ? TRUE : FALSE;
+		if(same != TRUE) return same;
+	}
+
+	return a == b ? TRUE : FALSE;
+}
+
+static void unlink_lru(Memo* m, Entry* e) {
+	if(e->newer) e->newer->older = e->older;
+	else         m->newest = e->older;
+	if(e->older) e->older->newer = e->newer;
+	else         m->oldest = e->newer;
+}
+
+static void link_newest(Memo* m, Entry* e) {
+	e->newer = NULL;
+	e->older = m->newest;
+	if(m->newest) m->newest->newer = e;
+	else          m->oldest = e;
+	m->newest = e;
+}
+
+// The slot pointing to the entry for args, or to the NULL ending its bucket
+// if there is none. Sets err when equal? runs out of room.
+static Entry** find(Memo* m, Expr* args, size_t hash, Expr** err) {
+	Entry** slot = &m->buckets[hash % m->nbuckets];
+	for(; *slot; slot = &(*slot)->next) {
+		if((*slot)->hash != hash) continue;
+
+		Expr* same = same_args((*slot)->args, args, m->byEqual);
+		if(same == TRUE) break;
+		if(same != FALSE) {
+			*err = same;
+			break;
+		}
+	}
+
+	return slot;
+}
+
+static void drop(Memo* m, Entry** slot) {
+	Entry* e = *slot;
+	*slot = e->next;
+	unlink_lru(m, e);
+	free(e);
+	m->count--;
+}
+
+// Doubles the buckets, unless that can't be allocated
+static void grow(Memo* m) {
+	size_t n = 2 * m->nbuckets;
+	Entry** buckets = calloc(n, sizeof(Entry*));
+	if(!buckets) return;
+
+	for(size_t i = 0; i < m->nbuckets; i++) {
+		for(Entry* e = m->buckets[i], * next; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash % n];
+			buckets[e->hash % n] = e;
+		}
+	}
+
+	free(m->buckets);
+	m->buckets = buckets;
+	m->nbuckets = n;
+}
+
+Expr* scm_memo_ref(Expr* memo, Expr* args) {
+	Memo* m = scm_memo(memo);
+	Expr* err = NULL;
+	Entry* e = *find(m, args, hash_args(args, m->byEqual), &err);
+	if(err) return err;
+	if(!e) return NULL;
+
+	unlink_lru(m, e);
+	link_newest(m, e);
+
+	return e->value;
+}
+
+Expr* scm_memo_set(Expr* memo, Expr* args, Expr* v) {
+	Memo* m = scm_memo(memo);
+	const size_t hash = hash_args(args, m->byEqual);
+	Expr* err = NULL;
+	Entry** slot = find(m, args, hash, &err);
+	if(err) return err;
+
+	if(*slot) {
+		(*slot)->value = v;
+		unlink_lru(m, *slot);
+		link_newest(m, *slot);
+		return v;
+	}
+
+	Entry* e = malloc(sizeof(Entry));
+	if(!e) return OOM;
+
+	if(m->bound && m->count == m->bound) {
+		Entry* old = m->oldest;
+		Entry** s = &m->buckets[old->hash % m->nbuckets];
+		while(*s != old) s = &(*s)->next;
+		drop(m, s);
+	}
+
+	*e = (Entry) { .args = args, .value = v, .hash = hash };
+	link_newest(m, e);
+	if(++m->count > m->nbuckets) grow(m);
+
+	// the buckets may have grown, so e is added to them last
+	Entry** bucket = &m->buckets[hash % m->nbuckets];
+	e->next = *bucket;
+	*bucket = e;
+
+	return v;
+}
+
+Expr* scm_memo_forget(Expr* memo, Expr* args) {
+	Memo* m = scm_memo(memo);
+	Expr* err = NULL;
+	Entry** slot = find(m, args, hash_args(args, m->byEqual), &err);
+	if(err) return err;
+	if(!*slot) return FALSE;
+
+	drop(m, slot);
+	return TRUE;
+}
+
+static void free_entries(Memo* m) {
+	for(Entry* e = m->newest, * older; e; e = older) {
+		older = e->older;
+		free(e);
+	}
+}
+
+void scm_memo_clear(Expr* memo) {
+	Memo* m = scm_memo(memo);
+	free_entries(m);
+	memset(m->buckets, 0, m->nbuckets * sizeof(Entry*));
+	m->newest = m->oldest = NULL;
+	m->count = 0;
+}
+
+size_t scm_memo_size(Expr* memo) {
+	return scm_memo(memo)->count;
+}
+
+void scm_free_memo(Memo* m) {
+	free_entries(m);
+	free(m->buckets);
+	free(m);
+}
+
+void scm_mark_memo(Memo* m) {
+	for(Entry* e = m->newest; e; e = e->older) {
+		scm_mark(e->args);
+		scm_mark(e->value);
+	}
+}
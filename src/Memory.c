@@ -1,38 +1,54 @@
 /* This file handles all of the memory management and garbage collection. The
  * basic ideas behind it are:
- *   - A fixed-size pool of Exprs is allocated statically
+ *   - Exprs are allocated from pools, the first of which is static
  *   - A doubly-linked freelist is created out of them using the pair cells
  *   - Allocating an Expr involves extracting the head of the freelist
  *   - Freeing an Expr involves inserting it back into the freelist
  *
  * Garbage collection is done by resetting the mark bits of all the Exprs in the
- * pool, followed by doing a recursive marking of Exprs in use starting from
- * known entry points (the scheme environment) and Exprs that have their
- * protected bits set. Once this is done, all unmarked Exprs are linked
- * together to form a new freelist.
+ * pools, followed by marking the Exprs in use starting from known entry points
+ * (the scheme environment) and Exprs that have their protected bits set.
+ * Marking keeps the Exprs left to visit on a stack of its own rather than
+ * recursing, so that a long list doesn't exhaust the C stack. Once this is
+ * done, all unmarked Exprs are linked together to form a new freelist. When
+ * most of the pools survive a collection a new pool, as large as all of them
+ * together, is added. Symbols live outside of the pools but take part in the
+ * same mark phase, see Symbol.c.
  *
  * TODO:
- *   - Use the Schorr-Deutch-Waite link-inversion algorithm for marking
- *   - Allow multiple dynamic pools
  *   - Switch to an incremental gc algorithm
  */
 
 #include "SchemeSecret.h"
 #include <stddef.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #define MEM_SIZE 5000
-#define STACK_SIZE 1024
-
-//TODO: remove
-extern void free(void* ptr);
+#define MAX_POOLS 24
+#define STACK_SIZE 65536
+#define MARK_STACK_SIZE 1024
 
 static size_t gcRuns = 0;
 
+typedef struct Pool {
+	Expr* cells;
+	size_t size;
+} Pool;
+
 static Expr pool[MEM_SIZE];
+static Pool pools[MAX_POOLS] = { { pool, MEM_SIZE } };
+static size_t npools = 1;
+static size_t memSize = MEM_SIZE; // Exprs in all of the pools
+
 static Expr* freeList = NULL;
 static size_t freeListSize = 0;
 
+// Exprs left to mark
+static Expr** markStack = NULL;
+static size_t markTop = 0;
+static size_t markCap = 0;
+
 static Expr** protStack[STACK_SIZE];
 static size_t protStackSize = 0;
 
@@ -65,6 +81,18 @@ void scm_init_mem() {
 	gcRuns = 0;
 }
 
+void scm_reset_mem() {
+	for(size_t i = 1; i < npools; i++) {
+		free(pools[i].cells);
+	}
+	npools = 1;
+	memSize = MEM_SIZE;
+
+	free(markStack);
+	markStack = NULL;
+	markTop = markCap = 0;
+}
+
 static Expr* dll_insert(Expr* node, Expr* list) {
 	assert(node);
 
@@ -113,6 +141,25 @@ static Expr* dll_remove(Expr* node) {
 	return new;
 }
 
+// Adds a pool of size Exprs to the freelist, unless it can't be allocated
+static void add_pool(size_t size) {
+	if(npools == MAX_POOLS) return;
+
+	Expr* cells = malloc(size * sizeof(Expr));
+	if(!cells) return;
+
+	for(size_t i = 0; i < size; i++) {
+		cells[i].tag = PAIR;
+		cells[i].protect = false;
+		cells[i].mark = false;
+		freeList = dll_insert(&cells[i], freeList);
+	}
+
+	pools[npools++] = (Pool) { cells, size };
+	memSize += size;
+	freeListSize += size;
+}
+
 Expr* scm_alloc() {
 	if(!freeList) scm_gc();
 	if(!freeList) return NULL;
@@ -127,22 +174,141 @@ Expr* scm_alloc() {
 static void cleanup(Expr* e) {
 	assert(e);
 
-	if(scm_is_atom(e) && (scm_is_string(e) || scm_is_symbol(e) || scm_is_error(e))) {
+	if(scm_is_atom(e) && (scm_is_string(e) || scm_is_symbol(e) || (scm_is_error(e) && !scm_is_raised(e)) || scm_is_condition(e))) {
 		free(e->atom.sval);
 		e->atom.sval = NULL;
+	} else if(scm_is_env(e)) {
+		scm_free_frame(e->env.frame);
+		e->tag = PAIR; // free cells are swept again by every gc
+	} else if(scm_is_proto(e)) {
+		scm_free_proto(scm_proto(e));
+		e->tag = PAIR;
+	} else if(scm_is_dref(e)) {
+		scm_free_dref(e->atom.dref);
+		e->tag = PAIR;
+	} else if(scm_is_cont(e)) {
+		scm_free_cont(scm_cont(e));
+		e->tag = PAIR;
+	} else if(scm_is_task(e)) {
+		scm_free_task(scm_task(e));
+		e->tag = PAIR;
+	} else if(scm_is_channel(e)) {
+		scm_free_channel(scm_channel(e));
+		e->tag = PAIR;
+	} else if(scm_is_memo(e)) {
+		scm_free_memo(scm_memo(e));
+		e->tag = PAIR;
 	}
 }
 
-static void mark(Expr* e) {
+static void mark(Expr* e);
+
+// Leaves e to be marked later on, or marks it right away when the stack of
+// Exprs left to mark can't grow
+static void later(Expr* e) {
+	if(e->mark && !scm_is_gref(e)) return;
+
+	if(markTop == markCap) {
+		size_t cap = markCap ? 2 * markCap : MARK_STACK_SIZE;
+		Expr** grown = realloc(markStack, cap * sizeof(Expr*));
+		if(!grown) {
+			mark(e);
+			return;
+		}
+
+		markStack = grown;
+		markCap = cap;
+	}
+
+	markStack[markTop++] = e;
+}
+
+static void visit(Expr* e) {
 	assert(e);
 
+	// GREFs live in their symbol, outside of the pools
+	if(scm_is_gref(e)) e = e->atom.gref;
+
 	if(e->mark) return;
 
 	e->mark = true;
-	if(scm_is_pair(e) || scm_is_closure(e) || scm_is_env(e)) {
-		mark(scm_car(e));
-		mark(scm_cdr(e));
+	if(scm_is_pair(e) || scm_is_closure(e)) {
+		// the car goes on top, so that walking down a list takes no room
+		later(scm_cdr(e));
+		later(scm_car(e));
+	} else if(scm_is_env(e)) {
+		Frame* f = scm_env_frame(e);
+		later(scm_env_parent(e));
+		later(f->names);
+		later(f->extra);
+		for(unsigned i = 0; i < f->size; i++) {
+			if(f->slots[i]) later(f->slots[i]);
+		}
+	} else if(scm_is_symbol(e)) {
+		Expr* global = *scm_symbol_cell(e);
+		if(global) later(global);
+		if(scm_symbol_alias(e)) later(scm_symbol_alias(e));
+	} else if(scm_is_proto(e)) {
+		Proto* p = scm_proto(e);
+		later(p->args);
+		later(p->body);
+		later(p->outer);
+		later(p->name);
+		later(p->locals);
+		later(p->macros);
+		if(p->code) later(p->code);
+		for(unsigned i = 0; p->bc && i < p->bc->nconsts; i++) {
+			later(p->bc->consts[i]);
+		}
+	} else if(scm_is_dref(e)) {
+		later(e->atom.dref->sym);
+	} else if(scm_is_raised(e)) {
+		later(e->atom.raised);
+	} else if(scm_is_cont(e) && scm_cont(e)->vm) {
+		scm_mark_snapshot(scm_cont(e)->vm);
+	} else if(scm_is_macro(e)) {
+		later(e->atom.rules);
+	} else if(scm_is_task(e)) {
+		scm_mark_task(scm_task(e));
+	} else if(scm_is_channel(e)) {
+		scm_mark_channel(scm_channel(e));
+	} else if(scm_is_promise(e)) {
+		later(e->atom.promise);
+	} else if(scm_is_memo(e)) {
+		scm_mark_memo(scm_memo(e));
+	}
+}
+
+static void mark(Expr* e) {
+	const size_t base = markTop;
+
+	visit(e);
+	while(markTop > base) {
+		visit(markStack[--markTop]);
+	}
+}
+
+void scm_mark(Expr* e) {
+	mark(e);
+}
+
+#ifndef NDEBUG
+static bool in_pools(const Expr* e) {
+	for(size_t i = 0; i < npools; i++) {
+		if(e >= pools[i].cells && e < pools[i].cells + pools[i].size) return true;
 	}
+
+	return false;
+}
+#endif
+
+void scm_release(Expr* e) {
+	assert(in_pools(e));
+	assert(!e->protect);
+
+	cleanup(e);
+	freeList = dll_insert(e, freeList);
+	freeListSize++;
 }
 
 void scm_protect(Expr* e) {
@@ -162,6 +328,19 @@ void scm_stack_push(Expr** e) {
 	protStack[protStackSize++] = e;
 }
 
+size_t scm_stack_room() {
+	return STACK_SIZE - protStackSize;
+}
+
+size_t scm_stack_size() {
+	return protStackSize;
+}
+
+void scm_stack_unwind(size_t n) {
+	assert(n <= protStackSize);
+	protStackSize = n;
+}
+
 void scm_stack_pop(Expr** e) {
 	assert(e); (void)e;
 	assert(protStackSize > 0);
@@ -174,31 +353,47 @@ void scm_gc() {
 	freeList = NULL;
 	freeListSize = 0;
 
-	for(size_t i = 0; i < MEM_SIZE; i++) {
-		pool[i].mark = false;
+	for(size_t p = 0; p < npools; p++) {
+		for(size_t i = 0; i < pools[p].size; i++) {
+			pools[p].cells[i].mark = false;
+		}
 	}
+	scm_unmark_symbols();
 
-	for(size_t i = 0; i < MEM_SIZE; i++) {
-		if(pool[i].protect) {
-			mark(&pool[i]);
+	for(size_t p = 0; p < npools; p++) {
+		for(size_t i = 0; i < pools[p].size; i++) {
+			if(pools[p].cells[i].protect) mark(&pools[p].cells[i]);
 		}
 	}
 
 	for(size_t i = 0; i < protStackSize; i++) {
 		mark(*protStack[i]);
 	}
+	scm_mark_symbols();
+	scm_mark_frame_stack();
+	scm_mark_vm();
+	scm_mark_analyzer();
+	scm_mark_arg_stack();
+	scm_mark_escape();
+	scm_mark_tasks();
 
 	//TODO actual marking
 	if(BASE_ENV)    mark(BASE_ENV);
 	if(CURRENT_ENV) mark(CURRENT_ENV);
 
-	for(size_t i=0; i<MEM_SIZE; i++) {
-		if(!pool[i].mark && !pool[i].protect) {
-			cleanup(&pool[i]);
-			freeList = dll_insert(&pool[i], freeList);
-			freeListSize++;
+	for(size_t p = 0; p < npools; p++) {
+		for(size_t i = 0; i < pools[p].size; i++) {
+			Expr* e = &pools[p].cells[i];
+			if(!e->mark && !e->protect) {
+				cleanup(e);
+				freeList = dll_insert(e, freeList);
+				freeListSize++;
+			}
 		}
 	}
+	scm_sweep_symbols();
+
+	if(freeListSize < memSize / 4) add_pool(memSize);
 
 	gcRuns++;
 }
@@ -0,0 +1,84 @@
+/* This file keeps the limits on how far scm_eval() gets: fuel, a number of
+ * calls it may still make, a deadline, and a flag scm_interrupt() raises.
+ *
+ * All engines count their calls down in scm_ticks, and only look at the
+ * limits when it goes below 0, every POLL_EVERY calls at most. The calls made
+ * in between are charged to the fuel then, so that checking them costs a
+ * decrement and a branch per call, and the clock is read only once in a
+ * while. An interrupt is noticed at the next poll.
+ */
+
+#include "SchemeSecret.h"
+
+#include <signal.h>
+#include <time.h>
+
+#define POLL_EVERY 1024
+
+long long scm_ticks = 0;
+
+static long long fuel = -1;   // calls left, negative for no limit
+static long long chunk = 0;   // what scm_ticks counted down from
+static struct timespec deadline;
+static bool timed = false;
+static volatile sig_atomic_t interrupted = 0;
+
+void scm_set_fuel(long long calls) {
+	fuel = calls < 0 ? -1 : calls;
+	chunk = 0;
+	scm_ticks = 0;
+}
+
+long long scm_get_fuel() {
+	// the calls made since the last poll are charged only at the next one
+	return fuel < 0 ? fuel : fuel - (chunk - scm_ticks);
+}
+
+void scm_set_timeout(double seconds) {
+	timed = seconds > 0;
+	if(!timed) return;
+
+	timespec_get(&deadline, TIME_UTC);
+	long long ns = deadline.tv_nsec + (long long) ((seconds - (long long) seconds) * 1e9);
+	deadline.tv_sec += (time_t) seconds + ns / 1000000000;
+	deadline.tv_nsec = ns % 1000000000;
+}
+
+void scm_interrupt() {
+	interrupted = 1;
+}
+
+bool scm_is_preempted(const Expr* e) {
+	return e == OUT_OF_FUEL || e == TIMED_OUT || e == INTERRUPTED;
+}
+
+static bool past_deadline() {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+
+	return now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+Expr* scm_poll() {
+	if(fuel >= 0) fuel -= chunk;
+	chunk = 0;
+	scm_ticks = 0;
+
+	if(interrupted) {
+		interrupted = 0;
+		return INTERRUPTED;
+	}
+	if(timed && past_deadline()) return TIMED_OUT;
+	if(fuel == 0) return OUT_OF_FUEL;
+
+	// the call being made is the first of the next chunk
+	chunk = fuel >= 0 && fuel < POLL_EVERY ? fuel : POLL_EVERY;
+	scm_ticks = chunk - 1;
+	return NULL;
+}
+
+void scm_reset_limits() {
+	scm_set_fuel(-1);
+	timed = false;
+	interrupted = 0;
+}
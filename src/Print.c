@@ -168,9 +168,39 @@ static void print(Expr* e, buf* b) {
 		append(b, scm_sval(e));
 		append(b, ")#");
 		break;
+	case RAISED:
+		append(b, "#(ERROR: uncaught exception: ");
+		print(e->atom.raised, b);
+		append(b, ")#");
+		break;
 	case FFUNC:
+	case VFUNC:
 		append(b, "#(PRIMITIVE PROC)#");
 		break;
+	case CONT:
+		append(b, "#(CONTINUATION)#");
+		break;
+	case CONDITION:
+		append(b, "#(CONDITION: ");
+		append(b, scm_sval(e));
+		append(b, ")#");
+		break;
+	case MACRO:
+		append(b, "#(MACRO)#");
+		break;
+	case TASK:
+		append(b, "#(TASK)#");
+		break;
+	case CHANNEL:
+		append(b, "#(CHANNEL)#");
+		break;
+	case PROMISE:
+	case FORCED:
+		append(b, "#(PROMISE)#");
+		break;
+	case MEMO:
+		append(b, "#(MEMO)#");
+		break;
 	default:
 		append(b, "#UNKNOWN#");
 		break;
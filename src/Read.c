@@ -88,6 +88,11 @@ static inline char b_peek(const Buffer* b) {
 	else            return '\0';
 }
 
+// Whether a lone . is next, as in a dotted pair, rather than a symbol like ...
+static inline bool b_dot(const Buffer* b) {
+	return b_peek(b) == '.' && (b->i + 1 > b->n || is_bound(b->s[b->i + 1]));
+}
+
 static inline void b_unget(Buffer* b) {
 	assert(b->i > 0);
 	b->i--;
@@ -229,7 +234,7 @@ Expr* reade_list(Buffer* b) {
 
 	while(true) {
 		b_eat_white(b);
-		if(b_peek(b) == '.') {
+		if(b_dot(b)) {
 			b_get(b);
 			car->pair.cdr = reade(b);
 			b_eat_white(b);
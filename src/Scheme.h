@@ -12,11 +12,25 @@ extern "C" {
 typedef struct Expr Expr;
 
 typedef Expr *(*ffunc)(Expr*);
+typedef Expr *(*vfunc)(int argc, Expr** argv);
+
+// A primitive taking its arguments as a vector. It is only called with
+// minArgs to maxArgs (-1 for no limit) of them. A pure one depends on nothing
+// but its arguments and changes nothing, so calls to it on constants may be
+// made ahead of time.
+typedef struct VFunc {
+	vfunc fn;
+	const char* name;
+	int minArgs;
+	int maxArgs;
+	bool pure;
+} VFunc;
 
 struct Expr {
 	union {
 		struct {
-			enum { INT, REAL, CHAR, STRING, SYMBOL, BOOL, ERROR, FFUNC } type;
+			enum { INT, REAL, CHAR, STRING, SYMBOL, BOOL, ERROR, RAISED, FFUNC, VFUNC, CONT, CONDITION, MACRO, TASK, CHANNEL,
+			       PROMISE, FORCED, MEMO, LREF, GREF, DREF, PROTO /* only found in resolved code */ } type;
 			union {
 				long long ival;
 				double rval;
@@ -24,6 +38,18 @@ struct Expr {
 				char cval;
 				bool bval;
 				ffunc ffptr;
+				const VFunc* vfptr;
+				struct Cont* cont;
+				struct Expr* raised;
+				struct Expr* rules;
+				struct Task* task;
+				struct Channel* chan;
+				struct Expr* promise;
+				struct Memo* memo;
+				struct { unsigned depth, index; } lref;
+				struct Expr* gref;
+				struct DRef* dref;
+				struct Proto* proto;
 			};
 		} atom;
 
@@ -31,6 +57,11 @@ struct Expr {
 			struct Expr* car;
 			struct Expr* cdr;
 		} pair;
+
+		struct {
+			struct Expr* parent;
+			struct Frame* frame;
+		} env;
 	};
 	enum { ATOM, PAIR, CLOSURE, ELIST, ENV } tag : 3;
 	bool protect : 1;
@@ -119,8 +150,36 @@ unsigned scm_gc_free_objects();
 Expr* scm_read(const char* in);
 Expr* scm_read_inc(const char* in, char** rem);
 Expr* scm_eval(Expr* expr);
+
+// How scm_eval() evaluates code: by walking it, by compiling it to bytecode
+// for a virtual machine, the default, or by analyzing it once into a tree of
+// nodes that execute themselves. All give the same results, but only the VM
+// doesn't use up the C stack on deep recursion.
+typedef enum { SCM_ENGINE_TREE, SCM_ENGINE_VM, SCM_ENGINE_ANALYZE } scm_engine;
+void scm_set_engine(scm_engine e);
+scm_engine scm_get_engine();
+// Whether code the VM compiles to machine code is listed in
+// /tmp/perf-<pid>.map for perf. Off unless HLISP_PERF_MAP is set.
+void scm_set_jit_perf_map(bool on);
 char* scm_print(Expr* expr);
 
+// Limits on how far scm_eval() gets, checked whenever it calls a procedure.
+// Fuel is a number of calls, negative for no limit, and the timeout a number
+// of seconds from now, 0 for none. scm_interrupt() may be called from a
+// signal handler. Once one trips, scm_eval() returns an error for which
+// scm_is_preempted() holds, and which guard doesn't catch.
+void scm_set_fuel(long long calls);
+long long scm_get_fuel();
+void scm_set_timeout(double seconds);
+void scm_interrupt();
+bool scm_is_preempted(const Expr* e);
+
+// An evaluation the VM runs out of fuel in is suspended rather than
+// abandoned, unless it is nested in another. scm_resume() carries on with
+// the last one suspended, returning what scm_eval() would have, or an error
+// if there is none.
+Expr* scm_resume();
+
 
 #undef puref
 
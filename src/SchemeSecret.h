@@ -2,6 +2,8 @@
 
 #include "Scheme.h"
 
+#include <setjmp.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -26,26 +28,78 @@ extern Expr* ELSE;
 extern Expr* AND;
 extern Expr* OR;
 extern Expr* R_APPLY;
+extern Expr* R_CALLCC;
+extern Expr* R_CALLEC;
 extern Expr* R_EVAL;
+extern Expr* R_FOLD;
+extern Expr* R_TRY;
+extern Expr* GUARD;
+extern Expr* DEFSYNTAX;
+extern Expr* SYNRULES;
+extern Expr* ELLIPSIS;
+extern Expr* UNDERSCORE;
 
 //Memory
 void scm_init_mem();
+// Frees the pools added since scm_init_mem(), once nothing is left in them
+void scm_reset_mem();
 Expr* scm_alloc();
+void scm_mark(Expr* e);
+
+// Hands e straight back to the freelist. Nothing may refer to it anymore.
+void scm_release(Expr* e);
+// How many more scm_stack_push() there is room for
+size_t scm_stack_room();
+// How many roots are pushed, and pops those above n
+size_t scm_stack_size();
+void scm_stack_unwind(size_t n);
 
 //Environments
 extern Expr* BASE_ENV;
 extern Expr* CURRENT_ENV;
 
+typedef struct Frame {
+	Expr* names;      // names of the first slots, shaped like a lambda's arguments
+	Expr* extra;      // names of the slots added by define, most recent first
+	unsigned size, cap;
+	bool captured;    // handed out by cur-env, can't be released early
+	bool extended;    // a define added a name the resolver didn't foresee
+	Expr* slots[];    // NULL when unbound
+} Frame;
+
+#define scm_env_parent(e) ((e)->env.parent)
+#define scm_env_frame(e) ((e)->env.frame)
+
 void scm_init_env();
 void scm_reset_env();
 
-Expr* scm_mk_env(Expr* parent, Expr* names, Expr* vals);
+// Creates an environment with size unbound slots, named by names
+Expr* scm_mk_env(Expr* parent, Expr* names, unsigned size);
+void scm_free_frame(Frame* f);
 
-void scm_env_push(Expr* names, Expr* vals);
 void scm_env_pop();
 
+// Marks env and its ancestors as reachable from scheme code
+void scm_env_capture(Expr* env);
+
+// The frames of calls that can't capture them. They are released as soon as
+// they are popped, unless something captured them in the meantime.
+bool scm_frame_stack_push(Expr* env);
+size_t scm_frame_stack_size();
+// Pops the frames above base, stopping early at keep if it is one of them
+void scm_frame_stack_unwind(size_t base, Expr* keep);
+// Exchanges the frame stack for the one given
+void scm_frame_stack_switch(Expr*** frames, size_t* top, size_t* cap);
+void scm_mark_frame_stack();
+
+// The names bound in env and their values, in the same order
+Expr* scm_env_names(Expr* env);
+Expr* scm_env_values(Expr* env);
+
 // Returns an scm error on failure
 Expr* scm_env_lookup(Expr* env, Expr* sym);
+// Same as the above, but NULL when sym is unbound
+Expr* scm_env_find(Expr* env, Expr* sym);
 
 // Returns val on success, an scm error on failure
 Expr* scm_env_define(Expr* env, Expr* sym, Expr* val);
@@ -54,6 +108,44 @@ Expr* scm_env_define_unsafe(Expr* env, Expr* sym, Expr* val);
 // Returns val on success, an scm_error on failure
 Expr* scm_env_set(Expr* env, Expr* sym, Expr* val);
 
+// The slot sym names in a frame laid out by names, extra and size, or -1
+int scm_slot_index(Expr* sym, Expr* names, Expr* extra, unsigned size);
+
+// How many of the frames alive a define added a name the resolver didn't
+// foresee to. While there are any, resolved references check the frames they
+// go past, and are looked up by name if one of them is extended.
+extern unsigned scm_extended_frames;
+
+// Bumped whenever a define creates a binding
+extern unsigned long long scm_env_version;
+
+// Bumped whenever a primitive is rebound, or a frame extended, which voids
+// the calls the resolver folded ahead of time
+extern unsigned scm_fold_version;
+
+// References made by the resolver: LREF atoms address a slot some frames up
+// from the current one, GREF atoms are embedded in the symbol they refer to
+// and DREF atoms cache where a name that couldn't be resolved was found
+#define scm_is_lref(e) ((e)->tag == ATOM && (e)->atom.type == LREF)
+#define scm_is_gref(e) ((e)->tag == ATOM && (e)->atom.type == GREF)
+#define scm_is_dref(e) ((e)->tag == ATOM && (e)->atom.type == DREF)
+
+typedef struct DRef {
+	Expr* sym;
+	Expr** cell;                 // valid while version is current
+	unsigned long long version;
+	unsigned depth;              // frames up to where the outermost lambda was made
+} DRef;
+
+Expr* scm_mk_lref(unsigned depth, unsigned index);
+#define scm_mk_gref(sym) (&((Symbol*)(sym))->ref)
+Expr* scm_mk_dref(Expr* sym, unsigned depth);
+void scm_free_dref(DRef* r);
+
+// Same as the above, but through a reference
+Expr* scm_env_get_ref(Expr* env, Expr* ref);
+Expr* scm_env_set_ref(Expr* env, Expr* ref, Expr* val);
+
 //Error Messages
 extern Expr* OOM;
 
@@ -61,22 +153,401 @@ void scm_init_expr();
 void scm_reset_expr();
 
 //Symbols
+typedef struct Symbol {
+	Expr e;
+	Expr* value;   // bound in BASE_ENV, NULL when unbound
+	Expr ref;      // GREF to this symbol
+	unsigned form; // the FORM_ id of the syntax it names, FORM_NONE if none
+	Expr* alias;   // (name . scope) for a name a macro renamed, NULL if none
+} Symbol;
+
+#define SYNTAX(id, name) SYM_##id,
+#define PRIMITIVE(id, name) SYM_##id,
+
+enum {
+#include "Builtins.def"
+	SYM_COUNT
+};
+
+#undef PRIMITIVE
+#undef SYNTAX
+
+// The evaluator dispatches on these instead of comparing symbols one by one
+#define SYNTAX(id, name) FORM_##id,
+#define PRIMITIVE(id, name)
+
+enum {
+	FORM_NONE,
+#include "Builtins.def"
+	FORM_COUNT
+};
+
+#undef PRIMITIVE
+#undef SYNTAX
+
+#define scm_symbol_form(sym) (((Symbol*)(sym))->form)
+#define scm_symbol_alias(sym) (((Symbol*)(sym))->alias)
+
+extern Symbol scm_builtin_symbols[SYM_COUNT];
+
+// The value bound to sym in BASE_ENV, NULL when unbound
+#define scm_symbol_cell(sym) (&((Symbol*)(sym))->value)
+
 Expr* scm_get_symbol(const char* s);
+void scm_reset_builtins();
 void scm_reset_symbol_set();
 Expr* scm_all_symbols();
 
+// The list of names of all primitives, which are bound from the start
+Expr* scm_builtin_globals();
+
+// Called by the gc around its mark phase to reclaim unreachable symbols
+void scm_unmark_symbols();
+void scm_mark_symbols();
+void scm_sweep_symbols();
+
 //Functions
-void scm_init_func();
+#define SYNTAX(id, name)
+#define PRIMITIVE(id, name) extern const Expr FF_##id;
+#include "Builtins.def"
+#undef PRIMITIVE
+#undef SYNTAX
+
+// Primitives are ffuncs taking their arguments either as a list (FFUNC) or as
+// a vector (VFUNC, all of the builtin ones)
+#define scm_is_vfunc(e) ((e)->tag == ATOM && (e)->atom.type == VFUNC)
+
+// Calls the ffunc f on the argc values in argv, checking them against its
+// arity. A list of them is made for an FFUNC.
+Expr* scm_call_ffunc(Expr* f, int argc, Expr** argv);
+// Calls the ffunc f on the list of values args
+Expr* scm_apply_ffunc(Expr* f, Expr* args);
+
+// What eqv? and equal? compare by. scm_equal() returns TRUE or FALSE, or OOM
+// when out of room to keep track of the pairs left to compare.
+bool  scm_eqv(Expr* a, Expr* b);
+Expr* scm_equal(Expr* a, Expr* b);
+
+// The stack the tree walker evaluates the arguments of a primitive onto,
+// a gc root. Pushing returns false once it is full.
+bool   scm_arg_stack_push(Expr* v);
+size_t scm_arg_stack_size();
+Expr** scm_arg_stack_at(size_t base);
+void   scm_arg_stack_unwind(size_t base);
+void   scm_mark_arg_stack();
 
 //Standard library
 void scm_init_stdlib();
 
+//Bytecode
+#define OPCODE(name, operands) OP_##name,
+enum {
+#include "Opcodes.def"
+	OP_COUNT
+};
+#undef OPCODE
+
+// What Compile.c makes out of the code of a PROTO and VM.c runs
+typedef struct Bytecode {
+	int* ops;         // opcodes, each followed by its operands
+	Expr** consts;    // the Exprs the operands refer to
+	unsigned nops, nconsts;
+	unsigned maxStack; // the most values it keeps on the stack at once
+} Bytecode;
+
+void scm_free_bytecode(Bytecode* bc);
+
+//Native code
+// Closures called this many times on the VM are compiled to machine code
+#define SCM_JIT_THRESHOLD 100
+
+// What Jit.c makes out of the bytecode of a PROTO, opaque outside of it
+typedef struct Native Native;
+
+// Compiles the bytecode of proto, leaving it to the VM when it can't
+void scm_jit_compile(Expr* proto);
+// Runs n from the instruction at offset at up to the first one it hands back
+// to the VM, and returns that one's offset. On failure, returns -1 and sets
+// err to an scm error.
+int scm_jit_run(Native* n, Expr** stack, size_t* sp, int at, Expr** err);
+void scm_free_native(Native* n);
+
+//Analyzed code
+// What Analyze.c makes out of the code of a PROTO, opaque outside of it
+typedef struct Node Node;
+
+void scm_free_node(Node* n);
+
 //Closures
-Expr* scm_mk_closure(Expr* penv, Expr* args, Expr* body);
+// What all closures made by evaluating the same lambda share. The body is
+// resolved on the first call, after which code and locals are set.
+typedef struct Proto {
+	Expr* args;       // as written in the lambda
+	Expr* body;       // as written in the lambda
+	Expr* outer;      // PROTO of the lambda this one is nested in, or FALSE
+	Expr* name;       // symbol the lambda is defined as, or FALSE
+	Expr* locals;     // names defined in the body, laid out as a Frame's extra
+	Expr* macros;     // (name . macro) for each define-syntax in the body
+	Expr* code;       // NULL until resolved
+	unsigned nreq;    // arguments before the dotted tail
+	unsigned size;    // slots in a frame for this lambda
+	bool rest;        // takes a dotted tail
+	bool badArgs;     // the dotted tail isn't a symbol
+	bool global;      // free names refer to BASE_ENV
+	bool noCapture;   // code makes no closure that outlives a call
+	Bytecode* bc;     // NULL until compiled for the VM
+	Native* native;   // NULL until compiled to machine code
+	unsigned calls;   // made on the VM, counted up to SCM_JIT_THRESHOLD
+	Node* node;       // NULL until analyzed
+} Proto;
+
+#define scm_is_proto(e) ((e)->tag == ATOM && (e)->atom.type == PROTO)
+#define scm_proto(e) ((e)->atom.proto)
+
+Expr* scm_mk_proto(Expr* args, Expr* body, Expr* outer, bool global);
+void scm_free_proto(Proto* p);
+
+Expr* scm_mk_closure(Expr* penv, Expr* proto);
+Expr* scm_closure_proto(Expr* c);
 Expr* scm_closure_env(Expr* c);
 Expr* scm_closure_args(Expr* c);
 Expr* scm_closure_body(Expr* c);
 
+//Evaluation
+// Resolves the body of a closure's PROTO, see Eval.c
+Expr* scm_resolve_body(Expr* proto);
+// Resolves e as code evaluated in CURRENT_ENV outside of any lambda, into the
+// code of a PROTO that takes no arguments
+Expr* scm_resolve_toplevel(Expr* e);
+// Evaluates e with the tree walking evaluator whatever the engine
+Expr* scm_eval_tree(Expr* e);
+// true once the C stack of the calling thread or the gc roots are close to
+// running out, for the evaluators that recurse in C to stop before they do
+bool scm_too_deep();
+
+// Compiles the resolved code of proto, returns an scm error on failure
+Expr* scm_compile(Expr* proto);
+
+// Evaluates e in CURRENT_ENV with the VM
+Expr* scm_vm_eval(Expr* e);
+// Calls the procedure f on the argc values in argv from C, with the VM
+// whatever the engine
+Expr* scm_apply(Expr* f, int argc, Expr** argv);
+void scm_mark_vm();
+
+// Evaluates e in CURRENT_ENV with the analyzing evaluator
+Expr* scm_analyze_eval(Expr* e);
+void scm_mark_analyzer();
+
+//Continuations
+// What __callcc and __callec hand to the procedure they call. Those made by
+// the tree walker and the analyzer only escape back up to where they were
+// made, while it is still running. Those made by the VM keep what it needs to
+// carry on from there at any later time, see VM.c.
+typedef struct Snapshot Snapshot;
+
+typedef struct Cont {
+	bool live;       // the call that made it hasn't returned yet
+	Snapshot* vm;    // NULL unless made by the VM
+} Cont;
+
+#define scm_is_cont(e) ((e)->tag == ATOM && (e)->atom.type == CONT)
+#define scm_cont(e) ((e)->atom.cont)
+
+Expr* scm_mk_cont(Snapshot* vm);
+void scm_free_cont(Cont* c);
+void scm_free_snapshot(Snapshot* s);
+void scm_mark_snapshot(Snapshot* s);
+
+// The error a continuation unwinds with. Every evaluator hands it back up
+// like any other, until it reaches the one that can carry on from there.
+extern Expr* ESCAPE;
+
+// Calls the continuation k on the argc values in argv, returns ESCAPE
+Expr* scm_throw(Expr* k, int argc, Expr** argv);
+// The continuation ESCAPE is headed for
+Expr* scm_escape_target();
+// Takes the value ESCAPE carries if it is headed for k, NULL otherwise
+Expr* scm_catch(Expr* k);
+void scm_mark_escape();
+
+//Exceptions
+// What errors are caught as by guard and with-exception-handler, unless
+// they were raised with some other object
+#define scm_is_condition(e) ((e)->tag == ATOM && (e)->atom.type == CONDITION)
+Expr* scm_mk_condition(const char* msg);
+
+// The errors raise makes, which keep the object raised rather than a
+// message, so that it is only printed if the error goes uncaught
+#define scm_is_raised(e) ((e)->tag == ATOM && (e)->atom.type == RAISED)
+Expr* scm_mk_raised(Expr* obj);
+
+// The handlers installed by with-exception-handler, innermost first
+extern Expr* scm_handlers;
+
+// Remembers the handlers installed when err was made, called on every error
+void scm_note_error(Expr* err);
+// Raises obj, returning the error that does if nothing catches it first
+Expr* scm_raise(Expr* obj);
+// What a __try that installed handlers catches err as: NULL when err wasn't
+// raised within it or is ESCAPE or a preemption, an error when out of memory
+Expr* scm_condition(Expr* err, Expr* handlers);
+
+// Where an error unwinds to without returning through the calls in between:
+// a __try of the tree walker or the analyzer that handles what its thunk
+// raises, or a run of the VM, which unwinds its own calls
+typedef struct Catch {
+	jmp_buf to;
+	struct Catch* outer;
+	Expr* handlers;   // installed by the __try, NULL for a run of the VM
+	Expr* env;        // what it puts back along with the stacks
+	size_t roots, args, frames;
+	Expr* caught;     // the error it was unwound to with
+} Catch;
+
+// Makes c the innermost place to unwind to, saving the state to put back
+void scm_enter_catch(Catch* c, Expr* handlers);
+void scm_leave_catch(Catch* c);
+// Unwinds to the innermost __try that catches err with a longjmp to its
+// catch, unless a run of the VM comes first. Returns err if it doesn't.
+Expr* scm_signal(Expr* err);
+
+void scm_init_eval();
+void scm_reset_eval();
+
+//Preemption
+// The errors scm_eval() gives up with when a limit trips
+extern Expr* OUT_OF_FUEL;
+extern Expr* TIMED_OUT;
+extern Expr* INTERRUPTED;
+
+// Counts calls down to the next check of the limits, which every engine
+// makes with scm_tick() before each call to a closure, giving up with the
+// error it returns if any
+extern long long scm_ticks;
+Expr* scm_poll();
+#define scm_tick() (--scm_ticks < 0 ? scm_poll() : NULL)
+
+void scm_reset_limits();
+void scm_reset_vm();
+
+//Tasks
+// Green threads, see Task.c. Each task runs its thunk on the VM, on stacks of
+// its own: a Fiber.
+#define scm_is_task(e) ((e)->tag == ATOM && (e)->atom.type == TASK)
+#define scm_task(e) ((e)->atom.task)
+#define scm_is_channel(e) ((e)->tag == ATOM && (e)->atom.type == CHANNEL)
+#define scm_channel(e) ((e)->atom.chan)
+
+typedef struct Task Task;
+typedef struct Channel Channel;
+typedef struct Fiber Fiber;
+
+// Makes the stacks for a task calling thunk, NULL when out of memory
+Fiber* scm_mk_fiber(Expr* thunk);
+void scm_free_fiber(Fiber* f);
+void scm_mark_fiber(Fiber* f);
+// Carries on with f until it is over, switches out or is preempted, handing
+// v to the primitive it switched out in. Returns what its thunk returned or
+// failed with once over is set, SWITCH or the preemption error otherwise.
+Expr* scm_fiber_run(Fiber* f, Expr* v, bool* over);
+
+// What a primitive returns to switch out of the task calling it, which it can
+// only do when scm_can_switch() holds: the VM of that task is calling it
+// directly, not from machine code or a nested evaluation
+extern Expr* SWITCH;
+bool scm_can_switch();
+// Whether the primitive f may switch tasks or call procedures, which machine
+// code leaves to the VM
+bool scm_needs_vm(const Expr* f);
+
+Expr* scm_spawn(Expr* thunk);
+Expr* scm_yield();
+Expr* scm_sleep(double seconds);
+// Returns what the thunk of task returned, once it is over
+Expr* scm_task_wait(Expr* task);
+
+// Makes a channel holding up to cap values no one has received yet
+Expr* scm_mk_channel(long long cap);
+Expr* scm_channel_send(Expr* ch, Expr* v);
+Expr* scm_channel_receive(Expr* ch);
+// Sends or receives on whichever of the n ops is ready first, see Task.c
+Expr* scm_select(int n, Expr** ops);
+
+void scm_free_task(Task* t);
+void scm_free_channel(Channel* c);
+void scm_mark_task(Task* t);
+void scm_mark_channel(Channel* c);
+void scm_mark_tasks();
+void scm_reset_tasks();
+
+//Promises
+// Made by delay, delay-force and make-promise, and the streams made of them,
+// see Lazy.c. A PROMISE holds what computes its value, a FORCED one its value.
+#define scm_is_promise(e) ((e)->tag == ATOM && ((e)->atom.type == PROMISE || (e)->atom.type == FORCED))
+
+// Makes a promise calling thunk when forced, which returns another promise
+// to force in its place, as delay-force does
+Expr* scm_mk_lazy(Expr* thunk);
+// Makes a promise already forced to v
+Expr* scm_mk_forced(Expr* v);
+// The value of p, forced first if it isn't yet. Anything else than a promise
+// is its own value.
+Expr* scm_force(Expr* p);
+
+// The streams of what f returns for the values of streams, a list of them,
+// until any is over, of the values of s pred holds for, and of the first n
+// values of s
+Expr* scm_stream_map(Expr* f, Expr* streams);
+Expr* scm_stream_filter(Expr* pred, Expr* s);
+Expr* scm_stream_take(long long n, Expr* s);
+// Calls f on what it last returned, init at first, and each value of the
+// stream in s, which is moved along it so that the values gone over can be
+// collected
+Expr* scm_stream_fold(Expr* f, Expr* init, Expr** s);
+// The list of the first n values of s, all of them if n is negative
+Expr* scm_stream_to_list(Expr* s, long long n);
+
+//Memo tables
+// What memoize keeps the values a procedure returned in, keyed by the lists
+// of arguments it was called with, see Memo.c
+#define scm_is_memo(e) ((e)->tag == ATOM && (e)->atom.type == MEMO)
+#define scm_memo(e) ((e)->atom.memo)
+
+typedef struct Memo Memo;
+
+// Makes a table comparing arguments with equal? if byEqual, eqv? otherwise,
+// holding up to bound entries if it isn't 0
+Expr* scm_mk_memo(long long bound, bool byEqual);
+// The value kept for args, NULL if none
+Expr* scm_memo_ref(Expr* memo, Expr* args);
+// Keeps v for args, dropping the entry used least recently if memo is full.
+// Returns v.
+Expr* scm_memo_set(Expr* memo, Expr* args, Expr* v);
+// Drops the value kept for args, returns whether there was one
+Expr* scm_memo_forget(Expr* memo, Expr* args);
+void scm_memo_clear(Expr* memo);
+size_t scm_memo_size(Expr* memo);
+
+void scm_free_memo(Memo* m);
+void scm_mark_memo(Memo* m);
+
+//Macros
+// What (syntax-rules ...) evaluates to, holding (scope ellipsis literals
+// rule...), scope being the PROTO of the lambda it was made in, or FALSE
+#define scm_is_macro(e) ((e)->tag == ATOM && (e)->atom.type == MACRO)
+
+// Makes the macro spec, a (syntax-rules ...) form made in scope, stands for
+Expr* scm_mk_macro(Expr* spec, Expr* scope);
+// Returns what form, a use of macro, expands to. The names its templates
+// refer to without binding them are renamed when resolved is set, which the
+// resolver then looks up where the macro was made.
+Expr* scm_expand(Expr* macro, Expr* form, bool resolved);
+// The macro sym names in scope, NULL if it doesn't name one
+Expr* scm_macro_ref(Expr* sym, Expr* scope);
+// The name sym stands for, sym itself unless a macro renamed it
+Expr* scm_unrenamed(Expr* sym);
+
 #ifdef __cplusplus
 }
 #endif
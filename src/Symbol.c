@@ -3,7 +3,23 @@
  * represented by the same unique symbol Expr.
  *
  * Uniqueness is guaranteed by allocating all symbols in a set backed by an
- * AVL tree.
+ * AVL tree. Each tree node embeds its symbol Expr and name, so interning a
+ * symbol takes a single allocation outside of the scheme pool.
+ *
+ * The set holds its symbols weakly: the garbage collector clears the mark
+ * bits of all mortal symbols along with the pool, and once marking is done
+ * scm_sweep_symbols() frees the ones that are no longer reachable and
+ * rebuilds the tree out of the survivors. Symbols with their protected bit
+ * set (the ones held by C globals such as DEFINE) are never collected.
+ *
+ * Every symbol also carries the cell holding its value in the base
+ * environment, so that global variables can be read and written without
+ * searching for them, and the GREF the resolver uses to refer to that cell.
+ *
+ * The symbols listed in Builtins.def are allocated statically, already bound
+ * to their primitives or tagged with the special form they name, and are
+ * looked up with a binary search before the tree is consulted. They are
+ * immortal, and their global values are gc roots.
  */
 
 #include "SchemeSecret.h"
@@ -12,22 +28,67 @@
 #include <string.h>
 #include <stdlib.h>
 
-typedef struct __attribute__((packed)) AVL {
-	Expr* v;
+typedef struct AVL {
+	Symbol s;
 	struct AVL* l;
 	struct AVL* r;
 	short h;
+	char name[];
 } AVL;
 
-static AVL* symbols = NULL;
+#define builtin(id, n, v, f) { \
+	.e = { .tag = ATOM, .atom = { .type = SYMBOL, .sval = n }, .protect = true, .mark = true }, \
+	.value = v, \
+	.ref = { .tag = ATOM, .atom = { .type = GREF, .gref = &scm_builtin_symbols[SYM_##id].e } }, \
+	.form = f }
+#define SYNTAX(id, n) builtin(id, n, NULL, FORM_##id),
+#define PRIMITIVE(id, n) builtin(id, n, (Expr*) &FF_##id, FORM_NONE),
 
-static char* strdup(const char* s) {
-	size_t len = strlen(s);
-	char* toRet = malloc(len + 1);
-	strcpy(toRet, s);
+Symbol scm_builtin_symbols[SYM_COUNT] = {
+#include "Builtins.def"
+};
 
-	return toRet;
-}
+#undef PRIMITIVE
+#undef SYNTAX
+#undef builtin
+
+// The global values the builtin symbols are restored to by a reset
+#define SYNTAX(id, n) NULL,
+#define PRIMITIVE(id, n) (Expr*) &FF_##id,
+
+static Expr* const builtinValues[SYM_COUNT] = {
+#include "Builtins.def"
+};
+
+#undef PRIMITIVE
+#undef SYNTAX
+
+// The names bound to primitives, chained into a list. The cdr of the last
+// one can only be set to EMPTY_LIST at runtime, and the extra cell past it is
+// never part of the list.
+#define SYNTAX(id, n)
+#define PRIMITIVE(id, n) PRIM_##id,
+
+enum {
+#include "Builtins.def"
+	PRIM_COUNT
+};
+
+#undef PRIMITIVE
+#define PRIMITIVE(id, n) [PRIM_##id] = { .tag = PAIR, .pair = { &scm_builtin_symbols[SYM_##id].e, &builtinNames[PRIM_##id + 1] }, .protect = true, .mark = true },
+
+static Expr builtinNames[PRIM_COUNT + 1] = {
+#include "Builtins.def"
+};
+
+#undef PRIMITIVE
+#undef SYNTAX
+
+static AVL* symbols = NULL;
+static size_t nSymbols = 0;
+
+// set while the tree is being walked by code that can trigger a gc
+static bool pinned = false;
 
 static inline short h(AVL* avl) {
 	if(!avl) return 0;
@@ -91,11 +152,11 @@ static Expr* avl_find(AVL* avl, const char* key) {
 start:
 	if(!avl) return FALSE;
 
-	const char* val = scm_sval(avl->v);
+	const char* val = avl->name;
 	int cmp = strcmp(key, val);
 
 	if(cmp == 0) {
-		return avl->v;
+		return &avl->s.e;
 	} else if(cmp < 0) {
 		avl = avl->l;
 		goto start;
@@ -107,36 +168,44 @@ start:
 
 static AVL* avl_insert(AVL* avl, const char* key, Expr** res) {
 	if(!avl) {
-		//bypass the scheme GC since interned symbols are forever anyway
-		AVL* new = (AVL*) malloc(sizeof(AVL));
+		//symbols live outside of the pool, the gc reclaims them through
+		//scm_sweep_symbols()
+		size_t len = strlen(key);
+		AVL* new = (AVL*) malloc(sizeof(AVL) + len + 1);
 		if(!new) {
 			*res = NULL;
 			return NULL;
 		}
 		new->l = new->r = NULL;
 		new->h = 1;
-		new->v = (Expr*) malloc(sizeof(Expr));
-		if(!new->v) {
-			free(new);
-			*res = NULL;
-			return NULL;
-		}
-		new->v->mark = new->v->protect = true;
-		new->v->tag = ATOM;
-		new->v->atom.type = SYMBOL;
-		new->v->atom.sval = strdup(key);
-		*res = new->v;
+		new->s.value = NULL;
+		new->s.form = FORM_NONE;
+		new->s.alias = NULL;
+		memcpy(new->name, key, len + 1);
+		new->s.e.mark = false;
+		new->s.e.protect = false;
+		new->s.e.tag = ATOM;
+		new->s.e.atom.type = SYMBOL;
+		new->s.e.atom.sval = new->name;
+		new->s.ref.mark = false;
+		new->s.ref.protect = false;
+		new->s.ref.tag = ATOM;
+		new->s.ref.atom.type = GREF;
+		new->s.ref.atom.gref = &new->s.e;
+		*res = &new->s.e;
+		nSymbols++;
 
 		return new;
 	}
 
-	const char* val = scm_sval(avl->v);
+	const char* val = avl->name;
 	int cmp = strcmp(key, val);
 
 	if(cmp == 0) {
-		*res = avl->v;
+		*res = &avl->s.e;
 	} else if(cmp < 0) {
 		avl->l = avl_insert(avl->l, key, res);
+		if(!avl->l) return avl;
 
 		if(avl->l->h > h(avl->r) + 1) {
 			if(h(avl->l->r) > h(avl->l->l)) {
@@ -147,6 +216,7 @@ static AVL* avl_insert(AVL* avl, const char* key, Expr** res) {
 		}
 	} else if(cmp > 0) {
 		avl->r = avl_insert(avl->r, key, res);
+		if(!avl->r) return avl;
 
 		if(avl->r->h > h(avl->l) + 1) {
 			if(h(avl->r->l) > h(avl->r->r)) {
@@ -166,17 +236,43 @@ static AVL* avl_insert(AVL* avl, const char* key, Expr** res) {
 
 static void avl_free(AVL* avl) {
 	if(avl) {
-		free(scm_sval(avl->v));
-		free(avl->v);
-
 		avl_free(avl->l);
 		avl_free(avl->r);
 		free(avl);
 	}
 }
 
+static Expr* find_builtin(const char* s) {
+	size_t lo = 0;
+	size_t hi = SYM_COUNT;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(s, scm_builtin_symbols[mid].e.atom.sval);
+
+		if(cmp == 0)     return &scm_builtin_symbols[mid].e;
+		else if(cmp < 0) hi = mid;
+		else             lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+Expr* scm_builtin_globals() {
+#ifndef NDEBUG
+	for(size_t i = 1; i < SYM_COUNT; i++) {
+		assert(strcmp(scm_builtin_symbols[i-1].e.atom.sval, scm_builtin_symbols[i].e.atom.sval) < 0);
+	}
+#endif
+	builtinNames[PRIM_COUNT - 1].pair.cdr = EMPTY_LIST;
+
+	return &builtinNames[0];
+}
+
 Expr* scm_get_symbol(const char* s) {
-	Expr* res = NULL;
+	Expr* res = find_builtin(s);
+	if(res) return res;
+
 	symbols = avl_insert(symbols, s, &res);
 
 	return res;
@@ -186,7 +282,7 @@ static void traverse(Expr** dst, AVL* head) {
 	if(head == NULL) return;
 	
 	traverse(dst, head->r);
-	*dst = scm_mk_pair(head->v, *dst);
+	if(*dst) *dst = scm_mk_pair(&head->s.e, *dst);
 	traverse(dst, head->l);
 }
 
@@ -194,13 +290,98 @@ Expr* scm_all_symbols() {
 	Expr* toRet = EMPTY_LIST;
 	scm_stack_push(&toRet);
 
+	//consing can trigger a gc, which must not reshape the tree under us
+	pinned = true;
 	traverse(&toRet, symbols);
+	pinned = false;
+
+	for(size_t i = 0; toRet && i < SYM_COUNT; i++) {
+		toRet = scm_mk_pair(&scm_builtin_symbols[i].e, toRet);
+	}
 
 	scm_stack_pop(&toRet);
-	return toRet;
+	return toRet ? toRet : OOM;
+}
+
+static void unmark(AVL* avl) {
+	while(avl) {
+		if(!avl->s.e.protect) avl->s.e.mark = false;
+		unmark(avl->l);
+		avl = avl->r;
+	}
+}
+
+void scm_unmark_symbols() {
+	unmark(symbols);
+}
+
+void scm_mark_symbols() {
+	for(size_t i = 0; i < SYM_COUNT; i++) {
+		if(scm_builtin_symbols[i].value) scm_mark(scm_builtin_symbols[i].value);
+	}
+}
+
+static size_t count_dead(AVL* avl) {
+	size_t dead = 0;
+	while(avl) {
+		dead += !avl->s.e.mark;
+		dead += count_dead(avl->l);
+		avl = avl->r;
+	}
+	return dead;
+}
+
+// frees dead nodes and stores the live ones in order into dst
+static void collect(AVL* avl, AVL** dst, size_t* n) {
+	if(!avl) return;
+
+	AVL* r = avl->r;
+	collect(avl->l, dst, n);
+	if(avl->s.e.mark) {
+		dst[(*n)++] = avl;
+	} else {
+		free(avl);
+	}
+	collect(r, dst, n);
+}
+
+static AVL* build(AVL** nodes, size_t n) {
+	if(n == 0) return NULL;
+
+	size_t mid = n / 2;
+	AVL* root = nodes[mid];
+	root->l = build(nodes, mid);
+	root->r = build(nodes + mid + 1, n - mid - 1);
+	updateH(root);
+
+	return root;
+}
+
+void scm_sweep_symbols() {
+	if(pinned || count_dead(symbols) == 0) return;
+
+	AVL** live = malloc(nSymbols * sizeof(AVL*));
+	//not being able to collect symbols just leaks them until the next gc
+	if(!live) return;
+
+	size_t n = 0;
+	collect(symbols, live, &n);
+	nSymbols = n;
+	symbols = build(live, n);
+
+	free(live);
+}
+
+// Done before the last gc of a session, so that builtins the program
+// redefined don't keep its values alive past it
+void scm_reset_builtins() {
+	for(size_t i = 0; i < SYM_COUNT; i++) {
+		scm_builtin_symbols[i].value = builtinValues[i];
+	}
 }
 
 void scm_reset_symbol_set() {
 	avl_free(symbols);
 	symbols = NULL;
+	nSymbols = 0;
 }
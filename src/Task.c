@@ -0,0 +1,639 @@
+/* This file schedules green threads: tasks, which each call a thunk and only
+ * switch to one another when they yield, sleep or wait, along with the
+ * channels they pass values over.
+ *
+ * A task runs on the VM whatever engine is selected, on stacks of its own
+ * (see VM.c), so that switching to another one only exchanges them. It can
+ * switch out where its VM calls a primitive that waits directly, which then
+ * returns SWITCH. Anything else that has to wait, above all the evaluation
+ * tasks are spawned from, runs the tasks that are ready in C until it can
+ * carry on. Tasks only ever run then: the scheduler is whatever loop waits.
+ *
+ * A channel holds up to a fixed number of values no one has received yet,
+ * none by default, in which case a send waits for a receive and the other way
+ * around. Values are handed over in the order they were sent, and waiting
+ * tasks served in the order they came. select waits on several sends and
+ * receives at once, and does whichever can be done first.
+ *
+ * A task waiting on channels nothing else can reach is garbage, and so is
+ * collected along with them.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "SchemeSecret.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+// The longest the scheduler sleeps before checking the limits of
+// evaluation again
+#define MAX_NAP_NS 10000000
+
+// A task waiting on a channel or on another task to be over, in a queue of
+// them
+typedef struct Waiter {
+	Task* task;
+	Expr* on;           // the channel or task the queue belongs to
+	Expr* value;        // what it sends, NULL for a receive
+	int index;          // of its op in a select
+	struct Waiter* prev;
+	struct Waiter* next;
+	struct Queue* queue;
+} Waiter;
+
+typedef struct Queue {
+	Waiter* head;
+	Waiter* tail;
+} Queue;
+
+struct Task {
+	Expr* self;         // NULL for the evaluation outside of any task
+	Fiber* fiber;       // NULL once over
+	Expr* result;
+	enum { READY, RUNNING, WAITING, SLEEPING, OVER } state;
+	bool inC;           // waits in C, so isn't queued once ready
+
+	Expr* value;        // what it carries on with
+	bool selecting;     // carries on with (index . value) instead
+	int chosen;
+
+	Waiter* waits;      // the ops it waits on
+	int nwaits;
+	Waiter one;         // the only one outside of a select
+
+	Queue joiners;      // tasks waiting for it to be over
+
+	struct timespec wake;
+	size_t slot;        // in the heap of sleeping tasks
+	Task* next;         // in the queue of ready tasks
+};
+
+struct Channel {
+	Expr** buf;
+	size_t cap, head, count;
+	Queue senders;
+	Queue receivers;
+};
+
+static Task outside = { .state = RUNNING };
+static Task* current = &outside;
+
+static Task* readyHead = NULL;
+static Task* readyTail = NULL;
+static size_t nready = 0;
+
+// The sleeping tasks, in a heap by when they wake up
+static Task** sleepers = NULL;
+static size_t nsleepers = 0;
+static size_t sleepersCap = 0;
+
+// Where select starts looking for an op that can be done, so that none wins
+// every time
+static unsigned rotation = 0;
+
+static void enqueue(Task* t) {
+	t->next = NULL;
+	if(readyTail) readyTail->next = t;
+	else          readyHead = t;
+	readyTail = t;
+	nready++;
+}
+
+static void enqueue_first(Task* t) {
+	t->next = readyHead;
+	readyHead = t;
+	if(!readyTail) readyTail = t;
+	nready++;
+}
+
+static Task* dequeue() {
+	Task* t = readyHead;
+	if(!t) return NULL;
+
+	readyHead = t->next;
+	if(!readyHead) readyTail = NULL;
+	nready--;
+
+	return t;
+}
+
+// Queues of waiters
+
+static void wait_on(Task* t, Waiter* w, Queue* q, Expr* on, Expr* value, int index) {
+	*w = (Waiter) { t, on, value, index, q->tail, NULL, q };
+	if(q->tail) q->tail->next = w;
+	else        q->head = w;
+	q->tail = w;
+}
+
+static void unlink_waiter(Waiter* w) {
+	Queue* q = w->queue;
+	if(w->prev) w->prev->next = w->next;
+	else        q->head = w->next;
+	if(w->next) w->next->prev = w->prev;
+	else        q->tail = w->prev;
+}
+
+// The sleeping tasks
+
+static bool earlier(const struct timespec* a, const struct timespec* b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void place(Task* t, size_t i) {
+	sleepers[i] = t;
+	t->slot = i;
+}
+
+static void sift_up(size_t i) {
+	Task* t = sleepers[i];
+	while(i > 0 && earlier(&t->wake, &sleepers[(i - 1) / 2]->wake)) {
+		place(sleepers[(i - 1) / 2], i);
+		i = (i - 1) / 2;
+	}
+	place(t, i);
+}
+
+static void sift_down(size_t i) {
+	Task* t = sleepers[i];
+	for(;;) {
+		size_t c = 2 * i + 1;
+		if(c >= nsleepers) break;
+		if(c + 1 < nsleepers && earlier(&sleepers[c + 1]->wake, &sleepers[c]->wake)) c++;
+		if(!earlier(&sleepers[c]->wake, &t->wake)) break;
+
+		place(sleepers[c], i);
+		i = c;
+	}
+	place(t, i);
+}
+
+static bool add_sleeper(Task* t) {
+	if(nsleepers == sleepersCap) {
+		size_t cap = sleepersCap ? 2 * sleepersCap : 16;
+		Task** grown = realloc(sleepers, cap * sizeof(Task*));
+		if(!grown) return false;
+
+		sleepers = grown;
+		sleepersCap = cap;
+	}
+
+	place(t, nsleepers++);
+	sift_up(t->slot);
+	return true;
+}
+
+static void remove_sleeper(Task* t) {
+	size_t i = t->slot;
+	Task* last = sleepers[--nsleepers];
+	if(i == nsleepers) return;
+
+	place(last, i);
+	sift_up(i);
+	sift_down(last->slot);
+}
+
+// Stops t from waiting on anything
+static void cancel(Task* t) {
+	for(int i = 0; i < t->nwaits; i++) {
+		unlink_waiter(&t->waits[i]);
+	}
+	if(t->waits != &t->one) free(t->waits);
+	t->waits = NULL;
+	t->nwaits = 0;
+
+	if(t->state == SLEEPING) remove_sleeper(t);
+}
+
+// Makes t ready to carry on with v, as the op of its select it waited on at
+// index when selecting
+static void wake(Task* t, Expr* v, int index) {
+	cancel(t);
+	t->value = v;
+	t->chosen = index;
+	t->state = READY;
+	if(!t->inC) enqueue(t);
+}
+
+static void wake_sleepers() {
+	if(!nsleepers) return;
+
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	while(nsleepers && !earlier(&now, &sleepers[0]->wake)) {
+		Task* t = sleepers[0];
+		remove_sleeper(t);
+		t->state = WAITING;
+		wake(t, EMPTY_LIST, -1);
+	}
+}
+
+// What t carries on with once woken
+static Expr* resumed_value(Task* t) {
+	Expr* v = t->value;
+	t->value = NULL;
+	if(!t->selecting) return v;
+
+	t->selecting = false;
+	if(!v || scm_is_error(v)) return v;
+
+	scm_stack_push(&v);
+	Expr* i = scm_mk_int(t->chosen);
+	scm_stack_push(&i);
+	Expr* toRet = scm_is_error(i) ? i : scm_mk_pair(i, v);
+	scm_stack_pop(&i);
+	scm_stack_pop(&v);
+
+	return toRet;
+}
+
+static void finish(Task* t, Expr* res) {
+	if(res == ESCAPE) res = scm_mk_error("continuation called outside of its task");
+
+	t->result = res;
+	t->state = OVER;
+	scm_free_fiber(t->fiber);
+	t->fiber = NULL;
+
+	while(t->joiners.head) {
+		wake(t->joiners.head->task, res, -1);
+	}
+}
+
+// Runs t until it is over or switches out. Returns NULL, or the error it was
+// preempted with, in which case it is the first to carry on later.
+static Expr* step(Task* t) {
+	// neither is queued meanwhile
+	Task* outer = current;
+	Expr* self = t->self;
+	Expr* outerSelf = outer->self;
+	scm_stack_push(&self);
+	if(outerSelf) scm_stack_push(&outerSelf);
+
+	current = t;
+	t->state = RUNNING;
+
+	bool over;
+	Expr* res = scm_fiber_run(t->fiber, resumed_value(t), &over);
+
+	current = outer;
+	if(over) {
+		finish(t, res);
+		res = NULL;
+	} else if(res == SWITCH) {
+		res = NULL;
+	} else {
+		t->state = READY;
+		enqueue_first(t);
+	}
+
+	if(outerSelf) scm_stack_pop(&outerSelf);
+	scm_stack_pop(&self);
+
+	return res;
+}
+
+// Runs the next task that is ready, or sleeps until one is. Returns an error
+// when none ever will be, or the evaluation is preempted.
+static Expr* run_next() {
+	Expr* err = scm_tick();
+	if(err) return err;
+
+	wake_sleepers();
+	Task* next = dequeue();
+	if(next) return step(next);
+
+	if(!nsleepers) return scm_mk_error("deadlock: every task is waiting");
+
+	struct timespec now, nap = { 0, 0 };
+	timespec_get(&now, TIME_UTC);
+	long long ns = (long long) (sleepers[0]->wake.tv_sec - now.tv_sec) * 1000000000 + (sleepers[0]->wake.tv_nsec - now.tv_nsec);
+	if(ns > 0) {
+		nap.tv_nsec = ns < MAX_NAP_NS ? ns : MAX_NAP_NS;
+		nanosleep(&nap, NULL);
+	}
+
+	return scm_poll();
+}
+
+// Waits for t, which can't switch out, to be woken
+static Expr* wait_in_c(Task* t) {
+	t->inC = true;
+
+	Expr* err = NULL;
+	while(t->state != READY && !err) {
+		err = run_next();
+	}
+
+	t->inC = false;
+	if(err && t->state != READY) {
+		cancel(t);
+		t->selecting = false;
+		t->value = NULL;
+		t->state = RUNNING;
+		return err;
+	}
+
+	// noticed again at the next check, as what t was woken with can't be lost
+	if(err == INTERRUPTED) scm_interrupt();
+
+	t->state = RUNNING;
+	return resumed_value(t);
+}
+
+// Waits for the current task to be woken, and returns what it carries on with
+static Expr* block() {
+	return scm_can_switch() ? SWITCH : wait_in_c(current);
+}
+
+Expr* scm_spawn(Expr* thunk) {
+	assert(thunk);
+
+	Task* t = calloc(1, sizeof(Task));
+	Fiber* f = t ? scm_mk_fiber(thunk) : NULL;
+	Expr* toRet = f ? scm_alloc() : NULL;
+	if(!toRet) {
+		if(f) scm_free_fiber(f);
+		free(t);
+		return OOM;
+	}
+
+	t->self = toRet;
+	t->fiber = f;
+	t->state = READY;
+	enqueue(t);
+
+	toRet->tag = ATOM;
+	toRet->atom.type = TASK;
+	toRet->atom.task = t;
+
+	return toRet;
+}
+
+Expr* scm_yield() {
+	Task* t = current;
+	if(scm_can_switch()) {
+		t->value = EMPTY_LIST;
+		t->state = READY;
+		enqueue(t);
+		return SWITCH;
+	}
+
+	// the tasks ready by now run once each
+	wake_sleepers();
+	for(size_t n = nready; n > 0; n--) {
+		Expr* err = step(dequeue());
+		if(err) return err;
+	}
+
+	return EMPTY_LIST;
+}
+
+Expr* scm_sleep(double seconds) {
+	if(seconds <= 0) return scm_yield();
+
+	Task* t = current;
+	timespec_get(&t->wake, TIME_UTC);
+	long long ns = t->wake.tv_nsec + (long long) ((seconds - (long long) seconds) * 1e9);
+	t->wake.tv_sec += (time_t) seconds + ns / 1000000000;
+	t->wake.tv_nsec = ns % 1000000000;
+
+	if(!add_sleeper(t)) return OOM;
+	t->state = SLEEPING;
+
+	return block();
+}
+
+Expr* scm_task_wait(Expr* task) {
+	assert(task); assert(scm_is_task(task));
+
+	Task* w = scm_task(task);
+	if(w->state == OVER) return w->result;
+	if(w == current) return scm_mk_error("a task can't wait for itself to be over");
+
+	Task* t = current;
+	wait_on(t, &t->one, &w->joiners, task, NULL, -1);
+	t->waits = &t->one;
+	t->nwaits = 1;
+	t->state = WAITING;
+
+	return block();
+}
+
+// Channels
+
+Expr* scm_mk_channel(long long cap) {
+	if(cap < 0) return scm_mk_error("a channel can't hold fewer than 0 values");
+
+	Channel* c = calloc(1, sizeof(Channel));
+	Expr** buf = c && cap ? malloc(cap * sizeof(Expr*)) : NULL;
+	Expr* toRet = c && (buf || !cap) ? scm_alloc() : NULL;
+	if(!toRet) {
+		free(buf);
+		free(c);
+		return OOM;
+	}
+
+	c->buf = buf;
+	c->cap = cap;
+
+	toRet->tag = ATOM;
+	toRet->atom.type = CHANNEL;
+	toRet->atom.chan = c;
+
+	return toRet;
+}
+
+// What the task waiting to send for w carries on with
+static Expr* sent(Waiter* w) {
+	return w->index < 0 ? EMPTY_LIST : w->value;
+}
+
+// Sends v on c when a receive is waiting or there is room for it
+static bool try_send(Channel* c, Expr* v) {
+	Waiter* w = c->receivers.head;
+	if(w) {
+		wake(w->task, v, w->index);
+		return true;
+	}
+
+	if(c->count == c->cap) return false;
+
+	c->buf[(c->head + c->count++) % c->cap] = v;
+	return true;
+}
+
+// Receives from c into *v when a value or a send is waiting
+static bool try_receive(Channel* c, Expr** v) {
+	Waiter* w = c->senders.head;
+	if(c->count) {
+		*v = c->buf[c->head];
+		c->head = (c->head + 1) % c->cap;
+		c->count--;
+
+		// a send waiting for room gets the one made
+		if(w) {
+			c->buf[(c->head + c->count++) % c->cap] = w->value;
+			wake(w->task, sent(w), w->index);
+		}
+		return true;
+	}
+
+	if(!w) return false;
+
+	*v = w->value;
+	wake(w->task, sent(w), w->index);
+	return true;
+}
+
+Expr* scm_channel_send(Expr* ch, Expr* v) {
+	assert(ch); assert(scm_is_channel(ch)); assert(v);
+
+	Channel* c = scm_channel(ch);
+	if(try_send(c, v)) return EMPTY_LIST;
+
+	Task* t = current;
+	wait_on(t, &t->one, &c->senders, ch, v, -1);
+	t->waits = &t->one;
+	t->nwaits = 1;
+	t->state = WAITING;
+
+	return block();
+}
+
+Expr* scm_channel_receive(Expr* ch) {
+	assert(ch); assert(scm_is_channel(ch));
+
+	Channel* c = scm_channel(ch);
+	Expr* v;
+	if(try_receive(c, &v)) return v;
+
+	Task* t = current;
+	wait_on(t, &t->one, &c->receivers, ch, NULL, -1);
+	t->waits = &t->one;
+	t->nwaits = 1;
+	t->state = WAITING;
+
+	return block();
+}
+
+// Each op is either a channel to receive from or a pair of a channel and a
+// value to send on it. Returns the index of the op done and the value
+// received or sent, in a pair.
+Expr* scm_select(int n, Expr** ops) {
+	assert(n > 0);
+
+	for(int i = 0; i < n; i++) {
+		if(!scm_is_channel(ops[i]) && !(scm_is_pair(ops[i]) && scm_is_channel(scm_car(ops[i])))) {
+			return scm_mk_error("select expects channels to receive from or (channel . value) pairs to send");
+		}
+	}
+
+	const int first = rotation++ % n;
+	for(int k = 0; k < n; k++) {
+		const int i = (first + k) % n;
+
+		Expr* v = NULL;
+		if(scm_is_channel(ops[i])) {
+			if(!try_receive(scm_channel(ops[i]), &v)) continue;
+		} else {
+			v = scm_cdr(ops[i]);
+			if(!try_send(scm_channel(scm_car(ops[i])), v)) continue;
+		}
+
+		scm_stack_push(&v);
+		Expr* index = scm_mk_int(i);
+		scm_stack_push(&index);
+		Expr* toRet = scm_is_error(index) ? index : scm_mk_pair(index, v);
+		scm_stack_pop(&index);
+		scm_stack_pop(&v);
+
+		return toRet;
+	}
+
+	Task* t = current;
+	Waiter* waits = malloc(n * sizeof(Waiter));
+	if(!waits) return OOM;
+
+	for(int i = 0; i < n; i++) {
+		if(scm_is_channel(ops[i])) wait_on(t, &waits[i], &scm_channel(ops[i])->receivers, ops[i], NULL, i);
+		else                       wait_on(t, &waits[i], &scm_channel(scm_car(ops[i]))->senders, scm_car(ops[i]), scm_cdr(ops[i]), i);
+	}
+	t->waits = waits;
+	t->nwaits = n;
+	t->selecting = true;
+	t->state = WAITING;
+
+	return block();
+}
+
+// Memory
+
+void scm_free_task(Task* t) {
+	if(t->fiber) scm_free_fiber(t->fiber);
+	if(t->waits != &t->one) free(t->waits);
+	free(t);
+}
+
+void scm_free_channel(Channel* c) {
+	free(c->buf);
+	free(c);
+}
+
+static void mark_queue(const Queue* q) {
+	for(Waiter* w = q->head; w; w = w->next) {
+		if(w->task->self) scm_mark(w->task->self);
+		if(w->value)      scm_mark(w->value);
+	}
+}
+
+void scm_mark_task(Task* t) {
+	if(t->fiber)  scm_mark_fiber(t->fiber);
+	if(t->result) scm_mark(t->result);
+	if(t->value)  scm_mark(t->value);
+
+	for(int i = 0; i < t->nwaits; i++) {
+		scm_mark(t->waits[i].on);
+		if(t->waits[i].value) scm_mark(t->waits[i].value);
+	}
+
+	mark_queue(&t->joiners);
+}
+
+void scm_mark_channel(Channel* c) {
+	for(size_t i = 0; i < c->count; i++) {
+		scm_mark(c->buf[(c->head + i) % c->cap]);
+	}
+
+	mark_queue(&c->senders);
+	mark_queue(&c->receivers);
+}
+
+void scm_mark_tasks() {
+	for(Task* t = readyHead; t; t = t->next) {
+		scm_mark(t->self);
+	}
+
+	for(size_t i = 0; i < nsleepers; i++) {
+		if(sleepers[i]->self) scm_mark(sleepers[i]->self);
+	}
+
+	if(current->self) scm_mark(current->self);
+	scm_mark_task(&outside);
+}
+
+void scm_reset_tasks() {
+	if(outside.waits != &outside.one) free(outside.waits);
+	outside = (Task) { .state = RUNNING };
+	current = &outside;
+
+	readyHead = readyTail = NULL;
+	nready = 0;
+
+	free(sleepers);
+	sleepers = NULL;
+	nsleepers = sleepersCap = 0;
+	rotation = 0;
+}
@@ -0,0 +1,1217 @@
+/* This file is the virtual machine scm_eval() runs code on once the VM engine
+ * is selected with scm_set_engine(). Code is resolved and compiled to
+ * bytecode (see Compile.c) on its way in, and so is the body of a closure on
+ * its first call.
+ *
+ * The VM is a stack machine: instructions take their operands off a stack of
+ * values and push their results back on it. A call to a closure doesn't
+ * recurse in C. The state of the caller is pushed on a stack of calls
+ * instead, and popped back by the RETURN of the callee. A tail call simply
+ * replaces the state of the current call. Both stacks are gc roots, and grow
+ * on the heap as needed, so that the depth of recursion is only limited by
+ * memory.
+ *
+ * Frames are made the same way as by the tree walker, and released as soon
+ * as a call is over when nothing can capture them. Errors unwind everything
+ * back to the innermost __try still running its thunk, or to where the VM
+ * was entered, which is as far as anything raised in a run gets without
+ * returning from it. Instructions are dispatched through
+ * computed gotos when the compiler supports them.
+ *
+ * As the whole state of a run lies in those two stacks, a continuation is
+ * made by copying the part of them that belongs to the run, along with the
+ * state of the current call. Nothing is copied until then. Calling it puts
+ * them back, in whichever run calls it once its own is over. Calls are
+ * numbered, so that a continuation called while the calls under the one that
+ * made it are still there escapes by merely dropping the calls above and
+ * putting back the values of that one call. A continuation made by __callec
+ * can only do that, and copies nothing else.
+ *
+ * map and for-each don't call their procedure from C when called on the VM,
+ * which would run it in an evaluation of its own. They are given a call of
+ * their own instead, running the two instructions of MAP_LOOP on the lists
+ * kept among its values, so that the calls they make are like any other: a
+ * continuation made in one can be called once it is over, a task can switch
+ * out of one, and an evaluation preempted in one can be resumed.
+ *
+ * A task (see Task.c) has stacks of its own, a Fiber, exchanged with the ones
+ * in use while it runs. Its run carries on in the same entry call every time,
+ * and switches out by returning with everything left on them, either in a
+ * primitive that returned SWITCH or where a call starts when preempted.
+ */
+
+#include "SchemeSecret.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__)
+#define THREADED
+#endif
+
+#define STACK_SIZE 8192
+#define CALLS_SIZE 4096
+
+// What the stacks of a task start with
+#define FIBER_STACK_SIZE 256
+#define FIBER_CALLS_SIZE 32
+#define FIBER_FRAMES_SIZE 64
+
+// Where a call carries on from once its callee returns
+typedef struct Call {
+	const int* pc;
+	Expr* proto;      // whose bytecode pc points into
+	Expr* env;
+	size_t base;      // where the values of the call start on the stack
+	size_t frames;    // size of the frame stack when the call started
+	unsigned long long id;
+	bool catches;     // made by a __try, which catches what the callee raises
+} Call;
+
+// Numbers the calls, which are never numbered the same twice
+static unsigned long long callIds = 0;
+
+// What a continuation made by the VM carries on from
+struct Snapshot {
+	unsigned long long run;    // id of the entry call of the run it was made in
+	size_t entry;              // where that call is
+	unsigned long long caller; // id of the call under the one that made it
+	size_t ncalls;             // calls under the one that made it
+	Call top;                  // the state of the one that made it
+	size_t sp;
+	size_t from;               // where the values copied start on the stack
+	Expr** values;             // stack[from .. sp)
+	Call* calls;               // calls[entry + 1 .. ncalls), NULL if it escapes
+	bool escapes;              // only escapes, made by __callec
+	Expr* handlers;            // installed by with-exception-handler
+};
+
+static Expr** stack = NULL;
+static size_t sp = 0;
+static size_t stackCap = 0;
+
+static Call* calls = NULL;
+static size_t ncalls = 0;
+static size_t callsCap = 0;
+
+// How many runs of machine code are under way. The stack can't move while
+// there are any, as they keep pointers into it.
+static unsigned pinned = 0;
+
+// The PROTO whose bytecode is running, NULL outside of the VM
+static Expr* running = NULL;
+
+// The continuation of the evaluation that last ran out of fuel
+static Expr* suspended = NULL;
+
+// The stacks of a task, which hold the ones they were exchanged with while it
+// runs
+struct Fiber {
+	Expr** stack;
+	size_t sp, stackCap;
+	Call* calls;
+	size_t ncalls, callsCap;
+	Expr** frames;
+	size_t nframes, framesCap;
+	unsigned pinned, nested;
+
+	Expr* handlers;  // installed by with-exception-handler in the task
+	Call top;        // where it carries on from
+	bool tail;       // the primitive it switched out in was a tail call
+	bool atCall;     // preempted where a call starts, so it takes no value
+	Expr* value;     // for the primitive it switched out in
+	bool started, over;
+};
+
+// The task running, NULL outside of any
+static Fiber* fiber = NULL;
+
+// How many evaluations were entered from C since the run of the task, which
+// it can't switch out of
+static unsigned nested = 0;
+
+// What the call of a map or for-each runs, never compiled to machine code
+static int mapOps[] = { OP_MAP, OP_MAP_NEXT };
+static Bytecode mapCode = { mapOps, NULL, 2, 0, 0 };
+static Proto mapProto = { .bc = &mapCode };
+static Expr MAP_LOOP = { .tag = ATOM, .atom = { .type = PROTO, .proto = &mapProto }, .protect = true, .mark = true };
+
+void scm_mark_vm() {
+	for(size_t i = 0; i < sp; i++) {
+		scm_mark(stack[i]);
+	}
+
+	for(size_t i = 0; i < ncalls; i++) {
+		if(calls[i].proto) scm_mark(calls[i].proto);
+		if(calls[i].env)   scm_mark(calls[i].env);
+	}
+
+	if(running) scm_mark(running);
+	if(suspended) scm_mark(suspended);
+}
+
+void scm_reset_vm() {
+	suspended = NULL;
+	fiber = NULL;
+	nested = 0;
+}
+
+Fiber* scm_mk_fiber(Expr* thunk) {
+	Fiber* f = calloc(1, sizeof(Fiber));
+	if(!f) return NULL;
+
+	f->stack = malloc(FIBER_STACK_SIZE * sizeof(Expr*));
+	f->calls = malloc(FIBER_CALLS_SIZE * sizeof(Call));
+	f->frames = malloc(FIBER_FRAMES_SIZE * sizeof(Expr*));
+	if(!f->stack || !f->calls || !f->frames) {
+		scm_free_fiber(f);
+		return NULL;
+	}
+
+	f->stackCap = FIBER_STACK_SIZE;
+	f->callsCap = FIBER_CALLS_SIZE;
+	f->framesCap = FIBER_FRAMES_SIZE;
+	f->stack[f->sp++] = thunk;
+	f->handlers = EMPTY_LIST;
+
+	return f;
+}
+
+void scm_free_fiber(Fiber* f) {
+	free(f->stack);
+	free(f->calls);
+	free(f->frames);
+	free(f);
+}
+
+void scm_mark_fiber(Fiber* f) {
+	for(size_t i = 0; i < f->sp; i++) {
+		scm_mark(f->stack[i]);
+	}
+
+	for(size_t i = 0; i < f->ncalls; i++) {
+		if(f->calls[i].proto) scm_mark(f->calls[i].proto);
+		if(f->calls[i].env)   scm_mark(f->calls[i].env);
+	}
+
+	for(size_t i = 0; i < f->nframes; i++) {
+		scm_mark(f->frames[i]);
+	}
+
+	if(f->top.proto) scm_mark(f->top.proto);
+	if(f->top.env)   scm_mark(f->top.env);
+	scm_mark(f->handlers);
+	if(f->value) scm_mark(f->value);
+}
+
+#define SWAP(type, a, b) do { type t_ = a; a = b; b = t_; } while(0)
+
+// Exchanges the stacks in use with the ones of f
+static void exchange(Fiber* f) {
+	SWAP(Expr**, stack, f->stack);
+	SWAP(size_t, sp, f->sp);
+	SWAP(size_t, stackCap, f->stackCap);
+	SWAP(Call*, calls, f->calls);
+	SWAP(size_t, ncalls, f->ncalls);
+	SWAP(size_t, callsCap, f->callsCap);
+	SWAP(unsigned, pinned, f->pinned);
+	SWAP(unsigned, nested, f->nested);
+	scm_frame_stack_switch(&f->frames, &f->nframes, &f->framesCap);
+}
+
+#undef SWAP
+
+bool scm_can_switch() {
+	return fiber && !nested && !pinned;
+}
+
+// Makes room for n more values on the stack
+static bool reserve(size_t n) {
+	if(sp + n <= stackCap) return true;
+	if(pinned) return false;
+
+	size_t cap = stackCap ? stackCap : STACK_SIZE;
+	while(cap < sp + n) cap *= 2;
+
+	Expr** grown = realloc(stack, cap * sizeof(Expr*));
+	if(!grown) return false;
+
+	stack = grown;
+	stackCap = cap;
+	return true;
+}
+
+void scm_mark_snapshot(Snapshot* s) {
+	for(size_t i = 0; i < s->sp - s->from; i++) {
+		scm_mark(s->values[i]);
+	}
+
+	for(size_t i = 0; s->calls && i < s->ncalls - s->entry - 1; i++) {
+		scm_mark(s->calls[i].proto);
+		scm_mark(s->calls[i].env);
+	}
+
+	scm_mark(s->top.proto);
+	scm_mark(s->top.env);
+	scm_mark(s->handlers);
+}
+
+void scm_free_snapshot(Snapshot* s) {
+	free(s->values);
+	free(s->calls);
+	free(s);
+}
+
+// Makes room for one more call
+static bool reserve_call() {
+	if(ncalls < callsCap) return true;
+
+	size_t cap = callsCap ? 2 * callsCap : CALLS_SIZE;
+	Call* grown = realloc(calls, cap * sizeof(Call));
+	if(!grown) return false;
+
+	calls = grown;
+	callsCap = cap;
+	return true;
+}
+
+// Evaluates e in env, which the tree walker handles when it is false
+static Expr* eval_in(Expr* e, Expr* env) {
+	Expr* curEnv = CURRENT_ENV;
+	scm_stack_push(&curEnv);
+
+	CURRENT_ENV = env;
+	nested++;
+	Expr* res = env == FALSE ? scm_eval_tree(e) : scm_vm_eval(e);
+	nested--;
+
+	CURRENT_ENV = curEnv;
+	scm_stack_pop(&curEnv);
+
+	return res;
+}
+
+// Makes a continuation for the call top, whose values end at topSp on the
+// stack, in the run whose entry call is at depth - 1
+static Expr* capture(size_t depth, Call top, size_t topSp, bool escapes) {
+	Snapshot* s = malloc(sizeof(Snapshot));
+	if(!s) return OOM;
+
+	s->run = calls[depth - 1].id;
+	s->entry = depth - 1;
+	s->caller = calls[ncalls - 1].id;
+	s->ncalls = ncalls;
+	s->top = top;
+	s->sp = topSp;
+	s->from = escapes ? top.base : calls[depth - 1].base;
+	s->escapes = escapes;
+	s->handlers = scm_handlers;
+
+	const size_t nvalues = s->sp - s->from;
+	const size_t ncopied = escapes ? 0 : ncalls - depth;
+	s->values = malloc((nvalues + 1) * sizeof(Expr*));
+	s->calls = escapes ? NULL : malloc((ncopied + 1) * sizeof(Call));
+	if(!s->values || (!escapes && !s->calls)) {
+		scm_free_snapshot(s);
+		return OOM;
+	}
+
+	memcpy(s->values, &stack[s->from], nvalues * sizeof(Expr*));
+	if(!escapes) memcpy(s->calls, &calls[depth], ncopied * sizeof(Call));
+
+	// the frames it may carry on in can't be released when their calls end
+	scm_env_capture(top.env);
+	for(size_t i = 0; i < ncopied; i++) {
+		scm_env_capture(s->calls[i].env);
+	}
+
+	return scm_mk_cont(s);
+}
+
+// Puts the stacks back the way they were when s was made, in the run whose
+// entry call is at depth - 1, which the caller checked s can carry on in.
+// Returns the state of the call that made it, with a NULL pc if there wasn't
+// room for it.
+static Call restore(Snapshot* s, size_t depth) {
+	Call top = s->top;
+	scm_handlers = s->handlers;
+
+	if(s->run == calls[depth - 1].id && s->ncalls <= ncalls && calls[s->ncalls - 1].id == s->caller) {
+		// only the values of the call that made it may have changed since
+		scm_frame_stack_unwind(top.frames, NULL);
+		ncalls = s->ncalls;
+		memcpy(&stack[top.base], &s->values[top.base - s->from], (s->sp - top.base) * sizeof(Expr*));
+		sp = s->sp;
+
+		return top;
+	}
+	assert(!s->escapes);
+
+	// the run carries on from somewhere else entirely, moved to where its
+	// values start on the stack
+	const size_t from = calls[depth - 1].base;
+	const size_t frames = calls[depth - 1].frames;
+	scm_frame_stack_unwind(frames, NULL);
+	ncalls = depth;
+	sp = from;
+
+	for(size_t i = 0; i < s->ncalls - s->entry - 1; i++) {
+		if(!reserve_call()) {
+			top.pc = NULL;
+			return top;
+		}
+
+		Call c = s->calls[i];
+		c.base = c.base - s->from + from;
+		c.frames = frames;
+		c.id = ++callIds;
+		calls[ncalls++] = c;
+	}
+
+	if(!reserve(s->sp - s->from + scm_proto(top.proto)->bc->maxStack)) {
+		top.pc = NULL;
+		return top;
+	}
+	memcpy(&stack[from], s->values, (s->sp - s->from) * sizeof(Expr*));
+	sp = from + s->sp - s->from;
+
+	top.base = top.base - s->from + from;
+	top.frames = frames;
+
+	return top;
+}
+
+// Whether the continuation k can carry on in the run whose entry call is at
+// depth - 1: either it was made in that run, or it copied its run, which is
+// over. A run still under way is carried on in by unwinding back to it.
+static bool resumes_here(Expr* k, size_t depth) {
+	Snapshot* s = scm_cont(k)->vm;
+	if(s->run == calls[depth - 1].id) {
+		return !s->escapes || (s->ncalls <= ncalls && calls[s->ncalls - 1].id == s->caller);
+	}
+
+	bool over = s->entry >= ncalls || calls[s->entry].id != s->run;
+	return over && !s->escapes;
+}
+
+// The dispatch table of run() takes the addresses of labels, and NEXT jumps
+// through it, which are GNU extensions
+#ifdef THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+// Runs the bytecode of proto, which takes no arguments, in CURRENT_ENV, or
+// carries on from where s was made instead if it isn't NULL. If both are, it
+// calls the procedure lying on the stack under its nargs arguments, or
+// carries on with the task whose stacks are in use if there is one and no
+// evaluation was entered from C since its run.
+static Expr* run(Expr* proto, Snapshot* s, int nargs) {
+	if(!reserve_call()) return scm_mk_error("too many nested calls");
+
+	// the entry call keeps whatever was running before. A task has its own
+	// at the bottom of its stacks, the same one every time it carries on.
+	const bool own = !proto && !s && fiber && !nested;
+	const bool resumed = own && fiber->started;
+	const size_t depth = resumed ? 1 : ++ncalls;
+	const unsigned long long id = resumed ? calls[0].id : ++callIds;
+	const size_t entryBase = proto || s ? sp : resumed ? 0 : sp - nargs - 1;
+	calls[depth - 1] = (Call) { NULL, running, CURRENT_ENV, entryBase, own ? 0 : scm_frame_stack_size(), id, false };
+
+	// put back if anything unwinds the run
+	Expr* handlers = scm_handlers;
+	scm_stack_push(&handlers);
+
+	// what is raised in the run unwinds its calls below, not its C frame
+	Catch boundary;
+	scm_enter_catch(&boundary, NULL);
+
+	Expr* res;
+	size_t base = calls[depth - 1].base;
+	size_t frames = calls[depth - 1].frames;
+	int n;
+	bool tail = false;
+	bool catching = false;
+
+	Bytecode* bc = NULL;
+	Expr** consts = NULL;
+	const int* pc = NULL;
+
+	if(own) scm_handlers = fiber->handlers;
+	if(!proto && !s && !resumed) {
+		// the procedure replaces the entry call. That of a task is its
+		// thunk, at the bottom of the stack.
+		if(own) fiber->started = true;
+		n = nargs;
+		tail = true;
+		goto call;
+	}
+
+	if(resumed) {
+		pc = fiber->top.pc;
+		running = fiber->top.proto;
+		CURRENT_ENV = fiber->top.env;
+		base = fiber->top.base;
+		frames = fiber->top.frames;
+		bc = scm_proto(running)->bc;
+		consts = bc->consts;
+
+		res = fiber->value;
+		fiber->value = NULL;
+		if(fiber->atCall) goto entered;
+		if(scm_is_error(res)) goto fail;
+		if(fiber->tail) goto ret;
+		goto resume;
+	}
+
+	running = proto;
+	bc = scm_proto(proto)->bc;
+	consts = bc->consts;
+	pc = bc->ops;
+	if(!reserve(bc->maxStack)) {
+		res = scm_mk_error("stack overflow");
+		goto fail;
+	}
+
+	if(s) {
+		Call top = restore(s, depth);
+		if(!top.pc) {
+			ncalls = depth;
+			res = scm_mk_error("stack overflow");
+			goto fail;
+		}
+
+		pc = top.pc;
+		running = top.proto;
+		CURRENT_ENV = top.env;
+		base = top.base;
+		frames = top.frames;
+		bc = scm_proto(running)->bc;
+		consts = bc->consts;
+	}
+
+#ifdef THREADED
+	static const void* labels[] = {
+#define OPCODE(name, operands) &&L_##name,
+#include "Opcodes.def"
+#undef OPCODE
+	};
+#define CASE(name) L_##name:
+#define NEXT goto *labels[*pc++]
+
+	NEXT;
+#else
+#define CASE(name) case OP_##name:
+#define NEXT continue
+
+	for(;;) switch(*pc++) {
+#endif
+
+// Carries on in machine code when the running proto has been compiled to it,
+// which is always entered where a call starts or returns
+#define RESUME \
+	if(scm_proto(running)->native) { \
+		pinned++; \
+		int at = scm_jit_run(scm_proto(running)->native, stack, &sp, pc - bc->ops, &res); \
+		pinned--; \
+		if(at < 0) goto fail; \
+		pc = bc->ops + at; \
+	} \
+	NEXT
+
+	CASE(CONST)
+		stack[sp++] = consts[*pc++];
+		NEXT;
+
+	CASE(LOCAL) {
+		Expr* env = CURRENT_ENV;
+		for(int d = pc[0]; d > 0; d--) {
+			env = scm_env_parent(env);
+		}
+
+		Expr* v = scm_env_frame(env)->slots[pc[1]];
+		if(!v || scm_extended_frames) {
+			v = scm_env_get_ref(CURRENT_ENV, consts[pc[2]]);
+			if(scm_is_error(v)) {
+				res = v;
+				goto fail;
+			}
+		}
+
+		stack[sp++] = v;
+		pc += 3;
+		NEXT;
+	}
+
+	CASE(GLOBAL) {
+		Expr* ref = consts[*pc++];
+		Expr* v = *scm_symbol_cell(ref->atom.gref);
+		if(!v || scm_extended_frames) {
+			v = scm_env_get_ref(CURRENT_ENV, ref);
+			if(scm_is_error(v)) {
+				res = v;
+				goto fail;
+			}
+		}
+
+		stack[sp++] = v;
+		NEXT;
+	}
+
+	CASE(REF) {
+		Expr* v = scm_env_get_ref(CURRENT_ENV, consts[*pc++]);
+		if(scm_is_error(v)) {
+			res = v;
+			goto fail;
+		}
+
+		stack[sp++] = v;
+		NEXT;
+	}
+
+	CASE(CLOSURE) {
+		Expr* v = scm_mk_closure(CURRENT_ENV, consts[*pc++]);
+		if(scm_is_error(v)) {
+			res = v;
+			goto fail;
+		}
+
+		stack[sp++] = v;
+		NEXT;
+	}
+
+	CASE(RAW) {
+		nested++;
+		Expr* v = scm_eval_tree(consts[*pc++]);
+		nested--;
+		if(scm_is_error(v)) {
+			res = v;
+			goto fail;
+		}
+
+		stack[sp++] = v;
+		NEXT;
+	}
+
+	CASE(POP)
+		sp--;
+		NEXT;
+
+	CASE(DEFINE) {
+		// the value stays on the stack while it is bound
+		Expr* v = scm_env_define(CURRENT_ENV, consts[*pc++], stack[sp - 1]);
+		if(scm_is_error(v)) {
+			res = v;
+			goto fail;
+		}
+
+		stack[sp - 1] = v;
+		NEXT;
+	}
+
+	CASE(SET) {
+		Expr* name = consts[*pc++];
+		Expr* v = scm_is_symbol(name) ? scm_env_set(CURRENT_ENV, name, stack[sp - 1]) : scm_env_set_ref(CURRENT_ENV, name, stack[sp - 1]);
+		if(scm_is_error(v)) {
+			res = v;
+			goto fail;
+		}
+
+		stack[sp - 1] = v;
+		NEXT;
+	}
+
+	CASE(JUMP)
+		pc = bc->ops + *pc;
+		NEXT;
+
+	CASE(JUMP_FALSE)
+		if(stack[--sp] == FALSE) pc = bc->ops + *pc;
+		else                     pc++;
+		NEXT;
+
+	CASE(AND)
+		if(stack[sp - 1] == FALSE) {
+			pc = bc->ops + *pc;
+		} else {
+			sp--;
+			pc++;
+		}
+		NEXT;
+
+	CASE(OR)
+		if(stack[sp - 1] != FALSE) {
+			pc = bc->ops + *pc;
+		} else {
+			sp--;
+			pc++;
+		}
+		NEXT;
+
+	CASE(CALL)
+		n = *pc++;
+		tail = false;
+		goto call;
+
+	CASE(TAIL_CALL)
+		n = *pc++;
+		tail = true;
+		goto call;
+
+	CASE(PRIM)
+		tail = false;
+		goto prim;
+
+	CASE(TAIL_PRIM)
+		tail = true;
+		goto prim;
+
+	CASE(FOLD)
+		if((unsigned) pc[1] == scm_fold_version) {
+			stack[sp++] = consts[pc[0]];
+			pc = bc->ops + pc[2];
+		} else {
+			pc += 3;
+		}
+		NEXT;
+
+	CASE(APPLY)
+		tail = false;
+		goto apply;
+
+	CASE(TAIL_APPLY)
+		tail = true;
+		goto apply;
+
+	CASE(EVAL) {
+		Expr* env = stack[sp - 1];
+		if(!scm_is_env(env) && env != FALSE) {
+			res = scm_mk_error("invalid environment passed to __eval");
+			goto fail;
+		}
+
+		Expr* v = eval_in(stack[sp - 2], env);
+		if(scm_is_error(v)) {
+			res = v;
+			goto fail;
+		}
+
+		stack[--sp - 1] = v;
+		RESUME;
+	}
+
+	CASE(RETURN)
+		res = stack[--sp];
+	ret:
+		scm_frame_stack_unwind(frames, NULL);
+		sp = base;
+		if(ncalls == depth) goto done;
+
+		{
+			Call* c = &calls[--ncalls];
+			pc = c->pc;
+			running = c->proto;
+			CURRENT_ENV = c->env;
+			base = c->base;
+			frames = c->frames;
+			catching = c->catches;
+		}
+
+		bc = scm_proto(running)->bc;
+		consts = bc->consts;
+		if(catching) {
+			catching = false;
+			goto tried;
+		}
+
+	resume:
+		stack[sp++] = res;
+		RESUME;
+
+	tried: {
+		// res is what the thunk of a __try returned or raised, and the
+		// handlers it installed are on top of the stack, above the ones to
+		// put back and the handler
+		Expr* installed = stack[--sp];
+		scm_handlers = stack[--sp];
+
+		Expr* c = scm_is_error(res) && stack[sp - 1] != FALSE ? scm_condition(res, installed) : NULL;
+		if(c && !scm_is_error(c)) {
+			stack[sp++] = c;
+			n = 1;
+			tail = false;
+			goto call;
+		}
+
+		sp--;
+		if(c) res = c;
+		if(scm_is_error(res)) goto fail;
+		goto resume;
+	}
+
+	CASE(TRY) {
+		// the handler goes under the handlers to put back and the ones to
+		// install, and the thunk is called on top of them
+		Expr* installed = stack[sp - 3];
+		Expr* thunk = stack[sp - 2];
+		stack[sp - 3] = stack[sp - 1];
+		stack[sp - 2] = scm_handlers;
+		stack[sp - 1] = installed;
+		stack[sp++] = thunk;
+		scm_handlers = installed;
+
+		if(scm_is_closure(thunk) || scm_is_proto(thunk)) {
+			n = 0;
+			tail = false;
+			catching = true;
+			goto call;
+		}
+
+		// anything else is done with right away
+		nested++;
+		if(scm_is_ffunc(thunk))     res = scm_call_ffunc(thunk, 0, NULL);
+		else if(scm_is_cont(thunk)) res = scm_throw(thunk, 0, NULL);
+		else                        res = scm_mk_error("can't evaluate (not a ffunc or closure)");
+		nested--;
+		sp--;
+		goto tried;
+	}
+
+	CASE(CALLCC) {
+		Expr* k = capture(depth, (Call) { pc + 1, running, CURRENT_ENV, base, frames, 0, false }, sp - 1, *pc);
+		if(scm_is_error(k)) {
+			res = k;
+			goto fail;
+		}
+
+		pc++;
+		stack[sp++] = k;
+		n = 1;
+		tail = false;
+		goto call;
+	}
+
+	CASE(BAD_SEQ)
+		res = scm_mk_error("sequence of expressions to evaluate isn't a proper list");
+		goto fail;
+
+	CASE(MAP) {
+		// the values of the call are the procedure, the lists left and what
+		// it returned so far, last first, which is #f for for-each
+		const size_t k = sp - base - 2;
+		for(size_t i = 0; i < k; i++) {
+			Expr* l = stack[base + 1 + i];
+			if(scm_is_pair(l)) continue;
+
+			if(l != EMPTY_LIST) {
+				res = scm_mk_error(stack[sp - 1] == FALSE ? "for-each expects lists" : "map expects lists");
+				goto fail;
+			}
+
+			// the values returned are copied, as a continuation may still
+			// carry on from any of them
+			res = EMPTY_LIST;
+			scm_stack_push(&res);
+			for(Expr* v = stack[sp - 1]; scm_is_pair(v); v = scm_cdr(v)) {
+				Expr* p = scm_mk_pair(scm_car(v), res);
+				if(!p) {
+					res = OOM;
+					break;
+				}
+				res = p;
+			}
+			scm_stack_pop(&res);
+
+			if(scm_is_error(res)) goto fail;
+			goto ret;
+		}
+
+		if(!reserve(k + 1)) {
+			res = scm_mk_error("stack overflow");
+			goto fail;
+		}
+
+		stack[sp++] = stack[base];
+		for(size_t i = 0; i < k; i++) {
+			stack[sp++] = scm_car(stack[base + 1 + i]);
+			stack[base + 1 + i] = scm_cdr(stack[base + 1 + i]);
+		}
+		n = k;
+		tail = false;
+		goto call;
+	}
+
+	CASE(MAP_NEXT)
+		if(stack[sp - 2] != FALSE) {
+			Expr* p = scm_mk_pair(stack[sp - 1], stack[sp - 2]);
+			if(!p) {
+				res = OOM;
+				goto fail;
+			}
+			stack[sp - 2] = p;
+		}
+
+		sp--;
+		pc = bc->ops;
+		NEXT;
+
+	prim: {
+		n = *pc++;
+		Expr* ff = consts[*pc++];
+		if(stack[sp - n - 1] != ff || ff == &FF_MAP || ff == &FF_FOREACH) goto call;
+
+		Expr* v = scm_call_ffunc(ff, n, &stack[sp - n]);
+		sp -= n + 1;
+		if(scm_is_error(v)) {
+			res = v;
+			goto fail;
+		}
+
+		if(tail) {
+			res = v;
+			goto ret;
+		}
+
+		stack[sp++] = v;
+		RESUME;
+	}
+
+	apply: {
+		// spreads the arguments out on the stack, under the procedure
+		Expr* func = stack[--sp];
+		Expr* args = stack[--sp];
+
+		int len = scm_list_len(args);
+		if(len < 0) {
+			res = scm_mk_error("args to apply aren't a list");
+			goto fail;
+		}
+		if(!reserve(len + 1)) {
+			res = scm_mk_error("stack overflow");
+			goto fail;
+		}
+
+		stack[sp++] = func;
+		for(; scm_is_pair(args); args = scm_cdr(args)) {
+			stack[sp++] = scm_car(args);
+		}
+		n = len;
+	}
+
+	call: {
+		Expr* func = stack[sp - n - 1];
+		Expr** args = &stack[sp - n];
+
+		// what map and for-each are called wrong with is left to them
+		if((func == &FF_MAP || func == &FF_FOREACH) && n >= 2 && (scm_is_closure(args[0]) || scm_is_ffunc(args[0]) || scm_is_cont(args[0]))) {
+			goto map;
+		}
+
+		if(scm_is_ffunc(func)) {
+			Expr* v = scm_call_ffunc(func, n, args);
+			sp -= n + 1;
+
+			if(scm_is_error(v)) {
+				res = v;
+				goto fail;
+			}
+
+			if(tail) {
+				res = v;
+				goto ret;
+			}
+
+			stack[sp++] = v;
+			RESUME;
+		}
+
+		if(scm_is_cont(func)) {
+			// dealt with along with the ones made elsewhere
+			res = scm_throw(func, n, args);
+			sp -= n + 1;
+			goto fail;
+		}
+
+		if(!scm_is_closure(func) && !scm_is_proto(func)) {
+			res = scm_mk_error("can't evaluate (not a ffunc or closure)");
+			goto fail;
+		}
+
+		// a lambda applied on the spot, as in a let, needs no closure
+		Expr* proto = scm_is_proto(func) ? func : scm_closure_proto(func);
+		Expr* penv = scm_is_proto(func) ? CURRENT_ENV : scm_closure_env(func);
+
+		Proto* p = scm_proto(proto);
+		if(!p->bc) {
+			Expr* r = p->code ? proto : scm_resolve_body(proto);
+			if(!scm_is_error(r)) r = scm_compile(proto);
+			if(scm_is_error(r)) {
+				res = r;
+				goto fail;
+			}
+		}
+		if(!p->native && ++p->calls == SCM_JIT_THRESHOLD) scm_jit_compile(proto);
+
+		if(p->badArgs) {
+			res = scm_mk_error("last entry in dotted tail args isn't a symbol");
+			goto fail;
+		} else if(!p->rest && (unsigned) n != p->nreq) {
+			res = scm_mk_error("incorrect number of args to procedure");
+			goto fail;
+		} else if((unsigned) n < p->nreq) {
+			res = scm_mk_error("too few args to procedure");
+			goto fail;
+		}
+
+		Expr* newEnv = scm_mk_env(penv, p->args, p->size);
+		if(scm_is_error(newEnv)) {
+			res = newEnv;
+			goto fail;
+		}
+		scm_env_frame(newEnv)->extra = p->locals;
+
+		for(unsigned i = 0; i < p->nreq; i++) {
+			scm_env_frame(newEnv)->slots[i] = args[i];
+		}
+		if(p->rest) {
+			scm_stack_push(&newEnv);
+			Expr* l = scm_mk_list(args + p->nreq, n - p->nreq);
+			scm_stack_pop(&newEnv);
+
+			if(scm_is_error(l)) {
+				res = l;
+				goto fail;
+			}
+			scm_env_frame(newEnv)->slots[p->nreq] = l;
+		}
+		sp -= n + 1;
+
+		if(tail) {
+			// the frames of the call this one replaces are done with
+			scm_frame_stack_unwind(frames, scm_env_parent(newEnv));
+			sp = base;
+		} else {
+			if(!reserve_call()) {
+				res = scm_mk_error("too many nested calls");
+				goto fail;
+			}
+
+			calls[ncalls++] = (Call) { pc, running, CURRENT_ENV, base, frames, ++callIds, catching };
+			catching = false;
+			base = sp;
+			frames = scm_frame_stack_size();
+		}
+		if(p->noCapture) scm_frame_stack_push(newEnv);
+
+		CURRENT_ENV = newEnv;
+		running = proto;
+		bc = p->bc;
+		consts = bc->consts;
+		pc = bc->ops;
+
+		if(!reserve(bc->maxStack)) {
+			res = scm_mk_error("stack overflow");
+			goto fail;
+		}
+
+		res = scm_tick();
+		if(res) goto preempted;
+	entered:
+		RESUME;
+	}
+
+	map: {
+		// the procedure and the lists move down over the primitive, and
+		// what it returns is gathered on top of them
+		Expr* acc = stack[sp - n - 1] == &FF_MAP ? EMPTY_LIST : FALSE;
+		memmove(&stack[sp - n - 1], &stack[sp - n], n * sizeof(Expr*));
+		stack[sp - 1] = acc;
+
+		if(tail) {
+			memmove(&stack[base], &stack[sp - n - 1], (n + 1) * sizeof(Expr*));
+			sp = base + n + 1;
+		} else {
+			if(!reserve_call()) {
+				res = scm_mk_error("too many nested calls");
+				goto fail;
+			}
+
+			calls[ncalls++] = (Call) { pc, running, CURRENT_ENV, base, frames, ++callIds, catching };
+			catching = false;
+			base = sp - n - 1;
+			frames = scm_frame_stack_size();
+		}
+
+		running = &MAP_LOOP;
+		bc = &mapCode;
+		consts = NULL;
+		pc = mapOps;
+		NEXT;
+	}
+
+	preempted:
+		// a task is switched out where the callee starts, and so is a run C
+		// code isn't waiting on, to carry on from there when resumed
+		if(own) {
+			fiber->top = (Call) { pc, running, CURRENT_ENV, base, frames, 0, false };
+			fiber->atCall = true;
+			goto leave;
+		}
+		if(res == OUT_OF_FUEL && depth == 1 && proto) {
+			Expr* k = capture(depth, (Call) { pc, running, CURRENT_ENV, base, frames, 0, false }, sp, false);
+			if(scm_is_error(k)) res = k;
+			else                suspended = k;
+		}
+		goto fail;
+
+#ifndef THREADED
+	}
+#endif
+#undef RESUME
+#undef NEXT
+#undef CASE
+
+fail:
+	if(res == SWITCH) {
+		// the primitive the task switched out in hands it a value when
+		// resumed, as if it returned it
+		assert(own);
+		fiber->top = (Call) { pc, running, CURRENT_ENV, base, frames, 0, false };
+		fiber->tail = tail;
+		fiber->atCall = false;
+		goto leave;
+	}
+
+	if(catching) {
+		// the thunk of a __try couldn't even be called
+		catching = false;
+		sp--;
+		goto tried;
+	}
+
+	if(res == ESCAPE) {
+		Expr* k = scm_escape_target();
+		if(k && scm_cont(k)->vm && resumes_here(k, depth)) {
+			Call top = restore(scm_cont(k)->vm, depth);
+			res = scm_catch(k);
+			if(!top.pc) {
+				ncalls = depth;
+				res = scm_mk_error("stack overflow");
+				goto fail;
+			}
+
+			pc = top.pc;
+			running = top.proto;
+			CURRENT_ENV = top.env;
+			base = top.base;
+			frames = top.frames;
+			bc = scm_proto(running)->bc;
+			consts = bc->consts;
+			goto resume;
+		}
+	} else {
+		// unwind to the innermost __try still running its thunk, which
+		// decides whether to handle the error or pass it on
+		for(size_t i = ncalls; i > depth; i--) {
+			if(!calls[i - 1].catches) continue;
+
+			scm_frame_stack_unwind(i < ncalls ? calls[i].frames : frames, NULL);
+			sp = i < ncalls ? calls[i].base : base;
+			ncalls = i - 1;
+
+			Call* c = &calls[ncalls];
+			pc = c->pc;
+			running = c->proto;
+			CURRENT_ENV = c->env;
+			base = c->base;
+			frames = c->frames;
+			bc = scm_proto(running)->bc;
+			consts = bc->consts;
+			goto tried;
+		}
+	}
+
+	ncalls = depth;
+	scm_frame_stack_unwind(calls[depth - 1].frames, NULL);
+	sp = calls[depth - 1].base;
+
+done:
+	ncalls--;
+	if(own) fiber->over = true;
+
+leave:
+	if(own) fiber->handlers = scm_handlers;
+	running = calls[depth - 1].proto;
+	CURRENT_ENV = calls[depth - 1].env;
+	scm_handlers = handlers;
+	scm_leave_catch(&boundary);
+	scm_stack_pop(&handlers);
+
+	return res;
+}
+#ifdef THREADED
+#pragma GCC diagnostic pop
+#endif
+
+Expr* scm_vm_eval(Expr* e) {
+	assert(e);
+
+	scm_stack_push(&e);
+	Expr* proto = scm_resolve_toplevel(e);
+	scm_stack_pop(&e);
+	if(scm_is_error(proto)) return proto;
+
+	scm_stack_push(&proto);
+	Expr* res = scm_compile(proto);
+	if(!scm_is_error(res)) res = run(proto, NULL, 0);
+	scm_stack_pop(&proto);
+
+	return res;
+}
+
+Expr* scm_apply(Expr* f, int argc, Expr** argv) {
+	assert(f); assert(argc >= 0);
+
+	// argv may lie on the stack, which moves when it grows
+	const bool onStack = argv >= stack && argv < stack + sp;
+	const size_t at = onStack ? (size_t) (argv - stack) : 0;
+	if(!reserve(argc + 1)) return scm_mk_error("stack overflow");
+	if(onStack) argv = stack + at;
+
+	stack[sp++] = f;
+	for(int i = 0; i < argc; i++) {
+		stack[sp++] = argv[i];
+	}
+
+	nested++;
+	Expr* res = run(NULL, NULL, argc);
+	nested--;
+
+	return res;
+}
+
+Expr* scm_fiber_run(Fiber* f, Expr* v, bool* over) {
+	Fiber* outer = fiber;
+	f->value = v;
+
+	exchange(f);
+	fiber = f;
+	Expr* res = run(NULL, NULL, 0);
+	fiber = outer;
+	exchange(f);
+
+	*over = f->over;
+	return res;
+}
+
+Expr* scm_resume() {
+	Expr* k = suspended;
+	if(!k) return scm_mk_error("no evaluation to resume");
+
+	suspended = NULL;
+	scm_stack_push(&k);
+	Expr* res = run(scm_cont(k)->vm->top.proto, scm_cont(k)->vm, 0);
+	scm_stack_pop(&k);
+
+	return res;
+}
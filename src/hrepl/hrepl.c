@@ -1,11 +1,17 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include <Scheme.h>
 
+static void on_sigint(int sig) {
+	(void) sig;
+	scm_interrupt();
+}
+
 int main() {
 	scm_init();
 
@@ -19,7 +25,10 @@ int main() {
 		bool error = false;
 		while(!error && *str != '\0') {
 			curExpr = scm_read_inc(str, &str);
+			// ^C stops the evaluation rather than the REPL
+			signal(SIGINT, on_sigint);
 			Expr* res = scm_eval(curExpr);
+			signal(SIGINT, SIG_DFL);
 			error = scm_is_error(res);
 			char* printed = scm_print(res);
 
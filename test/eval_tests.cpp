@@ -3,7 +3,33 @@
 
 #include <gtest/gtest.h>
 
-TEST(Eval, SelfEvaluating) {
+#include <fstream>
+#include <pthread.h>
+#include <sstream>
+#include <unistd.h>
+
+// Every test runs once on each evaluation engine
+class Eval : public testing::TestWithParam<scm_engine> {
+protected:
+	void SetUp() override {
+		saved = scm_get_engine();
+		scm_set_engine(GetParam());
+	}
+
+	void TearDown() override {
+		scm_set_engine(saved);
+	}
+
+	scm_engine saved;
+};
+
+#ifdef INSTANTIATE_TEST_SUITE_P
+INSTANTIATE_TEST_SUITE_P(Engines, Eval, testing::Values(SCM_ENGINE_TREE, SCM_ENGINE_VM, SCM_ENGINE_ANALYZE));
+#else
+INSTANTIATE_TEST_CASE_P(Engines, Eval, testing::Values(SCM_ENGINE_TREE, SCM_ENGINE_VM, SCM_ENGINE_ANALYZE));
+#endif
+
+TEST_P(Eval, SelfEvaluating) {
 	scm_init();
 	char* s;
 
@@ -46,7 +72,7 @@ TEST(Eval, SelfEvaluating) {
 	scm_reset();
 }
 
-TEST(Eval, Quotes) {
+TEST_P(Eval, Quotes) {
 	scm_init();
 	char* s;
 
@@ -65,7 +91,7 @@ TEST(Eval, Quotes) {
 	scm_reset();
 }
 
-TEST(Eval, Quasiquotes) {
+TEST_P(Eval, Quasiquotes) {
 	scm_init();
 	char* s;
 
@@ -92,7 +118,7 @@ TEST(Eval, Quasiquotes) {
 	scm_reset();
 }
 
-TEST(Eval, And) {
+TEST_P(Eval, And) {
 	scm_init();
 	char* s;
 
@@ -115,7 +141,7 @@ TEST(Eval, And) {
 	scm_reset();
 }
 
-TEST(Eval, Or) {
+TEST_P(Eval, Or) {
 	scm_init();
 	char* s;
 
@@ -138,7 +164,7 @@ TEST(Eval, Or) {
 	scm_reset();
 }
 
-TEST(Eval, SimpleLambda) {
+TEST_P(Eval, SimpleLambda) {
 	scm_init();
 	char* s;
 
@@ -161,7 +187,7 @@ TEST(Eval, SimpleLambda) {
 	scm_reset();
 }
 
-TEST(Eval, If) {
+TEST_P(Eval, If) {
 	scm_init();
 	char* s;
 
@@ -204,7 +230,7 @@ TEST(Eval, If) {
 	scm_reset();
 }
 
-TEST(Eval, TailCallOptimization) {
+TEST_P(Eval, TailCallOptimization) {
 	scm_init();
 	char* s;
 
@@ -214,3 +240,764 @@ TEST(Eval, TailCallOptimization) {
 
 	scm_reset();
 }
+
+TEST_P(Eval, GlobalVariables) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("(begin (define glob 1) (set! glob (+ glob 4)) glob)")));
+	EXPECT_STREQ("5", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("((lambda (x) (set! glob x) glob) 7)")));
+	EXPECT_STREQ("7", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(cons (car (env-names (base-env))) (car (env-values (base-env))))")));
+	EXPECT_STREQ("(glob . 7)", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(defined? 'glob (base-env))")));
+	EXPECT_STREQ("#t", s);
+	free(s);
+
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(set! not-defined-anywhere 1)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("not-defined-anywhere"))));
+
+	scm_reset();
+}
+
+TEST_P(Eval, LocalVariables) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("((lambda (a b . cs) (list a b cs)) 1 2 3 4)")));
+	EXPECT_STREQ("(1 2 (3 4))", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("((lambda xs xs) 1 2 3)")));
+	EXPECT_STREQ("(1 2 3)", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("((lambda (x) (define y 2) (define z 3) (set! x (+ x y z)) x) 1)")));
+	EXPECT_STREQ("6", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("((lambda (x . ys) (define z 3) (list (env-names (cur-env)) (env-values (cur-env)))) 1 2)")));
+	EXPECT_STREQ("((z x ys) (3 1 (2)))", s);
+	free(s);
+
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("((lambda (x y) x) 1)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("((lambda (x . ys) x))"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("((lambda (x) x) . 1)"))));
+
+	scm_reset();
+}
+
+TEST_P(Eval, ResolvedVariables) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("(begin (define (mk) (define n 0) (lambda () (set! n (+ n 1)) n)) (define c (mk)) (c) (c))")));
+	EXPECT_STREQ("2", s);
+	free(s);
+
+	// a local that isn't defined yet refers to the global
+	s = scm_print(scm_eval(scm_read("(begin (define y 1) (define (g) (define z y) (define y 2) (list y z)) (g))")));
+	EXPECT_STREQ("(2 1)", s);
+	free(s);
+
+	// eval can add names the resolver couldn't know about
+	s = scm_print(scm_eval(scm_read("(begin (define x 'global) (define (f) (eval '(define x 'local) (cur-env)) x) (f))")));
+	EXPECT_STREQ("local", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(begin (define (q a) `(a ,a ,@(list a a) `(,,a))) (q 5))")));
+	EXPECT_STREQ("(a 5 5 5 (quasiquote ((unquote 5))))", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(begin (define (h x) (+ x 1)) (closure-code h))")));
+	EXPECT_STREQ("((+ x 1))", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, CachedLookups) {
+	scm_init();
+	char* s;
+
+	// w is looked up by name from a lambda made by eval, and found in a
+	// different place once the local definition runs
+	s = scm_print(scm_eval(scm_read("(begin (define w 'global) (define (mk) (define f (eval '(lambda () w) (cur-env))) (define r1 (f)) (define w 'local) (list r1 (f))) (mk))")));
+	EXPECT_STREQ("(global local)", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(begin (define (mk2 v) (eval '(lambda (x) (set! v (+ v x)) v) (cur-env))) (define acc (mk2 10)) (acc 1) (acc 2))")));
+	EXPECT_STREQ("13", s);
+	free(s);
+
+	// a frame extended at runtime only hides names from the references that
+	// go past it
+	s = scm_print(scm_eval(scm_read("(begin (define x 'global) (define (outer) (define (inner) x) (eval '(define x 'outer) (cur-env)) (inner)) (define (plain) x) (list (outer) (plain) x))")));
+	EXPECT_STREQ("(outer global global)", s);
+	free(s);
+	s = scm_print(scm_eval(scm_read("(begin (define (o y) (define (mid) (eval '(define y 'mid) (cur-env)) ((lambda () y))) (list (mid) y)) (o 'o))")));
+	EXPECT_STREQ("(mid o)", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, StackFrames) {
+	scm_init();
+	char* s;
+
+	// a frame handed out by an alias of cur-env is kept, along with its parents
+	s = scm_print(scm_eval(scm_read("(begin (define here cur-env) (define (f x) (let ((y (* x 2))) (here))) (define e (f 3)) (gc) (list (env-values e) (env-values (env-parent e))))")));
+	EXPECT_STREQ("((6) (3))", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(begin (define (leaf x) (let ((y (+ x 1))) y)) (define (loop n acc) (if (= n 0) acc (loop (- n 1) (+ acc (leaf n))))) (loop 5000 0))")));
+	EXPECT_STREQ("12507500", s);
+	free(s);
+
+	// a closure keeps its frame whichever expression of the body or of a let
+	// made it, even once the frames of later calls have been collected
+	scm_eval(scm_read("(define saved #f)"));
+	scm_eval(scm_read("(define (k x) (lambda () x))"));
+	scm_eval(scm_read("(define (kl x) (let ((y (list x))) (lambda (z) (cons z y))))"));
+	scm_eval(scm_read("(define (ks x) (set! saved (lambda () x)) 'saved)"));
+	scm_eval(scm_read("(define a (k 1))"));
+	scm_eval(scm_read("(define b (kl 2))"));
+	scm_eval(scm_read("(ks 3)"));
+	scm_eval(scm_read("(begin (gc) (k 10) (kl 20) (leaf 30) (gc))"));
+	s = scm_print(scm_eval(scm_read("(list (a) (b 3) (saved) ((k 4)) ((kl 5) 6))")));
+	EXPECT_STREQ("(1 (3 2) 3 4 (6 5))", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, DesugaredForms) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("(begin (define (c x) (cond ((= x 1) 'one) ((= x 2) 1 'two) (else 'many))) (list (c 1) (c 2) (c 3)))")));
+	EXPECT_STREQ("(one two many)", s);
+	free(s);
+
+	// malformed clauses are still reported when they are reached
+	s = scm_print(scm_eval(scm_read("(begin (define (m x) (cond ((= x 1) 'one) ((= x 2)))) (m 1))")));
+	EXPECT_STREQ("one", s);
+	free(s);
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(m 2)"))));
+
+	s = scm_print(scm_eval(scm_read("(begin (define (d n acc) (if (= n 0) acc (let ((k (cond ((= n 1) 1) (else 2)))) (d (- n 1) (+ acc k))))) (d 1000 0))")));
+	EXPECT_STREQ("1999", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, Apply) {
+	scm_init();
+	char* s;
+
+	// the list of arguments is left alone, and a dotted tail gets a copy of it
+	s = scm_print(scm_eval(scm_read("(begin (define l (list 1 2 3)) (define (f . r) (set-car! r 0) r) (list (apply + l) (apply f l) l))")));
+	EXPECT_STREQ("(6 (0 2 3) (1 2 3))", s);
+	free(s);
+
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(apply + '(1 . 2))"))));
+
+	scm_reset();
+}
+
+TEST_P(Eval, HotClosures) {
+	scm_init();
+	char* s;
+
+	// called often enough to be compiled to machine code where there is a JIT
+	scm_eval(scm_read("(define (f a b) (+ a b))"));
+	scm_eval(scm_read("(define (lt a b) (< a b))"));
+	scm_eval(scm_read("(define (g x) (if (< x 0) h x))"));
+	s = scm_print(scm_eval(scm_read("(let loop ((i 0)) (if (= i 1000) (list (f i i) (lt i 1) (lt 1 i)) (begin (f i 1) (lt i i) (loop (+ i 1)))))")));
+	EXPECT_STREQ("(2000 #f #t)", s);
+	free(s);
+
+	// arguments and procedures the inline cases don't cover
+	s = scm_print(scm_eval(scm_read("(list (f 1.5 2) (lt 1.5 2) (f 9007199254740993 0))")));
+	EXPECT_STREQ("(3.500000 #t 9007199254740993)", s);
+	free(s);
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(f 1 \"a\")"))));
+
+	// errors raised from compiled code
+	s = scm_print(scm_eval(scm_read("(let loop ((i 0)) (if (= i 1000) (g i) (begin (g i) (loop (+ i 1)))))")));
+	EXPECT_STREQ("1000", s);
+	free(s);
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(g -1)"))));
+	s = scm_print(scm_eval(scm_read("(begin (define h 7) (g -1))")));
+	EXPECT_STREQ("7", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(begin (define < (lambda (a b) 'replaced)) (lt 1 2))")));
+	EXPECT_STREQ("replaced", s);
+	free(s);
+
+	// compiled code is only listed for perf when asked for, by its name
+	const std::string map = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+	remove(map.c_str());
+	scm_set_jit_perf_map(false);
+	scm_eval(scm_read("(let loop ((i 0)) (if (= i 1000) i (begin (f i i) (loop (+ i 1)))))"));
+	EXPECT_FALSE(std::ifstream(map).good());
+
+	scm_set_jit_perf_map(true);
+	scm_eval(scm_read("(define (hot x) (lambda () x))"));
+	scm_eval(scm_read("(let loop ((i 0)) (if (= i 1000) i (begin ((hot i)) (loop (+ i 1)))))"));
+	std::ifstream in(map);
+	if(in.good()) {
+		std::stringstream listed;
+		listed << in.rdbuf();
+		EXPECT_NE(std::string::npos, listed.str().find(" hlisp:hot\n"));
+		EXPECT_NE(std::string::npos, listed.str().find(" hlisp:lambda in hot\n"));
+	}
+	in.close();
+	remove(map.c_str());
+	scm_set_jit_perf_map(false);
+
+	scm_reset();
+}
+
+TEST_P(Eval, FoldedCalls) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("(begin (define (f) (list (+ 1 (* 2 3)) (car '(a b)) (if #t 'yes 'no) (not 1))) (f))")));
+	EXPECT_STREQ("(7 a yes #f)", s);
+	free(s);
+
+	// calls that fail are left to fail when they are made
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(begin (define (e) (car 1)) (e))"))));
+
+	// rebinding a primitive voids what was folded or called directly
+	s = scm_print(scm_eval(scm_read("(begin (define (k x) (cdr x)) (list (k '(1 2)) (begin (define * -) (f)) (begin (set! cdr car) (k '(1 2)))))")));
+	EXPECT_STREQ("((2) (0 a yes #f) 1)", s);
+	free(s);
+
+	// and so does a define that shadows one at runtime
+	s = scm_print(scm_eval(scm_read("(begin (define (g) (eval '(define not list) (cur-env)) (not 1)) (g))")));
+	EXPECT_STREQ("(1)", s);
+	free(s);
+
+	scm_reset();
+}
+
+static Expr* count_args(Expr* args) {
+	return scm_mk_int(scm_list_len(args));
+}
+
+TEST_P(Eval, PrimitiveArguments) {
+	scm_init();
+	char* s;
+
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(car '(1) '(2))"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(cons 1)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(-)"))));
+
+	s = scm_print(scm_eval(scm_read("(list (apply + '(1 2 3)) (apply cons '(1 2)) (make-string 2) (- 5) (+))")));
+	EXPECT_STREQ("(6 (1 . 2) \"aa\" -5 0)", s);
+	free(s);
+
+	// primitives taking a list of arguments are still called with one
+	static Expr ff;
+	ff.tag = decltype(ff.tag)::ATOM;
+	ff.atom.type = decltype(ff.atom.type)::FFUNC;
+	ff.atom.ffptr = count_args;
+	ff.protect = true;
+	ff.mark = true;
+	scm_env_define(BASE_ENV, scm_mk_symbol("count-args"), &ff);
+
+	s = scm_print(scm_eval(scm_read("(begin (define (f x) (count-args x 2 3)) (list (count-args) (f 1) (apply count-args '(1 2)) (primitive-procedure? count-args)))")));
+	EXPECT_STREQ("(0 3 2 #t)", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, RestArguments) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("(begin (define (f a . r) (cons a r)) (list (f 1) (f 1 (f 2 3) (+ 1 2)) ((lambda r r))))")));
+	EXPECT_STREQ("((1) (1 (2 3) 3) ())", s);
+	free(s);
+
+	// an argument that fails leaves nothing behind for the next call
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(f 1 2 (car 1) 4)"))));
+	s = scm_print(scm_eval(scm_read("(f 5 6)")));
+	EXPECT_STREQ("(5 6)", s);
+	free(s);
+
+	scm_reset();
+}
+
+// Evaluates code on a thread of its own, whose stack is only size bytes
+static Expr* eval_on_thread(const char* code, size_t size) {
+	struct Job {
+		const char* code;
+		Expr* res;
+	} job = { code, NULL };
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, size);
+	pthread_t t;
+	pthread_create(&t, &attr, [](void* p) -> void* {
+		Job* j = (Job*) p;
+		j->res = scm_eval(scm_read(j->code));
+		return NULL;
+	}, &job);
+	pthread_join(t, NULL);
+	pthread_attr_destroy(&attr);
+
+	return job.res;
+}
+
+TEST_P(Eval, DeepRecursion) {
+	scm_init();
+	char* s;
+
+	// more cells than the first pool holds
+	s = scm_print(scm_eval(scm_read("(begin (define (iota n) (let loop ((i n) (acc '())) (if (= i 0) acc (loop (- i 1) (cons i acc))))) (define l (iota 20000)) (length l))")));
+	EXPECT_STREQ("20000", s);
+	free(s);
+
+	// only the VM recurses without using up the C stack, the others stop
+	// cleanly once they have used what they may of it, going as deep as it
+	// allows
+	Expr* r = scm_eval(scm_read("(foldr + 0 l)"));
+	if(GetParam() == SCM_ENGINE_VM || !scm_is_error(r)) {
+		s = scm_print(r);
+		EXPECT_STREQ("200010000", s);
+		free(s);
+	}
+
+	scm_eval(scm_read("(define (d n) (if (= n 0) 0 (+ 1 (d (- n 1)))))"));
+	s = scm_print(eval_on_thread("(d 10000)", 16 * 1024 * 1024));
+	EXPECT_STREQ("10000", s);
+	free(s);
+
+	// however small it is, on whichever thread they run
+	r = eval_on_thread("(d 100000)", 256 * 1024);
+	if(GetParam() == SCM_ENGINE_VM) {
+		s = scm_print(r);
+		EXPECT_STREQ("100000", s);
+		free(s);
+	} else {
+		EXPECT_TRUE(scm_is_error(r));
+	}
+
+	s = scm_print(scm_eval(scm_read("(car (reverse l))")));
+	EXPECT_STREQ("20000", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, Continuations) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("(begin (define (find p l) (call/ec (lambda (return) (for-each (lambda (x) (if (p x) (return x) #f)) l) #f))) (list (find (lambda (x) (> x 2)) '(1 2 3 4)) (+ 1 (call/cc (lambda (k) (+ 10 (k 1))))) (call/cc (lambda (k) 5))))")));
+	EXPECT_STREQ("(3 2 5)", s);
+	free(s);
+
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(call/cc (lambda (k) (k 1 2)))"))));
+
+	// going back into a call that is over only works on the VM
+	Expr* r = scm_eval(scm_read("(begin (define k2 #f) (define n (+ 1 (call/cc (lambda (k) (set! k2 k) 1)))) (if (< n 5) (k2 n) n))"));
+	if(GetParam() == SCM_ENGINE_VM) {
+		s = scm_print(r);
+		EXPECT_STREQ("5", s);
+		free(s);
+	} else {
+		EXPECT_TRUE(scm_is_error(r));
+	}
+
+	// even from a procedure map called, leaving what it returned before alone
+	r = scm_eval(scm_read("(let ((k #f) (n 0) (acc '())) (let ((r (map (lambda (x) (call/cc (lambda (c) (if (= x 2) (set! k c) #f) x))) '(1 2 3)))) "
+	                      "(if (< n 2) (begin (set! n (+ n 1)) (set! acc (cons r acc)) (k (* 10 n))) (cons r acc))))"));
+	if(GetParam() == SCM_ENGINE_VM) {
+		s = scm_print(r);
+		EXPECT_STREQ("((1 20 3) (1 10 3) (1 2 3))", s);
+		free(s);
+	} else {
+		EXPECT_TRUE(scm_is_error(r));
+	}
+
+	scm_reset();
+}
+
+TEST_P(Eval, Macros) {
+	scm_init();
+	char* s;
+
+	// the tmp of the template can't capture the one passed in
+	scm_eval(scm_read("(define-syntax swap! (syntax-rules () ((_ a b) (let ((tmp a)) (set! a b) (set! b tmp)))))"));
+	s = scm_print(scm_eval(scm_read("(begin (define tmp 1) (define y 2) (swap! tmp y) (list tmp y))")));
+	EXPECT_STREQ("(2 1)", s);
+	free(s);
+
+	// nor can the code around a use capture what the template refers to
+	scm_eval(scm_read("(define-syntax my-list (syntax-rules () ((_ a ...) (list a ...))))"));
+	s = scm_print(scm_eval(scm_read("(let ((list (lambda (x) 'shadowed))) (my-list 1))")));
+	EXPECT_STREQ("(1)", s);
+	free(s);
+	s = scm_print(scm_eval(scm_read("(begin (define (f x) (define-syntax get-x (syntax-rules () ((_) x))) (let ((x 'inner)) (list x (get-x) (map (lambda (x) (get-x)) '(1))))) (f 'outer))")));
+	EXPECT_STREQ("(inner outer (outer))", s);
+	free(s);
+	s = scm_print(scm_eval(scm_read("(begin (define n 0) (define-syntax bump! (syntax-rules () ((_) (set! n (+ n 10))))) (list (let ((n 0) (+ -)) (bump!) n) n))")));
+	EXPECT_STREQ("(0 10)", s);
+	free(s);
+
+	scm_eval(scm_read("(define-syntax my-or (syntax-rules () ((_) #f) ((_ e) e) ((_ e r ...) (let ((t e)) (if t t (my-or r ...))))))"));
+	scm_eval(scm_read("(define-syntax flat (syntax-rules () ((_ (a b ...) ...) '(b ... ... a ...))))"));
+	s = scm_print(scm_eval(scm_read("(let ((t 5)) (list (my-or #f t) (flat (1 2 3) (4 5)) (let* ((a 1) (b (+ a 1))) (when (> b a) (* a b))) (unless #t 1)))")));
+	EXPECT_STREQ("(5 (2 3 5 1 4) 2 #f)", s);
+	free(s);
+
+	// defines a macro expands into still get slots in the body
+	scm_eval(scm_read("(define-syntax defn (syntax-rules () ((_ name v) (define name v))))"));
+	s = scm_print(scm_eval(scm_read("(begin (define (f) (defn x 3) (define-syntax twice (syntax-rules () ((_ e) (begin e e)))) (twice (set! x (+ x 1))) x) (f))")));
+	EXPECT_STREQ("5", s);
+	free(s);
+
+	// uses are expanded once, in place
+	s = scm_print(scm_eval(scm_read("(begin (define code '(swap! tmp y)) (eval code (interaction-environment)) (eval code (interaction-environment)) (list (car code) tmp y))")));
+	EXPECT_STREQ("(let 2 1)", s);
+	free(s);
+
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(swap! 1)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(define-syntax bad (syntax-rules))"))));
+
+	scm_reset();
+}
+
+TEST_P(Eval, Exceptions) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("(list (guard (e (#t (list 'caught e))) (raise 42)) (guard (e ((error-object? e) (error-object-message e))) (car 1)) (guard (e (else e)) (guard (e2 ((number? e2) (* e2 2))) (raise 'x))))")));
+	EXPECT_STREQ("((caught 42) \"arg to car must be a pair\" x)", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(list (with-exception-handler (lambda (c) 10) (lambda () (+ 1 (raise-continuable 5)))) (guard (e (#t (list 'outer e))) (with-exception-handler (lambda (c) (raise (list c c))) (lambda () (raise 3)))))")));
+	EXPECT_STREQ("(11 (outer (3 3)))", s);
+	free(s);
+
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(guard (e ((string? e) e)) (raise 5))"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(with-exception-handler (lambda (c) 1) (lambda () (raise 2)))"))));
+
+	// what is raised is only printed if nothing catches it, so it may be circular
+	s = scm_print(scm_eval(scm_read("(raise (list 'a \"b\"))")));
+	EXPECT_STREQ("#(ERROR: uncaught exception: (a \"b\"))#", s);
+	free(s);
+	s = scm_print(scm_eval(scm_read("(begin (define lst (list 1 2)) (set-cdr! (cdr lst) lst) (list (guard (e (#t 1)) (raise lst)) (guard (e ((pair? e) (eq? e lst))) (guard (e2 ((number? e2) e2)) (raise lst)))))")));
+	EXPECT_STREQ("(1 #t)", s);
+	free(s);
+
+	// what is raised unwinds straight to the guard that catches it, from deep
+	// in the calls under it or from a procedure a primitive calls, and what
+	// those calls had under way is put back
+	const size_t roots = scm_stack_size();
+	const size_t args = scm_arg_stack_size();
+	s = scm_print(scm_eval(scm_read("(begin (define (down n) (if (= n 0) (raise 'bottom) (+ 1 (down (- n 1))))) (define (g x) (guard (e ((eq? e 'bottom) (list x e))) (list 1 (down 500)))) (list (g 7) (guard (e (#t (list 'in-map e))) (map (lambda (x) (if (= x 2) (raise x) x)) '(1 2 3))) (let ((y 5)) (guard (e ((error-object? e) (list y (error-object-message e)))) (list 1 (let ((y 6)) (car y)))))))")));
+	EXPECT_STREQ("((7 bottom) (in-map 2) (5 \"arg to car must be a pair\"))", s);
+	free(s);
+	EXPECT_EQ(roots, scm_stack_size());
+	EXPECT_EQ(args, scm_arg_stack_size());
+
+	// nothing is left installed once an error gets out
+	s = scm_print(scm_eval(scm_read("(exception-handlers)")));
+	EXPECT_STREQ("()", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, Preemption) {
+	scm_init();
+	char* s;
+
+	scm_eval(scm_read("(define (spin) (spin))"));
+
+	// running out of fuel can't be caught like an error
+	scm_set_fuel(10000);
+	Expr* res = scm_eval(scm_read("(guard (e (#t 'caught)) (spin))"));
+	EXPECT_EQ(OUT_OF_FUEL, res);
+	EXPECT_TRUE(scm_is_preempted(res));
+	EXPECT_EQ(0, scm_get_fuel());
+
+	scm_set_fuel(-1);
+	scm_set_timeout(0.05);
+	EXPECT_EQ(TIMED_OUT, scm_eval(scm_read("(spin)")));
+	scm_set_timeout(0);
+
+	scm_interrupt();
+	EXPECT_EQ(INTERRUPTED, scm_eval(scm_read("(spin)")));
+
+	// what is left over is charged for the calls made
+	scm_set_fuel(100);
+	s = scm_print(scm_eval(scm_read("(let loop ((i 0)) (if (< i 10) (loop (+ i 1)) i))")));
+	EXPECT_STREQ("10", s);
+	free(s);
+	EXPECT_GT(100, scm_get_fuel());
+
+	if(GetParam() == SCM_ENGINE_VM) {
+		// an evaluation that runs out of fuel is carried on by scm_resume()
+		scm_set_fuel(1000);
+		EXPECT_EQ(OUT_OF_FUEL, scm_eval(scm_read("(let loop ((i 0) (acc '())) (if (< i 3000) (loop (+ i 1) (cons i acc)) (length acc)))")));
+		scm_set_fuel(1000);
+		EXPECT_EQ(OUT_OF_FUEL, scm_resume());
+		scm_set_fuel(-1);
+		s = scm_print(scm_resume());
+		EXPECT_STREQ("3000", s);
+		free(s);
+
+		// even where it ran out in a procedure map called
+		scm_eval(scm_read("(define (count n) (if (> n 0) (count (- n 1)) n))"));
+		scm_set_fuel(1000);
+		EXPECT_EQ(OUT_OF_FUEL, scm_eval(scm_read("(map (lambda (n) (count n) n) '(1 2000 3))")));
+		scm_set_fuel(-1);
+		s = scm_print(scm_resume());
+		EXPECT_STREQ("(1 2000 3)", s);
+		free(s);
+	}
+	EXPECT_TRUE(scm_is_error(scm_resume()));
+
+	scm_reset();
+}
+
+TEST_P(Eval, Tasks) {
+	scm_init();
+	char* s;
+
+	// a send on a channel without room waits for a receive
+	scm_eval(scm_read("(define c (make-channel))"));
+	scm_eval(scm_read("(define (produce n) (if (> n 0) (begin (channel-send c n) (produce (- n 1))) (channel-send c 'done)))"));
+	scm_eval(scm_read("(define (consume acc) (let ((v (channel-receive c))) (if (eq? v 'done) acc (consume (cons v acc)))))"));
+	s = scm_print(scm_eval(scm_read("(let ((t (spawn (lambda () (produce 5) 'produced)))) (list (consume '()) (task-wait t) (task? t) (channel? c)))")));
+	EXPECT_STREQ("((1 2 3 4 5) produced #t #t)", s);
+	free(s);
+
+	// tasks take turns when they yield, and sleeping ones wake up in order
+	scm_eval(scm_read("(define log '())"));
+	scm_eval(scm_read("(define (work name n) (if (> n 0) (begin (set! log (cons name log)) (yield) (work name (- n 1))) name))"));
+	s = scm_print(scm_eval(scm_read("(let ((a (spawn (lambda () (work 'a 3)))) (b (spawn (lambda () (work 'b 3))))) (list (task-wait b) (task-wait a) log))")));
+	EXPECT_STREQ("(b a (b a b a b a))", s);
+	free(s);
+	s = scm_print(scm_eval(scm_read("(begin (set! log '()) (for-each (lambda (t) (spawn (lambda () (sleep (cdr t)) (set! log (cons (car t) log))))) '((c . 0.03) (a . 0.01) (b . 0.02))) (sleep 0.05) log)")));
+	EXPECT_STREQ("(c b a)", s);
+	free(s);
+
+	// select does whichever op is ready first, sends included
+	scm_eval(scm_read("(define c1 (make-channel))"));
+	scm_eval(scm_read("(define c2 (make-channel 1))"));
+	s = scm_print(scm_eval(scm_read("(begin (spawn (lambda () (channel-send c1 'late))) (list (select c1 (cons c2 'x)) (select c1 c2) (select c1)))")));
+	EXPECT_STREQ("((1 . x) (1 . x) (0 . late))", s);
+	free(s);
+
+	// escapes, handlers and nested evaluations keep working across switches
+	s = scm_print(scm_eval(scm_read("(list (task-wait (spawn (lambda () (+ 1 (call/ec (lambda (k) (yield) (k 41) 0)))))) "
+	                                      "(task-wait (spawn (lambda () (guard (e (#t (list 'caught e))) (yield) (raise 'boom))))) "
+	                                      "(let ((t (spawn (lambda () (eval '(channel-receive c) (interaction-environment)))))) (channel-send c 'nested) (task-wait t)))")));
+	EXPECT_STREQ("(42 (caught boom) nested)", s);
+	free(s);
+
+	// a task waiting in a procedure map called lets the others run meanwhile
+	s = scm_print(scm_eval(scm_read("(let ((t (spawn (lambda () (map (lambda (x) (+ x (channel-receive c))) '(1 2)))))) (channel-send c 10) (channel-send c 20) (task-wait t))")));
+	EXPECT_STREQ("(11 22)", s);
+	free(s);
+
+	// what a task fails with is handed to whoever waits for it
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(task-wait (spawn (lambda () (yield) (car 5))))"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(channel-receive c)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(select 1)"))));
+
+	// a task preempted is the first to carry on later
+	scm_eval(scm_read("(define (count n) (if (> n 0) (count (- n 1)) 'counted))"));
+	scm_eval(scm_read("(define t (spawn (lambda () (count 100000))))"));
+	scm_set_fuel(1000);
+	EXPECT_EQ(OUT_OF_FUEL, scm_eval(scm_read("(task-wait t)")));
+	scm_set_fuel(-1);
+	s = scm_print(scm_eval(scm_read("(task-wait t)")));
+	EXPECT_STREQ("counted", s);
+	free(s);
+
+	// thousands of tasks
+	scm_eval(scm_read("(define done (make-channel 100))"));
+	scm_eval(scm_read("(define (start n) (if (> n 0) (begin (spawn (lambda () (yield) (channel-send done n))) (start (- n 1))) #f))"));
+	scm_eval(scm_read("(define (total n acc) (if (> n 0) (total (- n 1) (+ acc (channel-receive done))) acc))"));
+	s = scm_print(scm_eval(scm_read("(begin (start 5000) (total 5000 0))")));
+	EXPECT_STREQ("12502500", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, Promises) {
+	scm_init();
+	char* s;
+
+	// a promise is forced once, and delay doesn't force the promise it makes
+	scm_eval(scm_read("(define n 0)"));
+	scm_eval(scm_read("(define p (delay (begin (set! n (+ n 1)) n)))"));
+	s = scm_print(scm_eval(scm_read("(list (force p) (force p) n (promise? p) (promise? (force (delay (delay 1)))) (force 5))")));
+	EXPECT_STREQ("(1 1 1 #t #t 5)", s);
+	free(s);
+	s = scm_print(scm_eval(scm_read("(list (force (make-promise 'v)) (eq? p (make-promise p)) (force (delay-force (delay 'chained))))")));
+	EXPECT_STREQ("(v #t chained)", s);
+	free(s);
+
+	// a promise forcing itself while being forced keeps the first value
+	scm_eval(scm_read("(define count 0)"));
+	scm_eval(scm_read("(define x 5)"));
+	scm_eval(scm_read("(define q (delay (begin (set! count (+ count 1)) (if (> count x) count (force q)))))"));
+	s = scm_print(scm_eval(scm_read("(list (force q) (begin (set! x 10) (force q)))")));
+	EXPECT_STREQ("(6 6)", s);
+	free(s);
+
+	// chains of delay-force run in constant space
+	scm_eval(scm_read("(define (loop n) (if (= n 0) (delay 'done) (delay-force (loop (- n 1)))))"));
+	s = scm_print(scm_eval(scm_read("(force (loop 20000))")));
+	EXPECT_STREQ("done", s);
+	free(s);
+
+	// a failed force can be retried
+	scm_eval(scm_read("(define ok #f)"));
+	scm_eval(scm_read("(define r (delay (if ok 'fine (car '()))))"));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(force r)"))));
+	s = scm_print(scm_eval(scm_read("(begin (set! ok #t) (force r))")));
+	EXPECT_STREQ("fine", s);
+	free(s);
+
+	// streams, lists counting as streams already forced
+	scm_eval(scm_read("(define (ints n) (stream-cons n (ints (+ n 1))))"));
+	s = scm_print(scm_eval(scm_read("(stream->list (stream-take 5 (stream-filter (lambda (x) (> x 50)) (stream-map (lambda (x) (* x x)) (ints 1)))))")));
+	EXPECT_STREQ("(64 81 100 121 144)", s);
+	free(s);
+	s = scm_print(scm_eval(scm_read("(list (stream->list (stream-map + '(1 2 3) (ints 10))) (stream->list (ints 0) 3) (stream-car (stream-cdr (ints 7))) "
+	                                      "(stream-null? stream-null) (stream-pair? (ints 0)) (stream->list (stream-cons 1 '())))")));
+	EXPECT_STREQ("((11 13 15) (0 1 2) 8 #t #t (1))", s);
+	free(s);
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(stream-car stream-null)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(stream->list (stream-map car (ints 0)))"))));
+
+	// what a pipeline has gone over is garbage
+	s = scm_print(scm_eval(scm_read("(stream-fold + 0 (stream-take 20000 (stream-filter (lambda (x) (> x 10000)) (stream-map (lambda (x) (* 2 x)) (ints 0)))))")));
+	EXPECT_STREQ("600020000", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, ListPrimitives) {
+	scm_init();
+	char* s;
+
+	s = scm_print(scm_eval(scm_read("(list (caddr '(1 2 3)) (cdadr '(1 (2 3))) (cadddr '(1 2 3 4)) (length '()) (length '(1 2 3)) (list-tail '(1 2 3) 1) (list-ref '(a b c) 2))")));
+	EXPECT_STREQ("(3 (3) 4 0 3 (2 3) c)", s);
+	free(s);
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(cadr '(1))"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(length '(1 . 2))"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(list-tail '(1 2 3) -1)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(list-ref '(1 2 3) -1)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(let ((l '(1 2))) (list-ref l -5))"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(let ((l (list 1 2))) (set-cdr! (cdr l) l) (length l))"))));
+
+	// append takes any number of lists and shares the last one
+	s = scm_print(scm_eval(scm_read("(list (append) (append '(1) '(2 3) '() 4) (let ((l '(3))) (eq? l (cddr (append '(1 2) l)))) (reverse '(1 2 3)) (reverse-in-place! (list 1 2 3)))")));
+	EXPECT_STREQ("(() (1 2 3 . 4) #t (3 2 1) (3 2 1))", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(list (memq 'c '(a b c d)) (memv 2 '(1 2 3)) (member '(1) '((0) (1) (2))) (memq 'z '(a)) "
+	                                      "(assq 'b '((a 1) (b 2))) (assv 2 '((1 . a) (2 . b))) (assoc \"k\" '((\"j\" . 1) (\"k\" . 2))) (assq 'z '()))")));
+	EXPECT_STREQ("((c d) (2 3) ((1) (2)) #f (b 2) (2 . b) (\"k\" . 2) #f)", s);
+	free(s);
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(assq 'a '(1))"))));
+
+	// the generic helpers memq and assq were once written with are still there
+	s = scm_print(scm_eval(scm_read("(list (g-member = 2 '(1 2 3)) (g-member eq? 'z '(a)) (g-assoc equal? \"k\" '((\"j\" . 1) (\"k\" . 2))) "
+	                                      "(unzip1-with-cdr '(1 2) '(3 4)) (unzip1-with-cdr-iterative '((a b)) '() '()))")));
+	EXPECT_STREQ("((2 3) #f (\"k\" . 2) ((1 3) (2) (4)) ((a) (b)))", s);
+	free(s);
+
+	s = scm_print(scm_eval(scm_read("(list (string->list \"abc\") (list->string (list #\\a #\\b)) (string->list \"\") (list->string '()))")));
+	EXPECT_STREQ("((#\\a #\\b #\\c) \"ab\" () \"\")", s);
+	free(s);
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(list->string '(1))"))));
+
+	// map and for-each stop at the shortest list
+	s = scm_print(scm_eval(scm_read("(list (map + '(1 2 3) '(10 20)) (map (lambda (x) (* x x)) '(1 2 3)) "
+	                                      "(let ((acc '())) (for-each (lambda (x y) (set! acc (cons (+ x y) acc))) '(1 2) '(3 4)) acc))")));
+	EXPECT_STREQ("((11 22) (1 4 9) (6 4))", s);
+	free(s);
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(map car '(1 2))"))));
+
+	// none of them grow the stack with the length or depth of the lists
+	scm_eval(scm_read("(define (iota n) (let loop ((i n) (acc '())) (if (= i 0) acc (loop (- i 1) (cons i acc)))))"));
+	scm_eval(scm_read("(define (nest n) (let loop ((i 0) (l '(1))) (if (< i n) (loop (+ i 1) (list l)) l)))"));
+	s = scm_print(scm_eval(scm_read("(list (length (map (lambda (x) x) (iota 100000))) (length (append (iota 100000) '(1))) (equal? (nest 20000) (nest 20000)) (equal? (nest 20000) (nest 19999)))")));
+	EXPECT_STREQ("(100000 100001 #t #f)", s);
+	free(s);
+
+	scm_reset();
+}
+
+TEST_P(Eval, Memoize) {
+	scm_init();
+	char* s;
+
+	scm_eval(scm_read("(define calls 0)"));
+	scm_eval(scm_read("(define-memoized (fib n) (set! calls (+ calls 1)) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"));
+	s = scm_print(scm_eval(scm_read("(list (fib 80) calls (memo-size fib) (fib 80) calls)")));
+	EXPECT_STREQ("(23416728348467685 81 81 23416728348467685 81)", s);
+	free(s);
+
+	// manual invalidation
+	s = scm_print(scm_eval(scm_read("(list (memo-forget! fib 80) (memo-forget! fib 80) (memo-size fib) (fib 80) calls (begin (memo-clear! fib) (memo-size fib)) (fib 10) calls)")));
+	EXPECT_STREQ("(#t #f 80 23416728348467685 82 0 55 93)", s);
+	free(s);
+
+	// arguments are compared by equal? unless told otherwise, and a bounded
+	// table drops the entry used least recently
+	scm_eval(scm_read("(set! calls 0)"));
+	scm_eval(scm_read("(define g (memoize (lambda (l) (set! calls (+ calls 1)) (length l)) 2))"));
+	s = scm_print(scm_eval(scm_read("(list (g '(1 2)) (g (list 1 2)) (g '(a)) (g '(b c d)) (memo-size g) calls (g '(1 2)) calls)")));
+	EXPECT_STREQ("(2 2 1 3 2 3 2 4)", s);
+	free(s);
+	scm_eval(scm_read("(define h (memoize (lambda args (set! calls (+ calls 1)) args) #f eqv?))"));
+	s = scm_print(scm_eval(scm_read("(list (h) (h) (h 2) (h 2.0) (h 'a \"b\") (h 'a \"b\") (h (list 1)) (h (list 1)) calls)")));
+	EXPECT_STREQ("(() () (2) (2) (a \"b\") (a \"b\") ((1)) ((1)) 9)", s);
+	free(s);
+
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(memoize 1)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(memoize car 0)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(memoize car #f eq?)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(memo-clear! car)"))));
+	EXPECT_TRUE(scm_is_error(scm_eval(scm_read("(fib 'x)"))));
+
+	// what a table holds lives as long as it does
+	scm_eval(scm_read("(define (iota n) (let loop ((i n) (acc '())) (if (= i 0) acc (loop (- i 1) (cons i acc)))))"));
+	scm_eval(scm_read("(define big (memoize (lambda (n) (iota 50))))"));
+	scm_eval(scm_read("(begin (for-each big (iota 1000)) (gc))"));
+	unsigned held = scm_gc_free_objects();
+	s = scm_print(scm_eval(scm_read("(length (big 999))")));
+	EXPECT_STREQ("50", s);
+	free(s);
+	scm_eval(scm_read("(begin (set! big #f) (gc))"));
+	EXPECT_GT(scm_gc_free_objects(), held + 50000);
+
+	scm_reset();
+}
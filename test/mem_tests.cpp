@@ -97,3 +97,33 @@ TEST(Memory, StackProtect) {
 	scm_stack_pop(&e);
 	scm_reset();
 }
+
+TEST(Memory, SymbolCollection) {
+	scm_init();
+
+	Expr* kept = scm_mk_symbol("kept-symbol");
+	scm_stack_push(&kept);
+
+	scm_gc();
+	int before = scm_list_len(scm_all_symbols());
+
+	char buf[32];
+	for(int i = 0; i < 2000; i++) {
+		snprintf(buf, sizeof(buf), "garbage-%d", i);
+		ASSERT_TRUE(scm_mk_symbol(buf) != NULL);
+	}
+
+	scm_gc();
+	EXPECT_EQ(before, scm_list_len(scm_all_symbols()));
+
+	EXPECT_EQ(kept, scm_mk_symbol("kept-symbol"));
+	EXPECT_EQ(DEFINE, scm_mk_symbol("define"));
+	EXPECT_EQ(LAMBDA, scm_mk_symbol("lambda"));
+
+	char* s = scm_print(scm_eval(scm_read("(car (list 'a 'b))")));
+	EXPECT_STREQ("a", s);
+	free(s);
+
+	scm_stack_pop(&kept);
+	scm_reset();
+}